@@ -76,6 +76,8 @@
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/circuitstats.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_st.h"
 #include "core/or/connection_edge.h"
 #include "trunnel/conflux.h"
 #include "core/or/dos.h"
@@ -92,6 +94,7 @@
 #include "feature/dircache/dirserv.h"
 #include "feature/dirclient/dirclient_modes.h"
 #include "feature/hibernate/hibernate.h"
+#include "feature/hs/hs_client.h"
 #include "feature/hs/hs_config.h"
 #include "feature/hs/hs_pow.h"
 #include "feature/metrics/metrics.h"
@@ -181,6 +184,10 @@ static const char unix_q_socket_prefix[] = "unix:\"";
 #define MIN_CONSTRAINED_TCP_BUFFER 2048
 #define MAX_CONSTRAINED_TCP_BUFFER 262144  /* 256k */
 
+/* limits for the listener accept batch and per-port socket count */
+#define MAX_LISTENER_ACCEPT_BATCH_SIZE 1024
+#define MAX_LISTENER_SOCKETS_PER_PORT 64
+
 /** macro to help with the bulk rename of *DownloadSchedule to
  * *DownloadInitialDelay . */
 #ifndef COCCI
@@ -381,6 +388,7 @@ static const config_var_t option_vars_[] = {
   V(ClientUseIPv6,               BOOL,     "1"),
   V(ClientUseIPv4,               BOOL,     "1"),
   V(CompiledProofOfWorkHash,     AUTOBOOL, "auto"),
+  V(ProofOfWorkSolverThreads,    POSINT,   "1"),
   V(ConfluxEnabled,              AUTOBOOL, "auto"),
   VAR("ConfluxClientUX",         STRING,   ConfluxClientUX_option,
           "throughput"),
@@ -533,6 +541,7 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("CloseHSServiceRendCircuitsImmediatelyOnTimeout"),
   V_IMMUTABLE(HiddenServiceSingleHopMode,  BOOL,     "0"),
   V_IMMUTABLE(HiddenServiceNonAnonymousMode,BOOL,    "0"),
+  V(HSDescFetchParallelism,      POSINT,   "1"),
   V(HTTPProxy,                   STRING,   NULL),
   V(HTTPProxyAuthenticator,      STRING,   NULL),
   V(HTTPSProxy,                  STRING,   NULL),
@@ -554,6 +563,8 @@ static const config_var_t option_vars_[] = {
   VAR_D("HSLayer3Nodes",         ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V_IMMUTABLE(KeepBindCapabilities,        AUTOBOOL, "auto"),
+  V(ListenerAcceptBatchSize,     POSINT,   "32"),
+  V_IMMUTABLE(ListenerSocketsPerPort,      POSINT,   "1"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -696,6 +707,7 @@ static const config_var_t option_vars_[] = {
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
   VAR("__AlwaysCongestionControl",  BOOL, AlwaysCongestionControl, "0"),
+  VAR("__CongestionControlAlg",  STRING, CongestionControlAlg_option, NULL),
   VAR("__SbwsExit",  BOOL, SbwsExit, "0"),
   V_IMMUTABLE(User,              STRING,   NULL),
   OBSOLETE("UserspaceIOCPBuffers"),
@@ -2396,6 +2408,13 @@ options_act,(const or_options_t *old_options))
     if (options->MainloopStats != old_options->MainloopStats) {
       reset_main_loop_counters();
     }
+
+    if (options->KeepalivePeriod != old_options->KeepalivePeriod ||
+        options->ConnectionPadding != old_options->ConnectionPadding ||
+        options->TestingDirConnectionMaxStall !=
+          old_options->TestingDirConnectionMaxStall) {
+      connection_housekeeping_reschedule_all();
+    }
   }
 
   /* 31851: These options are relay-only, but we need to disable them if we
@@ -3465,6 +3484,15 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
     return -1;
   }
 
+  if (options->HSDescFetchParallelism <= 0 ||
+      options->HSDescFetchParallelism > HS_CLIENT_DESC_FETCH_PARALLELISM_MAX) {
+    tor_asprintf(msg,
+                 "HSDescFetchParallelism must be between 1 and %d, but "
+                 "was set to %d", HS_CLIENT_DESC_FETCH_PARALLELISM_MAX,
+                 options->HSDescFetchParallelism);
+    return -1;
+  }
+
   if (validate_ports_csv(options->FirewallPorts, "FirewallPorts", msg) < 0)
     return -1;
 
@@ -3585,6 +3613,15 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
              "'latency_lowmem', or 'throughput_lowmem'");
   }
 
+  options->CongestionControlAlg = CC_ALG_SENDME;
+  if (options->CongestionControlAlg_option) {
+    int alg =
+      congestion_control_alg_from_name(options->CongestionControlAlg_option);
+    if (alg < 0)
+      REJECT("__CongestionControlAlg must be 'vegas' or 'bbr'");
+    options->CongestionControlAlg = alg;
+  }
+
   if (options_validate_publish_server(old_options, options, msg) < 0)
     return -1;
 
@@ -3748,6 +3785,20 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+  if (options->ListenerAcceptBatchSize < 1 ||
+      options->ListenerAcceptBatchSize > MAX_LISTENER_ACCEPT_BATCH_SIZE) {
+    tor_asprintf(msg, "ListenerAcceptBatchSize must be between 1 and %d.",
+                 MAX_LISTENER_ACCEPT_BATCH_SIZE);
+    return -1;
+  }
+
+  if (options->ListenerSocketsPerPort < 1 ||
+      options->ListenerSocketsPerPort > MAX_LISTENER_SOCKETS_PER_PORT) {
+    tor_asprintf(msg, "ListenerSocketsPerPort must be between 1 and %d.",
+                 MAX_LISTENER_SOCKETS_PER_PORT);
+    return -1;
+  }
+
   if (config_ensure_bandwidth_cap(&options->BandwidthRate,
                            "BandwidthRate", msg) < 0)
     return -1;
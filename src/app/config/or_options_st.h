@@ -321,6 +321,9 @@ struct or_options_t {
   int PublishHidServDescriptors;
   int FetchServerDescriptors; /**< Do we fetch server descriptors as normal? */
   int FetchHidServDescriptors; /**< and hidden service descriptors? */
+  /** How many HSDirs do we fetch a hidden service descriptor from at the
+   * same time? */
+  int HSDescFetchParallelism;
 
   int FetchUselessDescriptors; /**< Do we fetch non-running descriptors too? */
   int AllDirActionsPrivate; /**< Should every directory action be sent
@@ -404,6 +407,11 @@ struct or_options_t {
   struct smartlist_t *AutomapHostsSuffixes;
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  /** How many connections do we accept from a listener each time it
+   * becomes readable? */
+  int ListenerAcceptBatchSize;
+  /** How many SO_REUSEPORT sockets do we open for each TCP listener port? */
+  int ListenerSocketsPerPort;
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
@@ -615,6 +623,11 @@ struct or_options_t {
   /** Boolean: Switch to override consensus to enable congestion control */
   int AlwaysCongestionControl;
 
+  /** Testing: name of the congestion control algorithm to use instead of
+   * the consensus one, and its cc_alg_t value (CC_ALG_SENDME if unset). */
+  char *CongestionControlAlg_option;
+  int CongestionControlAlg;
+
   /** Boolean: Switch to specify this is an sbws measurement exit */
   int SbwsExit;
 
@@ -741,6 +754,10 @@ struct or_options_t {
    * copmiler to interpreter. */
   int CompiledProofOfWorkHash;
 
+  /** How many worker threads solve a proof-of-work puzzle together? 0 means
+   * all of them. */
+  int ProofOfWorkSolverThreads;
+
   /** If true, the tor client will use conflux for its general purpose
    * circuits which excludes onion service traffic. */
   int ConfluxEnabled;
@@ -940,6 +940,7 @@ sandbox_init_filter(void)
   OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_CACHEDIR("cached-descriptors.tmp.tmp");
@@ -1046,6 +1047,7 @@ sandbox_init_filter(void)
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
@@ -18,6 +18,7 @@
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/mainloop/mainloop_pubsub.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/or/channeltls.h"
@@ -91,6 +92,7 @@ tor_cleanup(void)
       rep_hist_record_mtbf_data(now, 0);
   }
 
+  connection_housekeeping_set_enabled(0);
   timers_shutdown();
 
   tor_free_all(0); /* We could move tor_free_all back into the ifdef below
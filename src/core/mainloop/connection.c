@@ -120,6 +120,7 @@
 #include "lib/net/address.h"
 #include "lib/tls/tortls.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 #include "lib/compress/compress.h"
 
 #ifdef HAVE_PWD_H
@@ -199,6 +200,7 @@ const tor_addr_t *conn_get_outbound_address(sa_family_t family,
                   const or_options_t *options, unsigned int conn_type);
 static void reenable_blocked_connection_init(const or_options_t *options);
 static void reenable_blocked_connection_schedule(void);
+static void connection_bw_queue_remove(connection_t *conn, bool is_read);
 
 /** The last addresses that our network interface seemed to have been
  * binding to.  We use this as one way to detect when our IP changes.
@@ -856,6 +858,10 @@ connection_free_minimal(connection_t *conn)
 
   tor_str_wipe_and_free(conn->address);
 
+  timer_free(conn->housekeeping_timer);
+  connection_bw_queue_remove(conn, true);
+  connection_bw_queue_remove(conn, false);
+
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
     if (or_conn->tls) {
@@ -1066,8 +1072,8 @@ connection_close_immediate(connection_t *conn)
   connection_unregister_events(conn);
 
   /* Prevent the event from getting unblocked. */
-  conn->read_blocked_on_bw = 0;
-  conn->write_blocked_on_bw = 0;
+  connection_bw_queue_remove(conn, true);
+  connection_bw_queue_remove(conn, false);
 
   if (SOCKET_OK(conn->s))
     tor_close_socket(conn->s);
@@ -1410,6 +1416,49 @@ make_socket_reuseable(tor_socket_t sock)
 #endif /* defined(_WIN32) */
 }
 
+/** Return the number of listening sockets we should open for <b>port</b>:
+ * ListenerSocketsPerPort for TCP stream listeners on a fixed port when the
+ * platform supports SO_REUSEPORT, and 1 otherwise. */
+STATIC int
+connection_listener_sockets_per_port(const port_cfg_t *port)
+{
+  const int n = get_options()->ListenerSocketsPerPort;
+
+  if (n <= 1 || port->is_unix_addr || port->port == CFG_AUTO_PORT ||
+      port->type == CONN_TYPE_AP_DNS_LISTENER)
+    return 1;
+#ifdef SO_REUSEPORT
+  return n;
+#else
+  static int warned = 0;
+  if (!warned) {
+    log_warn(LD_NET, "ListenerSocketsPerPort is set, but this platform "
+             "does not support SO_REUSEPORT. Opening one socket per port.");
+    warned = 1;
+  }
+  return 1;
+#endif /* defined(SO_REUSEPORT) */
+}
+
+/** Let several listening sockets bind to the same address and port as
+ * <b>sock</b>, so that the kernel spreads incoming connections across them.
+ * Return 0 on success, -1 on failure. */
+static int
+make_socket_reuseport(tor_socket_t sock)
+{
+#ifdef SO_REUSEPORT
+  int one=1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+             (socklen_t)sizeof(one)) == -1) {
+    return -1;
+  }
+  return 0;
+#else
+  (void) sock;
+  return -1;
+#endif /* defined(SO_REUSEPORT) */
+}
+
 #ifdef _WIN32
 /** Tell the Windows TCP stack to prevent other applications from receiving
  * traffic from tor's open ports. Return 0 on success, -1 on failure. */
@@ -1524,6 +1573,13 @@ connection_listener_new(const struct sockaddr *listensockaddr,
                tor_socket_strerror(errno));
     }
 
+    if (port_cfg && connection_listener_sockets_per_port(port_cfg) > 1 &&
+        make_socket_reuseport(s) < 0) {
+      log_warn(LD_NET, "Error setting SO_REUSEPORT flag on %s: %s",
+               conn_type_to_string(type),
+               tor_socket_strerror(errno));
+    }
+
 #ifdef _WIN32
     if (make_win32_socket_exclusive(s) < 0) {
       log_warn(LD_NET, "Error setting SO_EXCLUSIVEADDRUSE flag on %s: %s",
@@ -1914,11 +1970,15 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Call accept() once on the listener connection <b>conn</b>, and add the
+ * new connection if necessary.
+ *
+ * Return 1 if we took a connection off the listen queue (whether or not we
+ * kept it), 0 if there is nothing more to accept right now, and -1 if the
+ * listener had an error and is now marked for close.
  */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_listener_accept_one(connection_t *conn, int new_type)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn = 0;
@@ -1974,7 +2034,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                tor_socket_strerror(errno));
     }
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (options->ConstrainedSockets)
@@ -1982,7 +2042,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6 ||
@@ -1993,7 +2053,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       log_info(LD_NET,
                "accept() returned a strange address; closing connection.");
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     tor_addr_from_sockaddr(&addr, remote, &port);
@@ -2007,7 +2067,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    fmt_and_decorate_addr(&addr));
         rep_hist_note_conn_rejected(new_type, conn->socket_family);
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -2017,7 +2077,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    fmt_and_decorate_addr(&addr));
         rep_hist_note_conn_rejected(new_type, conn->socket_family);
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_OR) {
@@ -2026,7 +2086,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       if (dos_conn_addr_get_defense_type(&addr) == DOS_CONN_DEFENSE_CLOSE) {
         rep_hist_note_conn_rejected(new_type, conn->socket_family);
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
@@ -2080,18 +2140,68 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (connection_add(newconn) < 0) { /* no space, forget it */
     connection_free(newconn);
-    return 0; /* no need to tear down the parent */
+    return 0; /* no need to tear down the parent, but stop accepting */
   }
 
   if (connection_init_accepted_conn(newconn, TO_LISTENER_CONN(conn)) < 0) {
     if (! newconn->marked_for_close)
       connection_mark_for_close(newconn);
-    return 0;
+    return 1;
   }
 
   note_connection(true /* inbound */, newconn);
 
-  return 0;
+  return 1;
+}
+
+/** Upper bounds of the histogram buckets of connections accepted per
+ * listener wakeup. */
+const int64_t listener_accepts_per_wakeup_buckets[] = {
+  0, 1, 2, 4, 8, 16, 32, 64,
+};
+CTASSERT(ARRAY_LENGTH(listener_accepts_per_wakeup_buckets) ==
+         LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS);
+/** Stats: number of listener wakeups, per number of connections accepted
+ * during the wakeup. The last element is for the wakeups that accepted more
+ * than the highest bucket. */
+uint64_t stats_listener_accepts_per_wakeup[
+                              LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS + 1];
+/** Stats: total number of connections accepted by our listeners. */
+uint64_t stats_n_listener_accepts = 0;
+
+/** Record that a listener wakeup accepted <b>n_accepted</b> connections. */
+STATIC void
+connection_note_listener_accepts(int n_accepted)
+{
+  int i;
+  for (i = 0; i < LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS; i++) {
+    if (n_accepted <= listener_accepts_per_wakeup_buckets[i])
+      break;
+  }
+  stats_listener_accepts_per_wakeup[i]++;
+  stats_n_listener_accepts += n_accepted;
+}
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept up to ListenerAcceptBatchSize pending connections from it, so that
+ * a burst of incoming connections doesn't need one wakeup each.
+ */
+static int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  const int batch_size = get_options()->ListenerAcceptBatchSize;
+  int n_accepted = 0;
+  int r = 0;
+
+  while (n_accepted < batch_size && !conn->marked_for_close) {
+    r = connection_listener_accept_one(conn, new_type);
+    if (r <= 0)
+      break;
+    ++n_accepted;
+  }
+  connection_note_listener_accepts(n_accepted);
+
+  return r < 0 ? -1 : 0;
 }
 
 /** Initialize states for newly accepted connection <b>conn</b>.
@@ -3104,6 +3214,8 @@ connection_read_proxy_handshake(connection_t *conn)
 /** Given a list of listener connections in <b>old_conns</b>, and list of
  * port_cfg_t entries in <b>ports</b>, open a new listener for every port in
  * <b>ports</b> that does not already have a listener in <b>old_conns</b>.
+ * A port may need several listeners: see
+ * connection_listener_sockets_per_port().
  *
  * Remove from <b>old_conns</b> every connection that has a corresponding
  * entry in <b>ports</b>.  Add to <b>new_conns</b> new every connection we
@@ -3131,14 +3243,15 @@ retry_listener_ports(smartlist_t *old_conns,
   smartlist_t *launch = smartlist_new();
   int r = 0;
 
-  if (control_listeners_only) {
-    SMARTLIST_FOREACH(ports, port_cfg_t *, p, {
-        if (p->type == CONN_TYPE_CONTROL_LISTENER)
-          smartlist_add(launch, p);
-    });
-  } else {
-    smartlist_add_all(launch, ports);
-  }
+  /* A port appears in launch once for every listening socket we want for
+   * it, so that each already open listener accounts for one of them. */
+  SMARTLIST_FOREACH_BEGIN(ports, port_cfg_t *, p) {
+    if (control_listeners_only && p->type != CONN_TYPE_CONTROL_LISTENER)
+      continue;
+    const int n_sockets = connection_listener_sockets_per_port(p);
+    for (int i = 0; i < n_sockets; ++i)
+      smartlist_add(launch, p);
+  } SMARTLIST_FOREACH_END(p);
 
   /* Iterate through old_conns, comparing it to launch: remove from both lists
    * each pair of elements that corresponds to the same port. */
@@ -3214,7 +3327,7 @@ retry_listener_ports(smartlist_t *old_conns,
       /* This listener is already running; we don't need to launch it. */
       //log_debug(LD_NET, "Already have %s on %s:%d",
       //    conn_type_to_string(found_port->type), conn->address, conn->port);
-      smartlist_remove(launch, found_port);
+      smartlist_del_keeporder(launch, smartlist_pos(launch, found_port));
       /* And we can remove the connection from old_conns too. */
       SMARTLIST_DEL_CURRENT(old_conns, conn);
     }
@@ -3729,6 +3842,109 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
 }
 
+/** Connections waiting for read bandwidth, in the order they ran out. */
+static TOR_TAILQ_HEAD(conn_bw_queue_t, connection_t) conns_blocked_on_read =
+  TOR_TAILQ_HEAD_INITIALIZER(conns_blocked_on_read);
+/** Connections waiting for write bandwidth, in the order they ran out. */
+static struct conn_bw_queue_t conns_blocked_on_write =
+  TOR_TAILQ_HEAD_INITIALIZER(conns_blocked_on_write);
+
+/** Total time, in msec, that connections of each class have spent waiting
+ * for bandwidth, indexed by class and then by [read, write]. */
+static uint64_t conn_bw_blocked_msec[CONN_BW_CLASS_MAX_][2];
+
+/** Return the class of <b>conn</b> for the purpose of counting how long it
+ * waits for bandwidth. */
+static conn_bw_class_t
+connection_get_bw_class(const connection_t *conn)
+{
+  switch (conn->type) {
+    case CONN_TYPE_OR:
+      return CONN_BW_CLASS_OR;
+    case CONN_TYPE_EXIT:
+    case CONN_TYPE_AP:
+      return CONN_BW_CLASS_EDGE;
+    case CONN_TYPE_DIR:
+      return CONN_BW_CLASS_DIR;
+    default:
+      return CONN_BW_CLASS_OTHER;
+  }
+}
+
+/** Return a string describing the connection class <b>cls</b>. */
+const char *
+conn_bw_class_to_string(conn_bw_class_t cls)
+{
+  switch (cls) {
+    case CONN_BW_CLASS_OR: return "or";
+    case CONN_BW_CLASS_EDGE: return "edge";
+    case CONN_BW_CLASS_DIR: return "dir";
+    case CONN_BW_CLASS_OTHER: return "other";
+    case CONN_BW_CLASS_MAX_: break;
+  }
+  tor_assert_unreached();
+  return "unknown"; // LCOV_EXCL_LINE
+}
+
+/** Return the total time, in msec, that connections of class <b>cls</b>
+ * have spent waiting for read (if <b>is_read</b>) or write bandwidth. */
+uint64_t
+connection_get_bw_blocked_msec(conn_bw_class_t cls, bool is_read)
+{
+  tor_assert(cls < CONN_BW_CLASS_MAX_);
+  return conn_bw_blocked_msec[cls][is_read ? 0 : 1];
+}
+
+/** Put <b>conn</b> at the back of the queue of connections waiting for read
+ * (if <b>is_read</b>) or write bandwidth, unless it is already waiting. */
+STATIC void
+connection_bw_queue_add(connection_t *conn, bool is_read)
+{
+  const uint32_t now_ts = monotime_coarse_get_stamp();
+
+  if (is_read) {
+    if (conn->read_blocked_on_bw)
+      return;
+    conn->read_blocked_on_bw = 1;
+    conn->read_blocked_on_bw_at = now_ts;
+    TOR_TAILQ_INSERT_TAIL(&conns_blocked_on_read, conn, read_bw_queue_entry);
+  } else {
+    if (conn->write_blocked_on_bw)
+      return;
+    conn->write_blocked_on_bw = 1;
+    conn->write_blocked_on_bw_at = now_ts;
+    TOR_TAILQ_INSERT_TAIL(&conns_blocked_on_write, conn,
+                          write_bw_queue_entry);
+  }
+}
+
+/** Take <b>conn</b> off the queue of connections waiting for read (if
+ * <b>is_read</b>) or write bandwidth, if it is on it, and count the time
+ * it spent there. */
+static void
+connection_bw_queue_remove(connection_t *conn, bool is_read)
+{
+  uint32_t blocked_at;
+
+  if (is_read) {
+    if (!conn->read_blocked_on_bw)
+      return;
+    TOR_TAILQ_REMOVE(&conns_blocked_on_read, conn, read_bw_queue_entry);
+    conn->read_blocked_on_bw = 0;
+    blocked_at = conn->read_blocked_on_bw_at;
+  } else {
+    if (!conn->write_blocked_on_bw)
+      return;
+    TOR_TAILQ_REMOVE(&conns_blocked_on_write, conn, write_bw_queue_entry);
+    conn->write_blocked_on_bw = 0;
+    blocked_at = conn->write_blocked_on_bw_at;
+  }
+
+  const uint32_t waited = monotime_coarse_get_stamp() - blocked_at;
+  conn_bw_blocked_msec[connection_get_bw_class(conn)][is_read ? 0 : 1] +=
+    monotime_coarse_stamp_units_to_approx_msec(waited);
+}
+
 /**
  * Mark <b>conn</b> as needing to stop reading because bandwidth has been
  * exhausted.  If <b>is_global_bw</b>, it is closing because global bandwidth
@@ -3745,7 +3961,7 @@ connection_read_bw_exhausted(connection_t *conn, bool is_global_bw)
   // set when it should not be, during an already-blocked XOFF
   // condition.
   if (!CONN_IS_EDGE(conn) || !TO_EDGE_CONN(conn)->xoff_received) {
-    conn->read_blocked_on_bw = 1;
+    connection_bw_queue_add(conn, true);
     connection_stop_reading(conn);
     reenable_blocked_connection_schedule();
   }
@@ -3761,7 +3977,7 @@ void
 connection_write_bw_exhausted(connection_t *conn, bool is_global_bw)
 {
   (void)is_global_bw;
-  conn->write_blocked_on_bw = 1;
+  connection_bw_queue_add(conn, false);
   connection_stop_writing(conn);
   reenable_blocked_connection_schedule();
 }
@@ -3876,12 +4092,11 @@ connection_bucket_adjust(const or_options_t *options)
  */
 static uint32_t last_refilled_global_buckets_ts=0;
 /**
- * Refill the token buckets for a single connection <b>conn</b>, and the
- * global token buckets as appropriate.  Requires that <b>now_ts</b> is
- * the time in coarse timestamp units.
+ * Refill the global token buckets, if we have not already done so at
+ * <b>now_ts</b> (in coarse timestamp units).
  */
 static void
-connection_bucket_refill_single(connection_t *conn, uint32_t now_ts)
+connection_bucket_refill_global(uint32_t now_ts)
 {
   /* Note that we only check for equality here: the underlying
    * token bucket functions can handle moving backwards in time if they
@@ -3891,6 +4106,17 @@ connection_bucket_refill_single(connection_t *conn, uint32_t now_ts)
     token_bucket_rw_refill(&global_relayed_bucket, now_ts);
     last_refilled_global_buckets_ts = now_ts;
   }
+}
+
+/**
+ * Refill the token buckets for a single connection <b>conn</b>, and the
+ * global token buckets as appropriate.  Requires that <b>now_ts</b> is
+ * the time in coarse timestamp units.
+ */
+static void
+connection_bucket_refill_single(connection_t *conn, uint32_t now_ts)
+{
+  connection_bucket_refill_global(now_ts);
 
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -3915,34 +4141,114 @@ static int reenable_blocked_connections_is_scheduled = 0;
 static struct timeval reenable_blocked_connections_delay;
 
 /**
- * Re-enable all connections that were previously blocked on read or write.
- * This event is scheduled after enough time has elapsed to be sure
- * that the buckets will refill when the connections have something to do.
+ * Return true iff <b>conn</b> can't read (if <b>is_read</b>) or write yet
+ * because its own token bucket is still empty, whatever the global buckets
+ * say.
+ */
+static bool
+connection_own_bucket_is_empty(connection_t *conn, bool is_read)
+{
+  if (is_read && CONN_IS_EDGE(conn) &&
+      token_bucket_rw_get_read(&TO_EDGE_CONN(conn)->bucket) <= 0)
+    return true;
+  if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
+    const token_bucket_rw_t *bucket = &TO_OR_CONN(conn)->bucket;
+    return (is_read ? token_bucket_rw_get_read(bucket) :
+                      token_bucket_rw_get_write(bucket)) <= 0;
+  }
+  return false;
+}
+
+/**
+ * Let connections waiting for read (if <b>is_read</b>) or write bandwidth
+ * start again, oldest first, for as long as the global
+ * buckets have tokens left for them.
+ *
+ * Each connection we wake up is expected to use about the share that
+ * connection_bucket_{read,write}_limit() would give it, so we stop once the
+ * global buckets are spoken for instead of waking everybody up at once to
+ * fight over them.  A connection that runs out again goes to the back of
+ * the queue.  Connections that are only waiting for their own bucket stay
+ * in place without using up the global budget.
+ */
+STATIC void
+connection_bw_queue_release(bool is_read, uint32_t now_ts)
+{
+  struct conn_bw_queue_t *queue =
+    is_read ? &conns_blocked_on_read : &conns_blocked_on_write;
+  const time_t now = approx_time();
+  connection_t *conn, *next;
+  ssize_t global_budget, relayed_budget;
+
+  if (is_read) {
+    global_budget = token_bucket_rw_get_read(&global_bucket);
+    relayed_budget = token_bucket_rw_get_read(&global_relayed_bucket);
+  } else {
+    global_budget = token_bucket_rw_get_write(&global_bucket);
+    relayed_budget = token_bucket_rw_get_write(&global_relayed_bucket);
+  }
+
+  for (conn = TOR_TAILQ_FIRST(queue); conn; conn = next) {
+    next = is_read ? TOR_TAILQ_NEXT(conn, read_bw_queue_entry) :
+                     TOR_TAILQ_NEXT(conn, write_bw_queue_entry);
+
+    connection_bucket_refill_single(conn, now_ts);
+    if (connection_own_bucket_is_empty(conn, is_read))
+      continue;
+
+    if (connection_is_rate_limited(conn)) {
+      const bool relayed = connection_counts_as_relayed_traffic(conn, now);
+      if (global_budget <= 0)
+        break;
+      if (relayed && relayed_budget <= 0)
+        continue;
+
+      ssize_t share = is_read ? connection_bucket_read_limit(conn, now) :
+                                connection_bucket_write_limit(conn, now);
+      global_budget -= MAX(share, 1);
+      if (relayed)
+        relayed_budget -= MAX(share, 1);
+    }
+
+    connection_bw_queue_remove(conn, is_read);
+    if (is_read) {
+      /* For conflux, we noticed logs of connection_start_reading() called
+       * multiple times while we were blocked from a previous XOFF, and this
+       * was log was correlated with stalls during ssh uploads. So we added
+       * this additional check, to avoid connection_start_reading() without
+       * getting an XON. The most important piece is always allowing
+       * the read_blocked_on_bw to get cleared, either way. */
+      if (!CONN_IS_EDGE(conn) || !TO_EDGE_CONN(conn)->xoff_received)
+        connection_start_reading(conn);
+    } else {
+      connection_start_writing(conn);
+    }
+  }
+}
+
+/**
+ * Re-enable connections that were previously blocked on read or write, as
+ * far as the refilled buckets allow.  This event is scheduled after enough
+ * time has elapsed to be sure that the buckets will refill when the
+ * connections have something to do, and reschedules itself for as long as
+ * any connection is still waiting.
  */
 static void
 reenable_blocked_connections_cb(mainloop_event_t *ev, void *arg)
 {
+  const uint32_t now_ts = monotime_coarse_get_stamp();
   (void)ev;
   (void)arg;
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    /* For conflux, we noticed logs of connection_start_reading() called
-     * multiple times while we were blocked from a previous XOFF, and this
-     * was log was correlated with stalls during ssh uploads. So we added
-     * this additional check, to avoid connection_start_reading() without
-     * getting an XON. The most important piece is always allowing
-     * the read_blocked_on_bw to get cleared, either way. */
-    if (conn->read_blocked_on_bw == 1 &&
-        (!CONN_IS_EDGE(conn) || !TO_EDGE_CONN(conn)->xoff_received)) {
-      connection_start_reading(conn);
-    }
-    conn->read_blocked_on_bw = 0;
-    if (conn->write_blocked_on_bw == 1) {
-      connection_start_writing(conn);
-      conn->write_blocked_on_bw = 0;
-    }
-  } SMARTLIST_FOREACH_END(conn);
 
   reenable_blocked_connections_is_scheduled = 0;
+
+  connection_bucket_refill_global(now_ts);
+  connection_bw_queue_release(true, now_ts);
+  connection_bw_queue_release(false, now_ts);
+
+  if (!TOR_TAILQ_EMPTY(&conns_blocked_on_read) ||
+      !TOR_TAILQ_EMPTY(&conns_blocked_on_write))
+    reenable_blocked_connection_schedule();
 }
 
 /**
@@ -4759,6 +5065,18 @@ connection_write_to_buf_commit(connection_t *conn)
   }
 }
 
+/** We're about to add data to <b>conn</b>'s outbuf.  If it is an OR
+ * connection whose outbuf is currently empty, remember that it was empty
+ * until now, so that the stuck-connection check in housekeeping doesn't
+ * have to sample the outbuf every second. */
+static void
+connection_note_outbuf_filling(connection_t *conn)
+{
+  if (conn->type == CONN_TYPE_OR && conn->outbuf &&
+      buf_datalen(conn->outbuf) == 0)
+    TO_OR_CONN(conn)->timestamp_lastempty = approx_time();
+}
+
 /** Append <b>len</b> bytes of <b>string</b> onto <b>conn</b>'s
  * outbuf, and ask it to start writing.
  *
@@ -4779,6 +5097,8 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   if (!connection_may_write_to_buf(conn))
     return;
 
+  connection_note_outbuf_filling(conn);
+
   if (zlib) {
     dir_connection_t *dir_conn = TO_DIR_CONN(conn);
     int done = zlib < 0;
@@ -4836,10 +5156,40 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
   if (!connection_may_write_to_buf(conn))
     return;
 
+  connection_note_outbuf_filling(conn);
+
   buf_move_all(conn->outbuf, buf);
   connection_write_to_buf_commit(conn);
 }
 
+/**
+ * Append <b>len</b> bytes at <b>data</b> to <b>conn</b>'s outbuf without
+ * copying them, and ask it to start writing.  We take over one reference to
+ * the memory holding <b>data</b>, which we drop by calling
+ * <b>release_fn</b>(<b>release_arg</b>) once the bytes have been flushed or
+ * discarded.  See buf_add_external().
+ */
+void
+connection_buf_add_external(const char *data, size_t len, connection_t *conn,
+                            void (*release_fn)(void *), void *release_arg)
+{
+  tor_assert(conn);
+
+  if (!len || !connection_may_write_to_buf(conn)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  connection_note_outbuf_filling(conn);
+
+  if (buf_add_external(conn->outbuf, data, len,
+                       release_fn, release_arg) < 0) {
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn);
+}
+
 #define CONN_GET_ALL_TEMPLATE(var, test) \
   STMT_BEGIN \
     smartlist_t *conns = get_connection_array();   \
@@ -241,6 +241,26 @@ void connection_write_bw_exhausted(struct connection_t *conn,
 void connection_consider_empty_read_buckets(struct connection_t *conn);
 void connection_consider_empty_write_buckets(struct connection_t *conn);
 
+/** Classes of connection for which we count the time spent waiting for
+ * bandwidth. */
+typedef enum {
+  CONN_BW_CLASS_OR = 0,
+  CONN_BW_CLASS_EDGE,
+  CONN_BW_CLASS_DIR,
+  CONN_BW_CLASS_OTHER,
+  CONN_BW_CLASS_MAX_,
+} conn_bw_class_t;
+
+const char *conn_bw_class_to_string(conn_bw_class_t cls);
+uint64_t connection_get_bw_blocked_msec(conn_bw_class_t cls, bool is_read);
+
+/** Number of buckets of the accepts per listener wakeup histogram. */
+#define LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS 8
+extern const int64_t listener_accepts_per_wakeup_buckets[];
+extern uint64_t stats_listener_accepts_per_wakeup[
+                              LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS + 1];
+extern uint64_t stats_n_listener_accepts;
+
 int connection_handle_read(struct connection_t *conn);
 
 int connection_buf_get_bytes(char *string, size_t len,
@@ -274,6 +294,10 @@ connection_buf_add(const char *string, size_t len, struct connection_t *conn)
 void connection_buf_add_compress(const char *string, size_t len,
                                  struct dir_connection_t *conn, int done);
 void connection_buf_add_buf(struct connection_t *conn, struct buf_t *buf);
+void connection_buf_add_external(const char *data, size_t len,
+                                 struct connection_t *conn,
+                                 void (*release_fn)(void *),
+                                 void *release_arg);
 
 size_t connection_get_inbuf_len(const struct connection_t *conn);
 size_t connection_get_outbuf_len(const struct connection_t *conn);
@@ -379,6 +403,11 @@ void connection_check_oos(int n_socks, int failed);
 
 #ifdef CONNECTION_PRIVATE
 STATIC void connection_free_minimal(struct connection_t *conn);
+STATIC void connection_bw_queue_add(struct connection_t *conn, bool is_read);
+STATIC void connection_bw_queue_release(bool is_read, uint32_t now_ts);
+STATIC int connection_listener_sockets_per_port(
+                               const struct port_cfg_t *port);
+STATIC void connection_note_listener_accepts(int n_accepted);
 
 /* Used only by connection.c and test*.c */
 MOCK_DECL(STATIC int,connection_connect_sockaddr,
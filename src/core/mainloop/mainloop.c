@@ -102,6 +102,7 @@
 
 #include "lib/net/buffers_net.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 
 #include <event2/event.h>
 
@@ -148,6 +149,13 @@ static uint64_t stats_n_main_loop_successes = 0;
 static uint64_t stats_n_main_loop_errors = 0;
 /** How many times have we returned from the main loop with no events. */
 static uint64_t stats_n_main_loop_idle = 0;
+/** How many times have we run housekeeping on a single connection? */
+static uint64_t stats_n_conn_housekeeping = 0;
+/** How many microseconds have we spent in connection housekeeping? */
+static uint64_t stats_conn_housekeeping_usec = 0;
+/** True iff connection housekeeping timers may be scheduled: that is, once
+ * the timer subsystem is up and the main loop is running. */
+static int conn_housekeeping_enabled = 0;
 
 /** How often will we honor SIGNEWNYM requests? */
 #define MAX_SIGNEWNYM_RATE 10
@@ -263,6 +271,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
     /* XXXX CHECK FOR NULL RETURN! */
   }
 
+  connection_schedule_housekeeping(conn, approx_time() + 1);
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
@@ -556,6 +566,20 @@ get_main_loop_idle_count(void)
   return stats_n_main_loop_idle;
 }
 
+/** Get the number of times we have run housekeeping on a connection. */
+uint64_t
+get_conn_housekeeping_count(void)
+{
+  return stats_n_conn_housekeeping;
+}
+
+/** Get the total number of microseconds spent in connection housekeeping. */
+uint64_t
+get_conn_housekeeping_usec(void)
+{
+  return stats_conn_housekeeping_usec;
+}
+
 /** Check whether <b>conn</b> is correct in having (or not having) a
  * read/write event (passed in <b>ev</b>). On success, return 0. On failure,
  * log a warning and return -1. */
@@ -1159,19 +1183,27 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
 }
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run from <b>conn</b>'s housekeeping timer.
+ *
+ * Return the earliest time at which any of these checks could have a
+ * different outcome for <b>conn</b>, or 0 if <b>conn</b> needs no more
+ * housekeeping.  Anything that can make a check fire sooner than that
+ * (losing our last circuit, becoming bad for new circuits, a new consensus
+ * or new options, hibernation, ...) calls connection_schedule_housekeeping()
+ * itself.
  */
-static void
-run_connection_housekeeping(int i, time_t now)
+STATIC time_t
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
   int have_any_circuits;
   int past_keepalive =
     now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  channelpadding_decision_t padding = CHANNELPADDING_WONTPAD;
+  time_t next;
 
   if (conn->outbuf && !connection_get_outbuf_len(conn) &&
       conn->type == CONN_TYPE_OR)
@@ -1179,18 +1211,17 @@ run_connection_housekeeping(int i, time_t now)
 
   if (conn->marked_for_close) {
     /* nothing to do here */
-    return;
+    return 0;
   }
 
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
-  if (conn->type == CONN_TYPE_DIR &&
-      ((DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_write_allowed
-            + options->TestingDirConnectionMaxStall < now) ||
-       (!DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_last_read_allowed
-            + options->TestingDirConnectionMaxStall < now))) {
+  if (conn->type == CONN_TYPE_DIR) {
+    const time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_last_write_allowed : conn->timestamp_last_read_allowed;
+    if (last_active + options->TestingDirConnectionMaxStall >= now)
+      return last_active + options->TestingDirConnectionMaxStall + 1;
+
     log_info(LD_DIR,"Expiring wedged directory conn (fd %d, purpose %d)",
              (int)conn->s, conn->purpose);
     /* This check is temporary; it's to let us know whether we should consider
@@ -1203,11 +1234,11 @@ run_connection_housekeeping(int i, time_t now)
     } else {
       connection_mark_for_close(conn);
     }
-    return;
+    return 0;
   }
 
   if (!connection_speaks_cells(conn))
-    return; /* we're all done here, the rest is just for OR conns */
+    return 0; /* we're all done here, the rest is just for OR conns */
 
   /* If we haven't flushed to an OR connection for a while, then either nuke
      the connection or send a keepalive, depending. */
@@ -1237,12 +1268,14 @@ run_connection_housekeeping(int i, time_t now)
                                    END_OR_CONN_REASON_TIMEOUT,
                                    "Tor gave up on the connection");
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!connection_state_is_open(conn)) {
     if (past_keepalive) {
       /* We never managed to actually get this connection open and happy. */
       log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
                (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
       connection_or_close_normally(TO_OR_CONN(conn), 0);
+      return 0;
     }
   } else if (we_are_hibernating() &&
              ! have_any_circuits &&
@@ -1253,6 +1286,7 @@ run_connection_housekeeping(int i, time_t now)
              "[Hibernating or exiting].",
              (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!have_any_circuits &&
              now - or_conn->idle_timeout >=
                                          chan->timestamp_last_had_circuits) {
@@ -1264,6 +1298,7 @@ run_connection_housekeeping(int i, time_t now)
              or_conn->idle_timeout,
              or_conn->is_canonical ? "" : "non");
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (
       now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
       now >=
@@ -1275,6 +1310,7 @@ run_connection_housekeeping(int i, time_t now)
            conn->port, (int)connection_get_outbuf_len(conn),
            (int)(now-conn->timestamp_last_write_allowed));
     connection_or_close_normally(TO_OR_CONN(conn), 0);
+    return 0;
   } else if (past_keepalive && !connection_get_outbuf_len(conn)) {
     /* send a padding cell */
     log_fn(LOG_DEBUG,LD_OR,"Sending keepalive to (%s:%d)",
@@ -1283,8 +1319,107 @@ run_connection_housekeeping(int i, time_t now)
     cell.command = CELL_PADDING;
     connection_or_write_cell_to_buf(&cell, or_conn);
   } else {
-    channelpadding_decide_to_pad_channel(chan);
+    padding = channelpadding_decide_to_pad_channel(chan);
+  }
+
+  /* Nothing fired: find the earliest time that one of the checks above
+   * could.  Activity on the connection only ever moves these later. */
+  next = conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  next = MIN(next,
+             MAX(or_conn->timestamp_lastempty,
+                 conn->timestamp_last_write_allowed) +
+             options->KeepalivePeriod*10);
+  if (!have_any_circuits)
+    next = MIN(next,
+               chan->timestamp_last_had_circuits + or_conn->idle_timeout);
+  /* Padding decisions expect to be made once per second while the channel
+   * is padding or might start to; so does hibernation. */
+  if (padding != CHANNELPADDING_WONTPAD || past_keepalive ||
+      we_are_hibernating())
+    next = now + 1;
+
+  return MAX(next, now + 1);
+}
+
+/** Timer callback: run housekeeping on the connection in <b>arg</b>, and
+ * schedule its next run. */
+static void
+connection_housekeeping_cb(tor_timer_t *timer, void *arg,
+                           const struct monotime_t *time_now)
+{
+  connection_t *conn = arg;
+  monotime_t start, end;
+  time_t next;
+  (void)timer;
+  (void)time_now;
+
+  conn->housekeeping_at = 0;
+
+  monotime_get(&start);
+  next = run_connection_housekeeping(conn, approx_time());
+  monotime_get(&end);
+
+  ++stats_n_conn_housekeeping;
+  stats_conn_housekeeping_usec += monotime_diff_usec(&start, &end);
+
+  if (next)
+    connection_schedule_housekeeping(conn, next);
+}
+
+/** Make sure that housekeeping runs on <b>conn</b> no later than
+ * <b>when</b>.  If it is already scheduled to run sooner, do nothing.
+ * Connections that need no housekeeping are never scheduled.
+ */
+void
+connection_schedule_housekeeping(connection_t *conn, time_t when)
+{
+  struct timeval tv;
+  time_t now;
+
+  tor_assert(conn);
+
+  if (!conn_housekeeping_enabled || conn->marked_for_close)
+    return;
+  if (conn->type != CONN_TYPE_OR && conn->type != CONN_TYPE_DIR)
+    return;
+  if (conn->housekeeping_at && conn->housekeeping_at <= when)
+    return;
+
+  now = approx_time();
+  if (when <= now)
+    when = now + 1;
+
+  if (!conn->housekeeping_timer) {
+    conn->housekeeping_timer = timer_new(connection_housekeeping_cb, conn);
   }
+  tv.tv_sec = (time_t)(when - now);
+  tv.tv_usec = 0;
+  timer_schedule(conn->housekeeping_timer, &tv);
+  conn->housekeeping_at = when;
+}
+
+/** Something that every connection's housekeeping depends on has changed
+ * (options, consensus parameters, hibernation state): make sure that every
+ * connection gets looked at again within the next second. */
+void
+connection_housekeeping_reschedule_all(void)
+{
+  const time_t next = approx_time() + 1;
+
+  if (!connection_array)
+    return;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                    connection_schedule_housekeeping(conn, next));
+}
+
+/** Enable or disable per-connection housekeeping timers.  When enabling,
+ * schedule housekeeping on every existing connection. */
+void
+connection_housekeeping_set_enabled(int enabled)
+{
+  conn_housekeeping_enabled = enabled;
+  if (enabled)
+    connection_housekeeping_reschedule_all();
 }
 
 /** Honor a NEWNYM request: make future requests unlinkable to past
@@ -1755,12 +1890,9 @@ second_elapsed_callback(time_t now, const or_options_t *options)
     circuit_expire_old_circs_as_needed(now);
   }
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. Per-connection housekeeping runs from each connection's own timer;
+   * here we only notice which channels have become bad for new circuits. */
   channel_update_bad_for_new_circs(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
 
   /* Run again in a second. */
   return 1;
@@ -1815,7 +1947,7 @@ rotate_x509_certificate_callback(time_t now, const or_options_t *options)
 
   /* We also make sure to rotate the TLS connections themselves if they've
    * been up for too long -- but that's done via is_bad_for_new_circs in
-   * run_connection_housekeeping() above. */
+   * run_connection_housekeeping(). */
   return MAX_SSL_KEY_LIFETIME_INTERNAL;
 }
 
@@ -2381,6 +2513,7 @@ do_main_loop(void)
   initialize_mainloop_events();
 
   periodic_events_connect_all();
+  connection_housekeeping_set_enabled(1);
 
   struct timeval one_second = { 1, 0 };
   initialize_periodic_events_event = tor_evtimer_new(
@@ -78,6 +78,12 @@ void reset_main_loop_counters(void);
 uint64_t get_main_loop_success_count(void);
 uint64_t get_main_loop_error_count(void);
 uint64_t get_main_loop_idle_count(void);
+uint64_t get_conn_housekeeping_count(void);
+uint64_t get_conn_housekeeping_usec(void);
+
+void connection_schedule_housekeeping(connection_t *conn, time_t when);
+void connection_housekeeping_reschedule_all(void);
+void connection_housekeeping_set_enabled(int enabled);
 
 void periodic_events_on_new_options(const or_options_t *options);
 
@@ -104,6 +110,7 @@ STATIC void teardown_periodic_events(void);
 STATIC int get_my_roles(const or_options_t *);
 STATIC int check_network_participation_callback(time_t now,
                                                 const or_options_t *options);
+STATIC time_t run_connection_housekeeping(connection_t *conn, time_t now);
 
 #ifdef TOR_UNIT_TESTS
 extern smartlist_t *connection_array;
@@ -2905,6 +2905,29 @@ channel_mark_bad_for_new_circs(channel_t *chan)
   tor_assert(chan);
 
   chan->is_bad_for_new_circs = 1;
+  channel_schedule_housekeeping(chan);
+}
+
+/**
+ * Schedule housekeeping on a channel soon.
+ *
+ * Call this when something that run_connection_housekeeping() looks at has
+ * changed for <b>chan</b>, so that the underlying connection gets checked
+ * again within the next second instead of at its next scheduled deadline.
+ */
+void
+channel_schedule_housekeeping(channel_t *chan)
+{
+  tor_assert(chan);
+
+  if (chan->magic != TLS_CHAN_MAGIC)
+    return;
+
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(chan);
+  if (tlschan->conn) {
+    connection_schedule_housekeeping(TO_CONN(tlschan->conn),
+                                     approx_time() + 1);
+  }
 }
 
 /**
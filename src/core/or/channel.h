@@ -443,9 +443,9 @@ struct channel_t {
   time_t timestamp_recv; /**< Cell received from lower layer */
   time_t timestamp_xmit; /**< Cell sent to lower layer */
 
-  /** Timestamp for run_connection_housekeeping(). We update this once a
-   * second when we run housekeeping and find a circuit on this channel, and
-   * whenever we add a circuit to the channel. */
+  /** Timestamp for run_connection_housekeeping(). We update this when we
+   * run housekeeping and find a circuit on this channel, and whenever we add
+   * a circuit to the channel or remove one from it. */
   time_t timestamp_last_had_circuits;
 
   /** Unique ID for measuring direct network status requests;vtunneled ones
@@ -457,6 +457,12 @@ struct channel_t {
   uint64_t n_cells_recved, n_bytes_recved;
   /** Channel counters for cells and bytes we have sent. */
   uint64_t n_cells_xmitted, n_bytes_xmitted;
+
+  /** Start of the current pacing budget window, in monotime usec, and the
+   * number of paced cells that circuits sent on this channel during it.
+   * See congestion_control_pacing.c. */
+  uint64_t pacing_window_start_usec;
+  uint32_t pacing_window_cells;
 };
 
 struct channel_listener_t {
@@ -728,6 +734,7 @@ MOCK_DECL(const char *, channel_describe_peer,(channel_t *chan));
 int channel_has_queued_writes(channel_t *chan);
 int channel_is_bad_for_new_circs(channel_t *chan);
 void channel_mark_bad_for_new_circs(channel_t *chan);
+void channel_schedule_housekeeping(channel_t *chan);
 int channel_is_canonical(channel_t *chan);
 int channel_is_client(const channel_t *chan);
 int channel_is_local(channel_t *chan);
@@ -271,6 +271,7 @@ channelpadding_update_padding_for_channel(channel_t *chan,
   }
 
   chan->padding_enabled = (pad_vars->command == CHANNELPADDING_COMMAND_START);
+  channel_schedule_housekeeping(chan);
 
   /* Min must not be lower than the current consensus parameter
      nf_ito_low. */
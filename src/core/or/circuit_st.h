@@ -80,6 +80,13 @@ struct circuit_t {
 
   /** Queue of cells waiting to be transmitted on n_chan */
   cell_queue_t n_chan_cells;
+  /** Coarse monotonic timestamp at which the sojourn time of the cells
+   * leaving n_chan_cells went above the AQM target, or 0 if it is below. */
+  uint32_t n_chan_cells_aqm_above_since;
+  /** Same as n_chan_cells_aqm_above_since but for p_chan_cells. This lives
+   * here, and not in or_circuit_t, so the AQM code stays direction
+   * agnostic. */
+  uint32_t p_chan_cells_aqm_above_since;
 
   /**
    * The hop to which we want to extend this circuit.  Should be NULL if
@@ -93,6 +100,12 @@ struct circuit_t {
   /** True iff we are waiting for p_chan_cells to become less full before
    * allowing any more cells on this circuit. (OR circuit only.) */
   unsigned int circuit_blocked_on_p_chan : 1;
+  /** True iff circuit_blocked_on_n_chan was set by the cell queue AQM
+   * because cells stayed too long in n_chan_cells. */
+  unsigned int circuit_aqm_blocked_on_n_chan : 1;
+  /** True iff circuit_blocked_on_p_chan was set by the cell queue AQM
+   * because cells stayed too long in p_chan_cells. */
+  unsigned int circuit_aqm_blocked_on_p_chan : 1;
 
   /** True iff we have queued a delete backwards on this circuit, but not put
    * it on the output buffer. */
@@ -172,6 +185,9 @@ struct circuit_t {
    *
    * We keep this timestamp with a higher resolution than most so that the
    * circuit-build-time tracking code can get millisecond resolution.
+   *
+   * Origin circuits are indexed by this value, so only change it with
+   * circuit_reset_timestamp_began() once the circuit exists.
    */
   struct timeval timestamp_began;
 
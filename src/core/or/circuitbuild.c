@@ -464,6 +464,8 @@ origin_circuit_init(uint8_t purpose, int flags)
   circ->build_state->need_conflux =
     ((flags & CIRCLAUNCH_NEED_CONFLUX) ? 1 : 0);
   circ->base_.purpose = purpose;
+  /* A new circuit is building so it is always an expiry candidate. */
+  circuit_update_expiry_index(circ);
   return circ;
 }
 
@@ -820,7 +822,7 @@ circuit_deliver_create_cell,(circuit_t *circ,
         tor_fragile_assert();
       }
 
-      tor_gettimeofday(&circ->timestamp_began);
+      circuit_reset_timestamp_began(circ);
     }
 
     /* mark it so it gets better rate limiting treatment. */
@@ -1010,8 +1012,10 @@ circuit_send_first_onion_skin(origin_circuit_t *circ)
      * analysis (such as netflow record retention). That means we want
      * to pad it.
      */
-    if (circ->base_.n_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS)
+    if (circ->base_.n_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS) {
       circ->base_.n_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+      channel_schedule_housekeeping(circ->base_.n_chan);
+    }
   }
 
   node = node_get_by_id(circ->base_.n_chan->identity_digest);
@@ -2171,7 +2175,7 @@ circuit_extend_to_new_exit(origin_circuit_t *circ, extend_info_t *exit_ei)
   int err_reason = 0;
   warn_if_last_router_excluded(circ, exit_ei);
 
-  tor_gettimeofday(&circ->base_.timestamp_began);
+  circuit_reset_timestamp_began(TO_CIRCUIT(circ));
 
   circuit_append_new_exit(circ, exit_ei);
   circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_BUILDING);
@@ -142,6 +142,11 @@ static smartlist_t *circuits_pending_other_guards = NULL;
  * circuit_mark_for_close and which are waiting for circuit_about_to_free. */
 static smartlist_t *circuits_pending_close = NULL;
 
+/** A priority queue, ordered by timestamp_began, of every origin circuit
+ * that circuit_expire_building() could act on. See
+ * circuit_update_expiry_index(). */
+static smartlist_t *circuits_expiry_index = NULL;
+
 static void circuit_about_to_free_atexit(circuit_t *circ);
 static void circuit_about_to_free(circuit_t *circ);
 
@@ -312,6 +317,14 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
         --(old_chan->num_p_circuits);
       }
     }
+
+    /* The old channel had circuits until now; if this was its last one,
+     * its idle timeout starts now. */
+    if (old_chan != chan) {
+      old_chan->timestamp_last_had_circuits = approx_time();
+      if (channel_num_circuits(old_chan) == 0)
+        channel_schedule_housekeeping(old_chan);
+    }
   }
 
   /* Change the values only after we have possibly made the circuit inactive
@@ -587,8 +600,10 @@ circuit_set_state(circuit_t *circ, uint8_t state)
 
   tor_trace(TR_SUBSYS(circuit), TR_EV(change_state), circ, circ->state, state);
   circ->state = state;
-  if (CIRCUIT_IS_ORIGIN(circ))
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    circuit_update_expiry_index(TO_ORIGIN_CIRCUIT(circ));
     circuit_state_publish(circ);
+  }
 }
 
 /** Append to <b>out</b> all circuits in state CHAN_WAIT waiting for
@@ -641,6 +656,130 @@ circuit_count_pending_on_channel(channel_t *chan)
   return cnt;
 }
 
+/** Compare the build start time of two origin circuits, for the expiry
+ * index priority queue. */
+static int
+compare_origin_circuits_by_began_(const void *a, const void *b)
+{
+  const circuit_t *ca = TO_CIRCUIT((const origin_circuit_t *) a);
+  const circuit_t *cb = TO_CIRCUIT((const origin_circuit_t *) b);
+
+  if (timercmp(&ca->timestamp_began, &cb->timestamp_began, OP_LT))
+    return -1;
+  if (timercmp(&ca->timestamp_began, &cb->timestamp_began, OP_GT))
+    return 1;
+  return 0;
+}
+
+/** Return true iff <b>circ</b> is an origin circuit that
+ * circuit_expire_building() may time out, that is it is still building or
+ * it is open with a purpose that is expected to make progress in a bounded
+ * time. Any open circuit of another purpose is always skipped there. */
+STATIC int
+circuit_is_expiry_candidate(const circuit_t *circ)
+{
+  if (!CIRCUIT_IS_ORIGIN(circ))
+    return 0;
+  if (circ->state != CIRCUIT_STATE_OPEN)
+    return 1;
+
+  switch (circ->purpose) {
+  case CIRCUIT_PURPOSE_S_ESTABLISH_INTRO:
+  case CIRCUIT_PURPOSE_C_REND_READY:
+  case CIRCUIT_PURPOSE_PATH_BIAS_TESTING:
+  case CIRCUIT_PURPOSE_C_ESTABLISH_REND:
+  case CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED:
+  case CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Remove <b>origin_circ</b> from the expiry index, if it is there. */
+static void
+circuit_remove_from_expiry_index(origin_circuit_t *origin_circ)
+{
+  if (origin_circ->expiry_index_idx < 0)
+    return;
+  tor_assert(circuits_expiry_index);
+  smartlist_pqueue_remove(circuits_expiry_index,
+                          compare_origin_circuits_by_began_,
+                          offsetof(origin_circuit_t, expiry_index_idx),
+                          origin_circ);
+  origin_circ->expiry_index_idx = -1;
+}
+
+/** Add or remove <b>origin_circ</b> to or from the expiry index depending on
+ * whether circuit_expire_building() may act on it.
+ *
+ * The index is ordered by timestamp_began so it MUST be called whenever the
+ * state, the purpose or timestamp_began of an origin circuit changes. These
+ * are handled by circuit_set_state(), circuit_change_purpose() and
+ * circuit_reset_timestamp_began(): use those rather than setting the fields
+ * directly. */
+void
+circuit_update_expiry_index(origin_circuit_t *origin_circ)
+{
+  circuit_remove_from_expiry_index(origin_circ);
+
+  if (!circuit_is_expiry_candidate(TO_CIRCUIT(origin_circ)))
+    return;
+
+  if (PREDICT_UNLIKELY(!circuits_expiry_index))
+    circuits_expiry_index = smartlist_new();
+  smartlist_pqueue_add(circuits_expiry_index,
+                       compare_origin_circuits_by_began_,
+                       offsetof(origin_circuit_t, expiry_index_idx),
+                       origin_circ);
+}
+
+/** Set the time at which <b>circ</b> began building to now, and keep the
+ * expiry index in order if it is an origin circuit. */
+void
+circuit_reset_timestamp_began(circuit_t *circ)
+{
+  tor_gettimeofday(&circ->timestamp_began);
+  if (CIRCUIT_IS_ORIGIN(circ))
+    circuit_update_expiry_index(TO_ORIGIN_CIRCUIT(circ));
+}
+
+/** Helper for circuit_get_expiry_candidates(): add the subtree of the expiry
+ * index rooted at <b>idx</b> to <b>out</b>, pruning every node that began
+ * after <b>cutoff</b> since, by the heap property, so do all its children. */
+static void
+circuit_get_expiry_candidates_rec(smartlist_t *out, int idx,
+                                  const struct timeval *cutoff)
+{
+  const origin_circuit_t *ocirc;
+  const circuit_t *circ;
+
+  if (idx >= smartlist_len(circuits_expiry_index))
+    return;
+  ocirc = smartlist_get(circuits_expiry_index, idx);
+  circ = TO_CIRCUIT(ocirc);
+  if (timercmp(&circ->timestamp_began, cutoff, OP_GT))
+    return;
+
+  smartlist_add(out, (void *) circ);
+  circuit_get_expiry_candidates_rec(out, 2*idx+1, cutoff);
+  circuit_get_expiry_candidates_rec(out, 2*idx+2, cutoff);
+}
+
+/** Append to <b>out</b> every circuit of the expiry index that began at or
+ * before <b>cutoff</b>. This costs time proportional to the number of
+ * circuits returned, not to the size of the index. */
+void
+circuit_get_expiry_candidates(smartlist_t *out, const struct timeval *cutoff)
+{
+  tor_assert(out);
+  tor_assert(cutoff);
+
+  if (!circuits_expiry_index)
+    return;
+  circuit_get_expiry_candidates_rec(out, 0, cutoff);
+}
+
 /** Remove <b>origin_circ</b> from the global list of origin circuits.
  * Called when we are freeing a circuit.
  */
@@ -1068,6 +1207,10 @@ origin_circuit_new(void)
   circ->global_origin_circuit_list_idx = -1;
   circuit_add_to_origin_circuit_list(circ);
 
+  /* Not in the expiry index until it gets an origin purpose. See
+   * origin_circuit_init(). */
+  circ->expiry_index_idx = -1;
+
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
 
   if (! circuit_build_times_disabled(get_options()) &&
@@ -1185,6 +1328,7 @@ circuit_free_(circuit_t *circ)
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
 
     circuit_remove_from_origin_circuit_list(ocirc);
+    circuit_remove_from_expiry_index(ocirc);
 
     if (ocirc->half_streams) {
       SMARTLIST_FOREACH_BEGIN(ocirc->half_streams, half_edge_t *,
@@ -1369,6 +1513,9 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
+  smartlist_free(circuits_expiry_index);
+  circuits_expiry_index = NULL;
+
   {
     chan_circid_circuit_map_t **elt, **next, *c;
     for (elt = HT_START(chan_circid_map, &chan_circid_map);
@@ -236,6 +236,10 @@ int circuit_get_cpath_len(origin_circuit_t *circ);
 int circuit_get_cpath_opened_len(const origin_circuit_t *);
 void circuit_clear_cpath(origin_circuit_t *circ);
 crypt_path_t *circuit_get_cpath_hop(origin_circuit_t *circ, int hopnum);
+void circuit_update_expiry_index(origin_circuit_t *origin_circ);
+void circuit_reset_timestamp_began(circuit_t *circ);
+void circuit_get_expiry_candidates(smartlist_t *out,
+                                   const struct timeval *cutoff);
 void circuit_get_all_pending_on_channel(smartlist_t *out,
                                         channel_t *chan);
 int circuit_count_pending_on_channel(channel_t *chan);
@@ -265,6 +269,7 @@ HANDLE_DECL(circuit, circuit_t, )
 #ifdef CIRCUITLIST_PRIVATE
 STATIC void circuit_free_(circuit_t *circ);
 #define circuit_free(circ) FREE_AND_NULL(circuit_t, circuit_free_, (circ))
+STATIC int circuit_is_expiry_candidate(const circuit_t *circ);
 STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
@@ -450,11 +450,12 @@ circuit_expire_building(void)
   struct timeval general_cutoff, begindir_cutoff, fourhop_cutoff,
     close_cutoff, extremely_old_cutoff,
     cannibalized_cutoff, c_intro_cutoff, s_intro_cutoff, stream_cutoff,
-    c_rend_ready_cutoff;
+    c_rend_ready_cutoff, latest_cutoff;
   const or_options_t *options = get_options();
   struct timeval now;
   cpath_build_state_t *build_state;
   int any_opened_circs = 0;
+  smartlist_t *victims;
 
   tor_gettimeofday(&now);
 
@@ -543,9 +544,33 @@ circuit_expire_building(void)
   SET_CUTOFF(close_cutoff, get_circuit_build_close_time_ms());
   SET_CUTOFF(extremely_old_cutoff, get_circuit_build_close_time_ms()*2 + 1000);
 
+  /* A circuit is only considered below if it began before the cutoff of its
+   * kind, so none can be acted on unless it began before the latest of them.
+   * This lets us ask the expiry index for those circuits only, instead of
+   * walking every circuit we have. */
+  latest_cutoff = general_cutoff;
+#define CONSIDER_CUTOFF(c) do {                                 \
+    if (timercmp(&(c), &latest_cutoff, OP_GT))                  \
+      latest_cutoff = (c);                                      \
+  } while (0)
+  CONSIDER_CUTOFF(begindir_cutoff);
+  CONSIDER_CUTOFF(fourhop_cutoff);
+  CONSIDER_CUTOFF(stream_cutoff);
+  CONSIDER_CUTOFF(cannibalized_cutoff);
+  CONSIDER_CUTOFF(c_intro_cutoff);
+  CONSIDER_CUTOFF(s_intro_cutoff);
+  CONSIDER_CUTOFF(c_rend_ready_cutoff);
+  CONSIDER_CUTOFF(close_cutoff);
+#undef CONSIDER_CUTOFF
+
   bool fixed_time = circuit_build_times_disabled(get_options());
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  /* Work on a copy since closing or repurposing a circuit updates the
+   * index. */
+  victims = smartlist_new();
+  circuit_get_expiry_candidates(victims, &latest_cutoff);
+
+  SMARTLIST_FOREACH_BEGIN(victims, circuit_t *, victim) {
     struct timeval cutoff;
 
     if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
@@ -817,6 +842,8 @@ circuit_expire_building(void)
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
   } SMARTLIST_FOREACH_END(victim);
+
+  smartlist_free(victims);
 }
 
 /**
@@ -2160,7 +2187,7 @@ circuit_launch_by_extend_info(uint8_t purpose,
        * Technically, the code should reset this when the
        * create cell is finally sent, but we're close enough
        * here. */
-      tor_gettimeofday(&circ->base_.timestamp_began);
+      circuit_reset_timestamp_began(TO_CIRCUIT(circ));
 
       control_event_circuit_cannibalized(circ, old_purpose,
                                          &old_timestamp_began);
@@ -3140,6 +3167,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
             new_purpose);
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
+    circuit_update_expiry_index(TO_ORIGIN_CIRCUIT(circ));
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
                                           old_purpose);
 
@@ -37,9 +37,19 @@ static inline uint64_t cwnd_sendable(const circuit_t *on_circ,
 /* Track the total number of bytes used by all ooo_q so it can be used by the
  * OOM handler to assess.
  *
- * When adding or subtracting to this value, use conflux_msg_alloc_cost(). */
+ * When adding or subtracting messages to this value, use
+ * conflux_msg_alloc_cost(); the slot arrays of the ooo rings are counted
+ * here too. */
 static uint64_t total_ooo_q_bytes = 0;
 
+/** Smallest number of slots we allocate for an out-of-order ring. */
+#define CONFLUX_OOO_RING_MIN_SLOTS 64
+/** Largest number of slots we allow an out-of-order ring to grow to.
+ * Messages further ahead than this go to the overflow priority queue, so
+ * that a peer can't make us allocate a huge, mostly empty ring by jumping
+ * ahead in sequence numbers. */
+#define CONFLUX_OOO_RING_MAX_SLOTS (1<<14)
+
 /**
  * Determine if we should multiplex a specific relay command or not.
  *
@@ -172,8 +182,8 @@ uint64_t
 conflux_get_circ_bytes_allocation(const circuit_t *circ)
 {
   if (circ->conflux) {
-    return smartlist_len(circ->conflux->ooo_q) * sizeof(void*)
-      + circ->conflux->ooo_q_alloc_cost;
+    return (circ->conflux->ooo_ring_cap + smartlist_len(circ->conflux->ooo_q))
+      * sizeof(void*) + circ->conflux->ooo_q_alloc_cost;
   }
   return 0;
 }
@@ -834,6 +844,106 @@ conflux_msg_alloc_cost(conflux_msg_t *msg)
   return msg->msg->length + sizeof(conflux_msg_t) + sizeof(relay_msg_t);
 }
 
+/**
+ * Return a new conflux_msg_t holding a copy of <b>msg</b>, with sequence
+ * number <b>seq</b>.  The entry, the message and its body share a single
+ * allocation of exactly conflux_msg_alloc_cost() bytes.
+ */
+static conflux_msg_t *
+conflux_msg_new(uint64_t seq, const relay_msg_t *msg)
+{
+  tor_assert(msg->length <= RELAY_PAYLOAD_SIZE_MAX);
+  conflux_msg_t *c_msg = tor_malloc_zero(sizeof(conflux_msg_t) +
+                                         sizeof(relay_msg_t) + msg->length);
+  relay_msg_t *copy = (relay_msg_t *) (c_msg + 1);
+  uint8_t *body = (uint8_t *) (copy + 1);
+
+  memcpy(copy, msg, sizeof(*msg));
+  copy->body = body;
+  memcpy(body, msg->body, msg->length);
+
+  c_msg->seq = seq;
+  c_msg->heap_idx = -1;
+  c_msg->msg = copy;
+  return c_msg;
+}
+
+/**
+ * Replace the out-of-order ring of <b>cfx</b> with one of <b>new_cap</b>
+ * slots (zero or a power of two), moving every queued message over.  The
+ * new ring must be large enough for the current window.
+ */
+static void
+conflux_ooo_ring_resize(conflux_t *cfx, size_t new_cap)
+{
+  conflux_msg_t **ring = NULL;
+
+  tor_assert(new_cap == 0 || (new_cap & (new_cap - 1)) == 0);
+  tor_assert(new_cap || cfx->ooo_ring_len == 0);
+
+  if (new_cap) {
+    ring = tor_calloc(new_cap, sizeof(conflux_msg_t *));
+    for (size_t i = 0; i < cfx->ooo_ring_cap; ++i) {
+      conflux_msg_t *c_msg = cfx->ooo_ring[i];
+      if (c_msg)
+        ring[c_msg->seq & (new_cap - 1)] = c_msg;
+    }
+  }
+
+  total_ooo_q_bytes -= cfx->ooo_ring_cap * sizeof(conflux_msg_t *);
+  total_ooo_q_bytes += new_cap * sizeof(conflux_msg_t *);
+  tor_free(cfx->ooo_ring);
+  cfx->ooo_ring = ring;
+  cfx->ooo_ring_cap = new_cap;
+}
+
+/**
+ * Add a copy of <b>msg</b>, which has absolute sequence number <b>seq</b>,
+ * to the out-of-order queue of <b>cfx</b>.  The sequence number must be
+ * beyond the next one we expect to deliver.
+ */
+void
+conflux_enqueue_relay_msg(conflux_t *cfx, uint64_t seq,
+                          const relay_msg_t *msg)
+{
+  /* Notice the copy here. Reason is that we don't have ownership of the
+   * message. If we wanted to pull that off, we would need to change the
+   * whole calling stack and unit tests on either not touching it after this
+   * function indicates that it has taken it or never allocate it from the
+   * stack. This is simpler and less error prone but might show up in our
+   * profile (maybe?). The Maze is serious. It needs to be respected. */
+  conflux_msg_t *c_msg = conflux_msg_new(seq, msg);
+  const uint64_t dist = seq - cfx->last_seq_delivered;
+  size_t cost = conflux_msg_alloc_cost(c_msg);
+
+  tor_assert(seq > cfx->last_seq_delivered);
+
+  /* Widen the ring if this message is past its end, unless that would take
+   * us over the maximum. */
+  if (dist > cfx->ooo_ring_cap && dist <= CONFLUX_OOO_RING_MAX_SLOTS) {
+    size_t new_cap = MAX(cfx->ooo_ring_cap, CONFLUX_OOO_RING_MIN_SLOTS);
+    while (new_cap < dist)
+      new_cap <<= 1;
+    conflux_ooo_ring_resize(cfx, new_cap);
+  }
+
+  conflux_msg_t **slot = NULL;
+  if (dist <= cfx->ooo_ring_cap)
+    slot = &cfx->ooo_ring[seq & (cfx->ooo_ring_cap - 1)];
+
+  if (slot && *slot == NULL) {
+    *slot = c_msg;
+    cfx->ooo_ring_len++;
+  } else {
+    /* Too far ahead for the ring, or a sequence number we already have. */
+    smartlist_pqueue_add(cfx->ooo_q, conflux_queue_cmp,
+                         offsetof(conflux_msg_t, heap_idx), c_msg);
+  }
+
+  total_ooo_q_bytes += cost;
+  cfx->ooo_q_alloc_cost += cost;
+}
+
 /**
  * Process an incoming relay cell for conflux. Called from
  * connection_edge_process_relay_cell().
@@ -879,22 +989,7 @@ conflux_process_relay_msg(conflux_t *cfx, circuit_t *in_circ,
     circuit_mark_for_close(in_circ, END_CIRC_REASON_INTERNAL);
     return false;
   } else {
-    conflux_msg_t *c_msg = tor_malloc_zero(sizeof(conflux_msg_t));
-    c_msg->seq = leg->last_seq_recv;
-    /* Notice the copy here. Reason is that we don't have ownership of the
-     * message. If we wanted to pull that off, we would need to change the
-     * whole calling stack and unit tests on either not touching it after this
-     * function indicates that it has taken it or never allocate it from the
-     * stack. This is simpler and less error prone but might show up in our
-     * profile (maybe?). The Maze is serious. It needs to be respected. */
-    c_msg->msg = relay_msg_copy(msg);
-    size_t cost = conflux_msg_alloc_cost(c_msg);
-
-    smartlist_pqueue_add(cfx->ooo_q, conflux_queue_cmp,
-                         offsetof(conflux_msg_t, heap_idx), c_msg);
-
-    total_ooo_q_bytes += cost;
-    cfx->ooo_q_alloc_cost += cost;
+    conflux_enqueue_relay_msg(cfx, leg->last_seq_recv, msg);
 
     /* This cell should not be processed yet, and the queue is not ready
      * to process because the next absolute seqnum has not yet arrived */
@@ -911,35 +1006,79 @@ conflux_process_relay_msg(conflux_t *cfx, circuit_t *in_circ,
 conflux_msg_t *
 conflux_dequeue_relay_msg(conflux_t *cfx)
 {
+  const uint64_t next_seq = cfx->last_seq_delivered + 1;
   conflux_msg_t *top = NULL;
-  if (smartlist_len(cfx->ooo_q) == 0)
-    return NULL;
 
-  top = smartlist_get(cfx->ooo_q, 0);
+  /* The next message is either in its ring slot, or in the overflow queue
+   * if it was too far ahead when it arrived. */
+  if (cfx->ooo_ring_len) {
+    conflux_msg_t **slot = &cfx->ooo_ring[next_seq & (cfx->ooo_ring_cap - 1)];
+    if (*slot) {
+      top = *slot;
+      tor_assert(top->seq == next_seq);
+      *slot = NULL;
+      cfx->ooo_ring_len--;
+    }
+  }
 
-  /* If the top cell is the next sequence number we need, then
-   * pop and return it. */
-  if (top->seq == cfx->last_seq_delivered+1) {
+  while (!top && smartlist_len(cfx->ooo_q)) {
+    conflux_msg_t *head = smartlist_get(cfx->ooo_q, 0);
+    if (head->seq > next_seq)
+      break;
     smartlist_pqueue_pop(cfx->ooo_q, conflux_queue_cmp,
                          offsetof(conflux_msg_t, heap_idx));
+    if (head->seq == next_seq) {
+      top = head;
+    } else {
+      /* A duplicate of a sequence number we already delivered: it can
+       * never be delivered, so don't let it block the queue. */
+      size_t cost = conflux_msg_alloc_cost(head);
+      total_ooo_q_bytes -= cost;
+      cfx->ooo_q_alloc_cost -= cost;
+      conflux_relay_msg_free(head);
+    }
+  }
 
-    size_t cost = conflux_msg_alloc_cost(top);
-    total_ooo_q_bytes -= cost;
-    cfx->ooo_q_alloc_cost -= cost;
-
-    cfx->last_seq_delivered++;
-    return top;
-  } else {
+  if (!top)
     return NULL;
+
+  size_t cost = conflux_msg_alloc_cost(top);
+  total_ooo_q_bytes -= cost;
+  cfx->ooo_q_alloc_cost -= cost;
+
+  /* Don't hold on to a large ring once it has drained. */
+  if (cfx->ooo_ring_len == 0 &&
+      cfx->ooo_ring_cap > CONFLUX_OOO_RING_MIN_SLOTS)
+    conflux_ooo_ring_resize(cfx, 0);
+
+  cfx->last_seq_delivered++;
+  return top;
+}
+
+/** Free every message in the out-of-order queue of <b>cfx</b>, along with
+ * the queue storage, and update the memory accounting. The overflow
+ * smartlist itself is kept. */
+void
+conflux_clear_ooo_queue(conflux_t *cfx)
+{
+  for (size_t i = 0; i < cfx->ooo_ring_cap; ++i) {
+    conflux_relay_msg_free(cfx->ooo_ring[i]);
   }
+  cfx->ooo_ring_len = 0;
+  conflux_ooo_ring_resize(cfx, 0);
+
+  SMARTLIST_FOREACH(cfx->ooo_q, conflux_msg_t *, c_msg,
+                    conflux_relay_msg_free(c_msg));
+  smartlist_clear(cfx->ooo_q);
+
+  total_ooo_q_bytes -= cfx->ooo_q_alloc_cost;
+  cfx->ooo_q_alloc_cost = 0;
 }
 
 /** Free a given conflux msg object. */
 void
 conflux_relay_msg_free_(conflux_msg_t *msg)
 {
-  if (msg) {
-    relay_msg_free(msg->msg);
-    tor_free(msg);
-  }
+  /* The relay message lives in the same allocation; see conflux_msg_new(). */
+  tor_free(msg);
 }
@@ -26,7 +26,7 @@ typedef struct conflux_leg_t conflux_leg_t;
 #define CONFLUX_NUM_LEGS(cfx) (smartlist_len(cfx->legs))
 
 /** A relay message for the out-of-order queue. */
-typedef struct {
+typedef struct conflux_msg_t {
   /**
    * Absolute sequence number of this cell, computed from the
    * relative sequence number of the conflux cell. */
@@ -38,7 +38,8 @@ typedef struct {
   int heap_idx;
 
   /** The relay message here is always guaranteed to have removed its
-   * extra conflux sequence number, for ease of processing */
+   * extra conflux sequence number, for ease of processing.  It lives in the
+   * same allocation as this object, right after it, followed by its body. */
   relay_msg_t *msg;
 } conflux_msg_t;
 
@@ -60,7 +61,10 @@ bool conflux_should_multiplex(int relay_command);
 bool conflux_process_relay_msg(conflux_t *cfx, circuit_t *in_circ,
                                crypt_path_t *layer_hint,
                                const relay_msg_t *msg);
+void conflux_enqueue_relay_msg(conflux_t *cfx, uint64_t seq,
+                               const relay_msg_t *msg);
 conflux_msg_t *conflux_dequeue_relay_msg(conflux_t *cfx);
+void conflux_clear_ooo_queue(conflux_t *cfx);
 void conflux_note_cell_sent(conflux_t *cfx, circuit_t *circ,
                             uint8_t relay_command);
 void conflux_relay_msg_free_(conflux_msg_t *msg);
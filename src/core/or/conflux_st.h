@@ -93,18 +93,28 @@ struct conflux_t {
   smartlist_t *legs;
 
   /**
-   * Out-of-order priority queue of conflux_cell_t *, heapified
-   * on conflux_cell_t.seq number (lowest at top of heap).
-   *
-   * XXX: We are most likely to insert cells at either the head or the tail.
-   * Verify that is fast-path wrt smartlist priority queues, and not a memmove
-   * nightmare. If so, we may need a real linked list, or a packed_cell_t list.
+   * Out-of-order queue, as a ring of ooo_ring_cap slots (zero or a power of
+   * two) indexed by sequence number: a message with sequence number seq is
+   * at ooo_ring[seq & (ooo_ring_cap - 1)].  Only messages with a sequence
+   * number in (last_seq_delivered, last_seq_delivered + ooo_ring_cap] go
+   * here, so slots never collide, and draining in order just walks the
+   * ring.  The ring grows as the window of queued messages widens.
+   */
+  struct conflux_msg_t **ooo_ring;
+  size_t ooo_ring_cap;
+  /** Number of occupied slots in ooo_ring. */
+  int ooo_ring_len;
+
+  /**
+   * Overflow for the out-of-order queue: a priority queue of conflux_msg_t
+   * *, heapified on seq (lowest at top of heap), holding the messages too
+   * far ahead to fit in ooo_ring, and any duplicate sequence numbers.
    */
   smartlist_t *ooo_q;
 
   /**
-   * Approximate allocation cost of the bytes stored in ooo_q
-   * and the messages that it contains.
+   * Approximate allocation cost of the messages stored in ooo_ring and
+   * ooo_q.
    */
   size_t ooo_q_alloc_cost;
 
@@ -0,0 +1,457 @@
+/* Copyright (c) 2019-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_bbr.c
+ * \brief Code that implements a BBR-style congestion control algorithm.
+ *
+ * TOR_BBR adapts the ideas of TCP BBR to SENDME-clocked circuits. It keeps a
+ * model of the path made of two numbers: the bottleneck bandwidth, which is
+ * the windowed maximum of the rate at which SENDMEs acknowledge cells, and
+ * the minimum RTT seen over the last few seconds. Their product is the BDP,
+ * and the congestion window follows it.
+ *
+ * Cells are not paced by default, so the usual BBR pacing gains are applied
+ * to the congestion window instead: once per round, PROBE_BW lets cwnd go a
+ * quarter above the BDP, then a quarter below it to drain what that probe
+ * queued. Unlike Vegas, a higher RTT alone is not a congestion signal, so
+ * jitter on an uncongested path does not shrink the window.
+ */
+
+#define TOR_CONGESTION_CONTROL_BBR_PRIVATE
+
+#include "core/or/or.h"
+
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_st.h"
+#include "core/or/congestion_control_bbr.h"
+#include "core/or/circuitlist.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/control/control_events.h"
+#include "lib/time/compat_time.h"
+
+/** Percentage of the BDP to keep in flight, on top of the cycle gain. */
+#define BBR_CWND_GAIN_DFLT (125)
+/** Number of rounds to remember the max delivery rate for. */
+#define BBR_BW_ROUNDS_DFLT (10)
+/** How long a min RTT sample stays valid, in msec. */
+#define BBR_MIN_RTT_WIN_DFLT (10*1000)
+
+/** Cwnd gain (percent) during startup: 2/ln(2), as in BBR. */
+#define BBR_STARTUP_GAIN (289)
+/** Upper bound on the ack aggregation allowance, as time at max_bw. */
+#define BBR_EXTRA_ACKED_MAX_USEC (100*1000)
+/** How long to stay in PROBE_RTT once inflight is low, in usec. */
+#define BBR_PROBE_RTT_USEC (200*1000)
+/** Startup ends when the rate grows by less than this percent ... */
+#define BBR_FULL_BW_GROWTH_PCT (125)
+/** ... for this many rounds in a row. */
+#define BBR_FULL_BW_ROUNDS (3)
+/** Number of sendme_incs between cwnd and inflight for cwnd to be
+ * still considered full. */
+#define BBR_CWND_FULL_GAP (2)
+
+/** The PROBE_BW cycle of cwnd gains, in percent: probe, drain, cruise. */
+static const uint8_t bbr_cycle_gain[] = {
+  125, 75, 100, 100, 100, 100, 100, 100
+};
+#define BBR_CYCLE_LEN (ARRAY_LENGTH(bbr_cycle_gain))
+
+/** Number of circuits that left startup. */
+uint64_t cc_stats_bbr_circ_exited_startup = 0;
+/** Number of times a circuit entered PROBE_RTT. */
+uint64_t cc_stats_bbr_probe_rtt = 0;
+
+/** Return a human-readable name for a BBR mode, for logging. */
+static const char *
+bbr_mode_to_string(uint8_t mode)
+{
+  switch (mode) {
+    case BBR_MODE_STARTUP: return "STARTUP";
+    case BBR_MODE_DRAIN: return "DRAIN";
+    case BBR_MODE_PROBE_BW: return "PROBE_BW";
+    case BBR_MODE_PROBE_RTT: return "PROBE_RTT";
+    default: return "UNKNOWN";
+  }
+}
+
+/**
+ * Cache BBR consensus parameters, and allocate the BBR state.
+ *
+ * The BBR model does not depend on path length, since it measures the
+ * path rather than budgeting a queue per hop, so <b>path</b> is unused.
+ */
+void
+congestion_control_bbr_set_params(congestion_control_t *cc,
+                                  cc_path_t path)
+{
+  tor_assert(cc->cc_alg == CC_ALG_BBR);
+  (void)path;
+
+  if (!cc->bbr)
+    cc->bbr = tor_malloc_zero(sizeof(struct bbr_state_t));
+
+  cc->bbr->cwnd_gain =
+    networkstatus_get_param(NULL, "cc_bbr_cwnd_gain",
+      BBR_CWND_GAIN_DFLT,
+      100,
+      400);
+
+  cc->bbr->bw_filter_rounds =
+    networkstatus_get_param(NULL, "cc_bbr_bw_rounds",
+      BBR_BW_ROUNDS_DFLT,
+      2,
+      BBR_BW_FILTER_MAX_ROUNDS);
+
+  cc->bbr->min_rtt_win_usec = 1000 *
+    networkstatus_get_param(NULL, "cc_bbr_min_rtt_win",
+      BBR_MIN_RTT_WIN_DFLT,
+      1000,
+      60*1000);
+
+  cc->bbr->mode = BBR_MODE_STARTUP;
+}
+
+/** Release the BBR state of <b>cc</b>. */
+void
+congestion_control_bbr_free_state(congestion_control_t *cc)
+{
+  tor_free(cc->bbr);
+}
+
+/** Return the bottleneck bandwidth estimate, in cells per second. */
+static uint64_t
+bbr_max_bw(const congestion_control_t *cc)
+{
+  uint32_t max_bw = 0;
+
+  for (int i = 0; i < cc->bbr->bw_filter_rounds; i++)
+    max_bw = MAX(max_bw, cc->bbr->bw_filter[i]);
+
+  return max_bw;
+}
+
+/** Return the BDP of the BBR path model in cells, or 0 if we have no
+ * model yet. */
+static uint64_t
+bbr_bdp(const congestion_control_t *cc)
+{
+  return bbr_max_bw(cc) * cc->bbr->min_rtt_usec / (1000*1000);
+}
+
+/**
+ * Count the cells acked by the SENDME that arrived at <b>now</b>, for a
+ * cell we sent at <b>sent</b>. If that cell was sent after the current
+ * round began, the round is over: take a delivery rate sample over it, put
+ * the sample in the bandwidth filter, and start a new round. Returns true
+ * on a new round.
+ *
+ * Sampling over a whole round, rather than between two SENDMEs, keeps
+ * SENDMEs that jitter bunched together from looking like a faster path.
+ * For the same reason we divide by the longer of the send and the ack
+ * intervals, as BBR does.
+ */
+static bool
+bbr_update_round(congestion_control_t *cc, uint64_t now, uint64_t sent)
+{
+  struct bbr_state_t *bbr = cc->bbr;
+
+  bbr->delivered += cc->sendme_inc;
+
+  if (sent < bbr->round_start_usec)
+    return false;
+
+  if (bbr->round_start_usec) {
+    uint64_t ack_elapsed = now - bbr->round_start_usec;
+    uint64_t send_elapsed = sent > bbr->round_start_sent_usec ?
+                              sent - bbr->round_start_sent_usec : 0;
+    uint64_t interval = MAX(ack_elapsed, send_elapsed);
+
+    if (interval > 0) {
+      uint64_t bw = (bbr->delivered - bbr->round_start_delivered) *
+                      1000*1000 / interval;
+      int slot = bbr->round_count % bbr->bw_filter_rounds;
+      bbr->bw_filter[slot] = (uint32_t)MIN(bw, UINT32_MAX);
+    }
+  }
+
+  bbr->round_count++;
+  bbr->round_start_usec = now;
+  bbr->round_start_sent_usec = sent;
+  bbr->round_start_delivered = bbr->delivered;
+  return true;
+}
+
+/**
+ * Estimate how many cells SENDMEs acknowledged in a burst beyond what the
+ * bottleneck bandwidth can explain, and keep the windowed max of that in
+ * extra_acked. This is BBR's ack aggregation allowance.
+ *
+ * Over a jittery path, SENDMEs arrive late and then bunched. If cwnd were
+ * just the BDP, the sender would sit idle waiting for each late SENDME, and
+ * the lower delivery rate would shrink the BDP in turn. Adding the usual
+ * burst size to cwnd keeps the bottleneck busy; on a smooth path it is
+ * close to zero and costs no queue.
+ */
+static void
+bbr_update_ack_aggregation(congestion_control_t *cc, uint64_t now,
+                           bool new_round)
+{
+  struct bbr_state_t *bbr = cc->bbr;
+  uint64_t max_bw = bbr_max_bw(cc);
+  uint64_t expected, extra;
+
+  if (new_round &&
+      ++bbr->extra_acked_rounds >= MAX(bbr->bw_filter_rounds / 2, 1)) {
+    bbr->extra_acked_rounds = 0;
+    bbr->extra_acked_idx ^= 1;
+    bbr->extra_acked[bbr->extra_acked_idx] = 0;
+  }
+
+  if (!max_bw)
+    return;
+
+  /* Start a new epoch whenever acks fall behind the bandwidth, so that
+   * only the bursts above it count. */
+  expected = max_bw * (now - bbr->ack_epoch_usec) / (1000*1000);
+  if (!bbr->ack_epoch_usec || bbr->ack_epoch_acked <= expected) {
+    bbr->ack_epoch_usec = now;
+    bbr->ack_epoch_acked = 0;
+    expected = 0;
+  }
+  bbr->ack_epoch_acked += cc->sendme_inc;
+
+  extra = MIN(bbr->ack_epoch_acked - expected, cc->cwnd);
+  if (extra > bbr->extra_acked[bbr->extra_acked_idx])
+    bbr->extra_acked[bbr->extra_acked_idx] = (uint32_t)extra;
+}
+
+/** Return the ack aggregation allowance to add to cwnd, in cells. */
+static uint64_t
+bbr_extra_acked(const congestion_control_t *cc)
+{
+  const struct bbr_state_t *bbr = cc->bbr;
+  uint64_t extra = MAX(bbr->extra_acked[0], bbr->extra_acked[1]);
+
+  return MIN(extra,
+             bbr_max_bw(cc) * BBR_EXTRA_ACKED_MAX_USEC / (1000*1000));
+}
+
+/**
+ * Feed an RTT sample into the windowed min RTT filter. Returns true if the
+ * previous min RTT had expired, which is our cue to enter PROBE_RTT.
+ */
+static bool
+bbr_update_min_rtt(congestion_control_t *cc, uint64_t now, uint64_t rtt)
+{
+  struct bbr_state_t *bbr = cc->bbr;
+  bool expired = bbr->min_rtt_usec &&
+                 now > bbr->min_rtt_stamp_usec + bbr->min_rtt_win_usec;
+
+  if (rtt && (!bbr->min_rtt_usec || rtt <= bbr->min_rtt_usec || expired)) {
+    bbr->min_rtt_usec = rtt;
+    bbr->min_rtt_stamp_usec = now;
+  }
+
+  return expired;
+}
+
+/** Switch <b>cc</b> to BBR <b>mode</b>, logging the change. */
+static void
+bbr_enter_mode(const circuit_t *circ, congestion_control_t *cc,
+               bbr_mode_t mode)
+{
+  struct bbr_state_t *bbr = cc->bbr;
+
+  log_info(LD_CIRC,
+           "CC: TOR_BBR %s -> %s. "
+           "RTT: %"PRIu64", %"PRIu64", "
+           "CWND: %"PRIu64", INFL: %"PRIu64", "
+           "BW: %"PRIu64", BDP: %"PRIu64,
+           bbr_mode_to_string(bbr->mode), bbr_mode_to_string(mode),
+           bbr->min_rtt_usec/1000, cc->ewma_rtt_usec/1000,
+           cc->cwnd, cc->inflight, bbr_max_bw(cc), bbr_bdp(cc));
+
+  if (bbr->mode == BBR_MODE_STARTUP) {
+    cc->in_slow_start = 0;
+    /* Never go back to startup, even if we left it early. */
+    bbr->full_bw_rounds = BBR_FULL_BW_ROUNDS;
+    cc_stats_bbr_circ_exited_startup++;
+
+    /* As with Vegas, sbws wants to know when slow start is over. */
+    if (CIRCUIT_IS_ORIGIN(circ)) {
+      /* We must discard const here because the event modifies fields :/ */
+      control_event_circ_bandwidth_used_for_circ(
+              TO_ORIGIN_CIRCUIT((circuit_t*)circ));
+    }
+  }
+
+  if (mode == BBR_MODE_PROBE_RTT) {
+    bbr->prior_cwnd = cc->cwnd;
+    bbr->probe_rtt_done_usec = 0;
+    cc_stats_bbr_probe_rtt++;
+  } else if (mode == BBR_MODE_PROBE_BW) {
+    /* Do not start the cycle on the probing or draining phase. */
+    bbr->cycle_idx = 2;
+  }
+
+  bbr->mode = mode;
+}
+
+/** Return true iff the window is, roughly, fully used. */
+static inline bool
+bbr_cwnd_is_full(const congestion_control_t *cc)
+{
+  return cc->inflight + BBR_CWND_FULL_GAP*cc->sendme_inc >= cc->cwnd;
+}
+
+/**
+ * Process a SENDME and update the congestion window according to the
+ * TOR_BBR path model.
+ *
+ * In startup, the window grows by one sendme_inc per SENDME, up to
+ * BBR_STARTUP_GAIN times the BDP, until the delivery rate stops growing.
+ * After draining the queue that this built, cwnd follows cwnd_gain times
+ * the BDP, scaled by the PROBE_BW gain cycle, plus the ack aggregation
+ * allowance. Every cc_bbr_min_rtt_win msec it drops to half a BDP for a
+ * moment to refresh the min RTT. A blocked local channel ends startup and
+ * stops any growth.
+ */
+int
+congestion_control_bbr_process_sendme(congestion_control_t *cc,
+                                      const circuit_t *circ)
+{
+  struct bbr_state_t *bbr;
+  uint64_t now, sent = 0, rtt = 0, bdp;
+  bool new_round, min_rtt_expired;
+
+  tor_assert(cc && cc->cc_alg == CC_ALG_BBR && cc->bbr);
+  tor_assert(circ);
+  bbr = cc->bbr;
+
+  /* Update ack counter until next congestion signal event is allowed */
+  if (cc->next_cc_event)
+    cc->next_cc_event--;
+
+  /* Update ack counter until a full cwnd is processed */
+  if (cc->next_cwnd_event)
+    cc->next_cwnd_event--;
+
+  /* Remember when the acked cell was sent, before the RTT code dequeues
+   * it. We need it for rate samples and round counting. */
+  if (smartlist_len(cc->sendme_pending_timestamps)) {
+    sent = *(uint64_t *)smartlist_get(cc->sendme_pending_timestamps, 0);
+  }
+
+  /* Compute RTT and the common BDP estimates. If we did not update, don't
+   * run the alg */
+  if (!congestion_control_update_circuit_estimates(cc, circ)) {
+    cc->inflight = cc->inflight - cc->sendme_inc;
+    return 0;
+  }
+
+  now = monotime_absolute_usec();
+  if (cc->ewma_rtt_usec && sent && now > sent)
+    rtt = now - sent;
+
+  cc->cwnd_full = bbr_cwnd_is_full(cc);
+
+  new_round = bbr_update_round(cc, now, sent);
+  bbr_update_ack_aggregation(cc, now, new_round);
+  min_rtt_expired = bbr_update_min_rtt(cc, now, rtt);
+  bdp = bbr_bdp(cc);
+
+  if (min_rtt_expired && bbr->mode != BBR_MODE_PROBE_RTT) {
+    bbr_enter_mode(circ, cc, BBR_MODE_PROBE_RTT);
+  }
+
+  switch (bbr->mode) {
+    case BBR_MODE_STARTUP:
+      /* Only judge the growth of rounds that could actually grow. */
+      if (new_round && cc->cwnd_full && !cc->blocked_chan) {
+        uint64_t max_bw = bbr_max_bw(cc);
+        if (max_bw * 100 >= (uint64_t)bbr->full_bw * BBR_FULL_BW_GROWTH_PCT) {
+          bbr->full_bw = (uint32_t)max_bw;
+          bbr->full_bw_rounds = 0;
+        } else {
+          bbr->full_bw_rounds++;
+        }
+      }
+
+      if (cc->blocked_chan || bbr->full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+        bbr_enter_mode(circ, cc, BBR_MODE_DRAIN);
+        cc->cwnd = MAX(bdp, cc->cwnd_min);
+      } else if (cc->cwnd_full &&
+                 (!bdp || cc->cwnd < bdp * BBR_STARTUP_GAIN / 100)) {
+        /* Without pacing, the startup gain bounds the window instead. */
+        cc->cwnd += cc->sendme_inc;
+      }
+      break;
+
+    case BBR_MODE_DRAIN:
+      cc->cwnd = MAX(bdp, cc->cwnd_min);
+      /* Inflight still counts the cells that this SENDME acks. */
+      if (cc->inflight - cc->sendme_inc <= cc->cwnd)
+        bbr_enter_mode(circ, cc, BBR_MODE_PROBE_BW);
+      break;
+
+    case BBR_MODE_PROBE_BW: {
+      uint64_t target;
+
+      if (new_round)
+        bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+
+      target = bdp * bbr_cycle_gain[bbr->cycle_idx] / 100 *
+                 bbr->cwnd_gain / 100 + bbr_extra_acked(cc);
+
+      /* Back off at once, but grow only as fast as startup would. */
+      if (target < cc->cwnd) {
+        cc->cwnd = target;
+      } else if (cc->cwnd_full && !cc->blocked_chan) {
+        cc->cwnd = MIN(cc->cwnd + cc->sendme_inc, target);
+      }
+      break;
+    }
+
+    case BBR_MODE_PROBE_RTT:
+      cc->cwnd = MAX(bdp / 2, cc->cwnd_min);
+
+      if (!bbr->probe_rtt_done_usec) {
+        if (cc->inflight - cc->sendme_inc <= cc->cwnd) {
+          bbr->probe_rtt_done_usec = now +
+            MAX(BBR_PROBE_RTT_USEC, bbr->min_rtt_usec);
+        }
+      } else if (now >= bbr->probe_rtt_done_usec) {
+        bbr->min_rtt_stamp_usec = now;
+        cc->cwnd = MAX(bbr->prior_cwnd, cc->cwnd);
+        bbr_enter_mode(circ, cc, bbr->full_bw_rounds >= BBR_FULL_BW_ROUNDS ?
+                                 BBR_MODE_PROBE_BW : BBR_MODE_STARTUP);
+      }
+      break;
+
+    default:
+      tor_assert_nonfatal_unreached();
+      break;
+  }
+
+  /* cwnd can never fall below 1 increment */
+  cc->cwnd = MAX(cc->cwnd, cc->cwnd_min);
+
+  /* Report our own model in the common BDP field, for logs and tracing. */
+  if (bdp)
+    cc->bdp = bdp;
+
+  /* Reset event counters */
+  if (cc->next_cwnd_event == 0) {
+    cc->next_cwnd_event = SENDME_PER_CWND(cc);
+  }
+  if (cc->next_cc_event == 0) {
+    cc->next_cc_event = CWND_UPDATE_RATE(cc);
+  }
+
+  /* Update inflight with ack */
+  cc->inflight = cc->inflight - cc->sendme_inc;
+
+  return 0;
+}
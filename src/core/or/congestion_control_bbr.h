@@ -0,0 +1,42 @@
+/* Copyright (c) 2019-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_bbr.h
+ * \brief Private-ish APIs for the TOR_BBR congestion control algorithm
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_BBR_H
+#define TOR_CONGESTION_CONTROL_BBR_H
+
+#include "core/or/crypt_path_st.h"
+#include "core/or/circuit_st.h"
+
+extern uint64_t cc_stats_bbr_circ_exited_startup;
+extern uint64_t cc_stats_bbr_probe_rtt;
+
+/* Processing SENDME cell. */
+int congestion_control_bbr_process_sendme(struct congestion_control_t *cc,
+                                          const circuit_t *circ);
+void congestion_control_bbr_set_params(struct congestion_control_t *cc,
+                                       cc_path_t path);
+void congestion_control_bbr_free_state(struct congestion_control_t *cc);
+
+/* Private section starts. */
+#ifdef TOR_CONGESTION_CONTROL_BBR_PRIVATE
+
+/** Phases of the BBR state machine. */
+typedef enum {
+  /** Grow cwnd exponentially until the delivery rate stops growing. */
+  BBR_MODE_STARTUP = 0,
+  /** Shrink cwnd to the BDP to drain the queue that startup built. */
+  BBR_MODE_DRAIN = 1,
+  /** Steady state: keep a BDP in flight, cycling gains to probe. */
+  BBR_MODE_PROBE_BW = 2,
+  /** Briefly cut inflight so that we can measure a fresh min RTT. */
+  BBR_MODE_PROBE_RTT = 3,
+} bbr_mode_t;
+
+#endif /* defined(TOR_CONGESTION_CONTROL_BBR_PRIVATE) */
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_BBR_H) */
@@ -22,6 +22,8 @@
 #include "core/or/congestion_control_st.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_vegas.h"
+#include "core/or/congestion_control_bbr.h"
+#include "core/or/congestion_control_pacing.h"
 #include "core/or/congestion_control_st.h"
 #include "core/or/conflux.h"
 #include "core/or/conflux_util.h"
@@ -131,6 +133,44 @@ static uint8_t rtt_reset_pct = RTT_RESET_PCT_DFLT;
 /** Metric to count the number of congestion control circuits **/
 uint64_t cc_stats_circs_created = 0;
 
+/** Implementations of each congestion control algorithm, indexed by
+ * cc_alg_t. Algorithms that we do not implement have no entry. */
+static const cc_alg_ops_t cc_alg_ops[NUM_CC_ALGS] = {
+  [CC_ALG_VEGAS] = {
+    .name = "vegas",
+    .set_params = congestion_control_vegas_set_params,
+    .process_sendme = congestion_control_vegas_process_sendme,
+  },
+  [CC_ALG_BBR] = {
+    .name = "bbr",
+    .set_params = congestion_control_bbr_set_params,
+    .process_sendme = congestion_control_bbr_process_sendme,
+    .free_state = congestion_control_bbr_free_state,
+  },
+};
+
+/** Return the implementation of congestion control algorithm <b>alg</b>,
+ * or NULL if we do not implement it. */
+const cc_alg_ops_t *
+congestion_control_alg_get_ops(int alg)
+{
+  if ((unsigned)alg >= NUM_CC_ALGS || !cc_alg_ops[alg].process_sendme)
+    return NULL;
+  return &cc_alg_ops[alg];
+}
+
+/** Return the congestion control algorithm whose name is <b>name</b>, or -1
+ * if there is no implemented algorithm by that name. */
+int
+congestion_control_alg_from_name(const char *name)
+{
+  for (int alg = 0; alg < NUM_CC_ALGS; alg++) {
+    if (cc_alg_ops[alg].name && !strcmp(cc_alg_ops[alg].name, name))
+      return alg;
+  }
+  return -1;
+}
+
 /** Return the number of RTT reset that have been done. */
 uint64_t
 congestion_control_get_num_rtt_reset(void)
@@ -213,7 +253,7 @@ congestion_control_new_consensus_params(const networkstatus_t *ns)
         CC_ALG_DFLT,
         CC_ALG_MIN,
         CC_ALG_MAX);
-  if (cc_alg != CC_ALG_SENDME && cc_alg != CC_ALG_VEGAS) {
+  if (cc_alg != CC_ALG_SENDME && !congestion_control_alg_get_ops(cc_alg)) {
     // Does not need rate limiting because consensus updates
     // are at most 1x/hour
     log_warn(LD_BUG, "Unsupported congestion control algorithm %d",
@@ -252,6 +292,8 @@ congestion_control_new_consensus_params(const networkstatus_t *ns)
         N_EWMA_SS_DFLT,
         N_EWMA_SS_MIN,
         N_EWMA_SS_MAX);
+
+  congestion_control_pacing_new_consensus_params(ns);
 }
 
 /**
@@ -269,6 +311,7 @@ congestion_control_init_params(congestion_control_t *cc,
                                cc_path_t path)
 {
   const or_options_t *opts = get_options();
+  const cc_alg_ops_t *ops;
   cc->sendme_inc = params->sendme_inc_cells;
 
 #define CWND_INIT_MIN SENDME_INC_DFLT
@@ -311,18 +354,21 @@ congestion_control_init_params(congestion_control_t *cc,
         CWND_MIN_MIN,
         CWND_MIN_MAX);
 
-  /* If the consensus says to use OG sendme, but torrc has
-   * always-enabled, use the default "always" alg (vegas),
-   * else use cached conensus alg. */
-  if (cc_alg == CC_ALG_SENDME && opts->AlwaysCongestionControl) {
+  /* If torrc picks an algorithm for testing, use it. If the consensus says
+   * to use OG sendme, but torrc has always-enabled, use the default
+   * "always" alg (vegas), else use cached conensus alg. */
+  if (opts->CongestionControlAlg != CC_ALG_SENDME) {
+    cc->cc_alg = opts->CongestionControlAlg;
+  } else if (cc_alg == CC_ALG_SENDME && opts->AlwaysCongestionControl) {
     cc->cc_alg = CC_ALG_DFLT_ALWAYS;
   } else {
     cc->cc_alg = cc_alg;
   }
 
   /* Algorithm-specific parameters */
-  if (cc->cc_alg == CC_ALG_VEGAS) {
-    congestion_control_vegas_set_params(cc, path);
+  ops = congestion_control_alg_get_ops(cc->cc_alg);
+  if (ops) {
+    ops->set_params(cc, path);
   } else {
     // This should not happen anymore
     log_warn(LD_BUG, "Unknown congestion control algorithm %d",
@@ -403,6 +449,7 @@ congestion_control_init(congestion_control_t *cc,
 
   cc->in_slow_start = 1;
   congestion_control_init_params(cc, params, path);
+  congestion_control_pacing_init(cc);
 
   cc->next_cc_event = CWND_UPDATE_RATE(cc);
 }
@@ -426,9 +473,16 @@ congestion_control_new(const circuit_params_t *params, cc_path_t path)
 void
 congestion_control_free_(congestion_control_t *cc)
 {
+  const cc_alg_ops_t *ops;
+
   if (!cc)
     return;
 
+  ops = congestion_control_alg_get_ops(cc->cc_alg);
+  if (ops && ops->free_state)
+    ops->free_state(cc);
+  congestion_control_pacing_free(cc);
+
   SMARTLIST_FOREACH(cc->sendme_pending_timestamps, uint64_t *, t, tor_free(t));
   smartlist_free(cc->sendme_pending_timestamps);
 
@@ -520,15 +574,25 @@ congestion_control_get_package_window(const circuit_t *circ,
   if (!cc) {
     return package_window;
   } else {
+    uint64_t window;
+
     /* Inflight can be above cwnd if cwnd was just reduced */
     if (cc->inflight > cc->cwnd)
       return 0;
+    window = cc->cwnd - cc->inflight;
+
+    /* If we pace cells, only let out what the pacing credit allows. */
+    if (cc->pacing) {
+      window = MIN(window, congestion_control_pacing_get_credit(cc, circ,
+                                                monotime_absolute_usec()));
+    }
+
     /* In the extremely unlikely event that cwnd-inflight is larger than
      * INT32_MAX, just return that cap, so old code doesn't explode. */
-    else if (cc->cwnd - cc->inflight > INT32_MAX)
+    if (window > INT32_MAX)
       return INT32_MAX;
     else
-      return (int)(cc->cwnd - cc->inflight);
+      return (int)window;
   }
 }
 
@@ -634,6 +698,10 @@ congestion_control_note_cell_sent(congestion_control_t *cc,
   tor_assert(circ);
   tor_assert(cc);
 
+  if (cc->pacing)
+    congestion_control_pacing_note_cell_sent(cc, circ,
+                                             monotime_absolute_usec());
+
   /* Is this the last cell before a SENDME? The idea is that if the
    * package_window reaches a multiple of the increment, after this cell, we
    * should expect a SENDME. Note that this function must be called *before*
@@ -975,9 +1043,12 @@ congestion_control_dispatch_cc_alg(congestion_control_t *cc,
                                    circuit_t *circ)
 {
   int ret = -END_CIRC_REASON_INTERNAL;
+  const cc_alg_ops_t *ops = congestion_control_alg_get_ops(cc->cc_alg);
 
-  tor_assert_nonfatal_once(cc->cc_alg == CC_ALG_VEGAS);
-  ret = congestion_control_vegas_process_sendme(cc, circ);
+  if (BUG(!ops)) {
+    return ret;
+  }
+  ret = ops->process_sendme(cc, circ);
 
   if (cc->cwnd > cwnd_max) {
     static ratelim_t cwnd_limit = RATELIM_INIT(60);
@@ -45,6 +45,29 @@ congestion_control_t *congestion_control_new(
                                     const struct circuit_params_t *params,
                                     cc_path_t path);
 
+/**
+ * The interface that every congestion control algorithm implements.
+ *
+ * The common code picks an implementation by cc_alg, calls set_params()
+ * once at circuit setup, process_sendme() for every SENDME, and free_state()
+ * (if any) when the circuit's congestion control object is freed.
+ */
+typedef struct cc_alg_ops_t {
+  /** Short name, as used in the __CongestionControlAlg option. */
+  const char *name;
+  /** Cache consensus parameters and set up per-circuit state. */
+  void (*set_params)(struct congestion_control_t *cc, cc_path_t path);
+  /** Update the congestion window from a SENDME. Returns 0 on success, or
+   * a negative END_CIRC_REASON_* on error. */
+  int (*process_sendme)(struct congestion_control_t *cc,
+                        const circuit_t *circ);
+  /** Release any algorithm-specific state. May be NULL. */
+  void (*free_state)(struct congestion_control_t *cc);
+} cc_alg_ops_t;
+
+const cc_alg_ops_t *congestion_control_alg_get_ops(int alg);
+int congestion_control_alg_from_name(const char *name);
+
 int congestion_control_dispatch_cc_alg(congestion_control_t *cc,
                                        circuit_t *circ);
 
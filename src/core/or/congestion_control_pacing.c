@@ -0,0 +1,388 @@
+/* Copyright (c) 2019-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_pacing.c
+ * \brief Code that spreads the cells of a congestion window over an RTT.
+ *
+ * Without pacing, a circuit sends its whole congestion window as soon as
+ * a SENDME opens it, and that burst waits in the queues of the relays on
+ * the path. When the "cc_pacing" consensus parameter is set, each
+ * congestion control object also gets a token bucket that fills at
+ * cwnd/RTT cells per second (times a small gain), and that can hold at
+ * most "cc_pacing_burst" cells. The package window is capped by that
+ * credit. When the credit is what stops the circuit, a timer resumes its
+ * streams once enough credit has built up again.
+ *
+ * The circuits that share a channel also share a budget of cells per
+ * millisecond, so that their timers firing together do not recreate the
+ * burst at the channel level.
+ */
+
+#define TOR_CONGESTION_CONTROL_PACING_PRIVATE
+
+#include "core/or/or.h"
+
+#include "core/or/channel.h"
+#include "core/or/circuitlist.h"
+#include "core/or/conflux.h"
+#include "core/or/conflux_util.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_pacing.h"
+#include "core/or/congestion_control_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/relay.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/cc/ctassert.h"
+#include "lib/defs/time.h"
+#include "lib/time/compat_time.h"
+
+/** Is pacing off by default? */
+#define CC_PACING_DFLT (0)
+/** Pacing rate, in percent of cwnd/RTT, in steady state ... */
+#define CC_PACING_GAIN_DFLT (125)
+/** ... and in slow start, where cwnd grows within the RTT. */
+#define CC_PACING_SS_GAIN_DFLT (200)
+/** Maximum number of cells that a circuit can send back to back. */
+#define CC_PACING_BURST_DFLT (16)
+/** Maximum number of paced cells per channel and per budget window. */
+#define CC_PACING_CHAN_BUDGET_DFLT (256)
+
+/** Length of a channel pacing budget window, in usec. */
+#define CC_PACING_CHAN_WINDOW_USEC (1000)
+
+/* Consensus parameters cached. The non static ones are extern. */
+bool cc_pacing_enabled = CC_PACING_DFLT;
+static uint32_t cc_pacing_gain = CC_PACING_GAIN_DFLT;
+static uint32_t cc_pacing_ss_gain = CC_PACING_SS_GAIN_DFLT;
+uint32_t cc_pacing_burst = CC_PACING_BURST_DFLT;
+uint32_t cc_pacing_chan_budget = CC_PACING_CHAN_BUDGET_DFLT;
+
+/** Upper bounds, in usec, of the pacing delay histogram buckets. */
+const int64_t cc_pacing_delay_buckets[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+};
+CTASSERT(ARRAY_LENGTH(cc_pacing_delay_buckets) == CC_PACING_DELAY_N_BUCKETS);
+/** Upper bounds, in cells, of the pacing burst size histogram buckets. */
+const int64_t cc_pacing_burst_buckets[] = {
+  1, 2, 4, 8, 16, 32, 64, 128, 256, 512,
+};
+CTASSERT(ARRAY_LENGTH(cc_pacing_burst_buckets) == CC_PACING_BURST_N_BUCKETS);
+
+/** Stats: how long pacing held circuits back, per delay bucket. The last
+ * element is for the delays longer than the highest bucket. */
+uint64_t cc_stats_pacing_delay_counts[CC_PACING_DELAY_N_BUCKETS + 1];
+/** Stats: total delay, in usec, of the pacing delays counted above. */
+uint64_t cc_stats_pacing_delay_usec;
+/** Stats: how many cells circuits sent between two pacing stops, per burst
+ * size bucket. */
+uint64_t cc_stats_pacing_burst_counts[CC_PACING_BURST_N_BUCKETS + 1];
+/** Stats: total number of cells in the bursts counted above. */
+uint64_t cc_stats_pacing_burst_cells;
+
+/**
+ * Update the pacing consensus parameters. Circuits pick up whether to pace
+ * when they are created; the other parameters apply right away.
+ */
+void
+congestion_control_pacing_new_consensus_params(const networkstatus_t *ns)
+{
+#define CC_PACING_MIN 0
+#define CC_PACING_MAX 1
+  cc_pacing_enabled =
+    networkstatus_get_param(ns, "cc_pacing",
+        CC_PACING_DFLT,
+        CC_PACING_MIN,
+        CC_PACING_MAX);
+
+#define CC_PACING_GAIN_MIN 100
+#define CC_PACING_GAIN_MAX 1000
+  cc_pacing_gain =
+    networkstatus_get_param(ns, "cc_pacing_gain",
+        CC_PACING_GAIN_DFLT,
+        CC_PACING_GAIN_MIN,
+        CC_PACING_GAIN_MAX);
+
+  cc_pacing_ss_gain =
+    networkstatus_get_param(ns, "cc_pacing_ss_gain",
+        CC_PACING_SS_GAIN_DFLT,
+        CC_PACING_GAIN_MIN,
+        CC_PACING_GAIN_MAX);
+
+#define CC_PACING_BURST_MIN 1
+#define CC_PACING_BURST_MAX 10000
+  cc_pacing_burst =
+    networkstatus_get_param(ns, "cc_pacing_burst",
+        CC_PACING_BURST_DFLT,
+        CC_PACING_BURST_MIN,
+        CC_PACING_BURST_MAX);
+
+  /* 0 means that channels do not limit their paced circuits. */
+#define CC_PACING_CHAN_BUDGET_MIN 0
+#define CC_PACING_CHAN_BUDGET_MAX INT32_MAX
+  cc_pacing_chan_budget =
+    networkstatus_get_param(ns, "cc_pacing_chan_budget",
+        CC_PACING_CHAN_BUDGET_DFLT,
+        CC_PACING_CHAN_BUDGET_MIN,
+        CC_PACING_CHAN_BUDGET_MAX);
+}
+
+/** Allocate the pacing state of <b>cc</b>, if pacing is enabled. */
+void
+congestion_control_pacing_init(congestion_control_t *cc)
+{
+  if (cc_pacing_enabled)
+    cc->pacing = tor_malloc_zero(sizeof(struct cc_pacing_t));
+}
+
+/** Free the pacing state of <b>cc</b>, and cancel its timer. */
+void
+congestion_control_pacing_free(congestion_control_t *cc)
+{
+  if (!cc->pacing)
+    return;
+
+  timer_free(cc->pacing->timer);
+  tor_free(cc->pacing);
+}
+
+/** Return the channel towards which <b>circ</b> packages cells. */
+static channel_t *
+cc_pacing_get_chan(const circuit_t *circ)
+{
+  if (CIRCUIT_IS_ORIGIN(circ))
+    return circ->n_chan;
+  return CONST_TO_OR_CIRCUIT(circ)->p_chan;
+}
+
+/** Return the rate at which <b>cc</b> earns credit, in thousandths of a cell
+ * per RTT. */
+static inline uint64_t
+cc_pacing_credit_per_rtt(const congestion_control_t *cc)
+{
+  uint32_t gain = cc->in_slow_start ? cc_pacing_ss_gain : cc_pacing_gain;
+  return MAX(cc->cwnd * gain * 10, 1);
+}
+
+/** Return the most credit that <b>cc</b> may hold, in thousandths of a
+ * cell. */
+static inline uint64_t
+cc_pacing_max_credit(const congestion_control_t *cc)
+{
+  return MIN(cc->cwnd, cc_pacing_burst) * 1000;
+}
+
+/** Add the credit that <b>cc</b> earned since its last refill. */
+static void
+cc_pacing_refill(congestion_control_t *cc, uint64_t now_usec)
+{
+  struct cc_pacing_t *pacing = cc->pacing;
+  uint64_t elapsed_usec, fill_usec;
+
+  if (!pacing->last_refill_usec) {
+    pacing->credit_milli = cc_pacing_max_credit(cc);
+    pacing->last_refill_usec = now_usec;
+    return;
+  }
+  if (now_usec <= pacing->last_refill_usec)
+    return;
+
+  /* Don't count more time than it takes to fill the bucket, so that we stay
+   * clear of overflows with large windows. */
+  fill_usec = CEIL_DIV(cc_pacing_max_credit(cc) * cc->ewma_rtt_usec,
+                       cc_pacing_credit_per_rtt(cc));
+  elapsed_usec = MIN(now_usec - pacing->last_refill_usec, fill_usec);
+  pacing->credit_milli +=
+    elapsed_usec * cc_pacing_credit_per_rtt(cc) / cc->ewma_rtt_usec;
+  pacing->credit_milli = MIN(pacing->credit_milli, cc_pacing_max_credit(cc));
+  pacing->last_refill_usec = now_usec;
+}
+
+/** Return the number of paced cells that <b>chan</b> can still take in its
+ * current budget window. */
+static uint64_t
+cc_pacing_chan_credit(channel_t *chan, uint64_t now_usec)
+{
+  if (!chan || !cc_pacing_chan_budget)
+    return UINT64_MAX;
+
+  if (now_usec - chan->pacing_window_start_usec >=
+      CC_PACING_CHAN_WINDOW_USEC) {
+    chan->pacing_window_start_usec = now_usec;
+    chan->pacing_window_cells = 0;
+  }
+  if (chan->pacing_window_cells >= cc_pacing_chan_budget)
+    return 0;
+  return cc_pacing_chan_budget - chan->pacing_window_cells;
+}
+
+/**
+ * Return how many cells pacing lets <b>cc</b>, of circuit <b>circ</b>,
+ * send at <b>now_usec</b>. That is UINT64_MAX when <b>cc</b> is not paced,
+ * or when it has no RTT estimate yet.
+ */
+uint64_t
+congestion_control_pacing_get_credit(congestion_control_t *cc,
+                                     const circuit_t *circ,
+                                     uint64_t now_usec)
+{
+  if (!cc->pacing || !cc->ewma_rtt_usec)
+    return UINT64_MAX;
+
+  cc_pacing_refill(cc, now_usec);
+  return MIN(cc->pacing->credit_milli / 1000,
+             cc_pacing_chan_credit(cc_pacing_get_chan(circ), now_usec));
+}
+
+/** Spend the pacing credit of a data cell that <b>cc</b>, of circuit
+ * <b>circ</b>, just sent. */
+void
+congestion_control_pacing_note_cell_sent(congestion_control_t *cc,
+                                         const circuit_t *circ,
+                                         uint64_t now_usec)
+{
+  struct cc_pacing_t *pacing = cc->pacing;
+  channel_t *chan;
+
+  if (!pacing || !cc->ewma_rtt_usec)
+    return;
+
+  cc_pacing_refill(cc, now_usec);
+  pacing->credit_milli -= MIN(pacing->credit_milli, 1000);
+  pacing->burst_cells++;
+
+  chan = cc_pacing_get_chan(circ);
+  if (chan && cc_pacing_chan_budget) {
+    cc_pacing_chan_credit(chan, now_usec);
+    chan->pacing_window_cells++;
+  }
+}
+
+/**
+ * Return how long, in usec, <b>cc</b> of circuit <b>circ</b> has to wait
+ * from <b>now_usec</b> until pacing lets it send a full burst, or what is
+ * left of its congestion window if that is less.
+ */
+STATIC uint64_t
+cc_pacing_get_delay(const congestion_control_t *cc, const circuit_t *circ,
+                    uint64_t now_usec)
+{
+  const channel_t *chan = cc_pacing_get_chan(circ);
+  uint64_t want_milli, delay_usec = 0;
+
+  want_milli = MIN(cc->cwnd - MIN(cc->inflight, cc->cwnd), cc_pacing_burst);
+  want_milli = MAX(want_milli, 1) * 1000;
+  if (cc->pacing->credit_milli < want_milli) {
+    delay_usec = CEIL_DIV((want_milli - cc->pacing->credit_milli) *
+                          cc->ewma_rtt_usec, cc_pacing_credit_per_rtt(cc));
+  }
+
+  /* If the channel budget is spent too, also wait for the next window. */
+  if (chan && cc_pacing_chan_budget &&
+      chan->pacing_window_cells >= cc_pacing_chan_budget &&
+      chan->pacing_window_start_usec + CC_PACING_CHAN_WINDOW_USEC >
+      now_usec) {
+    delay_usec = MAX(delay_usec, chan->pacing_window_start_usec +
+                     CC_PACING_CHAN_WINDOW_USEC - now_usec);
+  }
+
+  return MAX(delay_usec, 1);
+}
+
+/** Add <b>value</b> to the histogram <b>counts</b>, whose bucket upper
+ * bounds are <b>buckets</b>. */
+static void
+cc_pacing_hist_add(uint64_t *counts, const int64_t *buckets, int n_buckets,
+                   uint64_t value)
+{
+  int i;
+  for (i = 0; i < n_buckets; i++) {
+    if ((int64_t) value <= buckets[i])
+      break;
+  }
+  counts[i]++;
+}
+
+/** Timer callback: pacing credit is available again, so resume reading on
+ * the streams of the circuit. */
+static void
+cc_pacing_timer_cb(tor_timer_t *timer, void *arg, const monotime_t *now)
+{
+  struct cc_pacing_t *pacing = arg;
+  uint64_t delay_usec;
+  (void) timer;
+  (void) now;
+
+  pacing->timer_scheduled = false;
+
+  if (pacing->blocked_since_usec) {
+    delay_usec = monotime_absolute_usec() - pacing->blocked_since_usec;
+    cc_pacing_hist_add(cc_stats_pacing_delay_counts, cc_pacing_delay_buckets,
+                       CC_PACING_DELAY_N_BUCKETS, delay_usec);
+    cc_stats_pacing_delay_usec += delay_usec;
+    pacing->blocked_since_usec = 0;
+  }
+
+  if (pacing->circ->marked_for_close)
+    return;
+
+  circuit_resume_edge_reading(pacing->circ, pacing->cpath);
+}
+
+/**
+ * The package window of <b>circ</b> (at hop <b>cpath</b>, if we're the
+ * origin) is empty, and its edges stopped reading. If pacing rather than
+ * the congestion window is what stopped them, schedule their resumption.
+ */
+void
+congestion_control_pacing_note_blocked(circuit_t *circ, crypt_path_t *cpath)
+{
+  congestion_control_t *cc;
+  struct cc_pacing_t *pacing;
+  uint64_t now_usec, delay_usec;
+  struct timeval tv;
+
+  /* With conflux, the window that stopped us is the one of the leg that
+   * we would send on next. */
+  if (circ->conflux) {
+    circ = conflux_decide_next_circ(circ->conflux);
+    if (!circ)
+      return;
+    cpath = conflux_get_destination_hop(circ);
+  }
+
+  cc = cpath ? cpath->ccontrol : circ->ccontrol;
+  if (!cc || !cc->pacing || !cc->ewma_rtt_usec)
+    return;
+  pacing = cc->pacing;
+
+  /* A full congestion window is for the next SENDME to deal with. */
+  if (cc->inflight >= cc->cwnd)
+    return;
+
+  now_usec = monotime_absolute_usec();
+  if (congestion_control_pacing_get_credit(cc, circ, now_usec) > 0)
+    return;
+
+  if (!pacing->blocked_since_usec) {
+    pacing->blocked_since_usec = now_usec;
+    cc_pacing_hist_add(cc_stats_pacing_burst_counts, cc_pacing_burst_buckets,
+                       CC_PACING_BURST_N_BUCKETS, pacing->burst_cells);
+    cc_stats_pacing_burst_cells += pacing->burst_cells;
+    pacing->burst_cells = 0;
+  }
+
+  if (pacing->timer_scheduled)
+    return;
+
+  pacing->circ = circ;
+  pacing->cpath = cpath;
+  if (!pacing->timer)
+    pacing->timer = timer_new(cc_pacing_timer_cb, pacing);
+
+  delay_usec = cc_pacing_get_delay(cc, circ, now_usec);
+  tv.tv_sec = delay_usec / TOR_USEC_PER_SEC;
+  tv.tv_usec = delay_usec % TOR_USEC_PER_SEC;
+  timer_schedule(pacing->timer, &tv);
+  pacing->timer_scheduled = true;
+}
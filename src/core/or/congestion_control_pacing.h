@@ -0,0 +1,83 @@
+/* Copyright (c) 2019-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_pacing.h
+ * \brief APIs for pacing the cells of congestion controlled circuits.
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_PACING_H
+#define TOR_CONGESTION_CONTROL_PACING_H
+
+#include "core/or/crypt_path_st.h"
+#include "core/or/circuit_st.h"
+
+struct networkstatus_t;
+
+void congestion_control_pacing_new_consensus_params(
+                                        const struct networkstatus_t *ns);
+
+void congestion_control_pacing_init(congestion_control_t *cc);
+void congestion_control_pacing_free(congestion_control_t *cc);
+
+uint64_t congestion_control_pacing_get_credit(congestion_control_t *cc,
+                                              const circuit_t *circ,
+                                              uint64_t now_usec);
+void congestion_control_pacing_note_cell_sent(congestion_control_t *cc,
+                                              const circuit_t *circ,
+                                              uint64_t now_usec);
+void congestion_control_pacing_note_blocked(circuit_t *circ,
+                                            crypt_path_t *cpath);
+
+/** Number of buckets of the pacing delay histogram. */
+#define CC_PACING_DELAY_N_BUCKETS 10
+/** Number of buckets of the pacing burst size histogram. */
+#define CC_PACING_BURST_N_BUCKETS 10
+
+/** Metricsport externs */
+extern const int64_t cc_pacing_delay_buckets[];
+extern uint64_t cc_stats_pacing_delay_counts[CC_PACING_DELAY_N_BUCKETS + 1];
+extern uint64_t cc_stats_pacing_delay_usec;
+extern const int64_t cc_pacing_burst_buckets[];
+extern uint64_t cc_stats_pacing_burst_counts[CC_PACING_BURST_N_BUCKETS + 1];
+extern uint64_t cc_stats_pacing_burst_cells;
+
+/* Private section starts. */
+#ifdef TOR_CONGESTION_CONTROL_PACING_PRIVATE
+
+#include "lib/evloop/timers.h"
+
+/** Per-circuit (or per-hop) pacing state. It is allocated only when pacing
+ * is enabled, and it should not be accessed outside of
+ * congestion_control_pacing.c. */
+struct cc_pacing_t {
+  /** Sending credit, in thousandths of a cell. */
+  uint64_t credit_milli;
+  /** When the credit was last refilled, in monotime usec, or 0 if never. */
+  uint64_t last_refill_usec;
+  /** When pacing stopped the circuit, in monotime usec, or 0 if it did not
+   * stop it since it last resumed. */
+  uint64_t blocked_since_usec;
+  /** Number of cells sent since pacing last stopped the circuit. */
+  uint32_t burst_cells;
+  /** True iff <b>timer</b> is scheduled. */
+  bool timer_scheduled;
+  /** Timer that resumes edge reading once there is credit again. */
+  tor_timer_t *timer;
+  /** The circuit and hop that own this state, for the timer callback. Set
+   * when pacing first stops the circuit. */
+  circuit_t *circ;
+  crypt_path_t *cpath;
+};
+
+extern bool cc_pacing_enabled;
+extern uint32_t cc_pacing_burst;
+extern uint32_t cc_pacing_chan_budget;
+
+STATIC uint64_t cc_pacing_get_delay(const congestion_control_t *cc,
+                                    const circuit_t *circ,
+                                    uint64_t now_usec);
+
+#endif /* defined(TOR_CONGESTION_CONTROL_PACING_PRIVATE) */
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_PACING_H) */
@@ -44,10 +44,18 @@ typedef enum {
    * avoid out-competition. It seems a bit better throughput than Vegas, but
    * its aggressive BDP and rapid updates may lead to more queue latency. */
   CC_ALG_NOLA = 3,
+
+  /**
+   * TOR_BBR - BBR-style model-based control. Instead of treating queue delay
+   * as congestion, it estimates the bottleneck bandwidth (windowed max of the
+   * SENDME delivery rate) and the path min RTT, and keeps about one BDP in
+   * flight, with periodic probing for more bandwidth. This makes it far less
+   * sensitive than Vegas to RTT jitter on paths that are not congested. */
+  CC_ALG_BBR = 4,
 } cc_alg_t;
 
 /* Total number of CC algs in cc_alg_t enum */
-#define NUM_CC_ALGS  (CC_ALG_NOLA+1)
+#define NUM_CC_ALGS  (CC_ALG_BBR+1)
 
 /** Signifies how we estimate circuit BDP */
 typedef enum {
@@ -98,6 +106,60 @@ struct vegas_params_t {
     uint8_t bdp_mix_pct;
 };
 
+/** Maximum number of rounds in the BBR bottleneck bandwidth filter. */
+#define BBR_BW_FILTER_MAX_ROUNDS 16
+
+/** BBR algorithm parameters and model state. */
+struct bbr_state_t {
+  /** Cwnd gain (percent) applied on top of the probe cycle gain. */
+  uint16_t cwnd_gain;
+  /** Number of rounds over which we keep the max delivery rate. */
+  uint8_t bw_filter_rounds;
+  /** How long a min RTT sample stays valid before we probe for a new one. */
+  uint32_t min_rtt_win_usec;
+
+  /** Which phase of the BBR state machine we are in. */
+  uint8_t mode;
+  /** Position in the PROBE_BW gain cycle. */
+  uint8_t cycle_idx;
+  /** Rounds in a row in which startup did not grow the bandwidth. */
+  uint8_t full_bw_rounds;
+
+  /** Count of delivery rounds (roughly, RTTs) so far. */
+  uint32_t round_count;
+  /** Total number of cells that SENDMEs have acked. */
+  uint64_t delivered;
+  /** The SENDME that started the current round: when it arrived, when we
+   * sent the cell that it acked, and the value of delivered after it. */
+  uint64_t round_start_usec;
+  uint64_t round_start_sent_usec;
+  uint64_t round_start_delivered;
+
+  /** Per-round max delivery rate, in cells per second. */
+  uint32_t bw_filter[BBR_BW_FILTER_MAX_ROUNDS];
+  /** Bandwidth at which startup last grew by enough to keep going. */
+  uint32_t full_bw;
+
+  /** Start of the current ack aggregation epoch, and the number of cells
+   * acked since then. */
+  uint64_t ack_epoch_usec;
+  uint64_t ack_epoch_acked;
+  /** Windowed max of cells acked beyond what max_bw explains, over two
+   * half-windows of the bandwidth filter. */
+  uint32_t extra_acked[2];
+  /** Which extra_acked slot is current, and rounds since it was reset. */
+  uint8_t extra_acked_idx;
+  uint8_t extra_acked_rounds;
+
+  /** Windowed min RTT, and when it was last lowered or refreshed. */
+  uint64_t min_rtt_usec;
+  uint64_t min_rtt_stamp_usec;
+  /** When we may leave PROBE_RTT, or 0 if not yet scheduled. */
+  uint64_t probe_rtt_done_usec;
+  /** The cwnd to go back to once PROBE_RTT is over. */
+  uint64_t prior_cwnd;
+};
+
 /** Fields common to all congestion control algorithms */
 struct congestion_control_t {
   /**
@@ -178,6 +240,15 @@ struct congestion_control_t {
   /** Vegas-specific parameters. These should not be accessed anywhere
    * other than the congestion_control_vegas.c file. */
   struct vegas_params_t vegas_params;
+
+  /** BBR-specific state, allocated only for circuits using TOR_BBR. It
+   * should not be accessed outside of congestion_control_bbr.c. */
+  struct bbr_state_t *bbr;
+
+  /** Cell pacing state, allocated only when the "cc_pacing" consensus
+   * parameter is set. It should not be accessed outside of
+   * congestion_control_pacing.c. */
+  struct cc_pacing_t *pacing;
 };
 
 /**
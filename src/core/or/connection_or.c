@@ -2097,6 +2097,8 @@ connection_or_set_state_open(or_connection_t *conn)
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
+  /* Now that we're open, we may want to start padding. */
+  connection_schedule_housekeeping(TO_CONN(conn), approx_time() + 1);
 
   return 0;
 }
@@ -12,7 +12,11 @@
 #ifndef CONNECTION_ST_H
 #define CONNECTION_ST_H
 
+#include "tor_queue.h"
+
 struct buf_t;
+#define tor_timer_t timeout
+struct tor_timer_t;
 
 /* Values for connection_t.magic: used to make sure that downcasts (casts from
 * connection_t to foo_connection_t) are safe. */
@@ -112,6 +116,23 @@ struct connection_t {
 
   time_t timestamp_created; /**< When was this connection_t created? */
 
+  /** Timer that runs run_connection_housekeeping() on this connection, or
+   * NULL if we have never scheduled housekeeping for it. */
+  struct tor_timer_t *housekeeping_timer;
+  /** When is <b>housekeeping_timer</b> due to fire?  0 if it is not
+   * scheduled. */
+  time_t housekeeping_at;
+
+  /** Links for the queues of connections waiting for read or write
+   * bandwidth, used while read_blocked_on_bw or write_blocked_on_bw is set.
+   */
+  TOR_TAILQ_ENTRY(connection_t) read_bw_queue_entry;
+  TOR_TAILQ_ENTRY(connection_t) write_bw_queue_entry;
+  /** Coarse monotonic timestamps of when we started waiting for read or
+   * write bandwidth. */
+  uint32_t read_blocked_on_bw_at;
+  uint32_t write_blocked_on_bw_at;
+
   int socket_family; /**< Address family of this connection's socket.  Usually
                       * AF_INET, but it can also be AF_UNIX, or AF_INET6 */
   /**
@@ -191,4 +212,6 @@ struct connection_t {
  * directory connection. */
 #define DIR_CONN_IS_SERVER(conn) ((conn)->purpose == DIR_PURPOSE_SERVER)
 
+#undef tor_timer_t
+
 #endif /* !defined(CONNECTION_ST_H) */
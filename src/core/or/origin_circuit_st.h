@@ -148,6 +148,10 @@ struct origin_circuit_t {
    * present. */
   int global_origin_circuit_list_idx;
 
+  /** Index into the circuit expiry index priority queue for this circuit. -1
+   * if not present. See circuit_update_expiry_index(). */
+  int expiry_index_idx;
+
   /** How many more relay_early cells can we send on this circuit, according
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
@@ -101,6 +101,7 @@
 #include "core/or/sendme.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_flow.h"
+#include "core/or/congestion_control_pacing.h"
 #include "core/or/conflux.h"
 #include "core/or/conflux_util.h"
 #include "core/or/conflux_pool.h"
@@ -111,8 +112,6 @@ static edge_connection_t *relay_lookup_conn(circuit_t *circ,
                                             cell_direction_t cell_direction,
                                             crypt_path_t *layer_hint);
 
-static void circuit_resume_edge_reading(circuit_t *circ,
-                                        crypt_path_t *layer_hint);
 static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
                                               circuit_t *circ,
                                               crypt_path_t *layer_hint);
@@ -143,6 +142,23 @@ uint64_t stats_n_relay_cells_delivered = 0;
  * reached (see append_cell_to_circuit_queue()) */
 uint64_t stats_n_circ_max_cell_reached = 0;
 uint64_t stats_n_circ_max_cell_outq_reached = 0;
+/** Stats: how many times has the cell queue AQM blocked a circuit because its
+ * cells stayed in the queue for too long? */
+uint64_t stats_n_circ_queue_aqm_blocked = 0;
+
+/** Upper bounds, in msec, of the cell queue sojourn time histogram buckets. */
+const int64_t relay_circ_queue_sojourn_buckets[] = {
+  1, 5, 10, 25, 50, 100, 250, 500, 1000, 5000,
+};
+CTASSERT(ARRAY_LENGTH(relay_circ_queue_sojourn_buckets) ==
+         RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS);
+/** Stats: number of cells that left a circuit queue, per direction (index 0
+ * is inbound, 1 is outbound) and per sojourn time bucket. The last element is
+ * for the cells that waited longer than the highest bucket. */
+uint64_t stats_circ_queue_sojourn_counts[2][
+                                  RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS + 1];
+/** Stats: total sojourn time, in msec, of the cells counted above. */
+uint64_t stats_circ_queue_sojourn_msec[2];
 
 /**
  * Update channel usage state based on the type of relay cell and
@@ -191,6 +207,7 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
     if (circ->n_chan->channel_usage == CHANNEL_USED_FOR_FULL_CIRCS &&
         cell->command == CELL_RELAY) {
       circ->n_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+      channel_schedule_housekeeping(circ->n_chan);
     }
   } else {
     /* If we're a relay circuit, the question is more complicated. Basically:
@@ -212,9 +229,13 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
       if (cell->command == CELL_RELAY_EARLY) {
         if (or_circ->p_chan->channel_usage < CHANNEL_USED_FOR_FULL_CIRCS) {
           or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_FULL_CIRCS;
+          channel_schedule_housekeeping(or_circ->p_chan);
         }
-      } else if (cell->command == CELL_RELAY) {
+      } else if (cell->command == CELL_RELAY &&
+                 or_circ->p_chan->channel_usage !=
+                   CHANNEL_USED_FOR_USER_TRAFFIC) {
         or_circ->p_chan->channel_usage = CHANNEL_USED_FOR_USER_TRAFFIC;
+        channel_schedule_housekeeping(or_circ->p_chan);
       }
     }
   }
@@ -2408,11 +2429,11 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
 }
 
 /** The circuit <b>circ</b> has received a circuit-level sendme
- * (on hop <b>layer_hint</b>, if we're the OP). Go through all the
- * attached streams and let them resume reading and packaging, if
- * their stream windows allow it.
+ * (on hop <b>layer_hint</b>, if we're the OP), or its pacing credit has come
+ * back. Go through all the attached streams and let them resume reading and
+ * packaging, if their stream windows allow it.
  */
-static void
+void
 circuit_resume_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 {
   if (circuit_queue_streams_are_blocked(circ)) {
@@ -2631,6 +2652,7 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
       log_debug(domain,"yes, not-at-origin. stopped.");
       for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
         connection_stop_reading(TO_CONN(conn));
+      congestion_control_pacing_note_blocked(circ, layer_hint);
       return 1;
     }
     return 0;
@@ -2645,6 +2667,7 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
       if (edge_uses_cpath(conn, layer_hint))
         connection_stop_reading(TO_CONN(conn));
     }
+    congestion_control_pacing_note_blocked(circ, layer_hint);
     return 1;
   }
   return 0;
@@ -2882,6 +2905,10 @@ cell_queues_check_size(void)
   alloc += conflux_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
+    if (alloc >= get_options()->MaxMemInQueues) {
+      /* Idle compression states are the cheapest thing to give back. */
+      alloc -= tor_compress_pool_clear();
+    }
     if (alloc >= get_options()->MaxMemInQueues) {
       /* Note this overload down */
       rep_hist_note_overload(OVERLOAD_GENERAL);
@@ -3010,10 +3037,14 @@ set_circuit_blocked_on_chan(circuit_t *circ, channel_t *chan, int block)
   edge_connection_t *edge = NULL;
   if (circ->n_chan == chan) {
     circ->circuit_blocked_on_n_chan = block;
+    if (!block)
+      circ->circuit_aqm_blocked_on_n_chan = 0;
     if (CIRCUIT_IS_ORIGIN(circ))
       edge = TO_ORIGIN_CIRCUIT(circ)->p_streams;
   } else {
     circ->circuit_blocked_on_p_chan = block;
+    if (!block)
+      circ->circuit_aqm_blocked_on_p_chan = 0;
     tor_assert(!CIRCUIT_IS_ORIGIN(circ));
     edge = TO_OR_CIRCUIT(circ)->n_streams;
   }
@@ -3089,6 +3120,108 @@ packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids)
   }
 }
 
+/* Cell queue active queue management (AQM).
+ *
+ * This is modelled on CoDel (RFC 8289): instead of looking at how many cells
+ * are in a circuit queue, we look at how long the cells leaving it have been
+ * waiting. If that sojourn time stays above a target for a full interval, the
+ * queue is not draining on its own and we block the circuit on its channel,
+ * exactly like the high watermark does. That stops edge reading at the exit
+ * or client and, through the blocked_chan signal, feeds congestion control
+ * long before the queue grows to the point where we kill the circuit.
+ *
+ * The circuit is unblocked as soon as a cell leaves the queue below target.
+ * Blocking is a state and not a per cell drop so the CoDel control law is not
+ * needed here: congestion control only reacts once per cwnd anyway. */
+
+/* Default values and bounds of the cell queue AQM consensus parameters. The
+ * target and interval defaults are the ones CoDel uses on the Internet. */
+#define CIRC_QUEUE_AQM_ENABLED_DEFAULT 0
+#define CIRC_QUEUE_AQM_TARGET_MS_DEFAULT 5
+#define CIRC_QUEUE_AQM_TARGET_MS_MIN 1
+#define CIRC_QUEUE_AQM_TARGET_MS_MAX 10000
+#define CIRC_QUEUE_AQM_INTERVAL_MS_DEFAULT 100
+#define CIRC_QUEUE_AQM_INTERVAL_MS_MIN 1
+#define CIRC_QUEUE_AQM_INTERVAL_MS_MAX 60000
+
+/** Is the cell queue AQM enabled? Controlled by "circ_queue_aqm_enabled". */
+static int circ_queue_aqm_enabled = CIRC_QUEUE_AQM_ENABLED_DEFAULT;
+/** Sojourn time target in msec. Controlled by "circ_queue_aqm_target_ms". */
+static uint32_t circ_queue_aqm_target_msec = CIRC_QUEUE_AQM_TARGET_MS_DEFAULT;
+/** How long, in msec, the sojourn time has to stay above target before we
+ * block the circuit. Controlled by "circ_queue_aqm_interval_ms". */
+static uint32_t circ_queue_aqm_interval_msec =
+  CIRC_QUEUE_AQM_INTERVAL_MS_DEFAULT;
+
+/** Return the histogram bucket index for a sojourn time of <b>msec</b>. */
+static inline int
+circ_queue_sojourn_bucket(uint32_t msec)
+{
+  int i;
+  for (i = 0; i < RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS; i++) {
+    if (msec <= relay_circ_queue_sojourn_buckets[i])
+      break;
+  }
+  return i;
+}
+
+/** A cell that waited <b>sojourn_msec</b> just left the <b>queue</b> of
+ * <b>circ</b> towards <b>chan</b> at coarse timestamp <b>now_stamp</b>.
+ * Update the AQM state of that queue and block or unblock the circuit on the
+ * channel accordingly. */
+STATIC void
+circuit_queue_aqm_note_sojourn(circuit_t *circ, channel_t *chan,
+                               const cell_queue_t *queue,
+                               uint32_t now_stamp, uint32_t sojourn_msec)
+{
+  uint32_t *above_since;
+  int blocked, aqm_blocked;
+
+  if (!circ_queue_aqm_enabled)
+    return;
+
+  if (circ->n_chan == chan) {
+    above_since = &circ->n_chan_cells_aqm_above_since;
+    blocked = circ->circuit_blocked_on_n_chan;
+    aqm_blocked = circ->circuit_aqm_blocked_on_n_chan;
+  } else {
+    above_since = &circ->p_chan_cells_aqm_above_since;
+    blocked = circ->circuit_blocked_on_p_chan;
+    aqm_blocked = circ->circuit_aqm_blocked_on_p_chan;
+  }
+
+  /* Good queue: either the cell didn't wait long or there is so little left
+   * in the queue that it is about to drain anyway. */
+  if (sojourn_msec < circ_queue_aqm_target_msec ||
+      queue->n <= cell_queue_lowwatermark()) {
+    *above_since = 0;
+    /* Only lift a block we put in place ourselves and leave a full queue to
+     * the watermark logic. */
+    if (aqm_blocked && queue->n < cell_queue_highwatermark())
+      set_circuit_blocked_on_chan(circ, chan, 0);
+    return;
+  }
+
+  /* Bad queue. Start the interval if this is the first cell above target. A
+   * zero timestamp means "below target" so avoid it. */
+  if (*above_since == 0) {
+    *above_since = now_stamp ? now_stamp : 1;
+    return;
+  }
+
+  if (!blocked &&
+      monotime_coarse_stamp_units_to_approx_msec(now_stamp - *above_since) >=
+        circ_queue_aqm_interval_msec) {
+    set_circuit_blocked_on_chan(circ, chan, 1);
+    if (circ->n_chan == chan) {
+      circ->circuit_aqm_blocked_on_n_chan = 1;
+    } else {
+      circ->circuit_aqm_blocked_on_p_chan = 1;
+    }
+    stats_n_circ_queue_aqm_blocked++;
+  }
+}
+
 /** Pull as many cells as possible (but no more than <b>max</b>) from the
  * queue of the first active circuit on <b>chan</b>, and write them to
  * <b>chan</b>-&gt;outbuf.  Return the number of cells written.  Advance
@@ -3103,7 +3236,9 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   circuit_t *circ;
   or_circuit_t *or_circ;
   int circ_blocked;
+  int exitward;
   packed_cell_t *cell;
+  uint32_t timestamp_now, msec_waiting;
 
   /* Get the cmux */
   tor_assert(chan);
@@ -3140,7 +3275,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
     /* If it returns NULL, no cells left to send */
     if (!circ) break;
 
-    if (circ->n_chan == chan) {
+    exitward = (circ->n_chan == chan);
+    if (exitward) {
       queue = &circ->n_chan_cells;
       circ_blocked = circ->circuit_blocked_on_n_chan;
     } else {
@@ -3181,15 +3317,19 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    /* ...and pop() will always yield a cell from a nonempty queue. */
+    tor_assert(cell);
 
     /* Calculate the exact time that this cell has spent in the queue. */
-    if (get_options()->CellStatistics ||
-        get_options()->TestingEnableCellStatsEvent) {
-      uint32_t timestamp_now = monotime_coarse_get_stamp();
-      uint32_t msec_waiting =
-        (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+    timestamp_now = monotime_coarse_get_stamp();
+    msec_waiting = (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
                          timestamp_now - cell->inserted_timestamp);
+    stats_circ_queue_sojourn_counts[exitward][
+                                  circ_queue_sojourn_bucket(msec_waiting)]++;
+    stats_circ_queue_sojourn_msec[exitward] += msec_waiting;
 
+    if (get_options()->CellStatistics ||
+        get_options()->TestingEnableCellStatsEvent) {
       if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
         or_circ = TO_OR_CIRCUIT(circ);
         or_circ->total_cell_waiting_time += msec_waiting;
@@ -3204,7 +3344,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
         ent->command = command;
         ent->waiting_time = msec_waiting / 10;
         ent->removed = 1;
-        if (circ->n_chan == chan)
+        if (exitward)
           ent->exitward = 1;
         if (!circ->testing_cell_stats)
           circ->testing_cell_stats = smartlist_new();
@@ -3250,6 +3390,9 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * to write to this circuit? */
     if (circ_blocked && queue->n <= cell_queue_lowwatermark())
       set_circuit_blocked_on_chan(circ, chan, 0); /* unblock streams */
+    else
+      circuit_queue_aqm_note_sojourn(circ, chan, queue, timestamp_now,
+                                     msec_waiting);
 
     /* If n_flushed < max still, loop around and pick another circuit */
   }
@@ -3339,6 +3482,21 @@ relay_consensus_has_changed(const networkstatus_t *ns)
     get_param_max_circuit_cell_queue_size(ns);
   max_circuit_cell_queue_size_out =
     get_param_max_circuit_cell_queue_size_out(ns);
+
+  /* Update the cell queue AQM parameters. */
+  circ_queue_aqm_enabled =
+    networkstatus_get_param(ns, "circ_queue_aqm_enabled",
+                            CIRC_QUEUE_AQM_ENABLED_DEFAULT, 0, 1);
+  circ_queue_aqm_target_msec =
+    networkstatus_get_param(ns, "circ_queue_aqm_target_ms",
+                            CIRC_QUEUE_AQM_TARGET_MS_DEFAULT,
+                            CIRC_QUEUE_AQM_TARGET_MS_MIN,
+                            CIRC_QUEUE_AQM_TARGET_MS_MAX);
+  circ_queue_aqm_interval_msec =
+    networkstatus_get_param(ns, "circ_queue_aqm_interval_ms",
+                            CIRC_QUEUE_AQM_INTERVAL_MS_DEFAULT,
+                            CIRC_QUEUE_AQM_INTERVAL_MS_MIN,
+                            CIRC_QUEUE_AQM_INTERVAL_MS_MAX);
 }
 
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
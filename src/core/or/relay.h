@@ -18,6 +18,14 @@ extern uint64_t stats_n_relay_cells_relayed;
 extern uint64_t stats_n_relay_cells_delivered;
 extern uint64_t stats_n_circ_max_cell_reached;
 extern uint64_t stats_n_circ_max_cell_outq_reached;
+extern uint64_t stats_n_circ_queue_aqm_blocked;
+
+/** Number of buckets of the cell queue sojourn time histogram. */
+#define RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS 10
+extern const int64_t relay_circ_queue_sojourn_buckets[];
+extern uint64_t stats_circ_queue_sojourn_counts[2][
+                                  RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS + 1];
+extern uint64_t stats_circ_queue_sojourn_msec[2];
 
 const char *relay_command_to_string(uint8_t command);
 
@@ -53,6 +61,7 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int *max_cells);
 void connection_edge_consider_sending_sendme(edge_connection_t *conn);
 void circuit_reset_sendme_randomness(circuit_t *circ);
+void circuit_resume_edge_reading(circuit_t *circ, crypt_path_t *layer_hint);
 
 extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
@@ -142,6 +151,10 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const relay_msg_t *msg);
 STATIC packed_cell_t *packed_cell_new(void);
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+STATIC void circuit_queue_aqm_note_sojourn(circuit_t *circ, channel_t *chan,
+                                           const cell_queue_t *queue,
+                                           uint32_t now_stamp,
+                                           uint32_t sojourn_msec);
 STATIC destroy_cell_t *destroy_cell_queue_pop(destroy_cell_queue_t *queue);
 STATIC int cell_queues_check_size(void);
 STATIC int connection_edge_process_relay_cell(const relay_msg_t *msg,
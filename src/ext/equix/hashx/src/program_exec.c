@@ -95,6 +95,122 @@ static FORCE_INLINE uint64_t sign_extend_2s_compl(uint32_t x) {
 		(x > INT32_MAX ? (x | 0xffffffff00000000ULL) : (uint64_t)x);
 }
 
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(HASHX_PROGRAM_STATS)
+
+/*
+ * Threaded-code interpreter, for compilers that support computed gotos.
+ *
+ * Each combination of opcode and registers has its own handler, so that the
+ * registers can live in local variables that the compiler keeps in machine
+ * registers, rather than in memory. Each handler jumps straight to the next
+ * one, through a table indexed by opcode, destination and source register.
+ */
+
+#define REG_OP_UMULH_R(D, S) \
+	result = (uint32_t) (r##D = umulh(r##D, r##S))
+#define REG_OP_SMULH_R(D, S) \
+	result = (uint32_t) (r##D = smulh(r##D, r##S))
+#define REG_OP_MUL_R(D, S) r##D *= r##S
+#define REG_OP_SUB_R(D, S) r##D -= r##S
+#define REG_OP_XOR_R(D, S) r##D ^= r##S
+#define REG_OP_ADD_RS(D, S) r##D += r##S << instr->imm32
+#define REG_OP_ROR_C(D) r##D = rotr64(r##D, instr->imm32)
+#define REG_OP_ADD_C(D) r##D += sign_extend_2s_compl(instr->imm32)
+#define REG_OP_XOR_C(D) r##D ^= sign_extend_2s_compl(instr->imm32)
+
+#define NEXT_INSTRUCTION \
+	do { \
+		if (++i >= code_size) \
+			goto done; \
+		instr = &code[i]; \
+		goto *handlers[((unsigned)instr->opcode * 8 + (instr->dst & 7)) * 8 \
+		               + (instr->src & 7)]; \
+	} while (0)
+
+#define HANDLER2(OP, D, S) OP##_##D##_##S: REG_OP_##OP(D, S); NEXT_INSTRUCTION;
+#define HANDLERS2_S(OP, D) \
+	HANDLER2(OP, D, 0) HANDLER2(OP, D, 1) HANDLER2(OP, D, 2) \
+	HANDLER2(OP, D, 3) HANDLER2(OP, D, 4) HANDLER2(OP, D, 5) \
+	HANDLER2(OP, D, 6) HANDLER2(OP, D, 7)
+#define HANDLERS2(OP) \
+	HANDLERS2_S(OP, 0) HANDLERS2_S(OP, 1) HANDLERS2_S(OP, 2) \
+	HANDLERS2_S(OP, 3) HANDLERS2_S(OP, 4) HANDLERS2_S(OP, 5) \
+	HANDLERS2_S(OP, 6) HANDLERS2_S(OP, 7)
+#define HANDLER1(OP, D) OP##_##D: REG_OP_##OP(D); NEXT_INSTRUCTION;
+#define HANDLERS1(OP) \
+	HANDLER1(OP, 0) HANDLER1(OP, 1) HANDLER1(OP, 2) HANDLER1(OP, 3) \
+	HANDLER1(OP, 4) HANDLER1(OP, 5) HANDLER1(OP, 6) HANDLER1(OP, 7)
+
+#define LABEL2(OP, D, S) &&OP##_##D##_##S,
+#define LABELS2_S(OP, D) \
+	LABEL2(OP, D, 0) LABEL2(OP, D, 1) LABEL2(OP, D, 2) LABEL2(OP, D, 3) \
+	LABEL2(OP, D, 4) LABEL2(OP, D, 5) LABEL2(OP, D, 6) LABEL2(OP, D, 7)
+#define LABELS2(OP) \
+	LABELS2_S(OP, 0) LABELS2_S(OP, 1) LABELS2_S(OP, 2) LABELS2_S(OP, 3) \
+	LABELS2_S(OP, 4) LABELS2_S(OP, 5) LABELS2_S(OP, 6) LABELS2_S(OP, 7)
+/* Instructions without a source register (or a destination) may have -1
+   there, which ends up at index 7: the table has 8 copies of their label. */
+#define LABELS1_S(L) &&L, &&L, &&L, &&L, &&L, &&L, &&L, &&L,
+#define LABELS1(OP) \
+	LABELS1_S(OP##_0) LABELS1_S(OP##_1) LABELS1_S(OP##_2) LABELS1_S(OP##_3) \
+	LABELS1_S(OP##_4) LABELS1_S(OP##_5) LABELS1_S(OP##_6) LABELS1_S(OP##_7)
+#define LABELS0(L) \
+	LABELS1_S(L) LABELS1_S(L) LABELS1_S(L) LABELS1_S(L) \
+	LABELS1_S(L) LABELS1_S(L) LABELS1_S(L) LABELS1_S(L)
+
+void hashx_program_execute(const hashx_program* program, uint64_t r[8]) {
+	/* In the order of instr_type */
+	static const void* const handlers[] = {
+		LABELS2(UMULH_R)
+		LABELS2(SMULH_R)
+		LABELS2(MUL_R)
+		LABELS2(SUB_R)
+		LABELS2(XOR_R)
+		LABELS2(ADD_RS)
+		LABELS1(ROR_C)
+		LABELS1(ADD_C)
+		LABELS1(XOR_C)
+		LABELS0(TARGET)
+		LABELS0(BRANCH)
+	};
+	const instruction* code = program->code;
+	const size_t code_size = program->code_size;
+	const instruction* instr;
+	uint64_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+	uint64_t r4 = r[4], r5 = r[5], r6 = r[6], r7 = r[7];
+	size_t i = (size_t)-1;
+	size_t target = 0;
+	bool branch_enable = true;
+	uint32_t result = 0;
+
+	NEXT_INSTRUCTION;
+
+	HANDLERS2(UMULH_R)
+	HANDLERS2(SMULH_R)
+	HANDLERS2(MUL_R)
+	HANDLERS2(SUB_R)
+	HANDLERS2(XOR_R)
+	HANDLERS2(ADD_RS)
+	HANDLERS1(ROR_C)
+	HANDLERS1(ADD_C)
+	HANDLERS1(XOR_C)
+TARGET:
+	target = i;
+	NEXT_INSTRUCTION;
+BRANCH:
+	if (branch_enable && (result & instr->imm32) == 0) {
+		i = target;
+		branch_enable = false;
+	}
+	NEXT_INSTRUCTION;
+
+done:
+	r[0] = r0; r[1] = r1; r[2] = r2; r[3] = r3;
+	r[4] = r4; r[5] = r5; r[6] = r6; r[7] = r7;
+}
+
+#else
+
 void hashx_program_execute(const hashx_program* program, uint64_t r[8]) {
 	size_t target = 0;
 	bool branch_enable = true;
@@ -156,3 +272,5 @@ void hashx_program_execute(const hashx_program* program, uint64_t r[8]) {
 		}
 	}
 }
+
+#endif
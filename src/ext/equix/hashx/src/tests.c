@@ -198,6 +198,29 @@ static bool test_compiler_ctr2() {
 #endif
 }
 
+static bool test_compiler_many() {
+#ifndef HASHX_BLOCK_MODE
+	/* Enough inputs for the interpreter to take every branch of the
+	   program, and not take it. */
+	hashx_result result;
+	char hash1[HASHX_SIZE];
+	char hash2[HASHX_SIZE];
+	for (uint64_t counter = 0; counter < 10000; ++counter) {
+		result = hashx_exec(ctx_int, counter, hash1);
+		assert(result == HASHX_OK);
+		result = hashx_exec(ctx_cmp, counter, hash2);
+		if (result == HASHX_FAIL_UNPREPARED) {
+			return false;
+		}
+		assert(result == HASHX_OK);
+		assert(hashes_equal(hash1, hash2));
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
 static bool test_compiler_block1() {
 #ifndef HASHX_BLOCK_MODE
 	return false;
@@ -263,6 +286,7 @@ int main() {
 	RUN_TEST(test_make3);
 	RUN_TEST(test_compiler_ctr1);
 	RUN_TEST(test_compiler_ctr2);
+	RUN_TEST(test_compiler_many);
 	RUN_TEST(test_hash_block1);
 	RUN_TEST(test_compiler_block1);
 	RUN_TEST(test_alloc_automatic);
@@ -75,24 +75,18 @@ static void print_help(char* executable) {
 	printf("  --start S     start with nonce S (default: S=0)\n");
 	printf("  --threads T   use T threads (default: T=1)\n");
 	printf("  --interpret   use HashX interpreter\n");
+	printf("  --compare     run with the HashX compiler, then the interpreter\n");
 	printf("  --hugepages   use hugepages\n");
 	printf("  --sols        print all solutions\n");
 }
 
-int main(int argc, char** argv) {
-	int nonces, start, threads;
-	bool interpret, huge_pages, print_sols, help;
-	read_option("--help", argc, argv, &help);
-	if (help) {
-		print_help(argv[0]);
-		return 0;
-	}
-	read_int_option("--nonces", argc, argv, &nonces, 500);
-	read_int_option("--start", argc, argv, &start, 0);
-	read_option("--interpret", argc, argv, &interpret);
-	read_option("--hugepages", argc, argv, &huge_pages);
-	read_option("--sols", argc, argv, &print_sols);
-	read_int_option("--threads", argc, argv, &threads, 1);
+typedef struct bench_rates {
+	double solve;
+	double verify;
+} bench_rates;
+
+static int run_bench(int nonces, int start, int threads, bool interpret,
+                     bool huge_pages, bool print_sols, bench_rates* rates) {
 	equix_ctx_flags flags = EQUIX_CTX_SOLVE;
 	if (!interpret) {
 		flags |= EQUIX_CTX_MUST_COMPILE;
@@ -142,8 +136,9 @@ int main(int argc, char** argv) {
 		total_sols += jobs[thd].total_sols;
 	}
 	double elapsed = time_end - time_start;
+	rates->solve = total_sols / elapsed;
 	printf("%f solutions/nonce\n", total_sols / (double)nonces);
-	printf("%f solutions/sec. (%i thread%s)\n", total_sols / elapsed, threads, threads > 1 ? "s" : "");
+	printf("%f solutions/sec. (%i thread%s)\n", rates->solve, threads, threads > 1 ? "s" : "");
 	if (print_sols) {
 		for (int thd = 0; thd < threads; ++thd) {
 			worker_job* job = &jobs[thd];
@@ -172,10 +167,47 @@ int main(int argc, char** argv) {
 		}
 	}
 	time_end = hashx_time();
-	printf("%f verifications/sec. (1 thread)\n", total_sols / (time_end - time_start));
+	rates->verify = total_sols / (time_end - time_start);
+	printf("%f verifications/sec. (1 thread)\n", rates->verify);
 	for (int thd = 0; thd < threads; ++thd) {
+		equix_free(jobs[thd].ctx);
 		free(jobs[thd].output);
 	}
 	free(jobs);
 	return 0;
 }
+
+int main(int argc, char** argv) {
+	int nonces, start, threads;
+	bool interpret, compare, huge_pages, print_sols, help;
+	read_option("--help", argc, argv, &help);
+	if (help) {
+		print_help(argv[0]);
+		return 0;
+	}
+	read_int_option("--nonces", argc, argv, &nonces, 500);
+	read_int_option("--start", argc, argv, &start, 0);
+	read_option("--interpret", argc, argv, &interpret);
+	read_option("--compare", argc, argv, &compare);
+	read_option("--hugepages", argc, argv, &huge_pages);
+	read_option("--sols", argc, argv, &print_sols);
+	read_int_option("--threads", argc, argv, &threads, 1);
+	if (!compare) {
+		bench_rates rates;
+		return run_bench(nonces, start, threads, interpret, huge_pages,
+		                 print_sols, &rates);
+	}
+	bench_rates compiled, interpreted;
+	if (run_bench(nonces, start, threads, false, huge_pages, print_sols,
+	              &compiled) != 0) {
+		return 1;
+	}
+	if (run_bench(nonces, start, threads, true, huge_pages, print_sols,
+	              &interpreted) != 0) {
+		return 1;
+	}
+	printf("Interpreter vs. compiler: %.1f%% of the solutions/sec., %.1f%% of the verifications/sec.\n",
+		100.0 * interpreted.solve / compiled.solve,
+		100.0 * interpreted.verify / compiled.verify);
+	return 0;
+}
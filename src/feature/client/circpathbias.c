@@ -840,7 +840,7 @@ pathbias_send_usable_probe(circuit_t *circ)
   circuit_change_purpose(circ, CIRCUIT_PURPOSE_PATH_BIAS_TESTING);
 
   /* Update timestamp for when circuit_expire_building() should kill us */
-  tor_gettimeofday(&circ->timestamp_began);
+  circuit_reset_timestamp_began(circ);
 
   /* Generate a random address for the nonce */
   crypto_rand((char*)&ocirc->pathbias_probe_nonce,
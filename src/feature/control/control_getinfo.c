@@ -36,6 +36,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_cache.h"
+#include "feature/hs/hs_pow.h"
 #include "feature/hs_common/shared_random_client.h"
 #include "feature/nodelist/authcert.h"
 #include "feature/nodelist/microdesc.h"
@@ -154,6 +155,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
   } else if (!strcmp(question, "uptime")) {
     long uptime_secs = get_uptime();
     tor_asprintf(answer, "%ld", uptime_secs);
+  } else if (!strcmp(question, "hs/client/pow/solve-rate")) {
+    tor_asprintf(answer, "%"PRIu64, hs_pow_get_solve_rate());
   } else if (!strcmp(question, "process/pid")) {
     int myPid = -1;
 
@@ -1595,6 +1598,8 @@ static const getinfo_item_t getinfo_items[] = {
          "Hidden Service descriptor in client's cache by onion."),
   PREFIX("hs/service/desc/id/", dir,
          "Hidden Service descriptor in services's cache by onion."),
+  ITEM("hs/client/pow/solve-rate", misc,
+       "Equi-X solutions per second checked by the last PoW solve."),
   PREFIX("net/listeners/", listeners, "Bound addresses by type"),
   ITEM("ns/all", networkstatus,
        "Brief summary of router status (v2 directory format)"),
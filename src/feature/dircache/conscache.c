@@ -10,12 +10,27 @@
 
 #include "app/config/config.h"
 #include "feature/dircache/conscache.h"
+#include "lib/crypt_ops/crypto_digest.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "lib/fs/storagedir.h"
 #include "lib/encoding/confline.h"
+#include "lib/encoding/binascii.h"
+#include "lib/sandbox/sandbox.h"
 
 #define CCE_MAGIC 0x17162253
 
+/** @{ */
+/** Keywords used in the consensus cache index file.
+ *
+ * The index is a list of "@entry FNAME N" lines, each followed by the N
+ * labels of that file, in the same "key value" format that storagedir uses
+ * for labeled files.  It starts with an INDEX_HEADER line, and ends with an
+ * "@digest HEX" line holding the SHA256 digest of everything before it. */
+#define INDEX_HEADER "consensus-cache-index 1"
+#define INDEX_ENTRY "@entry"
+#define INDEX_DIGEST "@digest"
+/** @} */
+
 #ifdef _WIN32
 /* On Windows, unlink won't work on a file if the file is actively mmap()ed.
  * That forces us to be less aggressive about unlinking files, and causes other
@@ -44,6 +59,9 @@ struct consensus_cache_entry_t {
   config_line_t *labels;
   /** Pointer to the cache that includes this entry (if any). */
   consensus_cache_t *in_cache;
+  /** If true, we read our labels from the cache index, and haven't yet
+   * checked them against the file itself. */
+  unsigned labels_unverified : 1;
 
   /** Since what time has this object been mapped into RAM, but with the cache
    * being the only having a reference to it? */
@@ -64,6 +82,8 @@ struct consensus_cache_t {
   storage_dir_t *dir;
   /** List of all the entries in the directory. */
   smartlist_t *entries;
+  /** Name of the file holding the index of this cache's labels. */
+  char *index_fname;
 
   /** The maximum number of entries that we'd like to allow in this cache.
    * This is the same as the storagedir limit when MUST_UNMAP_TO_UNLINK is
@@ -76,6 +96,8 @@ static void consensus_cache_rescan(consensus_cache_t *);
 static void consensus_cache_entry_map(consensus_cache_t *,
                                       consensus_cache_entry_t *);
 static void consensus_cache_entry_unmap(consensus_cache_entry_t *ent);
+static int consensus_cache_load_index(consensus_cache_t *cache);
+static void consensus_cache_write_index(consensus_cache_t *cache);
 
 /**
  * Helper: Open a consensus cache in subdirectory <b>subdir</b> of the
@@ -110,7 +132,19 @@ consensus_cache_open(const char *subdir, int max_entries)
     return NULL;
   }
 
-  consensus_cache_rescan(cache);
+  /* The index lives next to the storage directory rather than inside it,
+   * since everything inside it is a labeled object. */
+  tor_asprintf(&directory, "%s.index", subdir);
+  cache->index_fname = get_cachedir_fname(directory);
+  tor_free(directory);
+
+  /* Reading one index file is much cheaper than opening and parsing every
+   * object in the cache, but we fall back to doing that if the index isn't
+   * usable. */
+  if (consensus_cache_load_index(cache) < 0) {
+    consensus_cache_rescan(cache);
+    consensus_cache_write_index(cache);
+  }
   return cache;
 }
 
@@ -162,7 +196,20 @@ consensus_cache_register_with_sandbox(consensus_cache_t *cache,
    */
   tor_assert_nonfatal_unreached();
 #endif /* defined(MUST_UNMAP_TO_UNLINK) */
-  return storage_dir_register_with_sandbox(cache->dir, cfg);
+  int problems = 0;
+  char *tmp_fname = NULL;
+  tor_asprintf(&tmp_fname, "%s.tmp", cache->index_fname);
+  problems += sandbox_cfg_allow_open_filename(cfg,
+                                              tor_strdup(cache->index_fname));
+  problems += sandbox_cfg_allow_open_filename(cfg, tor_strdup(tmp_fname));
+  problems += sandbox_cfg_allow_stat_filename(cfg,
+                                              tor_strdup(cache->index_fname));
+  problems += sandbox_cfg_allow_rename(cfg, tor_strdup(tmp_fname),
+                                       tor_strdup(cache->index_fname));
+  tor_free(tmp_fname);
+  if (storage_dir_register_with_sandbox(cache->dir, cfg) < 0)
+    ++problems;
+  return problems ? -1 : 0;
 }
 
 #ifdef _WIN32
@@ -201,6 +248,7 @@ consensus_cache_free_(consensus_cache_t *cache)
     consensus_cache_clear(cache);
   }
   storage_dir_free(cache->dir);
+  tor_free(cache->index_fname);
   tor_free(cache);
 }
 
@@ -242,6 +290,8 @@ consensus_cache_add(consensus_cache_t *cache,
    */
   ent->refcnt = 2;
 
+  consensus_cache_write_index(cache);
+
   return ent;
 }
 
@@ -508,6 +558,7 @@ consensus_cache_get_n_filenames_available(consensus_cache_t *cache)
 void
 consensus_cache_delete_pending(consensus_cache_t *cache, int force)
 {
+  int n_removed = 0;
   SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
     tor_assert_nonfatal(ent->in_cache == cache);
     int force_ent = force;
@@ -538,7 +589,11 @@ consensus_cache_delete_pending(consensus_cache_t *cache, int force)
     consensus_cache_entry_decref(ent);
     storage_dir_remove_file(cache->dir, fname);
     tor_free(fname);
+    ++n_removed;
   } SMARTLIST_FOREACH_END(ent);
+
+  if (n_removed)
+    consensus_cache_write_index(cache);
 }
 
 /**
@@ -590,6 +645,217 @@ consensus_cache_rescan(consensus_cache_t *cache)
   } SMARTLIST_FOREACH_END(fname);
 }
 
+/**
+ * Encode the labels of every entry in <b>cache</b> as an index, and return
+ * it in a newly allocated string.
+ */
+static char *
+consensus_cache_index_encode(const consensus_cache_t *cache)
+{
+  smartlist_t *chunks = smartlist_new();
+  char digest[DIGEST256_LEN];
+  char hex[HEX_DIGEST256_LEN+1];
+  char *body, *result = NULL;
+  size_t body_len;
+
+  smartlist_add_strdup(chunks, INDEX_HEADER "\n");
+  SMARTLIST_FOREACH_BEGIN(cache->entries, const consensus_cache_entry_t *,
+                          ent) {
+    const config_line_t *line;
+    int n_labels = 0;
+    for (line = ent->labels; line; line = line->next)
+      ++n_labels;
+    smartlist_add_asprintf(chunks, INDEX_ENTRY " %s %d\n",
+                           ent->fname, n_labels);
+    for (line = ent->labels; line; line = line->next)
+      smartlist_add_asprintf(chunks, "%s %s\n", line->key, line->value);
+  } SMARTLIST_FOREACH_END(ent);
+
+  body = smartlist_join_strings(chunks, "", 0, &body_len);
+  crypto_digest256(digest, body, body_len, DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, sizeof(digest));
+  tor_asprintf(&result, "%s" INDEX_DIGEST " %s\n", body, hex);
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(body);
+  return result;
+}
+
+/**
+ * Parse the index in <b>s</b>, and add a new entry for each object it lists
+ * to <b>entries_out</b>.  The entries are not yet part of any cache.
+ * Return 0 on success, or -1 if the index is corrupt.
+ */
+static int
+consensus_cache_index_parse(const char *s, smartlist_t *entries_out)
+{
+  const size_t digest_line_len =
+    strlen(INDEX_DIGEST " ") + HEX_DIGEST256_LEN + 1;
+  const size_t len = strlen(s);
+  char digest[DIGEST256_LEN], expected[DIGEST256_LEN];
+  config_line_t *lines = NULL, *line;
+  char *body = NULL;
+  smartlist_t *parts = smartlist_new();
+  smartlist_t *parsed = smartlist_new();
+  int result = -1;
+
+  /* Check the digest before we parse anything. */
+  if (len < digest_line_len || s[len-1] != '\n')
+    goto done;
+  const size_t body_len = len - digest_line_len;
+  if (body_len > 0 && s[body_len-1] != '\n')
+    goto done;
+  if (strcmpstart(s + body_len, INDEX_DIGEST " "))
+    goto done;
+  if (base16_decode(expected, sizeof(expected),
+                    s + body_len + strlen(INDEX_DIGEST " "),
+                    HEX_DIGEST256_LEN) != sizeof(expected))
+    goto done;
+  crypto_digest256(digest, s, body_len, DIGEST_SHA256);
+  if (tor_memneq(digest, expected, sizeof(digest)))
+    goto done;
+
+  body = tor_strndup(s, body_len);
+  if (config_get_lines(body, &lines, 0) < 0)
+    goto done;
+
+  line = lines;
+  if (!line || strcmp(line->key, "consensus-cache-index") ||
+      strcmp(line->value, "1"))
+    goto done;
+
+  for (line = line->next; line; ) {
+    int ok = 0;
+    if (strcmp(line->key, INDEX_ENTRY))
+      goto done;
+    smartlist_split_string(parts, line->value, " ",
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+    if (smartlist_len(parts) != 2 ||
+        strchr(smartlist_get(parts, 0), '/'))
+      goto done;
+    long n_labels = tor_parse_long(smartlist_get(parts, 1), 10, 0, INT_MAX,
+                                   &ok, NULL);
+    if (!ok)
+      goto done;
+
+    consensus_cache_entry_t *ent =
+      tor_malloc_zero(sizeof(consensus_cache_entry_t));
+    ent->magic = CCE_MAGIC;
+    ent->fname = tor_strdup(smartlist_get(parts, 0));
+    ent->refcnt = 1;
+    ent->unused_since = TIME_MAX;
+    ent->labels_unverified = 1;
+    smartlist_add(parsed, ent);
+    SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+    smartlist_clear(parts);
+
+    for (line = line->next; n_labels > 0; --n_labels, line = line->next) {
+      if (!line)
+        goto done;
+      config_line_append(&ent->labels, line->key, line->value);
+    }
+  }
+
+  smartlist_add_all(entries_out, parsed);
+  smartlist_clear(parsed);
+  result = 0;
+
+ done:
+  SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+  smartlist_free(parts);
+  SMARTLIST_FOREACH(parsed, consensus_cache_entry_t *, ent,
+                    consensus_cache_entry_decref(ent));
+  smartlist_free(parsed);
+  config_free_lines(lines);
+  tor_free(body);
+  return result;
+}
+
+/**
+ * Try to rebuild the list of entries in <b>cache</b> from its index, without
+ * opening any of the objects.  Their labels get checked lazily, the first
+ * time we map them.
+ *
+ * Return 0 on success.  Return -1 if the index is missing, corrupt, or
+ * doesn't list exactly the files in the cache.
+ */
+static int
+consensus_cache_load_index(consensus_cache_t *cache)
+{
+  smartlist_t *entries = smartlist_new();
+  smartlist_t *fnames = NULL, *listed = NULL;
+  char *s = read_file_to_str(cache->index_fname, 0, NULL);
+  int result = -1;
+
+  if (!s)
+    goto done;
+
+  if (consensus_cache_index_parse(s, entries) < 0) {
+    log_info(LD_FS, "Consensus cache index %s is corrupt; rescanning.",
+             escaped(cache->index_fname));
+    goto done;
+  }
+
+  /* A crash between writing an object and writing the index could leave
+   * the index behind the directory. */
+  fnames = smartlist_new();
+  SMARTLIST_FOREACH(entries, consensus_cache_entry_t *, ent,
+                    smartlist_add(fnames, ent->fname));
+  listed = smartlist_new();
+  smartlist_add_all(listed, storage_dir_list(cache->dir));
+  smartlist_sort_strings(fnames);
+  smartlist_sort_strings(listed);
+  if (smartlist_len(fnames) != smartlist_len(listed)) {
+    log_info(LD_FS, "Consensus cache index %s is stale; rescanning.",
+             escaped(cache->index_fname));
+    goto done;
+  }
+  for (int i = 0; i < smartlist_len(fnames); ++i) {
+    if (strcmp(smartlist_get(fnames, i), smartlist_get(listed, i))) {
+      log_info(LD_FS, "Consensus cache index %s is stale; rescanning.",
+               escaped(cache->index_fname));
+      goto done;
+    }
+  }
+
+  if (cache->entries) {
+    consensus_cache_clear(cache);
+  }
+  cache->entries = entries;
+  entries = NULL;
+  SMARTLIST_FOREACH(cache->entries, consensus_cache_entry_t *, ent,
+                    ent->in_cache = cache);
+  result = 0;
+
+ done:
+  if (entries) {
+    SMARTLIST_FOREACH(entries, consensus_cache_entry_t *, ent,
+                      consensus_cache_entry_decref(ent));
+    smartlist_free(entries);
+  }
+  smartlist_free(fnames);
+  smartlist_free(listed);
+  tor_free(s);
+  return result;
+}
+
+/**
+ * Replace the index of <b>cache</b> with one that describes its current
+ * entries.
+ */
+static void
+consensus_cache_write_index(consensus_cache_t *cache)
+{
+  char *s = consensus_cache_index_encode(cache);
+  if (write_str_to_file(cache->index_fname, s, 0) < 0) {
+    /* We'll just rescan next time. */
+    log_info(LD_FS, "Unable to write consensus cache index %s.",
+             escaped(cache->index_fname));
+  }
+  tor_free(s);
+}
+
 /**
  * Make sure that <b>ent</b> is mapped into RAM.
  */
@@ -597,12 +863,29 @@ static void
 consensus_cache_entry_map(consensus_cache_t *cache,
                           consensus_cache_entry_t *ent)
 {
+  config_line_t *labels = NULL;
+
   if (ent->map)
     return;
 
   ent->map = storage_dir_map_labeled(cache->dir, ent->fname,
-                                     NULL, &ent->body, &ent->bodylen);
+                                     ent->labels_unverified ? &labels : NULL,
+                                     &ent->body, &ent->bodylen);
   ent->unused_since = TIME_MAX;
+
+  if (ent->map && ent->labels_unverified) {
+    if (config_lines_eq(labels, ent->labels)) {
+      ent->labels_unverified = 0;
+    } else {
+      /* The index lied about this object.  Other code has already looked
+       * it up by its labels, so the safest thing is to drop it. */
+      log_warn(LD_FS, "Labels for %s in consensus cache did not match our "
+               "index; removing it.", escaped(ent->fname));
+      consensus_cache_entry_unmap(ent);
+      ent->can_remove = 1;
+    }
+  }
+  config_free_lines(labels);
 }
 
 /**
@@ -23,6 +23,7 @@
 #include "feature/dirparse/ns_parse.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/cc/ctassert.h"
 #include "lib/compress/compress.h"
 #include "lib/encoding/confline.h"
 
@@ -93,16 +94,18 @@ typedef enum cdm_diff_status_t {
   CDM_DIFF_ERROR=3,
 } cdm_diff_status_t;
 
-/** Which methods do we use for precompressing diffs? */
+/** Which methods do we use for precompressing diffs?  NO_METHOD must come
+ * first; the others are listed from cheapest to most expensive, which is the
+ * order in which we queue their compression jobs. */
 static const compress_method_t compress_diffs_with[] = {
   NO_METHOD,
   GZIP_METHOD,
-#ifdef HAVE_LZMA
-  LZMA_METHOD,
-#endif
 #ifdef HAVE_ZSTD
   ZSTD_METHOD,
 #endif
+#ifdef HAVE_LZMA
+  LZMA_METHOD,
+#endif
 };
 
 /**
@@ -120,6 +123,20 @@ n_diff_compression_methods(void)
   return ARRAY_LENGTH(compress_diffs_with);
 }
 
+/** Return the position of <b>method</b> in compress_diffs_with, or -1 if we
+ * don't compress diffs with that method. */
+static int
+diff_compression_method_pos(compress_method_t method)
+{
+  unsigned i;
+  for (i = 0; i < n_diff_compression_methods(); ++i) {
+    if (compress_diffs_with[i] == method) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 /** Which methods do we use for precompressing consensuses? */
 static const compress_method_t compress_consensus_with[] = {
   ZLIB_METHOD,
@@ -172,11 +189,47 @@ typedef struct cdm_diff_t {
   /** Handle to the cache entry for this diff, if any.  We use a handle here
    * to avoid thinking too hard about cache entry lifetime issues. */
   consensus_cache_entry_handle_t *entry;
+
+  /** When did we decide to compute this diff?  (Coarse monotonic msec, or 0
+   * if we don't know.)  Used to measure how long diffs take to become
+   * available. */
+  uint64_t pending_since_msec;
 } cdm_diff_t;
 
 /** Hashtable mapping flavor and source consensus digest to status. */
 static HT_HEAD(cdm_diff_ht, cdm_diff_t) cdm_diff_ht = HT_INITIALIZER();
 
+/** Histogram bucket upper bounds, in msec, for the time between deciding to
+ * compute a consensus diff and being able to serve it. */
+const int64_t consdiff_availability_buckets[] = {
+  100, 500, 1000, 5000, 10000, 30000, 60000, 300000, 900000,
+};
+CTASSERT(ARRAY_LENGTH(consdiff_availability_buckets) ==
+         CONSDIFF_AVAILABILITY_N_BUCKETS);
+/** Stats: number of diffs that became available, per compression method (in
+ * the order of compress_diffs_with) and per time-to-availability bucket.
+ * The last bucket is for the diffs that took longer than the last bound. */
+static uint64_t
+  stats_consdiff_availability[ARRAY_LENGTH(compress_diffs_with)]
+                             [CONSDIFF_AVAILABILITY_N_BUCKETS + 1];
+/** Stats: total time-to-availability, in msec, per compression method. */
+static int64_t
+  stats_consdiff_availability_msec[ARRAY_LENGTH(compress_diffs_with)];
+
+/**
+ * Maximum number of source consensus digests for which we remember how many
+ * times a diff was requested, per flavor.  This bounds the memory that
+ * requests for unknown digests can make us use.
+ */
+#define CDM_MAX_TRACKED_DIFF_SOURCES 1024
+/**
+ * Per flavor: map from the SHA3 digest-as-signed of a source consensus to
+ * the number of times that somebody asked us for a diff from it, stored as
+ * an uintptr_t.  We compute the diffs from the most requested sources
+ * first.
+ */
+static digest256map_t *cdm_diff_requests[N_CONSENSUS_FLAVORS];
+
 #ifdef _WIN32
    // XXX(ahf): For tor#24857, a contributor suggested that on Windows, the CPU
    // begins to spike at 100% once the number of files handled by the consensus
@@ -292,11 +345,56 @@ cdm_diff_ht_check_and_note_pending(consensus_flavor_t flav,
     }
     ent = cdm_diff_new(flav, from_sha3, target_sha3, method);
     ent->cdm_diff_status = CDM_DIFF_IN_PROGRESS;
+    ent->pending_since_msec = monotime_coarse_absolute_msec();
     HT_INSERT(cdm_diff_ht, &cdm_diff_ht, ent);
   }
   return result;
 }
 
+/**
+ * Record in our statistics that the diff <b>ent</b>, which we started to
+ * compute at <b>ent</b>-&gt;pending_since_msec, has just become available.
+ */
+static void
+cdm_diff_note_available(const cdm_diff_t *ent)
+{
+  int pos = diff_compression_method_pos(ent->compress_method);
+  if (BUG(pos < 0) || ent->pending_since_msec == 0)
+    return;
+
+  uint64_t now = monotime_coarse_absolute_msec();
+  int64_t elapsed = 0;
+  if (now > ent->pending_since_msec)
+    elapsed = (int64_t) (now - ent->pending_since_msec);
+
+  unsigned i;
+  for (i = 0; i < CONSDIFF_AVAILABILITY_N_BUCKETS; ++i) {
+    if (elapsed <= consdiff_availability_buckets[i])
+      break;
+  }
+  stats_consdiff_availability[pos][i]++;
+  stats_consdiff_availability_msec[pos] += elapsed;
+}
+
+/**
+ * Return the time-to-availability histogram of the consensus diffs that we
+ * compressed with <b>method</b>, as an array of
+ * CONSDIFF_AVAILABILITY_N_BUCKETS + 1 counts, and set *<b>sum_msec_out</b>
+ * to the sum of the observations.  Return NULL if we don't compress diffs
+ * with <b>method</b>.
+ */
+const uint64_t *
+consdiffmgr_get_diff_availability_hist(compress_method_t method,
+                                       int64_t *sum_msec_out)
+{
+  tor_assert(sum_msec_out);
+  int pos = diff_compression_method_pos(method);
+  if (pos < 0)
+    return NULL;
+  *sum_msec_out = stats_consdiff_availability_msec[pos];
+  return stats_consdiff_availability[pos];
+}
+
 /**
  * Update the status of the diff of type <b>flav</b> between consensuses with
  * the two provided SHA3-256 digests, so that its status becomes
@@ -334,6 +432,10 @@ cdm_diff_ht_set_status(consensus_flavor_t flav,
 
   tor_assert_nonfatal(ent->cdm_diff_status == CDM_DIFF_IN_PROGRESS);
 
+  if (status == CDM_DIFF_PRESENT &&
+      ent->cdm_diff_status == CDM_DIFF_IN_PROGRESS)
+    cdm_diff_note_available(ent);
+
   ent->cdm_diff_status = status;
   consensus_cache_entry_handle_free(ent->entry);
   ent->entry = handle;
@@ -648,6 +750,45 @@ consdiffmgr_find_consensus(struct consensus_cache_entry_t **entry_out,
     return CONSDIFF_NOT_FOUND;
 }
 
+/**
+ * Note that somebody asked us for a diff of type <b>flavor</b> from the
+ * consensus whose SHA3 digest-as-signed is <b>from_sha3</b>.
+ */
+static void
+cdm_diff_note_requested(consensus_flavor_t flavor, const uint8_t *from_sha3)
+{
+  if (BUG((int)flavor >= N_CONSENSUS_FLAVORS))
+    return; // LCOV_EXCL_LINE
+  digest256map_t *map = cdm_diff_requests[flavor];
+  if (!map)
+    map = cdm_diff_requests[flavor] = digest256map_new();
+
+  void *val = digest256map_get(map, from_sha3);
+  uintptr_t n = (uintptr_t) val;
+  if (n == 0 && digest256map_size(map) >= CDM_MAX_TRACKED_DIFF_SOURCES)
+    return;
+  if (n < UINTPTR_MAX)
+    ++n;
+  digest256map_set(map, from_sha3, (void*) n);
+}
+
+/**
+ * Return the number of times that somebody asked us for a diff of type
+ * <b>flavor</b> from the consensus whose SHA3 digest-as-signed is
+ * <b>from_sha3</b>.
+ */
+STATIC unsigned
+cdm_diff_get_n_requests(consensus_flavor_t flavor, const uint8_t *from_sha3)
+{
+  if (BUG((int)flavor >= N_CONSENSUS_FLAVORS))
+    return 0; // LCOV_EXCL_LINE
+  if (!cdm_diff_requests[flavor])
+    return 0;
+  void *val = digest256map_get(cdm_diff_requests[flavor], from_sha3);
+  uintptr_t n = (uintptr_t) val;
+  return n > UINT_MAX ? UINT_MAX : (unsigned) n;
+}
+
 /**
  * Look up consensus_cache_entry_t for the consensus of type <b>flavor</b>,
  * from the source consensus with the specified digest (which must be SHA3).
@@ -669,6 +810,8 @@ consdiffmgr_find_diff_from(consensus_cache_entry_t **entry_out,
     return CONSDIFF_NOT_FOUND; // LCOV_EXCL_LINE
   }
 
+  cdm_diff_note_requested(flavor, digest);
+
   // Try to look up the entry in the hashtable.
   cdm_diff_t search, *ent;
   memset(&search, 0, sizeof(search));
@@ -913,6 +1056,55 @@ consdiffmgr_validate(void)
   return problems;
 }
 
+/**
+ * A source consensus from which we want to compute a diff to the most recent
+ * consensus.
+ */
+typedef struct cdm_diff_candidate_t {
+  /** The source consensus. */
+  consensus_cache_entry_t *ent;
+  /** Its SHA3 digest-as-signed. */
+  uint8_t from_sha3[DIGEST256_LEN];
+  /** How many times have we been asked for a diff from it? */
+  unsigned n_requests;
+  /** Its position in the list of sources, from newest to oldest. */
+  int order;
+} cdm_diff_candidate_t;
+
+/** Helper: sort cdm_diff_candidate_t by decreasing number of requests, then
+ * from newest to oldest. */
+static int
+compare_diff_candidates_(const void **a_, const void **b_)
+{
+  const cdm_diff_candidate_t *a = *a_, *b = *b_;
+  if (a->n_requests != b->n_requests)
+    return a->n_requests > b->n_requests ? -1 : 1;
+  return a->order - b->order;
+}
+
+/**
+ * Forget how many times we were asked for diffs of type <b>flavor</b> from
+ * any consensus that is not in <b>keep</b>.
+ */
+static void
+cdm_diff_requests_prune(consensus_flavor_t flavor, const smartlist_t *keep)
+{
+  digest256map_t *old_map = cdm_diff_requests[flavor];
+  if (!old_map)
+    return;
+  digest256map_t *new_map = digest256map_new();
+  SMARTLIST_FOREACH_BEGIN(keep, consensus_cache_entry_t *, ent) {
+    uint8_t sha3[DIGEST256_LEN];
+    if (cdm_entry_get_sha3_value(sha3, ent, LABEL_SHA3_DIGEST_AS_SIGNED) < 0)
+      continue;
+    void *n = digest256map_get(old_map, sha3);
+    if (n)
+      digest256map_set(new_map, sha3, n);
+  } SMARTLIST_FOREACH_END(ent);
+  digest256map_free(old_map, NULL);
+  cdm_diff_requests[flavor] = new_map;
+}
+
 /**
  * Helper: build new diffs of <b>flavor</b> as needed
  */
@@ -922,6 +1114,7 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   smartlist_t *matches = NULL;
   smartlist_t *diffs = NULL;
   smartlist_t *compute_diffs_from = NULL;
+  smartlist_t *candidates = NULL;
   strmap_t *have_diff_from = NULL;
 
   // look for the most recent consensus, and for all previous in-range
@@ -1003,30 +1196,52 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   //    target consensuses.
   cdm_diff_ht_purge(flavor, most_recent_sha3);
 
-  // 5. Actually launch the requests.
+  // 5. Actually launch the requests, starting with the diffs from the
+  //    sources that have been requested most often.  Ties go to the most
+  //    recent source.
+  candidates = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(compute_diffs_from, consensus_cache_entry_t *, c) {
     if (BUG(c == most_recent))
       continue; // LCOV_EXCL_LINE
 
-    uint8_t this_sha3[DIGEST256_LEN];
-    if (cdm_entry_get_sha3_value(this_sha3, c,
+    cdm_diff_candidate_t *cand = tor_malloc_zero(sizeof(*cand));
+    if (cdm_entry_get_sha3_value(cand->from_sha3, c,
                                  LABEL_SHA3_DIGEST_AS_SIGNED)<0) {
       // Not actually a bug, since we might be running with a directory
       // with stale files from before the #22143 fixes.
+      tor_free(cand);
       continue;
     }
+    cand->ent = c;
+    cand->n_requests = cdm_diff_get_n_requests(flavor, cand->from_sha3);
+    cand->order = c_sl_idx;
+    smartlist_add(candidates, cand);
+  } SMARTLIST_FOREACH_END(c);
+  smartlist_sort(candidates, compare_diff_candidates_);
+
+  SMARTLIST_FOREACH_BEGIN(candidates, cdm_diff_candidate_t *, cand) {
     if (cdm_diff_ht_check_and_note_pending(flavor,
-                                           this_sha3, most_recent_sha3)) {
+                                           cand->from_sha3,
+                                           most_recent_sha3)) {
       // This is already pending, or we encountered an error.
       continue;
     }
-    consensus_diff_queue_diff_work(c, most_recent);
-  } SMARTLIST_FOREACH_END(c);
+    consensus_diff_queue_diff_work(cand->ent, most_recent);
+  } SMARTLIST_FOREACH_END(cand);
+
+  // 6. Forget the request counts for sources that we no longer have.
+  smartlist_add(matches, most_recent);
+  cdm_diff_requests_prune(flavor, matches);
 
  done:
   smartlist_free(matches);
   smartlist_free(diffs);
   smartlist_free(compute_diffs_from);
+  if (candidates) {
+    SMARTLIST_FOREACH(candidates, cdm_diff_candidate_t *, cand,
+                      tor_free(cand));
+    smartlist_free(candidates);
+  }
   strmap_free(have_diff_from, NULL);
 }
 
@@ -1280,6 +1495,9 @@ consdiffmgr_free_all(void)
     }
   }
   memset(latest_consensus, 0, sizeof(latest_consensus));
+  for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
+    digest256map_free(cdm_diff_requests[i], NULL);
+  }
   consensus_cache_free(cons_diff_cache);
   cons_diff_cache = NULL;
   mainloop_event_free(consdiffmgr_rescan_ev);
@@ -1411,10 +1629,52 @@ typedef struct consensus_diff_worker_job_t {
    */
   consensus_cache_entry_t *diff_to;
 
-  /** Output: labels and bodies */
-  compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
+  /** Output: labels and body of the uncompressed diff. */
+  compressed_result_t out;
+  /** Output: the labels shared by every compressed version of the diff. */
+  config_line_t *common_labels;
 } consensus_diff_worker_job_t;
 
+/**
+ * A consensus diff that has been computed, and which is waiting to be
+ * compressed with one or more methods.  Shared by all the
+ * consensus_diff_compress_job_t objects that compress it; the reference
+ * count is only touched from the main thread.
+ */
+typedef struct cdm_computed_diff_t {
+  /** Number of compression jobs (and other users) holding this object. */
+  int refcnt;
+  /** Flavor of the diff. */
+  consensus_flavor_t flavor;
+  /** SHA3-256 digest-as-signed of the consensus the diff is from. */
+  uint8_t from_sha3[DIGEST256_LEN];
+  /** SHA3-256 digest of the consensus the diff is to. */
+  uint8_t to_sha3[DIGEST256_LEN];
+  /** True iff we should record the results in the diff hashtable. */
+  int cache;
+  /** The uncompressed diff.  Read-only once this object is created. */
+  uint8_t *body;
+  /** Length of <b>body</b>. */
+  size_t bodylen;
+  /** Labels to use as a basis for each compressed version. */
+  config_line_t *labels;
+  /** Human-readable description of the diff, for logging. */
+  char *description;
+} cdm_computed_diff_t;
+
+/**
+ * An object passed to a worker thread that will compress a computed
+ * consensus diff with a single method.
+ */
+typedef struct consensus_diff_compress_job_t {
+  /** Input: the diff to compress.  Holds a reference. */
+  cdm_computed_diff_t *diff;
+  /** Input: the method to compress it with. */
+  compress_method_t method;
+  /** Output: labels and body. */
+  compressed_result_t out;
+} consensus_diff_compress_job_t;
+
 /** Given a consensus_cache_entry_t, check whether it has a label claiming
  * that it was compressed.  If so, uncompress its contents into *<b>out</b> and
  * set <b>outlen</b> to hold their size, and set *<b>owned_out</b> to a pointer
@@ -1549,11 +1809,11 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     return WQ_RPL_REPLY;
   }
 
-  /* Compress the results and send the reply */
-  tor_assert(compress_diffs_with[0] == NO_METHOD);
+  /* Label the results and send the reply; the main thread will queue the
+   * compression jobs. */
   size_t difflen = strlen(consensus_diff);
-  job->out[0].body = (uint8_t *) consensus_diff;
-  job->out[0].bodylen = difflen;
+  job->out.body = (uint8_t *) consensus_diff;
+  job->out.bodylen = difflen;
 
   config_line_t *common_labels = NULL;
   if (lv_to_valid_until)
@@ -1564,8 +1824,8 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     config_line_prepend(&common_labels, LABEL_SIGNATORIES, lv_to_signatories);
   cdm_labels_prepend_sha3(&common_labels,
                           LABEL_SHA3_DIGEST_UNCOMPRESSED,
-                          job->out[0].body,
-                          job->out[0].bodylen);
+                          job->out.body,
+                          job->out.bodylen);
   config_line_prepend(&common_labels, LABEL_FROM_VALID_AFTER,
                       lv_from_valid_after);
   config_line_prepend(&common_labels, LABEL_VALID_AFTER,
@@ -1578,18 +1838,13 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
   config_line_prepend(&common_labels, LABEL_DOCTYPE,
                       DOCTYPE_CONSENSUS_DIFF);
 
-  job->out[0].labels = config_lines_dup(common_labels);
-  cdm_labels_prepend_sha3(&job->out[0].labels,
+  job->out.labels = config_lines_dup(common_labels);
+  cdm_labels_prepend_sha3(&job->out.labels,
                           LABEL_SHA3_DIGEST,
-                          job->out[0].body,
-                          job->out[0].bodylen);
+                          job->out.body,
+                          job->out.bodylen);
 
-  compress_multiple(job->out+1,
-                    n_diff_compression_methods()-1,
-                    compress_diffs_with+1,
-                    (const uint8_t*)consensus_diff, difflen, common_labels);
-
-  config_free_lines(common_labels);
+  job->common_labels = common_labels;
   return WQ_RPL_REPLY;
 }
 
@@ -1605,20 +1860,151 @@ consensus_diff_worker_job_free_(consensus_diff_worker_job_t *job)
 {
   if (!job)
     return;
-  unsigned u;
-  for (u = 0; u < n_diff_compression_methods(); ++u) {
-    config_free_lines(job->out[u].labels);
-    tor_free(job->out[u].body);
-  }
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  config_free_lines(job->common_labels);
   consensus_cache_entry_decref(job->diff_from);
   consensus_cache_entry_decref(job->diff_to);
   tor_free(job);
 }
 
+/**
+ * Release a reference to <b>diff</b>, and free it if that was the last
+ * reference.
+ */
+static void
+cdm_computed_diff_decref(cdm_computed_diff_t *diff)
+{
+  if (!diff)
+    return;
+  tor_assert(diff->refcnt > 0);
+  if (--diff->refcnt > 0)
+    return;
+  tor_free(diff->body);
+  config_free_lines(diff->labels);
+  tor_free(diff->description);
+  tor_free(diff);
+}
+
+#define consensus_diff_compress_job_free(job)           \
+  FREE_AND_NULL(consensus_diff_compress_job_t,          \
+                consensus_diff_compress_job_free_, (job))
+
+/**
+ * Helper: release all storage held in <b>job</b>, and its reference to
+ * the diff it was compressing.
+ */
+static void
+consensus_diff_compress_job_free_(consensus_diff_compress_job_t *job)
+{
+  if (!job)
+    return;
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  cdm_computed_diff_decref(job->diff);
+  tor_free(job);
+}
+
+/**
+ * Return the priority at which we should compress consensus diffs with
+ * <b>method</b>.
+ *
+ * Cheap methods jump ahead of the diffs that are still waiting to be
+ * computed, so that each diff becomes available in the encodings that most
+ * clients ask for as soon as possible.  Expensive methods wait behind the
+ * remaining diff computations.
+ */
+static workqueue_priority_t
+cdm_diff_compress_priority(compress_method_t method)
+{
+  if (method == GZIP_METHOD || method == ZSTD_METHOD)
+    return WQ_PRI_MED;
+  else
+    return WQ_PRI_LOW;
+}
+
+/**
+ * Worker function. This function runs inside a worker thread and receives
+ * a consensus_diff_compress_job_t as its input.
+ */
+static workqueue_reply_t
+consensus_diff_compress_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  consensus_diff_compress_job_t *job = work_;
+  const cdm_computed_diff_t *diff = job->diff;
+
+  compress_multiple(&job->out, 1, &job->method,
+                    diff->body, diff->bodylen, diff->labels);
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Worker function: This function runs in the main thread, and receives
+ * a consensus_diff_compress_job_t that the worker thread has already
+ * processed.
+ */
+static void
+consensus_diff_compress_replyfn(void *work_)
+{
+  tor_assert(in_main_thread());
+  tor_assert(work_);
+
+  consensus_diff_compress_job_t *job = work_;
+  const cdm_computed_diff_t *diff = job->diff;
+  consensus_cache_entry_handle_t *handle = NULL;
+
+  int status = store_multiple(&handle, 1, &job->method, &job->out,
+                              diff->description);
+  if (status != CDM_DIFF_PRESENT) {
+    log_info(LD_DIRSERV, "Unable to compress %s with %s",
+             diff->description, compression_method_get_name(job->method));
+  }
+
+  if (diff->cache) {
+    cdm_diff_ht_set_status(diff->flavor, diff->from_sha3, diff->to_sha3,
+                           job->method, status, handle);
+  } else {
+    consensus_cache_entry_handle_free(handle);
+  }
+
+  consensus_diff_compress_job_free(job);
+}
+
+/**
+ * Queue the job of compressing <b>diff</b> with <b>method</b> in a worker
+ * thread.  Return 0 on success and -1 on failure.
+ */
+static int
+consensus_diff_queue_compress_work(cdm_computed_diff_t *diff,
+                                   compress_method_t method)
+{
+  tor_assert(in_main_thread());
+
+  consensus_diff_compress_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->diff = diff;
+  ++diff->refcnt;
+  job->method = method;
+
+  workqueue_entry_t *work;
+  work = cpuworker_queue_work(cdm_diff_compress_priority(method),
+                              consensus_diff_compress_threadfn,
+                              consensus_diff_compress_replyfn,
+                              job);
+  if (!work) {
+    consensus_diff_compress_job_free(job); // includes decref.
+    return -1;
+  }
+  return 0;
+}
+
 /**
  * Worker function: This function runs in the main thread, and receives
  * a consensus_diff_worker_job_t that the worker thread has already
  * processed.
+ *
+ * Store the uncompressed diff, and queue one job for each other method
+ * that we compress diffs with.
  */
 static void
 consensus_diff_worker_replyfn(void *work_)
@@ -1657,45 +2043,65 @@ consensus_diff_worker_replyfn(void *work_)
     cache = 0;
   }
 
-  consensus_cache_entry_handle_t *handles[ARRAY_LENGTH(compress_diffs_with)];
-  memset(handles, 0, sizeof(handles));
-
   char description[128];
   tor_snprintf(description, sizeof(description),
                "consensus diff from %s to %s",
                lv_from_digest, lv_to_digest);
 
-  int status = store_multiple(handles,
-                              n_diff_compression_methods(),
-                              compress_diffs_with,
-                              job->out,
-                              description);
-
-  if (status != CDM_DIFF_PRESENT) {
+  unsigned u;
+  if (job->out.body == NULL) {
     /* Failure! Nothing to do but complain */
     log_warn(LD_DIRSERV,
              "Worker was unable to compute consensus diff "
              "from %s to %s", lv_from_digest, lv_to_digest);
     /* Cache this error so we don't try to compute this one again. */
-    status = CDM_DIFF_ERROR;
+    if (cache) {
+      for (u = 0; u < n_diff_compression_methods(); ++u) {
+        cdm_diff_ht_set_status(flav, from_sha3, to_sha3,
+                               compress_diffs_with[u], CDM_DIFF_ERROR, NULL);
+      }
+    }
+    goto done;
   }
 
-  unsigned u;
-  for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
+  /* Store the uncompressed version right away. */
+  tor_assert(compress_diffs_with[0] == NO_METHOD);
+  consensus_cache_entry_handle_t *handle = NULL;
+  int status = store_multiple(&handle, 1, compress_diffs_with, &job->out,
+                              description);
+  if (cache) {
+    cdm_diff_ht_set_status(flav, from_sha3, to_sha3, NO_METHOD,
+                           status, handle);
+  } else {
+    consensus_cache_entry_handle_free(handle);
+  }
+
+  /* Hand the body over to the compression jobs. */
+  cdm_computed_diff_t *diff = tor_malloc_zero(sizeof(*diff));
+  diff->refcnt = 1;
+  diff->cache = cache;
+  if (cache) {
+    diff->flavor = flav;
+    memcpy(diff->from_sha3, from_sha3, DIGEST256_LEN);
+    memcpy(diff->to_sha3, to_sha3, DIGEST256_LEN);
+  }
+  diff->body = job->out.body;
+  diff->bodylen = job->out.bodylen;
+  job->out.body = NULL;
+  diff->labels = job->common_labels;
+  job->common_labels = NULL;
+  diff->description = tor_strdup(description);
+
+  for (u = 1; u < n_diff_compression_methods(); ++u) {
     compress_method_t method = compress_diffs_with[u];
-    if (cache) {
-      consensus_cache_entry_handle_t *h = handles[u];
-      int this_status = status;
-      if (h == NULL) {
-        this_status = CDM_DIFF_ERROR;
-      }
-      tor_assert_nonfatal(h != NULL || this_status == CDM_DIFF_ERROR);
-      cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method, this_status, h);
-    } else {
-      consensus_cache_entry_handle_free(handles[u]);
+    if (consensus_diff_queue_compress_work(diff, method) < 0 && cache) {
+      cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method,
+                             CDM_DIFF_ERROR, NULL);
     }
   }
+  cdm_computed_diff_decref(diff);
 
+ done:
   consensus_diff_worker_job_free(job);
 }
 
@@ -65,6 +65,14 @@ int consdiffmgr_register_with_sandbox(struct sandbox_cfg_elem_t **cfg);
 void consdiffmgr_free_all(void);
 int consdiffmgr_validate(void);
 
+/** Number of buckets in the histogram of consensus diff time to
+ * availability. */
+#define CONSDIFF_AVAILABILITY_N_BUCKETS 9
+extern const int64_t consdiff_availability_buckets[];
+const uint64_t *consdiffmgr_get_diff_availability_hist(
+                           enum compress_method_t method,
+                           int64_t *sum_msec_out);
+
 #ifdef CONSDIFFMGR_PRIVATE
 struct consensus_cache_t;
 struct consensus_cache_entry_t;
@@ -79,6 +87,8 @@ STATIC int cdm_entry_get_sha3_value(uint8_t *digest_out,
 STATIC int uncompress_or_set_ptr(const char **out, size_t *outlen,
                                  char **owned_out,
                                  struct consensus_cache_entry_t *ent);
+STATIC unsigned cdm_diff_get_n_requests(consensus_flavor_t flavor,
+                                        const uint8_t *from_sha3);
 #endif /* defined(CONSDIFFMGR_PRIVATE) */
 
 #ifdef TOR_UNIT_TESTS
@@ -211,6 +211,7 @@ static compress_method_t srv_meth_pref_precompressed[] = {
 /** Array of compression methods to use (if supported) for serving
  * streamed data, ordered from best to worst. */
 static compress_method_t srv_meth_pref_streaming_compression[] = {
+  ZSTD_DICT_METHOD,
   ZSTD_METHOD,
   ZLIB_METHOD,
   GZIP_METHOD,
@@ -1355,7 +1356,7 @@ handle_get_hs_descriptor_v3(dir_connection_t *conn,
                             const get_handler_args_t *args)
 {
   int retval;
-  const char *desc_str = NULL;
+  char *desc_str = NULL;
   const char *pubkey_str = NULL;
   const char *url = args->url;
 
@@ -1395,6 +1396,7 @@ handle_get_hs_descriptor_v3(dir_connection_t *conn,
   }
 
  done:
+  tor_free(desc_str);
   return 0;
 }
 
@@ -451,6 +451,21 @@ typedef enum {
   SRFS_DONE
 } spooled_resource_flush_status_t;
 
+/** Helper: release a reference to a cached_dir_t that an outbuf held. */
+static void
+spooled_cached_dir_release(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
+/** Helper: release a reference to a consensus_cache_entry_t that an outbuf
+ * held. */
+static void
+spooled_cce_release(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
+
 /** Flush some or all of the bytes from <b>spooled</b> onto <b>conn</b>.
  * Return SRFS_ERR on error, SRFS_MORE if there are more bytes to flush from
  * this spooled resource, or SRFS_DONE if we are done flushing this spooled
@@ -509,8 +524,24 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
       return SRFS_ERR;
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
 
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    if (conn->compress_state == NULL) {
+      /* The body can't go away or change while we hold a reference to it,
+       * so let the outbuf refer to it instead of copying it. */
+      if (cached) {
+        ++cached->refcnt;
+        connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                    bytes, TO_CONN(conn),
+                                    spooled_cached_dir_release, cached);
+      } else {
+        consensus_cache_entry_incref(cce);
+        connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                    bytes, TO_CONN(conn),
+                                    spooled_cce_release, cce);
+      }
+    } else {
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
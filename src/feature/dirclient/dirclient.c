@@ -1872,6 +1872,11 @@ dir_client_decompress_response_body(char **bodyp, size_t *bodylenp,
   int tried_both = 0;
   compress_method_t guessed = detect_compression_method(body, body_len);
 
+  /* A zstd frame compressed with our dictionary looks just like any other
+   * zstd frame. */
+  if (guessed == ZSTD_METHOD && compression == ZSTD_DICT_METHOD)
+    guessed = ZSTD_DICT_METHOD;
+
   description1 = compression_method_get_human_name(compression);
 
   if (BUG(description1 == NULL))
@@ -2880,6 +2885,7 @@ connection_dir_client_refetch_hsdesc_if_needed(dir_connection_t *dir_conn)
 /** Array of compression methods to use (if supported) for requesting
  * compressed data, ordered from best to worst. */
 static compress_method_t client_meth_pref[] = {
+  ZSTD_DICT_METHOD,
   LZMA_METHOD,
   ZSTD_METHOD,
   ZLIB_METHOD,
@@ -361,6 +361,217 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+/** Helper for calc_changes_myers: find a point through which a shortest edit
+ * script between the lines <b>lo1</b> (inclusive) through <b>hi1</b>
+ * (exclusive) of <b>list1</b> and the lines <b>lo2</b> through <b>hi2</b> of
+ * <b>list2</b> passes, using the "middle snake" search from Myers' paper.
+ *
+ * Neither range may be empty.  <b>v1</b> and <b>v2</b> are scratch arrays of
+ * at least (hi1-lo1)+(hi2-lo2)+3 elements each.
+ *
+ * On success, store the offsets of the split point relative to <b>lo1</b>
+ * and <b>lo2</b> in *<b>split1_out</b> and *<b>split2_out</b> and return 0.
+ * Return -1 if the two ranges have no line in common.
+ */
+static int
+myers_find_split(const smartlist_t *list1, int lo1, int hi1,
+                 const smartlist_t *list2, int lo2, int hi2,
+                 int *v1, int *v2, int *split1_out, int *split2_out)
+{
+  const int len1 = hi1 - lo1, len2 = hi2 - lo2;
+  const int max_d = (len1 + len2 + 1) / 2;
+  const int v_offset = max_d;
+  const int v_length = 2 * max_d + 2;
+  const int delta = len1 - len2;
+  /* If the total number of lines is odd, the forward path will overlap
+   * with the reverse path; otherwise the reverse path will overlap. */
+  const int front = (delta % 2 != 0);
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+  for (int i = 0; i < v_length; ++i) {
+    v1[i] = v2[i] = -1;
+  }
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (int d = 0; d < max_d; ++d) {
+    /* Walk the forward path one step. */
+    for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      const int k1_offset = v_offset + k1;
+      int x1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+        x1 = v1[k1_offset + 1];
+      else
+        x1 = v1[k1_offset - 1] + 1;
+      int y1 = x1 - k1;
+      while (x1 < len1 && y1 < len2 &&
+             lines_eq(smartlist_get(list1, lo1 + x1),
+                      smartlist_get(list2, lo2 + y1))) {
+        x1++;
+        y1++;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > len1) {
+        /* Ran off the right of the graph. */
+        k1end += 2;
+      } else if (y1 > len2) {
+        /* Ran off the bottom of the graph. */
+        k1start += 2;
+      } else if (front) {
+        const int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1) {
+          /* Mirror x2 onto the top-left coordinate system. */
+          const int x2 = len1 - v2[k2_offset];
+          if (x1 >= x2) {
+            *split1_out = x1;
+            *split2_out = y1;
+            return 0;
+          }
+        }
+      }
+    }
+
+    /* Walk the reverse path one step. */
+    for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      const int k2_offset = v_offset + k2;
+      int x2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+        x2 = v2[k2_offset + 1];
+      else
+        x2 = v2[k2_offset - 1] + 1;
+      int y2 = x2 - k2;
+      while (x2 < len1 && y2 < len2 &&
+             lines_eq(smartlist_get(list1, hi1 - x2 - 1),
+                      smartlist_get(list2, hi2 - y2 - 1))) {
+        x2++;
+        y2++;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > len1) {
+        /* Ran off the left of the graph. */
+        k2end += 2;
+      } else if (y2 > len2) {
+        /* Ran off the top of the graph. */
+        k2start += 2;
+      } else if (!front) {
+        const int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+          const int x1 = v1[k1_offset];
+          const int y1 = v_offset + x1 - k1_offset;
+          /* Mirror x2 onto the top-left coordinate system. */
+          if (x1 >= len1 - x2) {
+            *split1_out = x1;
+            *split2_out = y1;
+            return 0;
+          }
+        }
+      }
+    }
+  }
+
+  return -1;
+}
+
+/** Helper for calc_changes_myers: mark every line in the range from
+ * <b>lo</b> (inclusive) to <b>hi</b> (exclusive) as changed. */
+static void
+myers_set_all_changed(bitarray_t *changed, int lo, int hi)
+{
+  for (int i = lo; i < hi; ++i) {
+    bitarray_set(changed, i);
+  }
+}
+
+/** Helper for calc_changes_myers: recursively compute the changes between
+ * the ranges [<b>lo1</b>, <b>hi1</b>) of <b>list1</b> and [<b>lo2</b>,
+ * <b>hi2</b>) of <b>list2</b>. */
+static void
+myers_calc_changes(const smartlist_t *list1, int lo1, int hi1,
+                   const smartlist_t *list2, int lo2, int hi2,
+                   bitarray_t *changed1, bitarray_t *changed2,
+                   int *v1, int *v2)
+{
+  int split1, split2;
+
+  /* Trim any lines that are the same at the start or at the end. */
+  while (lo1 < hi1 && lo2 < hi2 &&
+         lines_eq(smartlist_get(list1, lo1), smartlist_get(list2, lo2))) {
+    ++lo1;
+    ++lo2;
+  }
+  while (lo1 < hi1 && lo2 < hi2 &&
+         lines_eq(smartlist_get(list1, hi1 - 1),
+                  smartlist_get(list2, hi2 - 1))) {
+    --hi1;
+    --hi2;
+  }
+
+  if (lo1 == hi1 || lo2 == hi2 ||
+      myers_find_split(list1, lo1, hi1, list2, lo2, hi2,
+                       v1, v2, &split1, &split2) < 0 ||
+      BUG(split1 + split2 == 0) ||
+      BUG(lo1 + split1 == hi1 && lo2 + split2 == hi2)) {
+    /* Nothing in common: everything left has changed. */
+    myers_set_all_changed(changed1, lo1, hi1);
+    myers_set_all_changed(changed2, lo2, hi2);
+    return;
+  }
+
+  myers_calc_changes(list1, lo1, lo1 + split1, list2, lo2, lo2 + split2,
+                     changed1, changed2, v1, v2);
+  myers_calc_changes(list1, lo1 + split1, hi1, list2, lo2 + split2, hi2,
+                     changed1, changed2, v1, v2);
+}
+
+/**
+ * Like calc_changes, but use Myers' O(ND) difference algorithm, which takes
+ * time proportional to the total length of the slices times the number of
+ * changed lines, instead of the product of their lengths.  Consecutive
+ * consensuses differ in few lines, so this is much faster than the LCS
+ * computation that calc_changes does.
+ *
+ * The result is also a shortest edit script, although it can pick a
+ * different one when several of them exist.
+ */
+STATIC void
+calc_changes_myers(smartlist_slice_t *slice1,
+                   smartlist_slice_t *slice2,
+                   bitarray_t *changed1, bitarray_t *changed2)
+{
+  trim_slices(slice1, slice2);
+  if (slice1->len == 0 || slice2->len == 0) {
+    myers_set_all_changed(changed1, slice1->offset,
+                          slice1->offset + slice1->len);
+    myers_set_all_changed(changed2, slice2->offset,
+                          slice2->offset + slice2->len);
+    return;
+  }
+
+  /* Scratch space for the forward and reverse paths; every recursive call
+   * needs less than the first one.  Most slices span a single router entry,
+   * so avoid the heap for those. */
+#define MYERS_STACK_SCRATCH 128
+  int v1_stack[MYERS_STACK_SCRATCH], v2_stack[MYERS_STACK_SCRATCH];
+  int *v1 = v1_stack, *v2 = v2_stack;
+  const size_t n_v = (size_t)slice1->len + slice2->len + 3;
+  if (n_v > MYERS_STACK_SCRATCH) {
+    v1 = tor_calloc(n_v, sizeof(int));
+    v2 = tor_calloc(n_v, sizeof(int));
+  }
+
+  myers_calc_changes(slice1->list, slice1->offset,
+                     slice1->offset + slice1->len,
+                     slice2->list, slice2->offset,
+                     slice2->offset + slice2->len,
+                     changed1, changed2, v1, v2);
+
+  if (v1 != v1_stack) {
+    tor_free(v1);
+    tor_free(v2);
+  }
+#undef MYERS_STACK_SCRATCH
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -620,11 +831,20 @@ preprocess_consensus(memarea_t *area,
  *   cons1_sl = smartlist_slice(cons1, 0, -1);
  *   cons2_sl = smartlist_slice(cons2, 0, -1);
  *   calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+ *
+ * The changes between router entries are computed with calc_changes if
+ * <b>engine</b> is CONSDIFF_ENGINE_LCS, and with calc_changes_myers if it is
+ * CONSDIFF_ENGINE_MYERS.
  */
 STATIC smartlist_t *
-gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
-            memarea_t *area)
+gen_ed_diff_with_engine(const smartlist_t *cons1_orig,
+                        const smartlist_t *cons2,
+                        memarea_t *area,
+                        consdiff_engine_t engine)
 {
+  void (*calc_changes_fn)(smartlist_slice_t *, smartlist_slice_t *,
+                          bitarray_t *, bitarray_t *) =
+    (engine == CONSDIFF_ENGINE_LCS) ? calc_changes : calc_changes_myers;
   smartlist_t *cons1 = smartlist_new();
   smartlist_add_all(cons1, cons1_orig);
   cdline_t *remove_trailer = preprocess_consensus(area, cons1);
@@ -737,7 +957,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    calc_changes_fn(cons1_sl, cons2_sl, changed1, changed2);
     tor_free(cons1_sl);
     tor_free(cons2_sl);
     start1 = i1, start2 = i2;
@@ -828,6 +1048,17 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   return NULL;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** As gen_ed_diff_with_engine, using the default diff engine. */
+STATIC smartlist_t *
+gen_ed_diff(const smartlist_t *cons1, const smartlist_t *cons2,
+            memarea_t *area)
+{
+  return gen_ed_diff_with_engine(cons1, cons2, area,
+                                 CONSDIFF_ENGINE_DEFAULT);
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /* Helper: Read a base-10 number between 0 and INT32_MAX from <b>s</b> and
  * store it in <b>num_out</b>.  Advance <b>s</b> to the character immediately
  * after the number.  Return 0 on success, -1 on failure. */
@@ -1027,9 +1258,10 @@ consdiff_gen_diff(const smartlist_t *cons1,
                   const smartlist_t *cons2,
                   const consensus_digest_t *digests1,
                   const consensus_digest_t *digests2,
-                  memarea_t *area)
+                  memarea_t *area,
+                  consdiff_engine_t engine)
 {
-  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area);
+  smartlist_t *ed_diff = gen_ed_diff_with_engine(cons1, cons2, area, engine);
   /* ed diff could not be generated - reason already logged by gen_ed_diff. */
   if (!ed_diff) {
     goto error_cleanup;
@@ -1340,6 +1572,20 @@ consensus_join_lines(const smartlist_t *inp)
 char *
 consensus_diff_generate(const char *cons1, size_t cons1len,
                         const char *cons2, size_t cons2len)
+{
+  return consensus_diff_generate_with_engine(cons1, cons1len,
+                                             cons2, cons2len,
+                                             CONSDIFF_ENGINE_DEFAULT);
+}
+
+/**
+ * As consensus_diff_generate(), but compute the changes between router
+ * entries with <b>engine</b>.
+ */
+char *
+consensus_diff_generate_with_engine(const char *cons1, size_t cons1len,
+                                    const char *cons2, size_t cons2len,
+                                    consdiff_engine_t engine)
 {
   consensus_digest_t d1, d2;
   smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
@@ -1359,7 +1605,7 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
   if (consensus_split_lines(lines2, cons2, cons2len, area) < 0)
     goto done;
 
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area, engine);
 
  done:
   if (result_lines) {
@@ -12,8 +12,25 @@
 
 #include "core/or/or.h"
 
+/**
+ * Algorithms that we can use to compute the changes between the router
+ * entries of two consensuses.
+ */
+typedef enum consdiff_engine_t {
+  /** Hirschberg-style longest common subsequence: O(n*m) time. */
+  CONSDIFF_ENGINE_LCS = 0,
+  /** Myers' difference algorithm: O((n+m)*D) time, for D changed lines. */
+  CONSDIFF_ENGINE_MYERS = 1,
+} consdiff_engine_t;
+
+/** The engine that consensus_diff_generate() uses. */
+#define CONSDIFF_ENGINE_DEFAULT CONSDIFF_ENGINE_MYERS
+
 char *consensus_diff_generate(const char *cons1, size_t cons1len,
                               const char *cons2, size_t cons2len);
+char *consensus_diff_generate_with_engine(const char *cons1, size_t cons1len,
+                                          const char *cons2, size_t cons2len,
+                                          consdiff_engine_t engine);
 char *consensus_diff_apply(const char *consensus, size_t consensus_len,
                            const char *diff, size_t diff_len);
 
@@ -40,7 +57,8 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const smartlist_t *cons2,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
-                                      struct memarea_t *area);
+                                      struct memarea_t *area,
+                                      consdiff_engine_t engine);
 STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
@@ -60,14 +78,23 @@ typedef struct smartlist_slice_t {
   /** Length of the slice, i.e. the number of elements it holds. */
   int len;
 } smartlist_slice_t;
+#ifdef TOR_UNIT_TESTS
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
                                 struct memarea_t *area);
+#endif
+STATIC smartlist_t *gen_ed_diff_with_engine(const smartlist_t *cons1,
+                                            const smartlist_t *cons2,
+                                            struct memarea_t *area,
+                                            consdiff_engine_t engine);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
+STATIC void calc_changes_myers(smartlist_slice_t *slice1,
+                               smartlist_slice_t *slice2,
+                               bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
@@ -286,6 +286,42 @@ microdesc_parse_fields(microdesc_t *md,
   return rv;
 }
 
+/**
+ * Parse the fields of <b>md</b> from its body.  The caller must already have
+ * set the body, bodylen, digest, and saved_location fields, as we do when
+ * loading a microdescriptor from the index of our cache file without parsing
+ * it.  Check that the body really matches the digest before trusting it.
+ *
+ * On success, return 0; otherwise return -1.
+ **/
+int
+microdesc_parse_body(microdesc_t *md)
+{
+  char digest[DIGEST256_LEN];
+  memarea_t *area;
+  int r;
+
+  tor_assert(md);
+  if (!md->body || md->bodylen < 9 || fast_memneq(md->body, "onion-key", 9)) {
+    log_warn(LD_DIR, "Malformed microdescriptor found in %s",
+             saved_location_to_string(md->saved_location));
+    return -1;
+  }
+
+  crypto_digest256(digest, md->body, md->bodylen, DIGEST_SHA256);
+  if (tor_memneq(digest, md->digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "Microdescriptor found in %s did not match its digest",
+             saved_location_to_string(md->saved_location));
+    return -1;
+  }
+
+  area = memarea_new();
+  r = microdesc_parse_fields(md, area, md->body, md->body + md->bodylen,
+                             0, md->saved_location);
+  memarea_drop_all(area);
+  return r;
+}
+
 /** Parse as many microdescriptors as are found from the string starting at
  * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
  * annotations we recognize and ignore ones we don't.
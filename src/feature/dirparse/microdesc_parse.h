@@ -16,5 +16,6 @@ smartlist_t *microdescs_parse_from_string(const char *s, const char *eos,
                                           int allow_annotations,
                                           saved_location_t where,
                                           smartlist_t *invalid_digests_out);
+int microdesc_parse_body(microdesc_t *md);
 
 #endif /* !defined(TOR_MICRODESC_PARSE_H) */
@@ -901,6 +901,9 @@ hibernate_begin(hibernate_state_t new_state, time_t now)
   hibernate_state = new_state;
   accounting_record_bandwidth_usage(now, get_or_state());
 
+  /* Idle OR connections get closed while we hibernate. */
+  connection_housekeeping_reschedule_all();
+
   or_state_mark_dirty(get_or_state(),
                       get_options()->AvoidDiskWrites ? now+600 : 0);
 }
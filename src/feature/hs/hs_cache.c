@@ -14,6 +14,7 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "lib/cc/torint.h"
+#include "lib/encoding/binascii.h"
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_client.h"
@@ -99,6 +100,96 @@ cache_dir_desc_free_void(void *ptr)
   cache_dir_desc_free_(ptr);
 }
 
+/** How the superencrypted section of an encoded descriptor starts, up to its
+ * base64 body, and how it ends. */
+#define SUPERENCRYPTED_BEGIN "\nsuperencrypted\n-----BEGIN MESSAGE-----\n"
+#define SUPERENCRYPTED_END "-----END MESSAGE-----"
+
+/** Return a newly allocated base64 encoding of the superencrypted blob of
+ * <b>plaintext_data</b>, formatted like in an encoded descriptor. Set
+ * <b>len_out</b> to its length. */
+static char *
+superencrypted_blob_to_base64(const hs_desc_plaintext_data_t *plaintext_data,
+                              size_t *len_out)
+{
+  size_t b64_size;
+  int b64_len;
+  char *b64;
+
+  b64_size = base64_encode_size(plaintext_data->superencrypted_blob_size,
+                                BASE64_ENCODE_MULTILINE) + 1;
+  b64 = tor_malloc_zero(b64_size);
+  b64_len = base64_encode(b64, b64_size,
+                          (const char *) plaintext_data->superencrypted_blob,
+                          plaintext_data->superencrypted_blob_size,
+                          BASE64_ENCODE_MULTILINE);
+  tor_assert(b64_len >= 0);
+  *len_out = b64_len;
+  return b64;
+}
+
+/** The superencrypted blob, which is most of a descriptor, is kept both in
+ * base64 in the encoded descriptor of <b>dir_desc</b> and in binary in its
+ * plaintext data. Cut the base64 copy out of the encoded descriptor, since we
+ * can rebuild it when the descriptor is fetched. Do nothing if the rebuilt
+ * text wouldn't be the exact same as what we got. */
+static void
+cache_dir_desc_elide_blob(hs_cache_dir_descriptor_t *dir_desc)
+{
+  const char *encoded = dir_desc->encoded_desc;
+  const char *body, *end;
+  char *b64 = NULL, *elided = NULL;
+  size_t b64_len;
+
+  body = strstr(encoded, SUPERENCRYPTED_BEGIN);
+  if (!body) {
+    goto end;
+  }
+  body += strlen(SUPERENCRYPTED_BEGIN);
+  end = strstr(body, SUPERENCRYPTED_END);
+  if (!end) {
+    goto end;
+  }
+
+  b64 = superencrypted_blob_to_base64(dir_desc->plaintext_data, &b64_len);
+  if (b64_len != (size_t) (end - body) || fast_memneq(b64, body, b64_len)) {
+    log_debug(LD_DIR, "Descriptor superencrypted section isn't in canonical "
+                      "form. Keeping it whole.");
+    goto end;
+  }
+
+  dir_desc->blob_offset = body - encoded;
+  tor_asprintf(&elided, "%.*s%s", (int) dir_desc->blob_offset, encoded, end);
+  tor_free(dir_desc->encoded_desc);
+  dir_desc->encoded_desc = elided;
+  dir_desc->blob_elided = 1;
+
+ end:
+  tor_free(b64);
+}
+
+/** Return a newly allocated copy of the encoded descriptor of <b>entry</b>,
+ * exactly as we received it. */
+STATIC char *
+cache_dir_desc_get_encoded(const hs_cache_dir_descriptor_t *entry)
+{
+  char *b64, *encoded;
+  size_t b64_len;
+
+  tor_assert(entry);
+
+  if (!entry->blob_elided) {
+    return tor_strdup(entry->encoded_desc);
+  }
+
+  b64 = superencrypted_blob_to_base64(entry->plaintext_data, &b64_len);
+  tor_asprintf(&encoded, "%.*s%s%s", (int) entry->blob_offset,
+               entry->encoded_desc, b64,
+               entry->encoded_desc + entry->blob_offset);
+  tor_free(b64);
+  return encoded;
+}
+
 /** Create a new directory cache descriptor object from a encoded descriptor.
  * On success, return the heap-allocated cache object, otherwise return NULL if
  * we can't decode the descriptor. */
@@ -119,6 +210,9 @@ cache_dir_desc_new(const char *desc)
     goto err;
   }
 
+  /* We only need one copy of the superencrypted blob. */
+  cache_dir_desc_elide_blob(dir_desc);
+
   /* The blinded pubkey is the indexed key. */
   dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
   dir_desc->created_ts = time(NULL);
@@ -130,7 +224,7 @@ cache_dir_desc_new(const char *desc)
 }
 
 /** Return the size of a cache entry in bytes. */
-static size_t
+STATIC size_t
 cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
 {
   return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
@@ -196,7 +290,7 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
  * encoded descriptor. If not found, 0 is returned and desc_out is untouched.
  * On error, a negative value is returned and desc_out is untouched. */
 static int
-cache_lookup_v3_as_dir(const char *query, const char **desc_out)
+cache_lookup_v3_as_dir(const char *query, char **desc_out)
 {
   int found = 0;
   ed25519_public_key_t blinded_key;
@@ -215,7 +309,7 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   if (entry != NULL) {
     found = 1;
     if (desc_out) {
-      *desc_out = entry->encoded_desc;
+      *desc_out = cache_dir_desc_get_encoded(entry);
     }
   }
 
@@ -383,7 +477,7 @@ hs_cache_store_as_dir(const char *desc)
  * untouched. */
 int
 hs_cache_lookup_as_dir(uint32_t version, const char *query,
-                       const char **desc_out)
+                       char **desc_out)
 {
   int found;
 
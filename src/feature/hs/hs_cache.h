@@ -67,8 +67,15 @@ typedef struct hs_cache_dir_descriptor_t {
    * encrypted part of the descriptor. */
   hs_desc_plaintext_data_t *plaintext_data;
   /** Encoded descriptor which is basically in text form. It's a NUL terminated
-   * string thus safe to strlen(). */
+   * string thus safe to strlen(). If blob_elided is set, the base64 body of
+   * the superencrypted section has been cut out of it: use
+   * cache_dir_desc_get_encoded() to get the whole descriptor. */
   char *encoded_desc;
+  /** Offset in encoded_desc where the base64 body of the superencrypted
+   * section goes back, if blob_elided is set. */
+  size_t blob_offset;
+  /** Is the superencrypted blob only kept in binary, in plaintext_data? */
+  unsigned int blob_elided : 1;
   /** How many times this descriptor has been downloaded. We use this as an
    * heuristic for the OOM cache cleaning. It is very large so we avoid an kind
    * of possible wrapping. */
@@ -96,7 +103,7 @@ unsigned int hs_cache_get_max_descriptor_size(void);
  * right function. */
 int hs_cache_store_as_dir(const char *desc);
 int hs_cache_lookup_as_dir(uint32_t version, const char *query,
-                           const char **desc_out);
+                           char **desc_out);
 void hs_cache_mark_dowloaded_as_dir(const hs_ident_dir_conn_t *ident);
 
 const hs_descriptor_t *
@@ -154,6 +161,9 @@ STATIC size_t cache_clean_v3_by_downloaded_as_dir(const uint64_t target,
                                            const size_t min_remove_bytes,
                                            uint64_t *next_lowest);
 STATIC hs_cache_dir_descriptor_t *lookup_v3_desc_as_dir(const uint8_t *key);
+STATIC char *cache_dir_desc_get_encoded(
+                                   const hs_cache_dir_descriptor_t *entry);
+STATIC size_t cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry);
 
 STATIC hs_cache_client_descriptor_t *
 lookup_v3_desc_as_client(const uint8_t *key);
@@ -145,46 +145,37 @@ decrypt_introduce2(const uint8_t *enc_key, const uint8_t *encrypted_section,
 
 /** Given a pointer to the decrypted data of the ENCRYPTED section of an
  * INTRODUCE2 cell of length decrypted_len, parse and validate the cell
- * content. Return a newly allocated cell structure or NULL on error. The
- * circuit and service object are only used for logging purposes. */
+ * content. Return a newly allocated cell structure or NULL on error. */
 static trn_cell_introduce_encrypted_t *
 parse_introduce2_encrypted(const uint8_t *decrypted_data,
-                           size_t decrypted_len, const origin_circuit_t *circ,
-                           const hs_service_t *service)
+                           size_t decrypted_len)
 {
   trn_cell_introduce_encrypted_t *enc_cell = NULL;
 
   tor_assert(decrypted_data);
-  tor_assert(circ);
-  tor_assert(service);
 
   if (trn_cell_introduce_encrypted_parse(&enc_cell, decrypted_data,
                                          decrypted_len) < 0) {
     log_info(LD_REND, "Unable to parse the decrypted ENCRYPTED section of "
-                      "the INTRODUCE2 cell on circuit %u for service %s",
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+                      "an INTRODUCE2 cell");
     goto err;
   }
 
   if (trn_cell_introduce_encrypted_get_onion_key_type(enc_cell) !=
       TRUNNEL_HS_INTRO_ONION_KEY_TYPE_NTOR) {
     log_info(LD_REND, "INTRODUCE2 onion key type is invalid. Got %u but "
-                      "expected %u on circuit %u for service %s",
+                      "expected %u",
              trn_cell_introduce_encrypted_get_onion_key_type(enc_cell),
-             TRUNNEL_HS_INTRO_ONION_KEY_TYPE_NTOR,
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             TRUNNEL_HS_INTRO_ONION_KEY_TYPE_NTOR);
     goto err;
   }
 
   if (trn_cell_introduce_encrypted_getlen_onion_key(enc_cell) !=
       CURVE25519_PUBKEY_LEN) {
     log_info(LD_REND, "INTRODUCE2 onion key length is invalid. Got %u but "
-                      "expected %d on circuit %u for service %s",
+                      "expected %d",
              (unsigned)trn_cell_introduce_encrypted_getlen_onion_key(enc_cell),
-             CURVE25519_PUBKEY_LEN, TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             CURVE25519_PUBKEY_LEN);
     goto err;
   }
   /* XXX: Validate NSPEC field as well. */
@@ -799,8 +790,7 @@ hs_cell_parse_intro_established(const uint8_t *payload, size_t payload_len)
  * structure is updated with the PoW effort. Return -1 on any kind of error
  * including if PoW couldn't be verified. */
 static int
-handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
-                                const hs_service_intro_point_t *ip,
+handle_introduce2_encrypted_cell_pow_extension(
                                 const trn_extension_field_t *field,
                                 hs_cell_introduce2_data_t *data)
 {
@@ -809,9 +799,8 @@ handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
   hs_pow_solution_t sol;
 
   tor_assert(field);
-  tor_assert(ip);
 
-  if (!service->state.pow_state) {
+  if (!data->pow_enabled) {
     log_info(LD_REND, "Unsolicited PoW solution in INTRODUCE2 request.");
     goto end;
   }
@@ -843,13 +832,19 @@ handle_introduce2_encrypted_cell_pow_extension(const hs_service_t *service,
          trn_cell_extension_pow_getconstarray_pow_solution(pow),
          HS_POW_EQX_SOL_LEN);
 
-  if (hs_pow_verify(&ip->blinded_id, service->state.pow_state, &sol)) {
+  /* The replay cache is checked once the whole cell is parsed, see
+   * hs_cell_parse_introduce2_finish(). */
+  if (hs_pow_verify_solution(&data->pow_blinded_id, data->pow_seed_current,
+                             data->pow_seed_previous, &sol,
+                             data->pow_compiled_hash)) {
     log_info(LD_REND, "PoW INTRODUCE2 request failed to verify.");
     goto end;
   }
 
   log_info(LD_REND, "PoW INTRODUCE2 request successfully verified.");
   data->rdv_data.pow_effort = sol.effort;
+  memcpy(&data->pow_solution, &sol, sizeof(sol));
+  data->has_pow_solution = 1;
 
   /* Successfully parsed and verified the PoW solution */
   ret = 0;
@@ -932,9 +927,7 @@ get_introduce2_keys_and_verify_mac(hs_cell_introduce2_data_t *data,
  * correctly, or return -1 if it is malformed (for example because it
  * includes a PoW that doesn't verify). */
 static int
-parse_introduce_cell_extension(const hs_service_t *service,
-                               const hs_service_intro_point_t *ip,
-                               hs_cell_introduce2_data_t *data,
+parse_introduce_cell_extension(hs_cell_introduce2_data_t *data,
                                const trn_extension_field_t *field)
 {
   int ret = 0;
@@ -952,8 +945,7 @@ parse_introduce_cell_extension(const hs_service_t *service,
     break;
   case TRUNNEL_EXT_TYPE_POW:
     /* PoW request. If successful, the effort is put in the data. */
-    if (handle_introduce2_encrypted_cell_pow_extension(service, ip,
-                                                       field, data) < 0) {
+    if (handle_introduce2_encrypted_cell_pow_extension(field, data) < 0) {
       log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid PoW cell extension.");
       ret = -1;
     }
@@ -966,24 +958,25 @@ parse_introduce_cell_extension(const hs_service_t *service,
   return ret;
 }
 
-/** Parse the INTRODUCE2 cell using data which contains everything we need to
- * do so and contains the destination buffers of information we extract and
- * compute from the cell. Return 0 on success else a negative value. The
- * service and circ are only used for logging purposes. */
+/** First stage of the parsing of an INTRODUCE2 cell, using data which
+ * contains everything we need to do so: decode the cell, and check the
+ * ENCRYPTED section against the replay cache of the introduction point. On
+ * success, set the ENCRYPTED section length in data.
+ *
+ * This stage and hs_cell_parse_introduce2_finish() run on the main thread.
+ * hs_cell_parse_introduce2_decrypt(), which does the costly part, can run
+ * in between on a cpuworker thread. Return 0 on success else a negative
+ * value. The service and circ are only used for logging purposes. */
 ssize_t
-hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
-                         const origin_circuit_t *circ,
-                         const hs_service_t *service,
-                         const hs_service_intro_point_t *ip)
+hs_cell_parse_introduce2_prepare(hs_cell_introduce2_data_t *data,
+                                 const origin_circuit_t *circ,
+                                 const hs_service_t *service)
 {
   int ret = -1;
   time_t elapsed;
-  uint8_t *decrypted = NULL;
   size_t encrypted_section_len;
   const uint8_t *encrypted_section;
   trn_cell_introduce1_t *cell = NULL;
-  trn_cell_introduce_encrypted_t *enc_cell = NULL;
-  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
 
   tor_assert(data);
   tor_assert(circ);
@@ -1021,6 +1014,47 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
     goto done;
   }
 
+  /* The ENCRYPTED section is the end of the cell. */
+  if (BUG(encrypted_section_len > data->payload_len)) {
+    goto done;
+  }
+  data->encrypted_section_len = encrypted_section_len;
+
+  /* Success. */
+  ret = 0;
+
+ done:
+  trn_cell_introduce1_free(cell);
+  return ret;
+}
+
+/** Second stage of the parsing of an INTRODUCE2 cell, once
+ * hs_cell_parse_introduce2_prepare() accepted it: compute the ntor keys,
+ * verify the MAC, decrypt the ENCRYPTED section, extract what we need to
+ * rendezvous and verify the PoW solution, if any.
+ *
+ * This only uses data, and none of the global state, so that it can run on
+ * a cpuworker thread. Return 0 on success else a negative value. */
+ssize_t
+hs_cell_parse_introduce2_decrypt(hs_cell_introduce2_data_t *data)
+{
+  int ret = -1;
+  uint8_t *decrypted = NULL;
+  size_t encrypted_section_len;
+  const uint8_t *encrypted_section;
+  trn_cell_introduce_encrypted_t *enc_cell = NULL;
+  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
+
+  tor_assert(data);
+
+  encrypted_section_len = data->encrypted_section_len;
+  if (BUG(encrypted_section_len < (CURVE25519_PUBKEY_LEN + DIGEST256_LEN) ||
+          encrypted_section_len > data->payload_len)) {
+    goto done;
+  }
+  encrypted_section =
+    data->payload + data->payload_len - encrypted_section_len;
+
   /* First bytes of the ENCRYPTED section are the client public key (they are
    * guaranteed to exist because of the length check above). We are gonna use
    * the client public key to compute the ntor keys and decrypt the payload:
@@ -1032,9 +1066,7 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   intro_keys = get_introduce2_keys_and_verify_mac(data, encrypted_section,
                                                   encrypted_section_len);
   if (!intro_keys) {
-    log_warn(LD_REND, "Could not get valid INTRO2 keys on circuit %u "
-             "for service %s", TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+    log_warn(LD_REND, "Could not get valid INTRO2 keys");
     goto done;
   }
 
@@ -1054,16 +1086,13 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                    encrypted_data, encrypted_data_len);
     if (decrypted == NULL) {
       log_info(LD_REND, "Unable to decrypt the ENCRYPTED section of an "
-                        "INTRODUCE2 cell on circuit %u for service %s",
-               TO_CIRCUIT(circ)->n_circ_id,
-               safe_str_client(service->onion_address));
+                        "INTRODUCE2 cell");
       goto done;
     }
 
     /* Parse this blob into an encrypted cell structure so we can then extract
      * the data we need out of it. */
-    enc_cell = parse_introduce2_encrypted(decrypted, encrypted_data_len,
-                                          circ, service);
+    enc_cell = parse_introduce2_encrypted(decrypted, encrypted_data_len);
     memwipe(decrypted, 0, encrypted_data_len);
     if (enc_cell == NULL) {
       goto done;
@@ -1107,22 +1136,14 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
         /* The number of extensions should match the number of fields. */
         break;
       }
-      if (parse_introduce_cell_extension(service, ip, data, field) < 0) {
+      if (parse_introduce_cell_extension(data, field) < 0) {
         goto done;
       }
     }
   }
 
-  /* If the client asked for congestion control, but we don't support it,
-   * that's a failure. It should not have asked, based on our descriptor. */
-  if (data->rdv_data.cc_enabled && !congestion_control_enabled()) {
-    goto done;
-  }
-
   /* Success. */
   ret = 0;
-  log_info(LD_REND,
-           "Valid INTRODUCE2 cell. Willing to launch rendezvous circuit.");
 
  done:
   if (intro_keys) {
@@ -1131,10 +1152,53 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   }
   tor_free(decrypted);
   trn_cell_introduce_encrypted_free(enc_cell);
-  trn_cell_introduce1_free(cell);
   return ret;
 }
 
+/** Last stage of the parsing of an INTRODUCE2 cell, once
+ * hs_cell_parse_introduce2_decrypt() accepted it: the checks that need the
+ * global state. Return 0 on success else a negative value. */
+ssize_t
+hs_cell_parse_introduce2_finish(hs_cell_introduce2_data_t *data)
+{
+  tor_assert(data);
+
+  /* If the client asked for congestion control, but we don't support it,
+   * that's a failure. It should not have asked, based on our descriptor. */
+  if (data->rdv_data.cc_enabled && !congestion_control_enabled()) {
+    return -1;
+  }
+
+  /* Fail if the PoW nonce was already used. */
+  if (data->has_pow_solution &&
+      hs_pow_nonce_cache_add_test(&data->pow_solution) < 0) {
+    log_info(LD_REND, "PoW INTRODUCE2 request failed to verify.");
+    return -1;
+  }
+
+  log_info(LD_REND,
+           "Valid INTRODUCE2 cell. Willing to launch rendezvous circuit.");
+  return 0;
+}
+
+/** Parse the INTRODUCE2 cell using data which contains everything we need to
+ * do so and contains the destination buffers of information we extract and
+ * compute from the cell, running all the parsing stages at once. Return 0 on
+ * success else a negative value. The service and circ are only used for
+ * logging purposes. */
+ssize_t
+hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
+                         const origin_circuit_t *circ,
+                         const hs_service_t *service)
+{
+  if (hs_cell_parse_introduce2_prepare(data, circ, service) < 0 ||
+      hs_cell_parse_introduce2_decrypt(data) < 0 ||
+      hs_cell_parse_introduce2_finish(data) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
 /** Build a RENDEZVOUS1 cell with the given rendezvous cookie and handshake
  * info. The encoded cell is put in cell_out and the length of the data is
  * returned. This can't fail. */
@@ -91,9 +91,27 @@ typedef struct hs_cell_introduce2_data_t {
   const uint8_t *payload;
   /** Size of the payload of the received encoded cell. */
   size_t payload_len;
+  /** True iff the service has PoW defenses enabled. The PoW parameters below
+   * are copies of its state, so that the cell can be parsed away from the
+   * main thread. */
+  unsigned int pow_enabled : 1;
+  /** Blinded public key of the introduction point's descriptor. */
+  ed25519_public_key_t pow_blinded_id;
+  /** Current and previous PoW seeds of the service. */
+  uint8_t pow_seed_current[HS_POW_SEED_LEN];
+  uint8_t pow_seed_previous[HS_POW_SEED_LEN];
+  /** Value of the CompiledProofOfWorkHash option. */
+  int pow_compiled_hash;
 
   /*** Mutable Section: Set upon parsing INTRODUCE2 cell. ***/
 
+  /** Length of the ENCRYPTED section, which ends the payload. */
+  size_t encrypted_section_len;
+  /** True iff the cell carries a PoW solution which we verified. */
+  unsigned int has_pow_solution : 1;
+  /** That solution. */
+  hs_pow_solution_t pow_solution;
+
   /** Data needed to launch a rendezvous circuit. */
   hs_cell_intro_rdv_data_t rdv_data;
   /** Replay cache of the introduction point. */
@@ -122,8 +140,12 @@ ssize_t hs_cell_parse_intro_established(const uint8_t *payload,
                                         size_t payload_len);
 ssize_t hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                  const origin_circuit_t *circ,
-                                 const hs_service_t *service,
-                                 const hs_service_intro_point_t *ip);
+                                 const hs_service_t *service);
+ssize_t hs_cell_parse_introduce2_prepare(hs_cell_introduce2_data_t *data,
+                                         const origin_circuit_t *circ,
+                                         const hs_service_t *service);
+ssize_t hs_cell_parse_introduce2_decrypt(hs_cell_introduce2_data_t *data);
+ssize_t hs_cell_parse_introduce2_finish(hs_cell_introduce2_data_t *data);
 int hs_cell_parse_introduce_ack(const uint8_t *payload, size_t payload_len);
 int hs_cell_parse_rendezvous2(const uint8_t *payload, size_t payload_len,
                               uint8_t *handshake_info,
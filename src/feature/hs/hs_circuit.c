@@ -19,6 +19,7 @@
 #include "core/or/extendinfo.h"
 #include "core/or/congestion_control_common.h"
 #include "core/crypto/onion_crypto.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/client/circpathbias.h"
 #include "feature/hs/hs_cell.h"
 #include "feature/hs/hs_circuit.h"
@@ -35,6 +36,7 @@
 #include "lib/crypt_ops/crypto_dh.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/time/compat_time.h"
 
 /* Trunnel. */
@@ -1299,10 +1301,305 @@ get_subcredential_for_handling_intro2_cell(const hs_service_t *service,
   return 0;
 }
 
+/** Fill in the PoW parameters of data from the state of the given service
+ * and intro point, so that the cell can be parsed without them. */
+static void
+set_introduce2_pow_params(const hs_service_t *service,
+                          const hs_service_intro_point_t *ip,
+                          hs_cell_introduce2_data_t *data)
+{
+  const hs_pow_service_state_t *pow_state = service->state.pow_state;
+
+  if (!pow_state) {
+    return;
+  }
+  data->pow_enabled = 1;
+  ed25519_pubkey_copy(&data->pow_blinded_id, &ip->blinded_id);
+  memcpy(data->pow_seed_current, pow_state->seed_current,
+         sizeof(data->pow_seed_current));
+  memcpy(data->pow_seed_previous, pow_state->seed_previous,
+         sizeof(data->pow_seed_previous));
+  data->pow_compiled_hash = get_options()->CompiledProofOfWorkHash;
+}
+
+/** Act on the INTRODUCE2 cell that we fully parsed into data, which the
+ * given intro point of the service received at received_ts: check its
+ * rendezvous cookie against our replay cache, then queue the rendezvous
+ * request or launch the rendezvous circuit. Return 0 on success else a
+ * negative value. */
+static int
+handle_introduce2_request(const hs_service_t *service,
+                          hs_service_intro_point_t *ip,
+                          hs_cell_introduce2_data_t *data,
+                          time_t received_ts)
+{
+  time_t elapsed;
+
+  /* Check whether we've seen this REND_COOKIE before to detect repeats. */
+  if (replaycache_add_test_and_elapsed(
+           service->state.replay_cache_rend_cookie,
+           data->rdv_data.rendezvous_cookie,
+           sizeof(data->rdv_data.rendezvous_cookie),
+           &elapsed)) {
+    /* A Tor client will send a new INTRODUCE1 cell with the same REND_COOKIE
+     * as its previous one if its intro circ times out while in state
+     * CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT. If we received the first
+     * INTRODUCE1 cell (the intro-point relay converts it into an INTRODUCE2
+     * cell), we are already trying to connect to that rend point (and may
+     * have already succeeded); drop this cell. */
+    log_info(LD_REND, "We received an INTRODUCE2 cell with same REND_COOKIE "
+                      "field %ld seconds ago. Dropping cell.",
+             (long int) elapsed);
+    hs_metrics_reject_intro_req(service,
+                                HS_METRICS_ERR_INTRO_REQ_INTRODUCE2_REPLAY);
+    return -1;
+  }
+
+  /* At this point, we just confirmed that the full INTRODUCE2 cell is valid
+   * so increment our counter that we've seen one on this intro point. */
+  ip->introduce2_count++;
+  if (ip->introduce2_count >= ip->introduce2_max) {
+    /* The service must now replace this intro point. */
+    hs_service_schedule_now(&service->keys.identity_pk);
+  }
+
+  /* Add the rendezvous request to the priority queue if PoW defenses are
+   * enabled, otherwise rendezvous as usual. */
+  if (have_module_pow() && service->config.has_pow_defenses_enabled) {
+    log_info(LD_REND,
+             "Adding introduction request to pqueue with effort: %u",
+             data->rdv_data.pow_effort);
+    if (enqueue_rend_request(service, ip, data, received_ts) < 0) {
+      return -1;
+    }
+
+    /* Track the total effort in valid requests received this period */
+    service->state.pow_state->total_effort += data->rdv_data.pow_effort;
+  } else {
+    /* Launch rendezvous circuit with the onion key and rend cookie. */
+    launch_rendezvous_point_circuit(service, &ip->auth_key_kp.pubkey,
+                                    &ip->enc_key_kp, &data->rdv_data,
+                                    time(NULL));
+  }
+
+  /* Update metrics that a new introduction was successful. */
+  hs_metrics_new_introduction(service);
+  return 0;
+}
+
+/** An INTRODUCE2 cell that a cpuworker decrypts and parses. The job holds
+ * copies of everything that hs_cell_parse_introduce2_decrypt() reads, since
+ * the service and its intro point might go away in the meantime. */
+typedef struct intro2_job_t {
+  /** Identity key of the service and auth key of the intro point that
+   * received the cell, to look them up again once the job is done. */
+  ed25519_public_key_t service_pk;
+  ed25519_public_key_t ip_auth_pk;
+  /** Encryption keypair of the intro point. */
+  curve25519_keypair_t ip_enc_kp;
+  /** Subcredentials to try on the cell. */
+  hs_subcredential_t *subcredentials;
+  /** The cell payload. */
+  uint8_t *payload;
+  /** The parsing data, which points into the fields above. */
+  hs_cell_introduce2_data_t data;
+  /** When we received the cell. */
+  time_t received_ts;
+  /** Set by the cpuworker: result of the parsing. */
+  int status;
+  /** True iff the cpuworker is done with this job. */
+  bool done;
+} intro2_job_t;
+
+/** INTRODUCE2 jobs that we handed to the cpuworkers, in the order we got
+ * their cells. Jobs can complete in any order, but we act on them in this
+ * one so that the replay caches and the rendezvous queue see the requests
+ * in the order they arrived. */
+static smartlist_t *intro2_jobs = NULL;
+
+/** Release all memory of the given INTRODUCE2 job. */
+static void
+intro2_job_free(intro2_job_t *job)
+{
+  if (!job) {
+    return;
+  }
+  link_specifier_smartlist_free(job->data.rdv_data.link_specifiers);
+  if (job->subcredentials) {
+    memwipe(job->subcredentials, 0,
+            sizeof(hs_subcredential_t) * job->data.n_subcredentials);
+    tor_free(job->subcredentials);
+  }
+  tor_free(job->payload);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Act on the parsed INTRODUCE2 cell of a completed job, if its service and
+ * intro point are still around. */
+static void
+intro2_job_deliver(intro2_job_t *job)
+{
+  hs_service_t *service = hs_service_find(&job->service_pk);
+  hs_service_intro_point_t *ip = NULL;
+
+  if (service) {
+    ip = hs_service_find_intro_point(service, &job->ip_auth_pk);
+  }
+  if (!service || !ip) {
+    log_info(LD_REND, "Service or intro point went away while we were "
+                      "parsing its INTRODUCE2 cell. Dropping cell.");
+    return;
+  }
+
+  if (job->status < 0 || hs_cell_parse_introduce2_finish(&job->data) < 0) {
+    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
+    return;
+  }
+  handle_introduce2_request(service, ip, &job->data, job->received_ts);
+}
+
+/** Worker function: decrypt and parse the INTRODUCE2 cell of a job. */
+static workqueue_reply_t
+intro2_worker_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  intro2_job_t *job = work_;
+
+  job->status = (int) hs_cell_parse_introduce2_decrypt(&job->data);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function, on the main thread: act on every completed job at the
+ * head of the queue. */
+static void
+intro2_worker_replyfn(void *work_)
+{
+  intro2_job_t *job = work_;
+
+  job->done = true;
+  if (!intro2_jobs) {
+    /* We are shutting down. */
+    intro2_job_free(job);
+    return;
+  }
+  while (smartlist_len(intro2_jobs) > 0) {
+    intro2_job_t *head = smartlist_get(intro2_jobs, 0);
+    if (!head->done) {
+      break;
+    }
+    smartlist_del_keeporder(intro2_jobs, 0);
+    intro2_job_deliver(head);
+    intro2_job_free(head);
+  }
+}
+
+/** Return a new INTRODUCE2 job for the cell in data, which went through
+ * hs_cell_parse_introduce2_prepare(), received by the intro point ip of
+ * service at now. The job takes ownership of the link specifiers of data. */
+static intro2_job_t *
+intro2_job_new(const hs_service_t *service,
+               const hs_service_intro_point_t *ip,
+               hs_cell_introduce2_data_t *data, time_t now)
+{
+  intro2_job_t *job = tor_malloc_zero(sizeof(*job));
+
+  ed25519_pubkey_copy(&job->service_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&job->ip_auth_pk, &ip->auth_key_kp.pubkey);
+  memcpy(&job->ip_enc_kp, &ip->enc_key_kp, sizeof(job->ip_enc_kp));
+  job->subcredentials =
+    tor_memdup(data->subcredentials,
+               sizeof(hs_subcredential_t) * data->n_subcredentials);
+  job->payload = tor_memdup(data->payload, data->payload_len);
+  job->received_ts = now;
+
+  memcpy(&job->data, data, sizeof(job->data));
+  job->data.auth_pk = &job->ip_auth_pk;
+  job->data.enc_kp = &job->ip_enc_kp;
+  job->data.subcredentials = job->subcredentials;
+  job->data.payload = job->payload;
+  /* Only the main thread uses the replay cache. */
+  job->data.replay_cache = NULL;
+  data->rdv_data.link_specifiers = NULL;
+
+  return job;
+}
+
+/** Hand over the decryption and parsing of the INTRODUCE2 cell in data,
+ * which went through hs_cell_parse_introduce2_prepare(), to a cpuworker.
+ * On success, the job takes ownership of the link specifiers of data.
+ *
+ * Return 0 if the cell is now in the hands of a cpuworker. Return -1 if the
+ * caller must parse it itself: we have no cpuworkers, or they are already
+ * busy enough. */
+static int
+queue_introduce2_job(const hs_service_t *service,
+                     const hs_service_intro_point_t *ip,
+                     hs_cell_introduce2_data_t *data, time_t now)
+{
+  intro2_job_t *job;
+  unsigned int n_threads = cpuworker_get_n_threads();
+
+  if (n_threads == 0) {
+    return -1;
+  }
+  if (!intro2_jobs) {
+    intro2_jobs = smartlist_new();
+  }
+  if (smartlist_len(intro2_jobs) >=
+      (int) (n_threads * MAX_INTRO2_JOBS_PER_THREAD)) {
+    return -1;
+  }
+
+  job = intro2_job_new(service, ip, data, now);
+  if (!cpuworker_queue_work(WQ_PRI_LOW, intro2_worker_threadfn,
+                            intro2_worker_replyfn, job)) {
+    /* The link specifiers still belong to data. */
+    data->rdv_data.link_specifiers = job->data.rdv_data.link_specifiers;
+    job->data.rdv_data.link_specifiers = NULL;
+    intro2_job_free(job);
+    return -1;
+  }
+  smartlist_add(intro2_jobs, job);
+  return 0;
+}
+
+/** Parse the INTRODUCE2 cell in data, which went through
+ * hs_cell_parse_introduce2_prepare(), on the main thread, but act on it
+ * only once the cpuworkers are done with the cells that arrived before it.
+ * The job takes ownership of the link specifiers of data.
+ *
+ * Return 0 if the cell now waits for its turn. Return -1 if the cpuworkers
+ * hold no earlier cell, in which case the caller can act on it right away. */
+static int
+append_parsed_introduce2_job(const hs_service_t *service,
+                             const hs_service_intro_point_t *ip,
+                             hs_cell_introduce2_data_t *data, time_t now)
+{
+  intro2_job_t *job;
+
+  if (!intro2_jobs || smartlist_len(intro2_jobs) == 0) {
+    return -1;
+  }
+
+  job = intro2_job_new(service, ip, data, now);
+  job->status = (int) hs_cell_parse_introduce2_decrypt(&job->data);
+  /* The head of the queue is still with a cpuworker, whose reply delivers
+   * this one in turn. */
+  job->done = true;
+  smartlist_add(intro2_jobs, job);
+  return 0;
+}
+
 /** We just received an INTRODUCE2 cell on the established introduction circuit
  * circ.  Handle the INTRODUCE2 payload of size payload_len for the given
  * circuit and service. This cell is associated with the intro point object ip
- * and the subcredential. Return 0 on success else a negative value. */
+ * and the subcredential.
+ *
+ * The costly part of the parsing happens on a cpuworker when we have some,
+ * in which case the outcome of the request is only known later. So is it for
+ * a cell that must wait for earlier ones that cpuworkers still hold. Return
+ * 0 on success or if the outcome is known later, else a negative value. */
 int
 hs_circ_handle_introduce2(const hs_service_t *service,
                           const origin_circuit_t *circ,
@@ -1311,7 +1608,6 @@ hs_circ_handle_introduce2(const hs_service_t *service,
                           const uint8_t *payload, size_t payload_len)
 {
   int ret = -1;
-  time_t elapsed;
   hs_cell_introduce2_data_t data;
   time_t now = time(NULL);
 
@@ -1323,6 +1619,7 @@ hs_circ_handle_introduce2(const hs_service_t *service,
 
   /* Populate the data structure with everything we need for the cell to be
    * parsed, decrypted and key material computed correctly. */
+  memset(&data, 0, sizeof(data));
   data.auth_pk = &ip->auth_key_kp.pubkey;
   data.enc_kp = &ip->enc_key_kp;
   data.payload = payload;
@@ -1331,6 +1628,7 @@ hs_circ_handle_introduce2(const hs_service_t *service,
   data.rdv_data.link_specifiers = smartlist_new();
   data.rdv_data.cc_enabled = 0;
   data.rdv_data.pow_effort = 0;
+  set_introduce2_pow_params(service, ip, &data);
 
   if (get_subcredential_for_handling_intro2_cell(service, &data,
                                                  subcredential)) {
@@ -1339,61 +1637,28 @@ hs_circ_handle_introduce2(const hs_service_t *service,
     goto done;
   }
 
-  if (hs_cell_parse_introduce2(&data, circ, service, ip) < 0) {
+  if (hs_cell_parse_introduce2_prepare(&data, circ, service) < 0) {
     hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
     goto done;
   }
 
-  /* Check whether we've seen this REND_COOKIE before to detect repeats. */
-  if (replaycache_add_test_and_elapsed(
-           service->state.replay_cache_rend_cookie,
-           data.rdv_data.rendezvous_cookie,
-           sizeof(data.rdv_data.rendezvous_cookie),
-           &elapsed)) {
-    /* A Tor client will send a new INTRODUCE1 cell with the same REND_COOKIE
-     * as its previous one if its intro circ times out while in state
-     * CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT. If we received the first
-     * INTRODUCE1 cell (the intro-point relay converts it into an INTRODUCE2
-     * cell), we are already trying to connect to that rend point (and may
-     * have already succeeded); drop this cell. */
-    log_info(LD_REND, "We received an INTRODUCE2 cell with same REND_COOKIE "
-                      "field %ld seconds ago. Dropping cell.",
-             (long int) elapsed);
-    hs_metrics_reject_intro_req(service,
-                                HS_METRICS_ERR_INTRO_REQ_INTRODUCE2_REPLAY);
+  if (queue_introduce2_job(service, ip, &data, now) == 0 ||
+      append_parsed_introduce2_job(service, ip, &data, now) == 0) {
+    ret = 0;
     goto done;
   }
 
-  /* At this point, we just confirmed that the full INTRODUCE2 cell is valid
-   * so increment our counter that we've seen one on this intro point. */
-  ip->introduce2_count++;
-
-  /* Add the rendezvous request to the priority queue if PoW defenses are
-   * enabled, otherwise rendezvous as usual. */
-  if (have_module_pow() && service->config.has_pow_defenses_enabled) {
-    log_info(LD_REND,
-             "Adding introduction request to pqueue with effort: %u",
-             data.rdv_data.pow_effort);
-    if (enqueue_rend_request(service, ip, &data, now) < 0) {
-      goto done;
-    }
-
-    /* Track the total effort in valid requests received this period */
-    service->state.pow_state->total_effort += data.rdv_data.pow_effort;
-
-    /* Successfully added rend circuit to priority queue. */
-    ret = 0;
+  if (hs_cell_parse_introduce2_decrypt(&data) < 0 ||
+      hs_cell_parse_introduce2_finish(&data) < 0) {
+    hs_metrics_reject_intro_req(service, HS_METRICS_ERR_INTRO_REQ_INTRODUCE2);
     goto done;
   }
 
-  /* Launch rendezvous circuit with the onion key and rend cookie. */
-  launch_rendezvous_point_circuit(service, &ip->auth_key_kp.pubkey,
-                                  &ip->enc_key_kp, &data.rdv_data, now);
-  /* Success. */
-  ret = 0;
+  ret = handle_introduce2_request(service, ip, &data, now);
 
  done:
-  /* Note that if PoW defenses are enabled, this is NULL. */
+  /* Note that if PoW defenses are enabled, or if a cpuworker took the cell,
+   * this is NULL. */
   link_specifier_smartlist_free(data.rdv_data.link_specifiers);
   memwipe(&data, 0, sizeof(data));
   return ret;
@@ -1650,6 +1915,19 @@ hs_circ_cleanup_on_free(circuit_t *circ)
   }
 }
 
+/** Release the INTRODUCE2 jobs that the cpuworkers are done with. The ones
+ * that a cpuworker still holds are freed when it replies. */
+void
+hs_circ_free_all(void)
+{
+  if (!intro2_jobs) {
+    return;
+  }
+  SMARTLIST_FOREACH(intro2_jobs, intro2_job_t *, job,
+                    if (job->done) intro2_job_free(job));
+  smartlist_free(intro2_jobs);
+}
+
 /** We are about to repurpose this <b>circ</b>. Clean it up from any related
  * HS data structures. This function can be called multiple times safely for
  * the same circuit. */
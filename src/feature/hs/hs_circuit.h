@@ -91,12 +91,19 @@ int hs_circuit_setup_e2e_rend_circ_legacy_client(origin_circuit_t *circ,
 
 bool hs_circ_is_rend_sent_in_intro1(const origin_circuit_t *circ);
 
+void hs_circ_free_all(void);
+
 void hs_circ_setup_congestion_control(origin_circuit_t *origin_circ,
                                       uint8_t sendme_inc,
                                       bool is_single_onion);
 
 #ifdef HS_CIRCUIT_PRIVATE
 
+/** Maximum number of INTRODUCE2 cells, per cpuworker thread, that can be in
+ * the hands of the cpuworkers at once. Past that, we parse the cells on the
+ * main thread, but still act on them in the order they arrived. */
+#define MAX_INTRO2_JOBS_PER_THREAD 64
+
 struct hs_ntor_rend_cell_keys_t;
 
 STATIC hs_ident_circuit_t *
@@ -37,10 +37,13 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerset.h"
+#include "lib/cc/ctassert.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/token_bucket.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/cpath_build_state_st.h"
 #include "feature/dircommon/dir_connection_st.h"
@@ -60,6 +63,52 @@ static struct mainloop_event_t *dir_info_changed_ev = NULL;
  * public key to hs_client_service_authorization_t *. */
 static digest256map_t *client_auths = NULL;
 
+/** Descriptor fetches in progress; map of service identity public key to
+ * hs_client_desc_fetch_t *. */
+static digest256map_t *desc_fetches = NULL;
+
+static hs_client_fetch_status_t
+directory_launch_v3_desc_fetch(const ed25519_public_key_t *onion_identity_pk,
+                               const routerstatus_t *hsdir);
+
+/** Rate limit on the requests that we launch in parallel to a pending one,
+ * across all services: a burst of ... */
+#define DESC_FETCH_HEDGE_BURST 10
+/** ... refilled at this many requests per second. */
+#define DESC_FETCH_HEDGE_RATE 1
+static token_bucket_ctr_t desc_fetch_hedge_bucket;
+static bool desc_fetch_hedge_bucket_initialized = false;
+
+/** Default delay, in msec, before we launch another request in parallel to
+ * a pending descriptor fetch. Controlled by "hs_desc_fetch_hedge_ms". */
+#define DESC_FETCH_HEDGE_MS_DFLT 500
+#define DESC_FETCH_HEDGE_MS_MIN 0
+#define DESC_FETCH_HEDGE_MS_MAX (60*1000)
+
+/** A fetch that is older than this, in msec, when we launch a new request
+ * for it is a new fetch: the previous one was left behind. */
+#define DESC_FETCH_MAX_AGE_MSEC (120*1000)
+
+/** Upper bounds, in msec, of the time-to-descriptor histogram buckets. */
+const int64_t hs_client_desc_fetch_time_buckets[] = {
+  250, 500, 1000, 2000, 5000, 10000, 30000, 60000, 120000,
+};
+CTASSERT(ARRAY_LENGTH(hs_client_desc_fetch_time_buckets) ==
+         HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS);
+/** Stats: how long it took from the first request of a fetch until a usable
+ * descriptor arrived, per time bucket. The last element is for the fetches
+ * that took longer than the highest bucket. */
+uint64_t hs_client_stats_desc_fetch_time_counts[
+                                    HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS + 1];
+/** Stats: total time, in msec, of the fetches counted above. */
+uint64_t hs_client_stats_desc_fetch_time_msec;
+/** Stats: how many descriptor requests we launched ... */
+uint64_t hs_client_stats_desc_fetch_launched;
+/** ... of which we launched in parallel to a pending one ... */
+uint64_t hs_client_stats_desc_fetch_hedged;
+/** ... and how many we cancelled because another one won. */
+uint64_t hs_client_stats_desc_fetch_cancelled;
+
 /** Mainloop callback. Scheduled to run when we are notified of a directory
  * info change. See hs_client_dir_info_changed(). */
 static void
@@ -236,12 +285,11 @@ purge_hid_serv_request(const ed25519_public_key_t *identity_pk)
   hs_purge_hid_serv_from_last_hid_serv_requests(base64_blinded_pk);
 }
 
-/** Return true iff there is at least one pending directory descriptor request
- * for the service identity_pk. */
-static int
-directory_request_is_pending(const ed25519_public_key_t *identity_pk)
+/** Return a newly allocated list of the pending directory descriptor
+ * requests for the service identity_pk. */
+static smartlist_t *
+find_pending_directory_requests(const ed25519_public_key_t *identity_pk)
 {
-  int ret = 0;
   smartlist_t *conns =
     connection_list_by_type_purpose(CONN_TYPE_DIR, DIR_PURPOSE_FETCH_HSDESC);
 
@@ -250,18 +298,256 @@ directory_request_is_pending(const ed25519_public_key_t *identity_pk)
     if (BUG(ident == NULL)) {
       /* A directory connection fetching a service descriptor can't have an
        * empty hidden service identifier. */
+      SMARTLIST_DEL_CURRENT(conns, conn);
       continue;
     }
     if (!ed25519_pubkey_eq(identity_pk, &ident->identity_pk)) {
-      continue;
+      SMARTLIST_DEL_CURRENT(conns, conn);
     }
-    ret = 1;
-    break;
   } SMARTLIST_FOREACH_END(conn);
 
+  return conns;
+}
+
+/** Return the number of pending directory descriptor requests for the
+ * service identity_pk. */
+static int
+count_pending_directory_requests(const ed25519_public_key_t *identity_pk)
+{
+  smartlist_t *conns = find_pending_directory_requests(identity_pk);
+  int n = smartlist_len(conns);
+
   /* No ownership of the objects in this list. */
   smartlist_free(conns);
-  return ret;
+  return n;
+}
+
+/** Return true iff there is at least one pending directory descriptor request
+ * for the service identity_pk. */
+static int
+directory_request_is_pending(const ed25519_public_key_t *identity_pk)
+{
+  return count_pending_directory_requests(identity_pk) > 0;
+}
+
+/** Return the number of HSDirs that we may fetch a descriptor from at the
+ * same time. */
+static int
+get_desc_fetch_parallelism(void)
+{
+  return get_options()->HSDescFetchParallelism;
+}
+
+/** Free a descriptor fetch object, and cancel its event. */
+static void
+desc_fetch_free_(hs_client_desc_fetch_t *fetch)
+{
+  if (!fetch) {
+    return;
+  }
+  mainloop_event_free(fetch->hedge_ev);
+  tor_free(fetch);
+}
+#define desc_fetch_free(f) \
+  FREE_AND_NULL(hs_client_desc_fetch_t, desc_fetch_free_, (f))
+
+/** Helper for digest256map_free(). */
+static void
+desc_fetch_free_void(void *fetch)
+{
+  desc_fetch_free_(fetch);
+}
+
+/** Return the descriptor fetch in progress for the service identity_pk, or
+ * NULL if there is none. */
+STATIC hs_client_desc_fetch_t *
+desc_fetch_lookup(const ed25519_public_key_t *identity_pk)
+{
+  if (!desc_fetches) {
+    return NULL;
+  }
+  return digest256map_get(desc_fetches, identity_pk->pubkey);
+}
+
+/** Forget the descriptor fetch in progress for the service identity_pk, if
+ * any. */
+static void
+desc_fetch_remove(const ed25519_public_key_t *identity_pk)
+{
+  hs_client_desc_fetch_t *fetch;
+
+  if (!desc_fetches) {
+    return;
+  }
+  fetch = digest256map_remove(desc_fetches, identity_pk->pubkey);
+  desc_fetch_free(fetch);
+}
+
+/** Forget all descriptor fetches in progress. */
+static void
+desc_fetch_remove_all(void)
+{
+  digest256map_free(desc_fetches, desc_fetch_free_void);
+}
+
+/** Return true iff the hedging rate limit lets us launch another request in
+ * parallel to a pending one, and if so, count it. */
+static bool
+desc_fetch_hedge_allowed(void)
+{
+  uint32_t now = (uint32_t) approx_time();
+
+  if (!desc_fetch_hedge_bucket_initialized) {
+    token_bucket_ctr_init(&desc_fetch_hedge_bucket, DESC_FETCH_HEDGE_RATE,
+                          DESC_FETCH_HEDGE_BURST, now);
+    desc_fetch_hedge_bucket_initialized = true;
+  }
+  token_bucket_ctr_refill(&desc_fetch_hedge_bucket, now);
+  if (token_bucket_ctr_get(&desc_fetch_hedge_bucket) == 0) {
+    return false;
+  }
+  token_bucket_ctr_dec(&desc_fetch_hedge_bucket, 1);
+  return true;
+}
+
+/** Mainloop callback: see desc_fetch_hedge(). */
+static void
+desc_fetch_hedge_callback(mainloop_event_t *event, void *arg)
+{
+  (void) event;
+  desc_fetch_hedge(arg);
+}
+
+/** Schedule the next parallel request of <b>fetch</b>, if we may launch
+ * one. */
+static void
+desc_fetch_schedule_hedge(hs_client_desc_fetch_t *fetch)
+{
+  struct timeval delay;
+  int32_t delay_msec;
+
+  if (get_desc_fetch_parallelism() <= 1) {
+    return;
+  }
+  /* Code paths exist (mostly unit tests) that launch fetches before the
+   * mainloop is up. Those simply don't race. */
+  if (!tor_libevent_is_initialized()) {
+    return;
+  }
+
+  delay_msec = networkstatus_get_param(NULL, "hs_desc_fetch_hedge_ms",
+                                       DESC_FETCH_HEDGE_MS_DFLT,
+                                       DESC_FETCH_HEDGE_MS_MIN,
+                                       DESC_FETCH_HEDGE_MS_MAX);
+  delay.tv_sec = delay_msec / 1000;
+  delay.tv_usec = (delay_msec % 1000) * 1000;
+
+  if (!fetch->hedge_ev) {
+    fetch->hedge_ev = mainloop_event_new(desc_fetch_hedge_callback, fetch);
+  }
+  mainloop_event_schedule(fetch->hedge_ev, &delay);
+}
+
+/** Note that we launched a directory request for the descriptor of the
+ * service identity_pk and, if we fetch from several HSDirs at once,
+ * schedule the next one. */
+STATIC void
+desc_fetch_note_launched(const ed25519_public_key_t *identity_pk)
+{
+  hs_client_desc_fetch_t *fetch = desc_fetch_lookup(identity_pk);
+  uint64_t now_msec = monotime_absolute_msec();
+
+  if (!fetch) {
+    if (!desc_fetches) {
+      desc_fetches = digest256map_new();
+    }
+    fetch = tor_malloc_zero(sizeof(*fetch));
+    ed25519_pubkey_copy(&fetch->identity_pk, identity_pk);
+    digest256map_set(desc_fetches, identity_pk->pubkey, fetch);
+    fetch->started_msec = now_msec;
+  } else if (now_msec - fetch->started_msec > DESC_FETCH_MAX_AGE_MSEC) {
+    fetch->started_msec = now_msec;
+  }
+
+  desc_fetch_schedule_hedge(fetch);
+}
+
+/** It is time to launch another request for <b>fetch</b>, in parallel to
+ * the pending ones. Do it, unless the descriptor has arrived in the
+ * meantime, enough requests are already pending, or the rate limit says
+ * no. */
+STATIC void
+desc_fetch_hedge(hs_client_desc_fetch_t *fetch)
+{
+  const ed25519_public_key_t *identity_pk = &fetch->identity_pk;
+  routerstatus_t *hsdir_rs;
+  int n_pending;
+
+  /* With no request pending, the fetch either succeeded, or it failed and
+   * hs_client_refetch_hsdesc() is in charge. */
+  n_pending = count_pending_directory_requests(identity_pk);
+  if (n_pending == 0 || n_pending >= get_desc_fetch_parallelism()) {
+    return;
+  }
+
+  if (!desc_fetch_hedge_allowed()) {
+    log_info(LD_REND, "Not fetching the descriptor of service %s from "
+                      "another HSDir: too many parallel fetches lately.",
+             safe_str_client(ed25519_fmt(identity_pk)));
+    return;
+  }
+
+  hsdir_rs = pick_hsdir_v3(identity_pk);
+  if (!hsdir_rs) {
+    log_info(LD_REND, "No other HSDir to fetch the descriptor of service %s "
+                      "from in parallel.",
+             safe_str_client(ed25519_fmt(identity_pk)));
+    return;
+  }
+
+  log_info(LD_REND, "Descriptor fetch for service %s still pending. "
+                    "Racing it with another HSDir.",
+           safe_str_client(ed25519_fmt(identity_pk)));
+  hs_client_stats_desc_fetch_hedged++;
+  directory_launch_v3_desc_fetch(identity_pk, hsdir_rs);
+
+  if (n_pending + 1 < get_desc_fetch_parallelism()) {
+    desc_fetch_schedule_hedge(fetch);
+  }
+}
+
+/** A usable descriptor for the service identity_pk arrived. Note how long
+ * the fetch took, and cancel the requests that lost the race. */
+static void
+desc_fetch_note_done(const ed25519_public_key_t *identity_pk)
+{
+  hs_client_desc_fetch_t *fetch = desc_fetch_lookup(identity_pk);
+  smartlist_t *losers;
+
+  if (fetch) {
+    uint64_t msec = monotime_absolute_msec() - fetch->started_msec;
+    int i;
+    for (i = 0; i < HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS; i++) {
+      if ((int64_t) msec <= hs_client_desc_fetch_time_buckets[i]) {
+        break;
+      }
+    }
+    hs_client_stats_desc_fetch_time_counts[i]++;
+    hs_client_stats_desc_fetch_time_msec += msec;
+    desc_fetch_remove(identity_pk);
+  }
+
+  losers = find_pending_directory_requests(identity_pk);
+  SMARTLIST_FOREACH_BEGIN(losers, connection_t *, conn) {
+    log_debug(LD_REND, "Cancelling a parallel descriptor fetch for service "
+                       "%s: we already got the descriptor.",
+              safe_str_client(ed25519_fmt(identity_pk)));
+    /* Change the purpose so that closing it doesn't trigger a refetch. */
+    conn->purpose = DIR_PURPOSE_HAS_FETCHED_HSDESC;
+    connection_mark_for_close(conn);
+    hs_client_stats_desc_fetch_cancelled++;
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(losers);
 }
 
 /** Helper function that changes the state of an entry connection to waiting
@@ -428,6 +714,7 @@ directory_launch_v3_desc_fetch(const ed25519_public_key_t *onion_identity_pk,
   /* Fire a REQUESTED event on the control port. */
   hs_control_desc_event_requested(onion_identity_pk, base64_blinded_pubkey,
                                   hsdir);
+  hs_client_stats_desc_fetch_launched++;
 
   /* Cleanup memory. */
   memwipe(&blinded_pubkey, 0, sizeof(blinded_pubkey));
@@ -480,6 +767,7 @@ MOCK_IMPL(STATIC hs_client_fetch_status_t,
 fetch_v3_desc, (const ed25519_public_key_t *onion_identity_pk))
 {
   routerstatus_t *hsdir_rs =NULL;
+  hs_client_fetch_status_t status;
 
   tor_assert(onion_identity_pk);
 
@@ -489,7 +777,11 @@ fetch_v3_desc, (const ed25519_public_key_t *onion_identity_pk))
     return HS_CLIENT_FETCH_NO_HSDIRS;
   }
 
-  return directory_launch_v3_desc_fetch(onion_identity_pk, hsdir_rs);
+  status = directory_launch_v3_desc_fetch(onion_identity_pk, hsdir_rs);
+  if (status == HS_CLIENT_FETCH_LAUNCHED) {
+    desc_fetch_note_launched(onion_identity_pk);
+  }
+  return status;
 }
 
 /** With a given <b>onion_identity_pk</b>, fetch its descriptor. If
@@ -1658,6 +1950,7 @@ client_dir_fetch_200(dir_connection_t *dir_conn,
   case HS_DESC_DECODE_BAD_CLIENT_AUTH:
     log_info(LD_REND, "Stored hidden service descriptor successfully.");
     TO_CONN(dir_conn)->purpose = DIR_PURPOSE_HAS_FETCHED_HSDESC;
+    desc_fetch_note_done(&dir_conn->hs_ident->identity_pk);
     if (decode_status == HS_DESC_DECODE_OK) {
       client_desc_has_arrived(entry_conns);
     } else {
@@ -2244,6 +2537,7 @@ hs_client_refetch_hsdesc(const ed25519_public_key_t *identity_pk)
     /* Remove HSDir fetch attempts so that we can retry later if the user
      * wants us to regardless of if we closed any connections. */
     purge_hid_serv_request(identity_pk);
+    desc_fetch_remove(identity_pk);
   }
   return status;
 }
@@ -2741,6 +3035,7 @@ hs_client_free_all(void)
   /* Purge the hidden service request cache. */
   hs_purge_last_hid_serv_requests();
   client_service_authorization_free_all();
+  desc_fetch_remove_all();
 
   /* This is NULL safe. */
   mainloop_event_free(dir_info_changed_ev);
@@ -2754,6 +3049,7 @@ hs_client_purge_state(void)
   /* Cancel all descriptor fetches. Do this first so once done we are sure
    * that our descriptor cache won't modified. */
   cancel_descriptor_fetches();
+  desc_fetch_remove_all();
   /* Purge the introduction point state cache. */
   hs_cache_client_intro_state_purge();
   /* Purge the descriptor cache. */
@@ -59,6 +59,23 @@ typedef enum {
   REMOVAL_BAD_ADDRESS,
 } hs_client_removal_auth_status_t;
 
+/** Maximum value of HSDescFetchParallelism: the number of HSDirs that a
+ * client fetches a descriptor from (hsdir_spread_fetch) for each of the two
+ * replicas. */
+#define HS_CLIENT_DESC_FETCH_PARALLELISM_MAX 6
+
+/** Number of buckets of the time-to-descriptor histogram. */
+#define HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS 9
+
+/** Metricsport externs */
+extern const int64_t hs_client_desc_fetch_time_buckets[];
+extern uint64_t hs_client_stats_desc_fetch_time_counts[
+                                    HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS + 1];
+extern uint64_t hs_client_stats_desc_fetch_time_msec;
+extern uint64_t hs_client_stats_desc_fetch_launched;
+extern uint64_t hs_client_stats_desc_fetch_hedged;
+extern uint64_t hs_client_stats_desc_fetch_cancelled;
+
 /** Flag to set when a client auth is permanent (saved on disk). */
 #define CLIENT_AUTH_FLAG_IS_PERMANENT (1<<0)
 
@@ -180,6 +197,23 @@ STATIC void retry_all_socks_conn_waiting_for_desc(void);
 
 STATIC void purge_ephemeral_client_auth(void);
 
+/** A descriptor fetch in progress for one service. It lives from the first
+ * directory request that we launch until a descriptor arrives or we give
+ * up, across the retries and the parallel requests in between. */
+typedef struct hs_client_desc_fetch_t {
+  /** Identity key of the service. */
+  ed25519_public_key_t identity_pk;
+  /** When we launched the first request, in monotime msec. */
+  uint64_t started_msec;
+  /** Fires when it is time to launch another request in parallel. */
+  struct mainloop_event_t *hedge_ev;
+} hs_client_desc_fetch_t;
+
+STATIC hs_client_desc_fetch_t *
+desc_fetch_lookup(const ed25519_public_key_t *identity_pk);
+STATIC void desc_fetch_note_launched(const ed25519_public_key_t *identity_pk);
+STATIC void desc_fetch_hedge(hs_client_desc_fetch_t *fetch);
+
 #ifdef TOR_UNIT_TESTS
 
 STATIC void set_hs_client_auths_map(digest256map_t *map);
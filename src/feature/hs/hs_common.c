@@ -17,6 +17,7 @@
 #include "core/or/extendinfo.h"
 #include "feature/dirauth/shared_random_state.h"
 #include "feature/hs/hs_cache.h"
+#include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_client.h"
 #include "feature/hs/hs_common.h"
@@ -1714,6 +1715,7 @@ hs_free_all(void)
   hs_cache_free_all();
   hs_client_free_all();
   hs_ob_free_all();
+  hs_circ_free_all();
 }
 
 /** For the given origin circuit circ, decrement the number of rendezvous
@@ -791,11 +791,15 @@ get_inner_encrypted_layer_plaintext(const hs_descriptor_t *desc)
       smartlist_add_asprintf(lines, "%s\n", str_single_onion);
     }
 
-    if (congestion_control_enabled()) {
-      /* Add flow control line into the descriptor. */
+    if (desc->encrypted_data.flow_control_pv) {
+      /* Add flow control line into the descriptor. We keep the versions the
+       * way the decoder does, as a "FlowCtrl=" protocol entry. */
+      const char *versions = desc->encrypted_data.flow_control_pv;
+      if (!strcmpstart(versions, "FlowCtrl=")) {
+        versions += strlen("FlowCtrl=");
+      }
       smartlist_add_asprintf(lines, "%s %s %u\n", str_flow_control,
-                             protover_get_supported(PRT_FLOWCTRL),
-                             congestion_control_sendme_inc());
+                             versions, desc->encrypted_data.sendme_inc);
     }
 
     /* Add PoW parameters if present. */
@@ -2845,8 +2849,11 @@ hs_desc_encode_descriptor,(const hs_descriptor_t *desc,
 
   /* Try to decode what we just encoded. Symmetry is nice!, but it is
    * symmetric only if the client auth is disabled (That is, the descriptor
-   * cookie will be NULL) and the test-only mock plaintext isn't in use. */
-  bool do_round_trip_test = !descriptor_cookie;
+   * cookie will be NULL) and the test-only mock plaintext isn't in use.
+   *
+   * The decoder checks the flow control values against the consensus, which
+   * only the main thread may look at, so a cpuworker skips this. */
+  bool do_round_trip_test = !descriptor_cookie && in_main_thread();
 #ifdef TOR_UNIT_TESTS
   if (desc->encrypted_data.test_extra_plaintext) {
     do_round_trip_test = false;
@@ -2964,6 +2971,99 @@ hs_descriptor_free_(hs_descriptor_t *desc)
   tor_free(desc);
 }
 
+/** Return a newly allocated copy of the given descriptor intro point. */
+static hs_desc_intro_point_t *
+hs_desc_intro_point_dup(const hs_desc_intro_point_t *ip)
+{
+  hs_desc_intro_point_t *dup = hs_desc_intro_point_new();
+
+  SMARTLIST_FOREACH(ip->link_specifiers, const link_specifier_t *, ls,
+                    smartlist_add(dup->link_specifiers,
+                                  link_specifier_dup(ls)));
+  memcpy(&dup->onion_key, &ip->onion_key, sizeof(dup->onion_key));
+  memcpy(&dup->enc_key, &ip->enc_key, sizeof(dup->enc_key));
+  if (ip->auth_key_cert) {
+    dup->auth_key_cert = tor_cert_dup(ip->auth_key_cert);
+  }
+  if (ip->enc_key_cert) {
+    dup->enc_key_cert = tor_cert_dup(ip->enc_key_cert);
+  }
+  if (ip->legacy.key) {
+    dup->legacy.key = crypto_pk_copy_full(ip->legacy.key);
+  }
+  if (ip->legacy.cert.encoded) {
+    dup->legacy.cert.encoded = tor_memdup(ip->legacy.cert.encoded,
+                                          ip->legacy.cert.len);
+    dup->legacy.cert.len = ip->legacy.cert.len;
+  }
+  dup->cross_certified = ip->cross_certified;
+  return dup;
+}
+
+/** Return a newly allocated deep copy of the given descriptor. The copy
+ * shares nothing with <b>desc</b> so it can be encoded on another thread
+ * while <b>desc</b> changes. */
+hs_descriptor_t *
+hs_descriptor_dup(const hs_descriptor_t *desc)
+{
+  hs_descriptor_t *dup;
+
+  tor_assert(desc);
+
+  dup = tor_memdup(desc, sizeof(*desc));
+
+  /* Plaintext section. */
+  if (desc->plaintext_data.signing_key_cert) {
+    dup->plaintext_data.signing_key_cert =
+      tor_cert_dup(desc->plaintext_data.signing_key_cert);
+  }
+  if (desc->plaintext_data.superencrypted_blob) {
+    dup->plaintext_data.superencrypted_blob =
+      tor_memdup(desc->plaintext_data.superencrypted_blob,
+                 desc->plaintext_data.superencrypted_blob_size);
+  }
+
+  /* Superencrypted section. */
+  if (desc->superencrypted_data.encrypted_blob) {
+    dup->superencrypted_data.encrypted_blob =
+      tor_memdup(desc->superencrypted_data.encrypted_blob,
+                 desc->superencrypted_data.encrypted_blob_size);
+  }
+  if (desc->superencrypted_data.clients) {
+    dup->superencrypted_data.clients = smartlist_new();
+    SMARTLIST_FOREACH(desc->superencrypted_data.clients,
+                      const hs_desc_authorized_client_t *, client,
+                      smartlist_add(dup->superencrypted_data.clients,
+                                    tor_memdup(client, sizeof(*client))));
+  }
+
+  /* Encrypted section. */
+  if (desc->encrypted_data.intro_auth_types) {
+    dup->encrypted_data.intro_auth_types = smartlist_new();
+    SMARTLIST_FOREACH(desc->encrypted_data.intro_auth_types, const char *, a,
+                      smartlist_add_strdup(
+                                  dup->encrypted_data.intro_auth_types, a));
+  }
+  if (desc->encrypted_data.flow_control_pv) {
+    dup->encrypted_data.flow_control_pv =
+      tor_strdup(desc->encrypted_data.flow_control_pv);
+  }
+  if (desc->encrypted_data.pow_params) {
+    dup->encrypted_data.pow_params =
+      tor_memdup(desc->encrypted_data.pow_params,
+                 sizeof(*desc->encrypted_data.pow_params));
+  }
+  if (desc->encrypted_data.intro_points) {
+    dup->encrypted_data.intro_points = smartlist_new();
+    SMARTLIST_FOREACH(desc->encrypted_data.intro_points,
+                      const hs_desc_intro_point_t *, ip,
+                      smartlist_add(dup->encrypted_data.intro_points,
+                                    hs_desc_intro_point_dup(ip)));
+  }
+
+  return dup;
+}
+
 /** Return the size in bytes of the given plaintext data object. A sizeof() is
  * not enough because the object contains pointers and the encrypted blob.
  * This is particularly useful for our OOM subsystem that tracks the HSDir
@@ -168,7 +168,10 @@ typedef struct hs_desc_encrypted_data_t {
   /** Is this descriptor a single onion service? */
   unsigned int single_onion_service : 1;
 
-  /** Flow control protocol version line. */
+  /** Flow control protocol version line, and the SENDME increment that goes
+   * with it. If NULL, the descriptor has no flow control line. When
+   * encoding, these are all we look at, so that the encoder doesn't need the
+   * consensus and can run on a cpuworker. */
   char *flow_control_pv;
   uint8_t sendme_inc;
 
@@ -273,6 +276,7 @@ hs_desc_is_supported_version(uint32_t version)
 void hs_descriptor_free_(hs_descriptor_t *desc);
 #define hs_descriptor_free(desc) \
   FREE_AND_NULL(hs_descriptor_t, hs_descriptor_free_, (desc))
+hs_descriptor_t *hs_descriptor_dup(const hs_descriptor_t *desc);
 void hs_desc_plaintext_data_free_(hs_desc_plaintext_data_t *desc);
 #define hs_desc_plaintext_data_free(desc) \
   FREE_AND_NULL(hs_desc_plaintext_data_t, hs_desc_plaintext_data_free_, (desc))
@@ -15,10 +15,15 @@
 #include "lib/metrics/metrics_store.h"
 #include "lib/log/util_bug.h"
 
+#include "feature/hs/hs_client.h"
 #include "feature/hs/hs_metrics.h"
 #include "feature/hs/hs_metrics_entry.h"
 #include "feature/hs/hs_service.h"
 
+/** Store of the onion service client metrics. Unlike the service stores, it
+ * is filled from the client counters when the MetricsPort asks for it. */
+static metrics_store_t *client_store = NULL;
+
 /** Return a static buffer pointer that contains the port as a string.
  *
  * Subsequent call to this function invalidates the previous buffer. */
@@ -70,6 +75,8 @@ add_metric_with_labels(hs_service_t *service, hs_metrics_key_t metric,
     case HS_METRICS_NUM_ESTABLISHED_INTRO: FALLTHROUGH;
     case HS_METRICS_POW_NUM_PQUEUE_RDV: FALLTHROUGH;
     case HS_METRICS_POW_SUGGESTED_EFFORT: FALLTHROUGH;
+    case HS_METRICS_REPLAY_CACHE_ENTRIES: FALLTHROUGH;
+    case HS_METRICS_REPLAY_CACHE_BYTES: FALLTHROUGH;
     case HS_METRICS_INTRO_CIRC_BUILD_TIME: FALLTHROUGH;
     case HS_METRICS_REND_CIRC_BUILD_TIME: FALLTHROUGH;
     default:
@@ -217,6 +224,53 @@ hs_metrics_update_by_ident(const hs_metrics_key_t key,
   hs_metrics_update_by_service(key, service, port, reason, n, obs, reset);
 }
 
+/** Fill the client metrics store from the client counters. */
+static void
+fill_client_store(void)
+{
+  metrics_store_entry_t *sentry;
+
+  if (!client_store) {
+    client_store = metrics_store_new();
+  }
+  metrics_store_reset(client_store);
+
+  sentry = metrics_store_add(client_store, METRICS_TYPE_HISTOGRAM,
+                     METRICS_NAME(hs_client_desc_fetch_time_msec),
+                     "Time from the first request until a usable onion "
+                     "service descriptor arrived, in milliseconds",
+                     HS_CLIENT_DESC_FETCH_TIME_N_BUCKETS,
+                     hs_client_desc_fetch_time_buckets);
+  metrics_store_hist_entry_merge(sentry,
+                       hs_client_stats_desc_fetch_time_counts,
+                       ARRAY_LENGTH(hs_client_stats_desc_fetch_time_counts),
+                       (int64_t) hs_client_stats_desc_fetch_time_msec);
+
+  sentry = metrics_store_add(client_store, METRICS_TYPE_COUNTER,
+                     METRICS_NAME(hs_client_desc_fetch_total),
+                     "Onion service descriptor requests", 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("action", "launched"));
+  metrics_store_entry_update(sentry,
+                             (int64_t) hs_client_stats_desc_fetch_launched);
+
+  sentry = metrics_store_add(client_store, METRICS_TYPE_COUNTER,
+                     METRICS_NAME(hs_client_desc_fetch_total),
+                     "Onion service descriptor requests", 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("action", "hedged"));
+  metrics_store_entry_update(sentry,
+                             (int64_t) hs_client_stats_desc_fetch_hedged);
+
+  sentry = metrics_store_add(client_store, METRICS_TYPE_COUNTER,
+                     METRICS_NAME(hs_client_desc_fetch_total),
+                     "Onion service descriptor requests", 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("action", "cancelled"));
+  metrics_store_entry_update(sentry,
+                             (int64_t) hs_client_stats_desc_fetch_cancelled);
+}
+
 /** Return a list of all the onion service metrics stores. This is the
  * function attached to the .get_metrics() member of the subsys_t. */
 const smartlist_t *
@@ -228,9 +282,22 @@ hs_metrics_get_stores(void)
 
   smartlist_free(stores_list);
   stores_list = hs_service_get_metrics_stores();
+
+  /* Only export the client metrics once we acted as a client. */
+  if (hs_client_stats_desc_fetch_launched > 0) {
+    fill_client_store();
+    smartlist_add(stores_list, client_store);
+  }
   return stores_list;
 }
 
+/** Free the onion service client metrics store. */
+void
+hs_metrics_client_free_all(void)
+{
+  metrics_store_free(client_store);
+}
+
 /** Initialize the metrics store in the given service. */
 void
 hs_metrics_service_init(hs_service_t *service)
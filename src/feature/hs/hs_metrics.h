@@ -19,6 +19,7 @@
 /* Init and Free. */
 void hs_metrics_service_init(hs_service_t *service);
 void hs_metrics_service_free(hs_service_t *service);
+void hs_metrics_client_free_all(void);
 
 /* Accessors. */
 const smartlist_t *hs_metrics_get_stores(void);
@@ -84,6 +85,16 @@ void hs_metrics_update_by_service(const hs_metrics_key_t key,
   hs_metrics_update_by_service(HS_METRICS_POW_SUGGESTED_EFFORT, (s), 0, \
                                NULL, (n), 0, true)
 
+/** Update the number of digests in the replay caches of the service. */
+#define hs_metrics_replay_cache_entries(s, n) \
+  hs_metrics_update_by_service(HS_METRICS_REPLAY_CACHE_ENTRIES, (s), 0, \
+                               NULL, (n), 0, true)
+
+/** Update the memory used by the replay caches of the service. */
+#define hs_metrics_replay_cache_bytes(s, n) \
+  hs_metrics_update_by_service(HS_METRICS_REPLAY_CACHE_BYTES, (s), 0, \
+                               NULL, (n), 0, true)
+
 /** New introduction circuit has been established. This is called when the
  * INTRO_ESTABLISHED has been received by the service. */
 #define hs_metrics_new_established_intro(s)                              \
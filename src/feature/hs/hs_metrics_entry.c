@@ -124,6 +124,18 @@ const hs_metrics_entry_t base_metrics[] =
     .name = METRICS_NAME(hs_pow_suggested_effort),
     .help = "Suggested effort for requests with a proof of work client puzzle",
   },
+  {
+    .key = HS_METRICS_REPLAY_CACHE_ENTRIES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(hs_replay_cache_entries),
+    .help = "Number of digests in the replay caches of the service",
+  },
+  {
+    .key = HS_METRICS_REPLAY_CACHE_BYTES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(hs_replay_cache_bytes),
+    .help = "Memory used by the replay caches of the service, in bytes",
+  },
 };
 
 /** Size of base_metrics array that is number of entries. */
@@ -66,6 +66,10 @@ typedef enum {
   HS_METRICS_POW_NUM_PQUEUE_RDV = 10,
   /** Suggested effort for requests with a proof of work client puzzle. */
   HS_METRICS_POW_SUGGESTED_EFFORT = 11,
+  /** Number of digests in the replay caches of the service. */
+  HS_METRICS_REPLAY_CACHE_ENTRIES = 12,
+  /** Memory used by the replay caches of the service, in bytes. */
+  HS_METRICS_REPLAY_CACHE_BYTES = 13,
 } hs_metrics_key_t;
 
 /** The metadata of an HS metrics. */
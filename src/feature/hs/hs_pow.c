@@ -7,6 +7,8 @@
  * when a hidden service is defending against DoS attacks.
  **/
 
+#define HS_POW_PRIVATE
+
 #include <stdio.h>
 
 #include "core/or/or.h"
@@ -21,12 +23,14 @@
 #include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_client.h"
 #include "feature/hs/hs_pow.h"
+#include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/arch/bytes.h"
 #include "lib/cc/ctassert.h"
 #include "core/mainloop/cpuworker.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
 #include "lib/time/compat_time.h"
 
 /** Replay cache set up */
@@ -78,17 +82,30 @@ nonce_cache_entry_match_seed_and_free(nonce_cache_entry_t *ent, void *data)
   return 0;
 }
 
-/** Helper: Increment a given nonce and set it in the challenge at the right
- * offset. Use by the solve function. */
+/** Number of Equi-X solutions per second that the last successful solve
+ * checked, across all the threads that worked on it. */
+static uint64_t pow_solve_rate = 0;
+
+/** Helper: Add <b>n</b> to a given nonce, as a little-endian integer that
+ * wraps around. */
 static inline void
-increment_and_set_nonce(uint8_t *nonce, uint8_t *challenge)
+add_to_nonce(uint8_t *nonce, unsigned n)
 {
-  for (unsigned i = 0; i < HS_POW_NONCE_LEN; i++) {
-    uint8_t prev = nonce[i];
-    if (++nonce[i] > prev) {
-      break;
-    }
+  uint64_t carry = n;
+
+  for (unsigned i = 0; i < HS_POW_NONCE_LEN && carry; i++) {
+    carry += nonce[i];
+    nonce[i] = (uint8_t) carry;
+    carry >>= 8;
   }
+}
+
+/** Helper: Add <b>step</b> to a given nonce and set it in the challenge at
+ * the right offset. Use by the solve function. */
+static inline void
+add_and_set_nonce(uint8_t *nonce, unsigned step, uint8_t *challenge)
+{
+  add_to_nonce(nonce, step);
   memcpy(challenge + HS_POW_NONCE_OFFSET, nonce, HS_POW_NONCE_LEN);
 }
 
@@ -196,18 +213,39 @@ hs_pow_equix_option_flags(int CompiledProofOfWorkHash)
 int
 hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
              hs_pow_solution_t *pow_solution_out)
+{
+  uint8_t nonce[HS_POW_NONCE_LEN];
+
+  /* Generate a random nonce N. */
+  crypto_rand((char *)nonce, sizeof nonce);
+
+  return hs_pow_solve_nonces(pow_inputs, nonce, 1, NULL, pow_solution_out);
+}
+
+/** Like hs_pow_solve(), but only try the nonces nonce_start,
+ * nonce_start + step, nonce_start + 2*step and so on. If <b>group</b> is not
+ * NULL, this is one of several solvers working on the same puzzle: count the
+ * Equi-X solutions we check in it, and give up as soon as another solver of
+ * the group finds a solution. */
+STATIC int
+hs_pow_solve_nonces(const hs_pow_solver_inputs_t *pow_inputs,
+                    const uint8_t *nonce_start, unsigned step,
+                    hs_pow_solve_group_t *group,
+                    hs_pow_solution_t *pow_solution_out)
 {
   int ret = -1;
   uint8_t nonce[HS_POW_NONCE_LEN];
   uint8_t *challenge = NULL;
   equix_ctx *ctx = NULL;
+  uint64_t n_solutions = 0;
 
   tor_assert(pow_inputs);
+  tor_assert(nonce_start);
+  tor_assert(step > 0);
   tor_assert(pow_solution_out);
   const uint32_t effort = pow_inputs->effort;
 
-  /* Generate a random nonce N. */
-  crypto_rand((char *)nonce, sizeof nonce);
+  memcpy(nonce, nonce_start, sizeof nonce);
 
   /* Build EquiX challenge string */
   challenge = build_equix_challenge(&pow_inputs->service_blinded_id,
@@ -230,15 +268,28 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
     /* Calculate solutions to S = equix_solve(C || N || E),  */
     equix_solutions_buffer buffer;
     equix_result result;
+
+    if (group && atomic_counter_get(&group->found)) {
+      log_debug(LD_REND, "Proof of work solved by another thread");
+      goto end;
+    }
+
     result = equix_solve(ctx, challenge, HS_POW_CHALLENGE_LEN, &buffer);
     switch (result) {
 
       case EQUIX_OK:
+        n_solutions += buffer.count;
+        if (group) {
+          atomic_counter_add(&group->n_solutions, buffer.count);
+        }
         for (unsigned i = 0; i < buffer.count; i++) {
           pack_equix_solution(&buffer.sols[i], sol_bytes);
 
           /* Check an Equi-X solution against the effort threshold */
           if (validate_equix_challenge(challenge, sol_bytes, effort)) {
+            if (group) {
+              atomic_counter_add(&group->found, 1);
+            }
             /* Store the nonce N. */
             memcpy(pow_solution_out->nonce, nonce, HS_POW_NONCE_LEN);
             /* Store the effort E. */
@@ -254,12 +305,14 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
             monotime_get(&end_time);
             int64_t duration_usec = monotime_diff_usec(&start_time, &end_time);
             log_info(LD_REND, "Proof of work solution (effort %u) found "
-                     "using %s implementation in %u.%06u seconds",
+                     "using %s implementation in %u.%06u seconds, "
+                     "checking %"PRIu64" solutions/sec",
                      effort,
                     (EQUIX_SOLVER_DID_USE_COMPILER & buffer.flags)
                        ? "compiled" : "interpreted",
                     (unsigned)(duration_usec / 1000000),
-                    (unsigned)(duration_usec % 1000000));
+                    (unsigned)(duration_usec % 1000000),
+                    n_solutions * 1000000 / MAX(duration_usec, 1));
 
             /* Indicate success and we are done. */
             ret = 0;
@@ -295,8 +348,8 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
     }
 
     /* No solutions for this nonce and/or none that passed the effort
-     * threshold, increment and try again. */
-    increment_and_set_nonce(nonce, challenge);
+     * threshold, move on to our next nonce and try again. */
+    add_and_set_nonce(nonce, step, challenge);
   }
 
  end:
@@ -305,6 +358,30 @@ hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
   return ret;
 }
 
+/** Return true iff the (nonce, seed) tuple of <b>pow_solution</b> is in the
+ * replay cache. */
+static bool
+nonce_is_cached(const hs_pow_solution_t *pow_solution)
+{
+  nonce_cache_entry_t search;
+
+  memcpy(search.bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
+  memcpy(search.bytes.seed_head, pow_solution->seed_head,
+         HS_POW_SEED_HEAD_LEN);
+  return HT_FIND(nonce_cache_table_ht, &nonce_cache_table, &search) != NULL;
+}
+
+/** Add the (nonce, seed) tuple of <b>pow_solution</b> to the replay cache. */
+static void
+nonce_cache_add(const hs_pow_solution_t *pow_solution)
+{
+  nonce_cache_entry_t *entry = tor_malloc_zero(sizeof(nonce_cache_entry_t));
+  memcpy(entry->bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
+  memcpy(entry->bytes.seed_head, pow_solution->seed_head,
+         HS_POW_SEED_HEAD_LEN);
+  HT_INSERT(nonce_cache_table_ht, &nonce_cache_table, entry);
+}
+
 /** Verify the solution in pow_solution using the service's current PoW
  * parameters found in pow_state. Returns 0 on success and -1 otherwise. Called
  * by the service. */
@@ -312,41 +389,65 @@ int
 hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
               const hs_pow_service_state_t *pow_state,
               const hs_pow_solution_t *pow_solution)
+{
+  tor_assert(pow_state);
+  tor_assert(pow_solution);
+
+  /* Fail if N = POW_NONCE is present in the replay cache. */
+  if (nonce_is_cached(pow_solution)) {
+    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
+    return -1;
+  }
+
+  if (hs_pow_verify_solution(service_blinded_id, pow_state->seed_current,
+                             pow_state->seed_previous, pow_solution,
+                             get_options()->CompiledProofOfWorkHash) < 0) {
+    return -1;
+  }
+
+  /* Add the (nonce, seed) tuple to the replay cache. */
+  nonce_cache_add(pow_solution);
+  return 0;
+}
+
+/** Verify the solution in pow_solution for the service's seeds
+ * <b>seed_current</b> and <b>seed_previous</b>, without looking at the
+ * replay cache. Returns 0 on success and -1 otherwise.
+ *
+ * This doesn't touch any global state, so that the service can call it from
+ * a cpuworker thread. It must then call hs_pow_nonce_cache_add_test() from
+ * the main thread before it accepts the solution. */
+int
+hs_pow_verify_solution(const ed25519_public_key_t *service_blinded_id,
+                       const uint8_t *seed_current,
+                       const uint8_t *seed_previous,
+                       const hs_pow_solution_t *pow_solution,
+                       int CompiledProofOfWorkHash)
 {
   int ret = -1;
   uint8_t *challenge = NULL;
-  nonce_cache_entry_t search, *entry = NULL;
   equix_ctx *ctx = NULL;
   const uint8_t *seed = NULL;
 
-  tor_assert(pow_state);
+  tor_assert(seed_current);
+  tor_assert(seed_previous);
   tor_assert(pow_solution);
   tor_assert(service_blinded_id);
   tor_assert_nonfatal(!ed25519_public_key_is_zero(service_blinded_id));
 
   /* Find a valid seed C that starts with the seed head. Fail if no such seed
    * exists. */
-  if (fast_memeq(pow_state->seed_current, pow_solution->seed_head,
+  if (fast_memeq(seed_current, pow_solution->seed_head,
                  HS_POW_SEED_HEAD_LEN)) {
-    seed = pow_state->seed_current;
-  } else if (fast_memeq(pow_state->seed_previous, pow_solution->seed_head,
+    seed = seed_current;
+  } else if (fast_memeq(seed_previous, pow_solution->seed_head,
                         HS_POW_SEED_HEAD_LEN)) {
-    seed = pow_state->seed_previous;
+    seed = seed_previous;
   } else {
     log_warn(LD_REND, "Seed head didn't match either seed.");
     goto done;
   }
 
-  /* Fail if N = POW_NONCE is present in the replay cache. */
-  memcpy(search.bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
-  memcpy(search.bytes.seed_head, pow_solution->seed_head,
-         HS_POW_SEED_HEAD_LEN);
-  entry = HT_FIND(nonce_cache_table_ht, &nonce_cache_table, &search);
-  if (entry) {
-    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
-    goto done;
-  }
-
   /* Build the challenge with the params we have. */
   challenge = build_equix_challenge(service_blinded_id, seed,
                                     pow_solution->nonce, pow_solution->effort);
@@ -358,7 +459,7 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
   }
 
   ctx = equix_alloc(EQUIX_CTX_VERIFY |
-    hs_pow_equix_option_flags(get_options()->CompiledProofOfWorkHash));
+                    hs_pow_equix_option_flags(CompiledProofOfWorkHash));
   if (!ctx) {
     goto done;
   }
@@ -376,19 +477,28 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
   /* PoW verified successfully. */
   ret = 0;
 
-  /* Add the (nonce, seed) tuple to the replay cache. */
-  entry = tor_malloc_zero(sizeof(nonce_cache_entry_t));
-  memcpy(entry->bytes.nonce, pow_solution->nonce, HS_POW_NONCE_LEN);
-  memcpy(entry->bytes.seed_head, pow_solution->seed_head,
-         HS_POW_SEED_HEAD_LEN);
-  HT_INSERT(nonce_cache_table_ht, &nonce_cache_table, entry);
-
  done:
   tor_free(challenge);
   equix_free(ctx);
   return ret;
 }
 
+/** Add the (nonce, seed) tuple of <b>pow_solution</b>, which
+ * hs_pow_verify_solution() accepted, to the replay cache. Return 0 on
+ * success, or -1 if it was already there: the solution is a replay. */
+int
+hs_pow_nonce_cache_add_test(const hs_pow_solution_t *pow_solution)
+{
+  tor_assert(pow_solution);
+
+  if (nonce_is_cached(pow_solution)) {
+    log_warn(LD_REND, "Found (nonce, seed) tuple in the replay cache.");
+    return -1;
+  }
+  nonce_cache_add(pow_solution);
+  return 0;
+}
+
 /** Remove entries from the (nonce, seed) replay cache which are for the seed
  * beginning with seed_head. If seed_head is NULL, remove all cache entries. */
 void
@@ -417,6 +527,53 @@ hs_pow_free_service_state(hs_pow_service_state_t *state)
    Thread workers
    =====*/
 
+/** Allocate a new solve group for <b>n_jobs</b> jobs. */
+STATIC hs_pow_solve_group_t *
+pow_solve_group_new(unsigned n_jobs)
+{
+  hs_pow_solve_group_t *group = tor_malloc_zero(sizeof(*group));
+  atomic_counter_init(&group->found);
+  atomic_counter_init(&group->n_solutions);
+  monotime_get(&group->start_time);
+  group->n_pending = n_jobs;
+  return group;
+}
+
+/** Release all storage held in <b>group</b>. */
+STATIC void
+pow_solve_group_free_(hs_pow_solve_group_t *group)
+{
+  if (!group)
+    return;
+  atomic_counter_destroy(&group->found);
+  atomic_counter_destroy(&group->n_solutions);
+  tor_free(group);
+}
+
+/** Return the number of worker threads that should solve a PoW puzzle
+ * together. */
+static unsigned
+get_n_solver_threads(void)
+{
+  unsigned n_workers = cpuworker_get_n_threads();
+  unsigned n = (unsigned) get_options()->ProofOfWorkSolverThreads;
+
+  if (n == 0) {
+    /* Automatic: every worker thread, but leave one to the onionskins if we
+     * are a relay, so that a puzzle doesn't stall our circuit handshakes. */
+    n = n_workers;
+    if (server_mode(get_options()) && n > 1) {
+      n--;
+    }
+  }
+  /* More jobs than worker threads would only wait in the queue until the
+   * puzzle is solved. */
+  if (n > n_workers) {
+    n = n_workers;
+  }
+  return MAX(n, 1);
+}
+
 /**
  * An object passed to a worker thread that will try to solve the pow.
  */
@@ -425,6 +582,15 @@ typedef struct pow_worker_job_t {
   /** Inputs for the PoW solver (seed, chosen effort) */
   hs_pow_solver_inputs_t pow_inputs;
 
+  /** The first nonce to try, and the distance to the next one. The jobs of
+   * a group start at consecutive nonces and use the group size as step, so
+   * that they never try the same nonce. */
+  uint8_t nonce_start[HS_POW_NONCE_LEN];
+  unsigned nonce_step;
+
+  /** The jobs that solve the same puzzle. Shared with the other jobs. */
+  hs_pow_solve_group_t *group;
+
   /** State: we'll look these up to figure out how to proceed after. */
   uint32_t intro_circ_identifier;
   uint8_t rend_circ_cookie[HS_REND_COOKIE_LEN];
@@ -446,7 +612,9 @@ pow_worker_threadfn(void *state_, void *work_)
   pow_worker_job_t *job = work_;
   job->pow_solution_out = tor_malloc_zero(sizeof(hs_pow_solution_t));
 
-  if (hs_pow_solve(&job->pow_inputs, job->pow_solution_out)) {
+  if (hs_pow_solve_nonces(&job->pow_inputs, job->nonce_start,
+                          job->nonce_step, job->group,
+                          job->pow_solution_out)) {
     tor_free(job->pow_solution_out);
     job->pow_solution_out = NULL; /* how we signal that we came up empty */
   }
@@ -476,6 +644,31 @@ pow_worker_replyfn(void *work_)
   tor_assert(work_);
 
   pow_worker_job_t *job = work_;
+  hs_pow_solve_group_t *group = job->group;
+
+  tor_assert(group->n_pending > 0);
+  group->n_pending--;
+
+  /* Only the first job of the group that comes back with a solution, or the
+   * last one to come back if none did, gets to use the circuits. */
+  if (group->done) {
+    goto done;
+  }
+  if (!job->pow_solution_out && group->n_pending > 0) {
+    goto done;
+  }
+  group->done = true;
+
+  if (job->pow_solution_out) {
+    uint64_t n_solutions = atomic_counter_get(&group->n_solutions);
+    monotime_t now;
+    monotime_get(&now);
+    int64_t duration_usec = monotime_diff_usec(&group->start_time, &now);
+    pow_solve_rate = n_solutions * 1000000 / MAX(duration_usec, 1);
+    log_info(LD_REND, "Proof of work (effort %u) solved by %u threads, "
+             "checking %"PRIu64" solutions/sec",
+             job->pow_inputs.effort, job->nonce_step, pow_solve_rate);
+  }
 
   /* Look up the circuits that we're going to use this pow in.
    * There's room for improvement here. We already had a fast mapping to
@@ -533,11 +726,16 @@ pow_worker_replyfn(void *work_)
     }
   }
 
+ done:
+  if (group->n_pending == 0) {
+    pow_solve_group_free(group);
+  }
   pow_worker_job_free(job);
 }
 
 /**
- * Queue the job of solving the pow in a worker thread.
+ * Queue the job of solving the pow in worker threads: one job per solver
+ * thread, each over its own share of the nonces.
  */
 int
 hs_pow_queue_work(uint32_t intro_circ_identifier,
@@ -550,20 +748,48 @@ hs_pow_queue_work(uint32_t intro_circ_identifier,
   tor_assert_nonfatal(
     !ed25519_public_key_is_zero(&pow_inputs->service_blinded_id));
 
-  pow_worker_job_t *job = tor_malloc_zero(sizeof(*job));
-  job->intro_circ_identifier = intro_circ_identifier;
-  memcpy(&job->rend_circ_cookie, rend_circ_cookie,
-         sizeof job->rend_circ_cookie);
-  memcpy(&job->pow_inputs, pow_inputs, sizeof job->pow_inputs);
-
-  workqueue_entry_t *work;
-  work = cpuworker_queue_work(WQ_PRI_LOW,
-                              pow_worker_threadfn,
-                              pow_worker_replyfn,
-                              job);
-  if (!work) {
-    pow_worker_job_free(job);
-    return -1;
+  const unsigned n_jobs = get_n_solver_threads();
+  uint8_t nonce[HS_POW_NONCE_LEN];
+  hs_pow_solve_group_t *group = pow_solve_group_new(n_jobs);
+
+  /* Generate a random nonce N. */
+  crypto_rand((char *)nonce, sizeof nonce);
+
+  for (unsigned i = 0; i < n_jobs; i++) {
+    pow_worker_job_t *job = tor_malloc_zero(sizeof(*job));
+    job->intro_circ_identifier = intro_circ_identifier;
+    memcpy(&job->rend_circ_cookie, rend_circ_cookie,
+           sizeof job->rend_circ_cookie);
+    memcpy(&job->pow_inputs, pow_inputs, sizeof job->pow_inputs);
+    memcpy(job->nonce_start, nonce, sizeof job->nonce_start);
+    add_to_nonce(job->nonce_start, i);
+    job->nonce_step = n_jobs;
+    job->group = group;
+
+    workqueue_entry_t *work;
+    work = cpuworker_queue_work(WQ_PRI_LOW,
+                                pow_worker_threadfn,
+                                pow_worker_replyfn,
+                                job);
+    if (!work) {
+      pow_worker_job_free(job);
+      /* The jobs that we already queued carry on with a larger step, which
+       * only leaves some nonces out. */
+      group->n_pending -= n_jobs - i;
+      if (group->n_pending == 0) {
+        pow_solve_group_free(group);
+        return -1;
+      }
+      break;
+    }
   }
   return 0;
 }
+
+/** Return the number of Equi-X solutions per second that the last
+ * successful PoW solve checked, or 0 if we never solved one. */
+uint64_t
+hs_pow_get_solve_rate(void)
+{
+  return pow_solve_rate;
+}
@@ -169,6 +169,12 @@ int hs_pow_solve(const hs_pow_solver_inputs_t *pow_inputs,
 int hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
                   const hs_pow_service_state_t *pow_state,
                   const hs_pow_solution_t *pow_solution);
+int hs_pow_verify_solution(const ed25519_public_key_t *service_blinded_id,
+                           const uint8_t *seed_current,
+                           const uint8_t *seed_previous,
+                           const hs_pow_solution_t *pow_solution,
+                           int CompiledProofOfWorkHash);
+int hs_pow_nonce_cache_add_test(const hs_pow_solution_t *pow_solution);
 
 void hs_pow_remove_seed_from_cache(const uint8_t *seed_head);
 void hs_pow_free_service_state(hs_pow_service_state_t *state);
@@ -177,6 +183,42 @@ int hs_pow_queue_work(uint32_t intro_circ_identifier,
                       const uint8_t *rend_circ_cookie,
                       const hs_pow_solver_inputs_t *pow_inputs);
 
+uint64_t hs_pow_get_solve_rate(void);
+
+#ifdef HS_POW_PRIVATE
+
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
+
+/** State shared by the worker jobs that solve the same PoW puzzle, each over
+ * its own share of the nonces. */
+typedef struct hs_pow_solve_group_t {
+  /** Nonzero once one of the jobs found a solution: the others give up. */
+  atomic_counter_t found;
+  /** Number of Equi-X solutions that the jobs checked so far. */
+  atomic_counter_t n_solutions;
+  /** When we queued the jobs. */
+  monotime_t start_time;
+
+  /* Only accessed from the main thread. */
+
+  /** Number of jobs whose reply we did not get yet. */
+  unsigned n_pending;
+  /** True iff one of the replies already used the circuits. */
+  bool done;
+} hs_pow_solve_group_t;
+
+STATIC int hs_pow_solve_nonces(const hs_pow_solver_inputs_t *pow_inputs,
+                               const uint8_t *nonce_start, unsigned step,
+                               hs_pow_solve_group_t *group,
+                               hs_pow_solution_t *pow_solution_out);
+STATIC hs_pow_solve_group_t *pow_solve_group_new(unsigned n_jobs);
+STATIC void pow_solve_group_free_(hs_pow_solve_group_t *group);
+#define pow_solve_group_free(g) \
+  FREE_AND_NULL(hs_pow_solve_group_t, pow_solve_group_free_, (g))
+
+#endif /* defined(HS_POW_PRIVATE) */
+
 #else /* !defined(HAVE_MODULE_POW) */
 #define have_module_pow() (0)
 
@@ -200,6 +242,28 @@ hs_pow_verify(const ed25519_public_key_t *service_blinded_id,
   return -1;
 }
 
+static inline int
+hs_pow_verify_solution(const ed25519_public_key_t *service_blinded_id,
+                       const uint8_t *seed_current,
+                       const uint8_t *seed_previous,
+                       const hs_pow_solution_t *pow_solution,
+                       int CompiledProofOfWorkHash)
+{
+  (void)service_blinded_id;
+  (void)seed_current;
+  (void)seed_previous;
+  (void)pow_solution;
+  (void)CompiledProofOfWorkHash;
+  return -1;
+}
+
+static inline int
+hs_pow_nonce_cache_add_test(const hs_pow_solution_t *pow_solution)
+{
+  (void)pow_solution;
+  return -1;
+}
+
 static inline void
 hs_pow_remove_seed_from_cache(const uint8_t *seed_head)
 {
@@ -223,6 +287,12 @@ hs_pow_queue_work(uint32_t intro_circ_identifier,
   return -1;
 }
 
+static inline uint64_t
+hs_pow_get_solve_rate(void)
+{
+  return 0;
+}
+
 #endif /* defined(HAVE_MODULE_POW) */
 
 #endif /* !defined(TOR_HS_POW_H) */
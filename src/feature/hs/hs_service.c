@@ -12,12 +12,14 @@
 #include "app/config/config.h"
 #include "app/config/statefile.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/extendinfo.h"
+#include "core/or/protover.h"
 #include "core/or/relay.h"
 #include "feature/client/circpathbias.h"
 #include "feature/dirclient/dirclient.h"
@@ -33,6 +35,7 @@
 #include "lib/crypt_ops/crypto_ope.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/time/tvdiff.h"
 #include "lib/time/compat_time.h"
 
@@ -82,6 +85,18 @@
       var = *var##_iter;
 #define FOR_EACH_SERVICE_END } STMT_END ;
 
+/** Helper macro. Iterate over every service that the scheduled events look
+ * at in their current run, see get_scheduled_services(). The var is the name
+ * of the service pointer. */
+#define FOR_EACH_SCHEDULED_SERVICE_BEGIN(var)                    \
+    STMT_BEGIN                                                   \
+    smartlist_t *var##_list = get_scheduled_services();          \
+    SMARTLIST_FOREACH_BEGIN(var##_list, hs_service_t *, var) {
+#define FOR_EACH_SCHEDULED_SERVICE_END(var)                      \
+    } SMARTLIST_FOREACH_END(var);                                \
+    smartlist_free(var##_list);                                  \
+    STMT_END ;
+
 /** Helper macro. Iterate over both current and previous descriptor of a
  * service. The var is the name of the descriptor pointer. This macro skips
  * any descriptor object of the service that is NULL. */
@@ -113,7 +128,20 @@ static smartlist_t *hs_service_staging_list;
  *  reupload if needed */
 static int consider_republishing_hs_descriptors = 0;
 
+/** Priority queue of the services in the global map, ordered by the time at
+ * which the scheduled events must look at them again. */
+static smartlist_t *service_schedule = NULL;
+
+/** True iff the global map changed since we built service_schedule. */
+static bool service_schedule_is_stale = true;
+
+/** Services that the scheduled events look at in their current run. NULL
+ * outside of hs_service_run_scheduled_events(). */
+static smartlist_t *scheduled_services = NULL;
+
 /* Static declaration. */
+static smartlist_t *get_scheduled_services(void);
+static void service_schedule_now(hs_service_t *service);
 static int load_client_keys(hs_service_t *service);
 static void set_descriptor_revision_counter(hs_service_descriptor_t *hs_desc,
                                             time_t now, bool is_current);
@@ -240,6 +268,9 @@ remove_service(hs_service_ht *map, hs_service_t *service)
 
   /* If we just modified the global map, we notify. */
   if (map == hs_service_map) {
+    /* The service is not part of the scheduled events anymore. The queue
+     * itself gets rebuilt before it is used again. */
+    service->state.sched_idx = -1;
     hs_service_map_has_changed();
   }
 }
@@ -442,6 +473,19 @@ get_intro_point_num_extra(void)
                                  NUM_INTRO_POINTS_EXTRA, 0, 128);
 }
 
+/** Return the number of digest bits that the replay caches of our services
+ * keep, defined by a consensus parameter or the default value. */
+static unsigned
+get_replay_cache_tag_bits(void)
+{
+  int32_t bits = networkstatus_get_param(NULL, "hs_service_replay_cache_bits",
+                                         REPLAYCACHE_DEFAULT_TAG_BITS,
+                                         REPLAYCACHE_MIN_TAG_BITS,
+                                         REPLAYCACHE_MAX_TAG_BITS);
+  /* Replay caches only keep whole bytes of each digest. */
+  return (unsigned) (bits - bits % 8);
+}
+
 /** Helper: Function that needs to return 1 for the HT for each loop which
  * frees every service in an hash map. */
 static int
@@ -536,7 +580,8 @@ service_intro_point_new(const node_t *node)
       crypto_rand_int_range(intro_point_min_lifetime,intro_point_max_lifetime);
   }
 
-  ip->replay_cache = replaycache_new(0, 0);
+  ip->replay_cache =
+    replaycache_new_with_tag_bits(0, 0, get_replay_cache_tag_bits());
 
   /* Initialize the base object. We don't need the certificate object. */
   ip->base.link_specifiers = node_get_link_specifier_smartlist(node, 0);
@@ -958,6 +1003,7 @@ move_hs_state(hs_service_t *src_service, hs_service_t *dst_service)
   src->replay_cache_rend_cookie = NULL; /* steal pointer reference */
 
   dst->next_rotation_time = src->next_rotation_time;
+  dst->next_desc_build_time = src->next_desc_build_time;
 
   if (src->ob_subcreds) {
     dst->ob_subcreds = src->ob_subcreds;
@@ -1800,6 +1846,22 @@ build_desc_signing_key_cert(hs_service_descriptor_t *desc, time_t now)
   tor_assert_nonfatal(plaintext->signing_key_cert);
 }
 
+/** Set the flow control line of the given descriptor from the consensus and
+ * our options as they are now. The encoder only looks at the descriptor for
+ * it, so that it can run on a cpuworker. */
+static void
+service_desc_set_flow_control(hs_descriptor_t *desc)
+{
+  hs_desc_encrypted_data_t *encrypted = &desc->encrypted_data;
+
+  tor_free(encrypted->flow_control_pv);
+  if (congestion_control_enabled()) {
+    tor_asprintf(&encrypted->flow_control_pv, "FlowCtrl=%s",
+                 protover_get_supported(PRT_FLOWCTRL));
+  }
+  encrypted->sendme_inc = congestion_control_sendme_inc();
+}
+
 /** Populate the descriptor encrypted section from the given service object.
  * This will generate a valid list of introduction points that can be used
  * after for circuit creation. Return 0 on success else -1 on error. */
@@ -1813,7 +1875,7 @@ build_service_desc_encrypted(const hs_service_t *service,
   tor_assert(desc);
 
   encrypted = &desc->desc->encrypted_data;
-  encrypted->sendme_inc = congestion_control_sendme_inc();
+  service_desc_set_flow_control(desc->desc);
 
   encrypted->create2_ntor = 1;
   encrypted->single_onion_service = service->config.is_single_onion;
@@ -2146,7 +2208,7 @@ build_descriptors_for_new_service(hs_service_t *service, time_t now)
 STATIC void
 build_all_descriptors(time_t now)
 {
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
 
     /* A service booting up will have both descriptors to NULL. No other cases
      * makes both descriptor non existent. */
@@ -2165,13 +2227,17 @@ build_all_descriptors(time_t now)
     }
 
     if (service->desc_next == NULL) {
+      /* After a rotation, we wait for our own random delay. */
+      if (service->state.next_desc_build_time > now) {
+        continue;
+      }
       build_service_descriptor(service, hs_get_next_time_period_num(0),
                                &service->desc_next);
       log_info(LD_REND, "Hidden service %s next descriptor successfully "
                         "built. Now scheduled for upload.",
                safe_str_client(service->onion_address));
     }
-  } FOR_EACH_DESCRIPTOR_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 }
 
 /** Randomly pick a node to become an introduction point but not present in the
@@ -2414,13 +2480,13 @@ update_service_descriptor_intro_points(hs_service_t *service,
 STATIC void
 update_all_descriptors_intro_points(time_t now)
 {
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
     /* We'll try to update each descriptor that is if certain conditions apply
      * in order for the descriptor to be updated. */
     FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
       update_service_descriptor_intro_points(service, desc, now);
     } FOR_EACH_DESCRIPTOR_END;
-  } FOR_EACH_SERVICE_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 }
 
 /** Update or initialise PoW parameters in the descriptors if they do not
@@ -2429,7 +2495,7 @@ update_all_descriptors_intro_points(time_t now)
 static void
 update_all_descriptors_pow_params(time_t now)
 {
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
     int descs_updated = 0;
     hs_pow_service_state_t *pow_state = service->state.pow_state;
     hs_desc_encrypted_data_t *encrypted;
@@ -2502,7 +2568,7 @@ update_all_descriptors_pow_params(time_t now)
         service_desc_schedule_upload(desc, now, 1);
       } FOR_EACH_DESCRIPTOR_END;
     }
-  } FOR_EACH_SERVICE_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 }
 
 /** Return true iff the given intro point has expired that is it has been used
@@ -2843,12 +2909,25 @@ should_rotate_descriptors(hs_service_t *service, time_t now)
   return 1;
 }
 
+/** Return the longest time, in seconds, that a service waits after rotating
+ * its descriptors before it builds its next descriptor. This is one voting
+ * interval, that is an hour on the public network: the next time period only
+ * starts half a protocol run after the rotation. */
+static int
+get_next_desc_build_max_delay(void)
+{
+  return (int) (sr_state_get_protocol_run_duration() /
+                (SHARED_RANDOM_N_ROUNDS * SHARED_RANDOM_N_PHASES));
+}
+
 /** Rotate the service descriptors of the given service. The current descriptor
  * will be freed, the next one put in as the current and finally the next
  * descriptor pointer is NULLified. */
 static void
-rotate_service_descriptors(hs_service_t *service)
+rotate_service_descriptors(hs_service_t *service, time_t now)
 {
+  int max_delay = get_next_desc_build_max_delay();
+
   if (service->desc_current) {
     /* Close all IP circuits for the descriptor. */
     close_intro_circuits(&service->desc_current->intro_points);
@@ -2857,9 +2936,13 @@ rotate_service_descriptors(hs_service_t *service)
     service_descriptor_free(service->desc_current);
   }
   /* The next one become the current one and emptying the next will trigger
-   * a descriptor creation for it. */
+   * a descriptor creation for it. Services pick a random time for that so
+   * that a tor instance hosting many of them spreads the work of building
+   * descriptors and intro circuits after a rotation. */
   service->desc_current = service->desc_next;
   service->desc_next = NULL;
+  service->state.next_desc_build_time =
+    now + ((max_delay > 0) ? crypto_rand_int(max_delay) : 0);
 
   /* We've just rotated, set the next time for the rotation. */
   set_rotation_time(service);
@@ -2872,9 +2955,10 @@ rotate_all_descriptors(time_t now)
 {
   /* XXX We rotate all our service descriptors at once. In the future it might
    *     be wise, to rotate service descriptors independently to hide that all
-   *     those descriptors are on the same tor instance */
+   *     those descriptors are on the same tor instance. For now, only the
+   *     building of the next descriptors is spread over time. */
 
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
 
     /* Note for a service booting up: Both descriptors are NULL in that case
      * so this function might return true if we are in the timeframe for a
@@ -2890,8 +2974,30 @@ rotate_all_descriptors(time_t now)
              service->desc_current, service->desc_next,
              safe_str_client(service->onion_address));
 
-    rotate_service_descriptors(service);
-  } FOR_EACH_SERVICE_END;
+    rotate_service_descriptors(service, now);
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
+}
+
+/** Report the number of digests in the replay caches of the given service,
+ * the one for rendezvous cookies and those of its intro points, and how much
+ * memory they use, to the metrics of the service. */
+STATIC void
+update_replay_cache_metrics(const hs_service_t *service)
+{
+  const replaycache_t *rend_cookies = service->state.replay_cache_rend_cookie;
+  size_t n_entries = replaycache_get_n_entries(rend_cookies);
+  size_t n_bytes = replaycache_get_memory_usage(rend_cookies);
+
+  FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
+    DIGEST256MAP_FOREACH(desc->intro_points.map, key,
+                         const hs_service_intro_point_t *, ip) {
+      n_entries += replaycache_get_n_entries(ip->replay_cache);
+      n_bytes += replaycache_get_memory_usage(ip->replay_cache);
+    } DIGEST256MAP_FOREACH_END;
+  } FOR_EACH_DESCRIPTOR_END;
+
+  hs_metrics_replay_cache_entries(service, n_entries);
+  hs_metrics_replay_cache_bytes(service, n_bytes);
 }
 
 /** Scheduled event run from the main loop. Make sure all our services are up
@@ -2903,7 +3009,7 @@ run_housekeeping_event(time_t now)
   /* Note that nothing here opens circuit(s) nor uploads descriptor(s). We are
    * simply moving things around or removing unneeded elements. */
 
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
 
     /* If the service is starting off, set the rotation time. We can't do that
      * at configure time because the get_options() needs to be set for setting
@@ -2924,6 +3030,9 @@ run_housekeeping_event(time_t now)
     /* Cleanup invalid intro points from the service descriptor. */
     cleanup_intro_points(service, now);
 
+    /* Report how big the replay caches of what is left are. */
+    update_replay_cache_metrics(service);
+
     /* Remove expired failing intro point from the descriptor failed list. We
      * reset them at each INTRO_CIRC_RETRY_PERIOD. */
     remove_expired_failing_intro(service, now);
@@ -2932,7 +3041,7 @@ run_housekeeping_event(time_t now)
      * events guaranteeing a valid state. Intro points might be missing from
      * the descriptors after the cleanup but the update/build process will
      * make sure we pick those missing ones. */
-  } FOR_EACH_SERVICE_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 }
 
 /** Scheduled event run from the main loop. Make sure all descriptors are up to
@@ -3112,7 +3221,7 @@ run_build_circuit_event(time_t now)
   }
 
   /* Run v3+ check. */
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
     /* For introduction circuit, we need to make sure we don't stress too much
      * circuit creation so make sure this service is respecting that limit. */
     if (can_service_launch_intro_circuit(service, now)) {
@@ -3121,45 +3230,26 @@ run_build_circuit_event(time_t now)
       /* Once the circuits have opened, we'll make sure to update the
        * descriptor intro point list and cleanup any extraneous. */
     }
-  } FOR_EACH_SERVICE_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 }
 
-/** Encode and sign the service descriptor desc and upload it to the given
- * hidden service directory.  This does nothing if PublishHidServDescriptors
- * is false. */
+/** Upload the service descriptor desc, encoded and signed in encoded_desc, to
+ * the given hidden service directory. */
 static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
-                           hs_service_descriptor_t *desc, const node_t *hsdir)
+                           hs_service_descriptor_t *desc, const node_t *hsdir,
+                           const char *encoded_desc)
 {
-  char *encoded_desc = NULL;
-
   tor_assert(service);
   tor_assert(desc);
   tor_assert(hsdir);
-
-  /* Let's avoid doing that if tor is configured to not publish. */
-  if (!get_options()->PublishHidServDescriptors) {
-    log_info(LD_REND, "Service %s not publishing descriptor. "
-                      "PublishHidServDescriptors is set to 0.",
-             safe_str_client(service->onion_address));
-    goto end;
-  }
-
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
-    goto end;
-  }
+  tor_assert(encoded_desc);
 
   /* Time to upload the descriptor to the directory. */
   hs_service_upload_desc_to_dir(encoded_desc, service->config.version,
                                 &service->keys.identity_pk,
                                 &desc->blinded_kp.pubkey, hsdir->rs);
 
-  /* Add this node to previous_hsdirs list */
-  service_desc_note_upload(desc, hsdir);
-
   /* Logging so we know where it was sent. */
   {
     int is_next_desc = (service->desc_next == desc);
@@ -3184,10 +3274,149 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
     hs_control_desc_event_upload(service->onion_address, hsdir->identity,
                                  &desc->blinded_kp.pubkey, idx);
   }
+}
+
+/** Upload the service descriptor desc, encoded and signed in encoded_desc, to
+ * each hidden service directory of the hsdirs list of identity digests. */
+static void
+upload_encoded_descriptor(const hs_service_t *service,
+                          hs_service_descriptor_t *desc,
+                          const smartlist_t *hsdirs, const char *encoded_desc)
+{
+  SMARTLIST_FOREACH_BEGIN(hsdirs, const char *, hsdir_id) {
+    const node_t *hsdir_node = node_get_by_id(hsdir_id);
+    /* The consensus can change while a cpuworker encodes the descriptor. */
+    if (!hsdir_node || !hsdir_node->rs) {
+      continue;
+    }
+    upload_descriptor_to_hsdir(service, desc, hsdir_node, encoded_desc);
+  } SMARTLIST_FOREACH_END(hsdir_id);
+}
+
+/** A service descriptor that a cpuworker encodes and signs before we upload
+ * it. The job works on its own copy of the descriptor since the service can
+ * change it, or go away, in the meantime. */
+typedef struct desc_encode_job_t {
+  /** Identity key of the service and blinded key of the descriptor, to look
+   * them up again once the job is done. */
+  ed25519_public_key_t service_pk;
+  ed25519_public_key_t blinded_pk;
+  /** The upload_gen value of the descriptor when we started this upload. */
+  uint32_t upload_gen;
+  /** The descriptor to encode, and the keys to encode it with. */
+  hs_descriptor_t *desc;
+  ed25519_keypair_t signing_kp;
+  uint8_t descriptor_cookie[HS_DESC_DESCRIPTOR_COOKIE_LEN];
+  /** True iff client authorization is enabled, in which case we encode the
+   * descriptor with <b>descriptor_cookie</b>. */
+  bool use_descriptor_cookie;
+  /** Identity digests of the hidden service directories to upload to. */
+  smartlist_t *hsdirs;
+  /** Set by the cpuworker: the encoded descriptor, or NULL on error. */
+  char *encoded_desc;
+} desc_encode_job_t;
+
+/** Release all memory of the given descriptor encoding job. */
+static void
+desc_encode_job_free(desc_encode_job_t *job)
+{
+  if (!job) {
+    return;
+  }
+  hs_descriptor_free(job->desc);
+  if (job->hsdirs) {
+    SMARTLIST_FOREACH(job->hsdirs, char *, d, tor_free(d));
+    smartlist_free(job->hsdirs);
+  }
+  tor_free(job->encoded_desc);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Worker function: encode and sign the descriptor of a job. */
+static workqueue_reply_t
+desc_encode_worker_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  desc_encode_job_t *job = work_;
+
+  hs_desc_encode_descriptor(job->desc, &job->signing_kp,
+                            job->use_descriptor_cookie ?
+                              job->descriptor_cookie : NULL,
+                            &job->encoded_desc);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function, on the main thread: upload the descriptor that a
+ * cpuworker encoded, unless a newer upload of it started meanwhile. */
+static void
+desc_encode_worker_replyfn(void *work_)
+{
+  desc_encode_job_t *job = work_;
+  hs_service_t *service = hs_service_find(&job->service_pk);
+  hs_service_descriptor_t *desc = NULL;
+
+  if (service) {
+    FOR_EACH_DESCRIPTOR_BEGIN(service, d) {
+      if (ed25519_pubkey_eq(&d->blinded_kp.pubkey, &job->blinded_pk)) {
+        desc = d;
+      }
+    } FOR_EACH_DESCRIPTOR_END;
+  }
+  if (!desc || desc->upload_gen != job->upload_gen) {
+    log_info(LD_REND, "Service descriptor went away, or is being uploaded "
+                      "again, while we were encoding it. Dropping it.");
+    goto end;
+  }
+  /* This should NEVER fail but just in case, let's make sure we have an
+   * actual usable descriptor. */
+  if (BUG(job->encoded_desc == NULL)) {
+    goto end;
+  }
+  upload_encoded_descriptor(service, desc, job->hsdirs, job->encoded_desc);
 
  end:
-  tor_free(encoded_desc);
-  return;
+  desc_encode_job_free(job);
+}
+
+/** Hand over the encoding and signing of the given service descriptor, and
+ * its upload to the hsdirs list of identity digests, to a cpuworker. On
+ * success, the job takes ownership of hsdirs.
+ *
+ * Return 0 if the descriptor is now in the hands of a cpuworker. Return -1 if
+ * the caller must encode it itself because we have no cpuworkers. */
+static int
+queue_desc_encode_job(const hs_service_t *service,
+                      const hs_service_descriptor_t *desc,
+                      smartlist_t *hsdirs)
+{
+  desc_encode_job_t *job;
+
+  if (cpuworker_get_n_threads() == 0) {
+    return -1;
+  }
+
+  job = tor_malloc_zero(sizeof(*job));
+  ed25519_pubkey_copy(&job->service_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&job->blinded_pk, &desc->blinded_kp.pubkey);
+  job->upload_gen = desc->upload_gen;
+  job->desc = hs_descriptor_dup(desc->desc);
+  memcpy(&job->signing_kp, &desc->signing_kp, sizeof(job->signing_kp));
+  if (is_client_auth_enabled(service)) {
+    memcpy(job->descriptor_cookie, desc->descriptor_cookie,
+           sizeof(job->descriptor_cookie));
+    job->use_descriptor_cookie = true;
+  }
+  job->hsdirs = hsdirs;
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW, desc_encode_worker_threadfn,
+                            desc_encode_worker_replyfn, job)) {
+    /* The list still belongs to the caller. */
+    job->hsdirs = NULL;
+    desc_encode_job_free(job);
+    return -1;
+  }
+  return 0;
 }
 
 /** Set the revision counter in <b>hs_desc</b>. We do this by encrypting a
@@ -3294,16 +3523,47 @@ upload_descriptor_to_all(const hs_service_t *service,
    *  list. Let's keep it up to date. */
   service_desc_clear_previous_hsdirs(desc);
 
-  /* For each responsible HSDir we have, initiate an upload command. */
-  SMARTLIST_FOREACH_BEGIN(responsible_dirs, const routerstatus_t *,
-                          hsdir_rs) {
-    const node_t *hsdir_node = node_get_by_id(hsdir_rs->identity_digest);
-    /* Getting responsible hsdir implies that the node_t object exists for the
-     * routerstatus_t found in the consensus else we have a problem. */
-    tor_assert(hsdir_node);
-    /* Upload this descriptor to the chosen directory. */
-    upload_descriptor_to_hsdir(service, desc, hsdir_node);
-  } SMARTLIST_FOREACH_END(hsdir_rs);
+  /* A cpuworker that is still encoding this descriptor for a previous upload
+   * must not upload it anymore. */
+  desc->upload_gen++;
+
+  if (!get_options()->PublishHidServDescriptors) {
+    /* Let's avoid doing that if tor is configured to not publish. */
+    log_info(LD_REND, "Service %s not publishing descriptor. "
+                      "PublishHidServDescriptors is set to 0.",
+             safe_str_client(service->onion_address));
+  } else if (smartlist_len(responsible_dirs) > 0) {
+    smartlist_t *hsdirs = smartlist_new();
+
+    SMARTLIST_FOREACH_BEGIN(responsible_dirs, const routerstatus_t *,
+                            hsdir_rs) {
+      const node_t *hsdir_node = node_get_by_id(hsdir_rs->identity_digest);
+      /* Getting responsible hsdir implies that the node_t object exists for
+       * the routerstatus_t found in the consensus else we have a problem. */
+      tor_assert(hsdir_node);
+      /* Add this node to previous_hsdirs list */
+      service_desc_note_upload(desc, hsdir_node);
+      smartlist_add(hsdirs, tor_memdup(hsdir_rs->identity_digest,
+                                       DIGEST_LEN));
+    } SMARTLIST_FOREACH_END(hsdir_rs);
+
+    /* The descriptor is the same for every HSDir so we encode and sign it
+     * only once, on a cpuworker if we have some. Whether it advertises flow
+     * control can change with the consensus, so we look now. */
+    service_desc_set_flow_control(desc->desc);
+    if (queue_desc_encode_job(service, desc, hsdirs) < 0) {
+      char *encoded_desc = NULL;
+      /* This should NEVER fail but just in case, let's make sure we have an
+       * actual usable descriptor. */
+      if (!BUG(service_encode_descriptor(service, desc, &desc->signing_kp,
+                                         &encoded_desc) < 0)) {
+        upload_encoded_descriptor(service, desc, hsdirs, encoded_desc);
+      }
+      tor_free(encoded_desc);
+      SMARTLIST_FOREACH(hsdirs, char *, d, tor_free(d));
+      smartlist_free(hsdirs);
+    }
+  }
 
   /* Set the next upload time for this descriptor. Even if we are configured
    * to not upload, we still want to follow the right cycle of life for this
@@ -3547,7 +3807,7 @@ STATIC void
 run_upload_descriptor_event(time_t now)
 {
   /* Run v3+ check. */
-  FOR_EACH_SERVICE_BEGIN(service) {
+  FOR_EACH_SCHEDULED_SERVICE_BEGIN(service) {
     FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
       /* If we were asked to re-examine the hash ring, and it changed, then
          schedule an upload */
@@ -3577,12 +3837,145 @@ run_upload_descriptor_event(time_t now)
       /* Proceed with the upload, the descriptor is ready to be encoded. */
       upload_descriptor_to_all(service, desc);
     } FOR_EACH_DESCRIPTOR_END;
-  } FOR_EACH_SERVICE_END;
+  } FOR_EACH_SCHEDULED_SERVICE_END(service);
 
   /* We are done considering whether to republish rend descriptors */
   consider_republishing_hs_descriptors = 0;
 }
 
+/** Return a newly allocated list of the services that the scheduled events
+ * look at: the ones that are due in the current run, or every service of the
+ * global map outside of a run, which is how the unit tests use the events. */
+static smartlist_t *
+get_scheduled_services(void)
+{
+  smartlist_t *services = smartlist_new();
+
+  if (scheduled_services) {
+    smartlist_add_all(services, scheduled_services);
+  } else {
+    FOR_EACH_SERVICE_BEGIN(service) {
+      smartlist_add(services, service);
+    } FOR_EACH_SERVICE_END;
+  }
+  return services;
+}
+
+/** Priority queue helper: order services by the time at which the scheduled
+ * events must look at them. */
+static int
+compare_service_next_run_time_(const void *a_, const void *b_)
+{
+  const hs_service_t *a = a_, *b = b_;
+
+  if (a->state.next_run_time < b->state.next_run_time) {
+    return -1;
+  } else if (a->state.next_run_time > b->state.next_run_time) {
+    return 1;
+  }
+  return 0;
+}
+
+/** Offset of the priority queue index in a service object. */
+#define SERVICE_SCHED_IDX_OFFSET offsetof(hs_service_t, state.sched_idx)
+
+/** Rebuild the priority queue of the scheduled events from the global map.
+ * Services keep the time at which they want to run next. */
+static void
+rebuild_service_schedule(void)
+{
+  if (!service_schedule) {
+    service_schedule = smartlist_new();
+  }
+  smartlist_clear(service_schedule);
+  FOR_EACH_SERVICE_BEGIN(service) {
+    smartlist_pqueue_add(service_schedule, compare_service_next_run_time_,
+                         SERVICE_SCHED_IDX_OFFSET, service);
+  } FOR_EACH_SERVICE_END;
+  service_schedule_is_stale = false;
+}
+
+/** Remove from the priority queue, and return in a newly allocated list, the
+ * services that the scheduled events must look at in their run at now. That
+ * is every service if we were asked to re-examine the hash ring. */
+STATIC smartlist_t *
+pop_due_services(time_t now)
+{
+  smartlist_t *due = smartlist_new();
+
+  if (service_schedule_is_stale) {
+    rebuild_service_schedule();
+  }
+  while (smartlist_len(service_schedule) > 0) {
+    hs_service_t *service = smartlist_get(service_schedule, 0);
+    if (service->state.next_run_time > now &&
+        !consider_republishing_hs_descriptors) {
+      break;
+    }
+    smartlist_pqueue_pop(service_schedule, compare_service_next_run_time_,
+                         SERVICE_SCHED_IDX_OFFSET);
+    smartlist_add(due, service);
+  }
+  return due;
+}
+
+/** Return the time at which the scheduled events must look at the given
+ * service again, knowing that they just did at now. A service that is still
+ * missing descriptors, intro points, intro circuits or an upload needs us
+ * every second. Else, we come back when something is due, and at most
+ * HS_SERVICE_IDLE_RUN_INTERVAL seconds later. Events that need a service
+ * sooner than that call hs_service_schedule_now(). */
+STATIC time_t
+service_get_next_run_time(const hs_service_t *service, time_t now)
+{
+  time_t next = now + HS_SERVICE_IDLE_RUN_INTERVAL;
+
+  tor_assert(service);
+
+  if (!service->desc_current) {
+    goto busy;
+  }
+  if (!service->desc_next) {
+    /* We are waiting out our delay before building it, see
+     * rotate_service_descriptors(). */
+    if (service->state.next_desc_build_time <= now) {
+      goto busy;
+    }
+    next = MIN(next, service->state.next_desc_build_time);
+  }
+  /* We rotate our descriptors with the first consensus that is valid past
+   * this time, see should_rotate_descriptors(). */
+  if (service->state.next_rotation_time == 0) {
+    goto busy;
+  }
+  next = MIN(next, service->state.next_rotation_time);
+
+  FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
+    unsigned int num_intro_points = digest256map_size(desc->intro_points.map);
+
+    if (num_intro_points < service->config.num_intro_points ||
+        count_desc_circuit_established(desc) != num_intro_points ||
+        desc->next_upload_time <= now) {
+      goto busy;
+    }
+    next = MIN(next, desc->next_upload_time);
+    DIGEST256MAP_FOREACH(desc->intro_points.map, key,
+                         const hs_service_intro_point_t *, ip) {
+      next = MIN(next, ip->time_to_expire);
+    } DIGEST256MAP_FOREACH_END;
+  } FOR_EACH_DESCRIPTOR_END;
+
+  if (service->config.has_pow_defenses_enabled && service->state.pow_state) {
+    next = MIN(next, service->state.pow_state->expiration_time);
+    next = MIN(next, service->state.pow_state->next_effort_update);
+  }
+
+  return MAX(next, now + 1);
+
+ busy:
+  return now + 1;
+}
+
 /** Called when the introduction point circuit is done building and ready to be
  * used. */
 static void
@@ -3751,6 +4144,9 @@ service_handle_intro_established(origin_circuit_t *circ,
                     "on circuit %u for service %s",
            TO_CIRCUIT(circ)->n_circ_id,
            safe_str_client(service->onion_address));
+
+  /* The descriptors might now be ready for upload. */
+  service_schedule_now(service);
   return 0;
 
  err:
@@ -3802,9 +4198,6 @@ service_handle_introduce2(origin_circuit_t *circ, const uint8_t *payload,
                                 payload, payload_len) < 0) {
     goto err;
   }
-  /* Update metrics that a new introduction was successful. */
-  hs_metrics_new_introduction(service);
-
   return 0;
  err:
 
@@ -3950,6 +4343,14 @@ hs_service_circuit_cleanup_on_close(const circuit_t *circ)
      * to reflect how many we have at the moment. */
     hs_metrics_close_established_intro(
       &CONST_TO_ORIGIN_CIRCUIT(circ)->hs_ident->identity_pk);
+    /* The service has an intro circuit to replace. */
+    hs_service_schedule_now(
+      &CONST_TO_ORIGIN_CIRCUIT(circ)->hs_ident->identity_pk);
+    break;
+  case CIRCUIT_PURPOSE_S_ESTABLISH_INTRO:
+    /* The service has an intro circuit to retry. */
+    hs_service_schedule_now(
+      &CONST_TO_ORIGIN_CIRCUIT(circ)->hs_ident->identity_pk);
     break;
   case CIRCUIT_PURPOSE_S_REND_JOINED:
     /* About to close an established rendezvous circuit. Update the metrics to
@@ -3970,6 +4371,9 @@ hs_service_circuit_cleanup_on_close(const circuit_t *circ)
 void
 hs_service_map_has_changed(void)
 {
+  /* The scheduled events must rebuild their priority queue of services. */
+  service_schedule_is_stale = true;
+
   /* If we now have services where previously we had not, we need to enable
    * the HS service main loop event. If we changed to having no services, we
    * need to disable the event. */
@@ -3999,6 +4403,7 @@ hs_service_new_consensus_params(const networkstatus_t *ns)
         /* Passing the maximum time_t will force expiration of all intro points
          * and thus will lead to a rebuild of the descriptor. */
         cleanup_intro_points(service, LONG_MAX);
+        service_schedule_now(service);
       }
     } FOR_EACH_DESCRIPTOR_END;
   } FOR_EACH_SERVICE_END;
@@ -4606,6 +5011,15 @@ hs_service_find(const ed25519_public_key_t *identity_pk)
   return find_service(hs_service_map, identity_pk);
 }
 
+/** Return the intro point of the given service that has the given auth key,
+ * in either of its descriptors, or NULL if not found. */
+hs_service_intro_point_t *
+hs_service_find_intro_point(const hs_service_t *service,
+                            const ed25519_public_key_t *auth_key)
+{
+  return service_intro_point_find(service, auth_key);
+}
+
 /** Allocate and initialize a service object. The service configuration will
  * contain the default values. Return the newly allocated object pointer. This
  * function can't fail. */
@@ -4619,7 +5033,11 @@ hs_service_new(const or_options_t *options)
   service->config.version = HS_SERVICE_DEFAULT_VERSION;
   /* Allocate the CLIENT_PK replay cache in service state. */
   service->state.replay_cache_rend_cookie =
-    replaycache_new(REND_REPLAY_TIME_INTERVAL, REND_REPLAY_TIME_INTERVAL);
+    replaycache_new_with_tag_bits(REND_REPLAY_TIME_INTERVAL,
+                                  REND_REPLAY_TIME_INTERVAL,
+                                  get_replay_cache_tag_bits());
+  /* Not in the priority queue of the scheduled events yet. */
+  service->state.sched_idx = -1;
 
   return service;
 }
@@ -4670,6 +5088,16 @@ hs_service_free_(hs_service_t *service)
 void
 hs_service_run_scheduled_events(time_t now)
 {
+  /* Only the services that are due are part of this run. The others wait in
+   * the priority queue until their next run time, or until something calls
+   * hs_service_schedule_now() on them. */
+  smartlist_t *due = pop_due_services(now);
+  if (smartlist_len(due) == 0) {
+    smartlist_free(due);
+    return;
+  }
+  scheduled_services = due;
+
   /* First thing we'll do here is to make sure our services are in a
    * quiescent state for the scheduled events. */
   run_housekeeping_event(now);
@@ -4685,6 +5113,49 @@ hs_service_run_scheduled_events(time_t now)
   run_build_circuit_event(now);
   /* Upload the descriptors if needed/possible. */
   run_upload_descriptor_event(now);
+
+  /* Put the services back in the queue for when they next need us. If the
+   * map changed during the run, the queue gets rebuilt anyway. */
+  scheduled_services = NULL;
+  SMARTLIST_FOREACH_BEGIN(due, hs_service_t *, service) {
+    service->state.next_run_time = service_get_next_run_time(service, now);
+    if (!service_schedule_is_stale) {
+      smartlist_pqueue_add(service_schedule, compare_service_next_run_time_,
+                           SERVICE_SCHED_IDX_OFFSET, service);
+    }
+  } SMARTLIST_FOREACH_END(service);
+  smartlist_free(due);
+}
+
+/** Make the scheduled events look at the given service at their next run,
+ * which is within a second. */
+static void
+service_schedule_now(hs_service_t *service)
+{
+  tor_assert(service);
+
+  service->state.next_run_time = 0;
+  /* Move it to the head of the queue. A service that is not in there gets
+   * back in when its run is over or when the queue is rebuilt. */
+  if (!service_schedule_is_stale && service->state.sched_idx >= 0) {
+    smartlist_pqueue_remove(service_schedule, compare_service_next_run_time_,
+                            SERVICE_SCHED_IDX_OFFSET, service);
+    smartlist_pqueue_add(service_schedule, compare_service_next_run_time_,
+                         SERVICE_SCHED_IDX_OFFSET, service);
+  }
+}
+
+/** Make the scheduled events look at the service with the given identity
+ * key, if we have it, at their next run. This is for the events that change
+ * what a service needs, like the loss of an intro circuit. */
+void
+hs_service_schedule_now(const ed25519_public_key_t *identity_pk)
+{
+  hs_service_t *service = hs_service_find(identity_pk);
+
+  if (service) {
+    service_schedule_now(service);
+  }
 }
 
 /** Initialize the service HS subsystem. */
@@ -4705,6 +5176,8 @@ hs_service_init(void)
 void
 hs_service_free_all(void)
 {
+  smartlist_free(service_schedule);
+  service_schedule_is_stale = true;
   service_free_all();
   hs_config_free_all();
 }
@@ -40,6 +40,11 @@
 #define HS_SERVICE_POW_SEED_ROTATE_TIME_MIN (7200 - 900)
 #define HS_SERVICE_POW_SEED_ROTATE_TIME_MAX (7200)
 
+/** A service that has all its descriptors, intro points and intro circuits
+ * is looked at by the scheduled events at least this often (in seconds).
+ * Services that are still missing something are looked at every second. */
+#define HS_SERVICE_IDLE_RUN_INTERVAL 10
+
 /** Collected metrics for a specific service. */
 typedef struct hs_service_metrics_t {
   /** Store containing the metrics values. */
@@ -180,6 +185,11 @@ typedef struct hs_service_descriptor_t {
    *  is different from this list, this means we received new dirinfo and we
    *  need to reupload our descriptor. */
   smartlist_t *previous_hsdirs;
+
+  /** Mutable: Incremented every time we start an upload of this descriptor.
+   * A cpuworker that is still encoding the descriptor for an older upload
+   * drops its result. */
+  uint32_t upload_gen;
 } hs_service_descriptor_t;
 
 /** Service key material. */
@@ -309,6 +319,19 @@ typedef struct hs_service_state_t {
   /** State of the PoW defenses, which may be enabled dynamically. NULL if not
    * defined for this service. */
   hs_pow_service_state_t *pow_state;
+
+  /** When we may build the next descriptor after a rotation. Each service
+   * picks a random delay so that a tor instance that hosts many of them
+   * doesn't build all their descriptors at once. */
+  time_t next_desc_build_time;
+
+  /** When the scheduled events must look at this service again. 0 means at
+   * their next run. */
+  time_t next_run_time;
+
+  /** Index of this service in the priority queue of the scheduled events, or
+   * -1 if it is not in it. */
+  int sched_idx;
 } hs_service_state_t;
 
 /** Representation of a service running on this tor instance. */
@@ -361,6 +384,9 @@ void hs_service_free_(hs_service_t *service);
 #define hs_service_free(s) FREE_AND_NULL(hs_service_t, hs_service_free_, (s))
 
 hs_service_t *hs_service_find(const ed25519_public_key_t *ident_pk);
+hs_service_intro_point_t *hs_service_find_intro_point(
+                                   const hs_service_t *service,
+                                   const ed25519_public_key_t *auth_key);
 MOCK_DECL(unsigned int, hs_service_get_num_services,(void));
 void hs_service_stage_services(const smartlist_t *service_list);
 int hs_service_load_all_keys(void);
@@ -375,6 +401,7 @@ void hs_service_map_has_changed(void);
 void hs_service_dir_info_changed(void);
 void hs_service_new_consensus_params(const networkstatus_t *ns);
 void hs_service_run_scheduled_events(time_t now);
+void hs_service_schedule_now(const ed25519_public_key_t *identity_pk);
 void hs_service_circuit_has_opened(origin_circuit_t *circ);
 int hs_service_receive_intro_established(origin_circuit_t *circ,
                                          const uint8_t *payload,
@@ -475,11 +502,15 @@ STATIC int can_service_launch_intro_circuit(hs_service_t *service,
                                             time_t now);
 STATIC int intro_point_should_expire(const hs_service_intro_point_t *ip,
                                      time_t now);
+STATIC void update_replay_cache_metrics(const hs_service_t *service);
 STATIC void run_housekeeping_event(time_t now);
 STATIC void rotate_all_descriptors(time_t now);
 STATIC void build_all_descriptors(time_t now);
 STATIC void update_all_descriptors_intro_points(time_t now);
 STATIC void run_upload_descriptor_event(time_t now);
+STATIC time_t service_get_next_run_time(const hs_service_t *service,
+                                        time_t now);
+STATIC smartlist_t *pop_due_services(time_t now);
 
 STATIC void service_descriptor_free_(hs_service_descriptor_t *desc);
 #define service_descriptor_free(d) \
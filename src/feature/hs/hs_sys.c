@@ -20,6 +20,7 @@ subsys_hs_initialize(void)
 static void
 subsys_hs_shutdown(void)
 {
+  hs_metrics_client_free_all();
 }
 
 const subsys_fns_t sys_hs = {
@@ -4,7 +4,7 @@
 /**
  * \file replaycache.c
  *
- * \brief Self-scrubbing replay cache for rendservice.c
+ * \brief Self-scrubbing replay cache for onion services
  *
  * To prevent replay attacks, hidden services need to recognize INTRODUCE2
  * cells that they've already seen, and drop them.  If they didn't, then
@@ -16,13 +16,105 @@
  * RSA-encrypted portion of the handshake, since the rest of the handshake is
  * malleable.)
  *
- * This module is used from rendservice.c.
+ * This module is used from the onion service code, for the INTRODUCE2 cells
+ * of each introduction point and for rendezvous cookies.
+ *
+ * A cache is a small ring of time buckets ("generations"), each an open
+ * addressing hash set of truncated keyed digests. New digests go to the
+ * newest bucket, and a bucket is dropped whole once everything in it is
+ * older than the horizon, so aging out never walks the entries.
  */
 
 #define REPLAYCACHE_PRIVATE
 
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "lib/crypt_ops/crypto_rand.h"
+
+/** Number of slots of a bucket's table when we first add to it. */
+#define REPLAYCACHE_MIN_CAPACITY 16
+
+/** Free the tags of <b>b</b> and mark it empty. */
+static void
+replaycache_bucket_clear(replaycache_bucket_t *b)
+{
+  tor_free(b->tags);
+  b->capacity = 0;
+  b->n_entries = 0;
+}
+
+/** Store the low <b>len</b> bytes of <b>tag</b> at <b>p</b>. */
+static inline void
+tag_store(uint8_t *p, size_t len, uint64_t tag)
+{
+  for (size_t i = 0; i < len; i++) {
+    p[i] = (uint8_t) (tag >> (8 * i));
+  }
+}
+
+/** Return the tag of <b>len</b> bytes stored at <b>p</b>. */
+static inline uint64_t
+tag_load(const uint8_t *p, size_t len)
+{
+  uint64_t tag = 0;
+  for (size_t i = 0; i < len; i++) {
+    tag |= ((uint64_t) p[i]) << (8 * i);
+  }
+  return tag;
+}
+
+/** Return the slot of <b>b</b> that holds <b>tag</b>, or the empty slot
+ * where it would go. The table of <b>b</b> must not be full. */
+static uint8_t *
+replaycache_bucket_slot(const replaycache_bucket_t *b, size_t tag_len,
+                        uint64_t tag)
+{
+  const size_t mask = b->capacity - 1;
+  size_t idx = (size_t) tag & mask;
+
+  for (;;) {
+    uint8_t *slot = b->tags + idx * tag_len;
+    uint64_t v = tag_load(slot, tag_len);
+    if (v == 0 || v == tag) {
+      return slot;
+    }
+    idx = (idx + 1) & mask;
+  }
+}
+
+/** Return true iff <b>tag</b> is in <b>b</b>. */
+static int
+replaycache_bucket_contains(const replaycache_bucket_t *b, size_t tag_len,
+                            uint64_t tag)
+{
+  if (b->n_entries == 0) {
+    return 0;
+  }
+  return tag_load(replaycache_bucket_slot(b, tag_len, tag), tag_len) == tag;
+}
+
+/** Add <b>tag</b>, which must not already be there, to <b>b</b>. Grow the
+ * table of <b>b</b> so that it is never more than half full. */
+static void
+replaycache_bucket_add(replaycache_bucket_t *b, size_t tag_len, uint64_t tag)
+{
+  if ((b->n_entries + 1) * 2 > b->capacity) {
+    replaycache_bucket_t grown = *b;
+    grown.capacity = b->capacity ? b->capacity * 2 : REPLAYCACHE_MIN_CAPACITY;
+    grown.tags = tor_calloc(grown.capacity, tag_len);
+    for (size_t i = 0; i < b->capacity; i++) {
+      uint64_t v = tag_load(b->tags + i * tag_len, tag_len);
+      if (v) {
+        tag_store(replaycache_bucket_slot(&grown, tag_len, v), tag_len, v);
+      }
+    }
+    tor_free(b->tags);
+    *b = grown;
+  }
+
+  tag_store(replaycache_bucket_slot(b, tag_len, tag), tag_len, tag);
+  b->n_entries++;
+}
 
 /** Free the replaycache r and all of its entries.
  */
@@ -34,7 +126,9 @@ replaycache_free_(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  for (int i = 0; i < r->n_buckets; i++) {
+    replaycache_bucket_clear(&r->buckets[i]);
+  }
 
   tor_free(r);
 }
@@ -45,6 +139,25 @@ replaycache_free_(replaycache_t *r)
  */
 replaycache_t *
 replaycache_new(time_t horizon, time_t interval)
+{
+  return replaycache_new_with_tag_bits(horizon, interval,
+                                       REPLAYCACHE_DEFAULT_TAG_BITS);
+}
+
+/** Like replaycache_new(), but only keep <b>tag_bits</b> bits of each
+ * digest, a multiple of 8 between REPLAYCACHE_MIN_TAG_BITS and
+ * REPLAYCACHE_MAX_TAG_BITS. Fewer bits use less memory, at the cost of a
+ * higher chance of taking a new digest for a replay: at most N / 2^tag_bits
+ * for a cache holding N digests.
+ *
+ * Digests are kept in time buckets of <b>interval</b> seconds (or a fraction
+ * of the horizon if interval is 0), which are dropped whole once everything
+ * in them is older than the horizon. So a digest may still be reported up to
+ * one interval after it aged out.
+ */
+replaycache_t *
+replaycache_new_with_tag_bits(time_t horizon, time_t interval,
+                              unsigned tag_bits)
 {
   replaycache_t *r = NULL;
 
@@ -54,17 +167,39 @@ replaycache_new(time_t horizon, time_t interval)
     goto err;
   }
 
+  if (tag_bits < REPLAYCACHE_MIN_TAG_BITS ||
+      tag_bits > REPLAYCACHE_MAX_TAG_BITS || tag_bits % 8) {
+    log_info(LD_BUG, "replaycache_new() called with invalid tag size"
+        " %u", tag_bits);
+    goto err;
+  }
+
   if (interval < 0) {
     log_info(LD_BUG, "replaycache_new() called with negative interval"
         " parameter");
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
-  r->scrub_interval = interval;
-  r->scrubbed = 0;
+  r = tor_malloc_zero(sizeof(*r));
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  r->tag_len = tag_bits / 8;
+  crypto_rand((char *) &r->key, sizeof(r->key));
+
+  if (horizon == 0) {
+    /* Nothing ever expires, so one generation will do. */
+    r->n_buckets = 1;
+  } else {
+    if (interval == 0 || interval > horizon) {
+      interval = CEIL_DIV(horizon, REPLAYCACHE_DEFAULT_BUCKETS - 1);
+    }
+    /* We need enough buckets that the one we recycle is always older than
+     * the horizon. */
+    if (CEIL_DIV(horizon, interval) + 1 > REPLAYCACHE_MAX_BUCKETS) {
+      interval = CEIL_DIV(horizon, REPLAYCACHE_MAX_BUCKETS - 1);
+    }
+    r->bucket_width = interval;
+    r->n_buckets = (int) CEIL_DIV(horizon, interval) + 1;
+  }
 
  err:
   return r;
@@ -78,8 +213,8 @@ replaycache_add_and_test_internal(
     time_t *elapsed)
 {
   int rv = 0;
-  uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  uint64_t tag;
+  replaycache_bucket_t *cur, *found = NULL;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -88,46 +223,67 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
+  /* Drop the generations that aged out, so they can't give us a hit. */
+  replaycache_scrub_if_needed_internal(present, r);
+
+  /* Start a new generation if the current one is full of time, recycling
+   * the oldest one which is past the horizon by now. */
+  cur = &r->buckets[r->cur_bucket];
+  if (r->horizon > 0 && cur->n_entries > 0 &&
+      present - cur->first_seen > r->bucket_width) {
+    r->cur_bucket = (r->cur_bucket + 1) % r->n_buckets;
+    cur = &r->buckets[r->cur_bucket];
+    replaycache_bucket_clear(cur);
+  }
+
   /* compute digest */
-  crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
-
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
-
-  /* seen before? */
-  if (access_time != NULL) {
-    /*
-     * If it's far enough in the past, no hit.  If the horizon is zero, we
-     * never expire.
-     */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
-      /* replay cache hit, return 1 */
-      rv = 1;
-      /* If we want to output an elapsed time, do so */
-      if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
-        } else {
-          /* We shouldn't really be seeing hits from the future, but... */
-          *elapsed = 0;
-        }
-      }
+  tag = siphash24(data, len, &r->key);
+  if (r->tag_len < sizeof(tag)) {
+    tag &= (UINT64_C(1) << (8 * r->tag_len)) - 1;
+  }
+  /* An all zero tag marks an empty slot. */
+  if (tag == 0) {
+    tag = 1;
+  }
+
+  /* seen before? Look from the newest generation to the oldest. */
+  for (int i = 0; i < r->n_buckets; i++) {
+    replaycache_bucket_t *b =
+      &r->buckets[(r->cur_bucket - i + r->n_buckets) % r->n_buckets];
+    if (replaycache_bucket_contains(b, r->tag_len, tag)) {
+      found = b;
+      break;
     }
-    /*
-     * If it's ahead of the cached time, update
-     */
-    if (*access_time < present) {
-      *access_time = present;
+  }
+
+  if (found) {
+    /* replay cache hit, return 1 */
+    rv = 1;
+    /* If we want to output an elapsed time, do so. We only know when its
+     * generation was last added to, so this can underestimate by up to one
+     * bucket width. */
+    if (elapsed) {
+      if (present >= found->last_seen) {
+        *elapsed = present - found->last_seen;
+      } else {
+        /* We shouldn't really be seeing hits from the future, but... */
+        *elapsed = 0;
+      }
     }
-  } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
   }
 
-  /* now scrub the cache if it's time */
-  replaycache_scrub_if_needed_internal(present, r);
+  /* Add it to the current generation, or refresh it if it is in an older
+   * one, so it is remembered for another horizon. */
+  if (found != cur) {
+    if (cur->n_entries == 0) {
+      cur->first_seen = present;
+      cur->last_seen = present;
+    }
+    replaycache_bucket_add(cur, r->tag_len, tag);
+  }
+  if (cur->last_seen < present) {
+    cur->last_seen = present;
+  }
 
  done:
   return rv;
@@ -138,43 +294,23 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
   }
 
-  /* scrub time yet? (scrubbed == 0 indicates never scrubbed before) */
-  if (present - r->scrubbed < r->scrub_interval && r->scrubbed > 0) return;
-
   /* if we're never expiring, don't bother scrubbing */
   if (r->horizon == 0) return;
 
-  /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
+  /* A generation ages out as a whole once its newest digest did. */
+  for (int i = 0; i < r->n_buckets; i++) {
+    replaycache_bucket_t *b = &r->buckets[i];
+    if (b->n_entries > 0 && b->last_seen < present - r->horizon) {
+      replaycache_bucket_clear(b);
     }
   }
-
-  /* update scrubbed timestamp */
-  if (present > r->scrubbed) r->scrubbed = present;
 }
 
 /** Test the buffer of length len point to by data against the replay cache r;
@@ -189,7 +325,8 @@ replaycache_add_and_test(replaycache_t *r, const void *data, size_t len)
 }
 
 /** Like replaycache_add_and_test(), but if it's a hit also return the time
- * elapsed since this digest was last seen.
+ * elapsed since this digest was last seen. That time is only known to within
+ * one scrub interval, and may be underestimated by that much.
  */
 int
 replaycache_add_test_and_elapsed(
@@ -207,3 +344,35 @@ replaycache_scrub_if_needed(replaycache_t *r)
   replaycache_scrub_if_needed_internal(time(NULL), r);
 }
 
+/** Return the number of digests that <b>r</b> holds, including any that
+ * aged out but haven't been scrubbed yet.
+ */
+size_t
+replaycache_get_n_entries(const replaycache_t *r)
+{
+  size_t n = 0;
+
+  if (!r) return 0;
+
+  for (int i = 0; i < r->n_buckets; i++) {
+    n += r->buckets[i].n_entries;
+  }
+  return n;
+}
+
+/** Return the number of bytes of memory used by <b>r</b>.
+ */
+size_t
+replaycache_get_memory_usage(const replaycache_t *r)
+{
+  size_t total;
+
+  if (!r) return 0;
+
+  total = sizeof(*r);
+  for (int i = 0; i < r->n_buckets; i++) {
+    total += r->buckets[i].capacity * r->tag_len;
+  }
+  return total;
+}
+
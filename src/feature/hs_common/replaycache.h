@@ -11,22 +11,61 @@
 
 typedef struct replaycache_t replaycache_t;
 
+/** Default number of bits of each digest that a replay cache keeps. A cache
+ * holding N entries reports a false replay with probability at most
+ * N / 2^bits. */
+#define REPLAYCACHE_DEFAULT_TAG_BITS 64
+/** Smallest and largest number of digest bits a replay cache can keep. Only
+ * multiples of 8 are allowed. */
+#define REPLAYCACHE_MIN_TAG_BITS 32
+#define REPLAYCACHE_MAX_TAG_BITS 64
+
 #ifdef REPLAYCACHE_PRIVATE
 
+#include "ext/siphash.h"
+
+/** Most time buckets a replay cache can have. */
+#define REPLAYCACHE_MAX_BUCKETS 8
+/** Number of time buckets of a cache created without a scrub interval. */
+#define REPLAYCACHE_DEFAULT_BUCKETS 4
+
+/** One generation of a replay cache: an open addressing hash set of
+ * truncated digests, all seen during the same span of time. */
+typedef struct replaycache_bucket_t {
+  /** Table of <b>capacity</b> tags, each of the cache's tag_len bytes. An
+   * all zero tag is an empty slot. NULL until something is added. */
+  uint8_t *tags;
+  /** Number of slots of <b>tags</b>; a power of two, or 0. */
+  size_t capacity;
+  /** Number of tags in use. */
+  size_t n_entries;
+  /** When the first and the last digest were added to this bucket. */
+  time_t first_seen;
+  time_t last_seen;
+} replaycache_bucket_t;
+
 struct replaycache_t {
-  /** Scrub interval */
-  time_t scrub_interval;
-  /** Last scrubbed */
-  time_t scrubbed;
   /**
    * Horizon
-   * (don't return true on digests in the cache but older than this)
+   * (don't return true on digests older than this; 0 means never expire)
    */
   time_t horizon;
-  /**
-   * Digest map: keys are digests, values are times the digest was last seen
-   */
-  digest256map_t *digests_seen;
+  /** Span of time covered by a single bucket. Digests age out between
+   * <b>horizon</b> and <b>horizon</b> + <b>bucket_width</b> after they were
+   * last seen. Unused if <b>horizon</b> is 0. */
+  time_t bucket_width;
+  /** Number of buckets in use in <b>buckets</b>. */
+  int n_buckets;
+  /** Index of the bucket that new digests are added to. The others are
+   * older generations, in ring order. */
+  int cur_bucket;
+  /** Number of bytes of each digest that we keep. */
+  size_t tag_len;
+  /** Random key for the digests, so that nobody can predict which inputs
+   * collide in our tables. */
+  struct sipkey key;
+  /** Generations of digests. */
+  replaycache_bucket_t buckets[REPLAYCACHE_MAX_BUCKETS];
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -42,6 +81,8 @@ void replaycache_free_(replaycache_t *r);
 #define replaycache_free(r) \
   FREE_AND_NULL(replaycache_t, replaycache_free_, (r))
 replaycache_t * replaycache_new(time_t horizon, time_t interval);
+replaycache_t *replaycache_new_with_tag_bits(time_t horizon, time_t interval,
+                                             unsigned tag_bits);
 
 #ifdef REPLAYCACHE_PRIVATE
 
@@ -68,5 +109,7 @@ int replaycache_add_and_test(replaycache_t *r, const void *data, size_t len);
 int replaycache_add_test_and_elapsed(
     replaycache_t *r, const void *data, size_t len, time_t *elapsed);
 void replaycache_scrub_if_needed(replaycache_t *r);
+size_t replaycache_get_n_entries(const replaycache_t *r);
+size_t replaycache_get_memory_usage(const replaycache_t *r);
 
 #endif /* !defined(TOR_REPLAYCACHE_H) */
@@ -39,6 +39,10 @@ struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+
+  /** If we're writing a new file for this store from a cpuworker, the job
+   * that's doing it. */
+  struct store_rebuild_job_t *rebuild_job;
 };
 
 #endif /* !defined(DESC_STORE_ST_H) */
@@ -611,6 +611,8 @@ clear_dir_servers(void)
   } else {
     trusted_dir_servers = smartlist_new();
   }
+  /* Their addresses are in the nodelist address set. */
+  nodelist_mark_addresses_stale();
   router_dir_info_changed();
 }
 
@@ -8,11 +8,16 @@
  *  less-frequently-changing router information.
  */
 
+#define MICRODESC_PRIVATE
 #include "core/or/or.h"
 
+#include "lib/buf/buffers.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/fdio/fdio.h"
 
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/policies.h"
 #include "feature/client/entrynodes.h"
@@ -44,7 +49,11 @@
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.
+ *
+ * Alongside the cache file, we keep an "index file" listing the digest and
+ * location of every microdescriptor in it, so that on startup we can map the
+ * cache file and parse each microdescriptor only once we look it up. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -54,6 +63,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file for the cache file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -73,6 +84,8 @@ struct microdesc_cache_t {
 static microdesc_cache_t *get_microdesc_cache_noload(void);
 static void warn_if_nul_found(const char *inp, size_t len, int64_t offset,
                               const char *activity);
+static microdesc_t *microdesc_cache_find(microdesc_cache_t *cache,
+                                         const char *d);
 
 /** Helper: computes a hash of <b>md</b> to place it in a hash table. */
 static inline unsigned int
@@ -195,6 +208,28 @@ microdesc_reset_outdated_dirservers_list(void)
 
 /****************************************************************************/
 
+/** Largest number of bytes that format_microdesc_annotations() can
+ * generate. */
+#define MAX_MICRODESC_ANNOTATION_LEN (ISO_TIME_LEN+32)
+
+/** Write the annotations that we store along with <b>md</b> into the
+ * MAX_MICRODESC_ANNOTATION_LEN-byte buffer at <b>out</b>, and return their
+ * length. */
+static size_t
+format_microdesc_annotations(const microdesc_t *md, char *out)
+{
+  /* XXXX drops unknown annotations. */
+  if (md->last_listed) {
+    char buf[ISO_TIME_LEN+1];
+    format_iso_time(buf, md->last_listed);
+    tor_snprintf(out, MAX_MICRODESC_ANNOTATION_LEN,
+                 "@last-listed %s\n", buf);
+    return strlen(out);
+  }
+  *out = '\0';
+  return 0;
+}
+
 /** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
  * On success, return the total number of bytes written, and set
  * *<b>annotation_len_out</b> to the number of bytes written as
@@ -204,27 +239,23 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
 {
   ssize_t r = 0;
   ssize_t written;
+  char annotation[MAX_MICRODESC_ANNOTATION_LEN];
+  size_t annotation_len;
   if (md->body == NULL) {
     *annotation_len_out = 0;
     return 0;
   }
-  /* XXXX drops unknown annotations. */
-  if (md->last_listed) {
-    char buf[ISO_TIME_LEN+1];
-    char annotation[ISO_TIME_LEN+32];
-    format_iso_time(buf, md->last_listed);
-    tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
-    if (write_all_to_fd(fd, annotation, strlen(annotation)) < 0) {
+  annotation_len = format_microdesc_annotations(md, annotation);
+  if (annotation_len) {
+    if (write_all_to_fd(fd, annotation, annotation_len) < 0) {
       log_warn(LD_DIR,
                "Couldn't write microdescriptor annotation: %s",
                strerror(errno));
       return -1;
     }
-    r += strlen(annotation);
-    *annotation_len_out = r;
-  } else {
-    *annotation_len_out = 0;
+    r += annotation_len;
   }
+  *annotation_len_out = annotation_len;
 
   md->off = tor_fd_getpos(fd);
   warn_if_nul_found(md->body, md->bodylen, (int64_t) md->off,
@@ -246,6 +277,38 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
  * such object has been allocated. */
 static microdesc_cache_t *the_microdesc_cache = NULL;
 
+/** State for a rebuild of the microdescriptor cache file.  We assemble the
+ * new contents of the cache file and its index in the main thread, and then
+ * write them out either there or from a cpuworker. */
+typedef struct md_rebuild_job_t {
+  /** Name of the cache file to replace. */
+  char *cache_fname;
+  /** Name of the index file to replace. */
+  char *index_fname;
+  /** New contents for the cache file. */
+  char *body;
+  /** Length of <b>body</b>. */
+  size_t body_len;
+  /** Encoded index of <b>body</b>. */
+  char *index;
+  /** Length of <b>index</b>. */
+  size_t index_len;
+  /** A list of md_index_entry_t for every microdescriptor in <b>body</b>. */
+  smartlist_t *entries;
+  /** Total size of the cache file and journal when we made this job. */
+  size_t orig_size;
+  /** Set by microdesc_rebuild_job_write(): 0 if we replaced the cache file,
+   * -1 if we couldn't. */
+  int status;
+  /** True if the cache got cleared since we made this job, so that we
+   * should ignore its result. */
+  unsigned int cancelled : 1;
+} md_rebuild_job_t;
+
+/** The rebuild job that we have handed to a cpuworker, if any.  We don't
+ * start another rebuild until this one is done. */
+static md_rebuild_job_t *pending_rebuild_job = NULL;
+
 /** Return a pointer to the microdescriptor cache, loading it if necessary. */
 microdesc_cache_t *
 get_microdesc_cache(void)
@@ -267,6 +330,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_cachedir_fname("cached-microdescs");
     cache->journal_fname = get_cachedir_fname("cached-microdescs.new");
+    cache->index_fname = get_cachedir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -486,6 +550,9 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->total_len_seen = 0;
   cache->n_seen = 0;
   cache->bytes_dropped = 0;
+
+  if (pending_rebuild_job)
+    pending_rebuild_job->cancelled = 1;
 }
 
 static void
@@ -509,6 +576,263 @@ warn_if_nul_found(const char *inp, size_t len, int64_t offset,
   }
 }
 
+/** Magic string at the start of a microdescriptor cache index. */
+#define MD_INDEX_MAGIC "tor-md-index-v1\n"
+/** Length of MD_INDEX_MAGIC. */
+#define MD_INDEX_MAGIC_LEN 16
+/** Length of the part of the index header that comes before its digest:
+ * the magic, a 4-byte entry count, 4 reserved bytes, and the 8-byte length
+ * of the cache file. */
+#define MD_INDEX_PREFIX_LEN (MD_INDEX_MAGIC_LEN + 4 + 4 + 8)
+/** Length of the index header: the prefix, and then a SHA256 digest of the
+ * prefix and all the entries. */
+#define MD_INDEX_HEADER_LEN (MD_INDEX_PREFIX_LEN + DIGEST256_LEN)
+/** Length of each encoded index entry: the microdescriptor digest, its
+ * 8-byte offset, its 4-byte length, 4 reserved bytes, and its 8-byte
+ * last-listed time. */
+#define MD_INDEX_ENTRY_LEN (DIGEST256_LEN + 8 + 4 + 4 + 8)
+
+/** Compute the digest of an encoded index whose entries are the
+ * <b>entries_len</b> bytes at <b>entries</b>, and store it in
+ * <b>digest_out</b>. */
+static void
+microdesc_cache_index_digest(char *digest_out, const char *prefix,
+                             const char *entries, size_t entries_len)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, prefix, MD_INDEX_PREFIX_LEN);
+  crypto_digest_add_bytes(d, entries, entries_len);
+  crypto_digest_get_digest(d, digest_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Encode the md_index_entry_t members of <b>entries</b> as the index of a
+ * cache file of <b>cache_len</b> bytes.  Return a newly allocated buffer,
+ * and set *<b>len_out</b> to its length. */
+STATIC char *
+microdesc_cache_index_encode(const smartlist_t *entries, uint64_t cache_len,
+                             size_t *len_out)
+{
+  const size_t n = smartlist_len(entries);
+  const size_t len = MD_INDEX_HEADER_LEN + n * MD_INDEX_ENTRY_LEN;
+  char *out = tor_malloc_zero(len);
+  char *cp = out + MD_INDEX_HEADER_LEN;
+
+  memcpy(out, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN);
+  set_uint32(out + MD_INDEX_MAGIC_LEN, htonl((uint32_t)n));
+  set_uint64(out + MD_INDEX_MAGIC_LEN + 8, tor_htonll(cache_len));
+
+  SMARTLIST_FOREACH_BEGIN(entries, const md_index_entry_t *, ent) {
+    memcpy(cp, ent->digest, DIGEST256_LEN);
+    set_uint64(cp + DIGEST256_LEN, tor_htonll(ent->off));
+    set_uint32(cp + DIGEST256_LEN + 8, htonl(ent->bodylen));
+    set_uint64(cp + DIGEST256_LEN + 16,
+               tor_htonll((uint64_t) ent->last_listed));
+    cp += MD_INDEX_ENTRY_LEN;
+  } SMARTLIST_FOREACH_END(ent);
+
+  microdesc_cache_index_digest(out + MD_INDEX_PREFIX_LEN, out,
+                               out + MD_INDEX_HEADER_LEN,
+                               len - MD_INDEX_HEADER_LEN);
+  *len_out = len;
+  return out;
+}
+
+/** Parse the <b>len</b>-byte encoded index at <b>body</b>, which is supposed
+ * to describe a cache file of <b>cache_len</b> bytes.  Return a newly
+ * allocated list of md_index_entry_t on success, or NULL if the index is
+ * malformed or describes some other file. */
+STATIC smartlist_t *
+microdesc_cache_index_parse(const char *body, size_t len, uint64_t cache_len)
+{
+  smartlist_t *result;
+  char digest[DIGEST256_LEN];
+  const char *cp;
+  uint32_t n, i;
+
+  if (len < MD_INDEX_HEADER_LEN ||
+      fast_memneq(body, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN))
+    return NULL;
+  n = ntohl(get_uint32(body + MD_INDEX_MAGIC_LEN));
+  if ((len - MD_INDEX_HEADER_LEN) % MD_INDEX_ENTRY_LEN != 0 ||
+      (len - MD_INDEX_HEADER_LEN) / MD_INDEX_ENTRY_LEN != n)
+    return NULL;
+  if (tor_ntohll(get_uint64(body + MD_INDEX_MAGIC_LEN + 8)) != cache_len)
+    return NULL;
+  microdesc_cache_index_digest(digest, body, body + MD_INDEX_HEADER_LEN,
+                               len - MD_INDEX_HEADER_LEN);
+  if (tor_memneq(digest, body + MD_INDEX_PREFIX_LEN, DIGEST256_LEN))
+    return NULL;
+
+  result = smartlist_new();
+  cp = body + MD_INDEX_HEADER_LEN;
+  for (i = 0; i < n; ++i) {
+    md_index_entry_t *ent = tor_malloc_zero(sizeof(*ent));
+    uint64_t last_listed;
+    memcpy(ent->digest, cp, DIGEST256_LEN);
+    ent->off = tor_ntohll(get_uint64(cp + DIGEST256_LEN));
+    ent->bodylen = ntohl(get_uint32(cp + DIGEST256_LEN + 8));
+    last_listed = tor_ntohll(get_uint64(cp + DIGEST256_LEN + 16));
+    ent->last_listed = (time_t) last_listed;
+    smartlist_add(result, ent);
+    cp += MD_INDEX_ENTRY_LEN;
+    if (ent->off > cache_len || ent->bodylen > cache_len - ent->off) {
+      SMARTLIST_FOREACH(result, md_index_entry_t *, e, tor_free(e));
+      smartlist_free(result);
+      return NULL;
+    }
+  }
+  return result;
+}
+
+/** Return a new md_index_entry_t for <b>md</b>, located at <b>off</b>. */
+static md_index_entry_t *
+md_index_entry_new(const microdesc_t *md, uint64_t off)
+{
+  md_index_entry_t *ent = tor_malloc_zero(sizeof(*ent));
+  memcpy(ent->digest, md->digest, DIGEST256_LEN);
+  ent->off = off;
+  ent->bodylen = (uint32_t) md->bodylen;
+  ent->last_listed = md->last_listed;
+  return ent;
+}
+
+/** Try to fill <b>cache</b> from the index of its cache file, which must
+ * already be mapped, without parsing any microdescriptors.  They get parsed
+ * when we first look them up.  Return the number of microdescriptors we
+ * added, or -1 if the index is missing or doesn't match the cache file. */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  struct stat st;
+  char *body;
+  smartlist_t *entries;
+  networkstatus_t *ns;
+  int n_added = 0;
+
+  tor_assert(mm);
+  body = read_file_to_str(cache->index_fname,
+                          RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (!body)
+    return -1;
+  entries = microdesc_cache_index_parse(body, (size_t)st.st_size, mm->size);
+  tor_free(body);
+  if (!entries) {
+    log_info(LD_DIR, "Microdescriptor cache index was malformed or out of "
+             "date; ignoring it.");
+    return -1;
+  }
+
+  /* Don't believe any of the index unless it all points at things that look
+   * like microdescriptors. */
+  SMARTLIST_FOREACH_BEGIN(entries, const md_index_entry_t *, ent) {
+    if (ent->bodylen < 9 ||
+        fast_memneq(mm->data + ent->off, "onion-key", 9)) {
+      log_info(LD_DIR, "Microdescriptor cache index did not match the cache "
+               "file; ignoring it.");
+      n_added = -1;
+      goto done;
+    }
+  } SMARTLIST_FOREACH_END(ent);
+
+  SMARTLIST_FOREACH_BEGIN(entries, const md_index_entry_t *, ent) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, ent->digest, DIGEST256_LEN);
+    if (HT_FIND(microdesc_map, &cache->map, md)) {
+      tor_free(md);
+      continue;
+    }
+    md->body = (char*)mm->data + ent->off;
+    md->bodylen = ent->bodylen;
+    md->off = (off_t) ent->off;
+    md->last_listed = ent->last_listed;
+    md->saved_location = SAVED_IN_CACHE;
+    md->needs_parse = 1;
+
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+    ++n_added;
+  } SMARTLIST_FOREACH_END(ent);
+
+  /* If we already have a consensus, its nodes need their microdescriptors
+   * now; everything else can wait. */
+  ns = networkstatus_get_latest_consensus();
+  if (ns && ns->flavor == FLAV_MICRODESC) {
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+      microdesc_t *md =
+        microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+      if (md)
+        nodelist_add_microdesc(md);
+    } SMARTLIST_FOREACH_END(rs);
+  }
+  if (n_added)
+    router_dir_info_changed();
+
+ done:
+  SMARTLIST_FOREACH(entries, md_index_entry_t *, ent, tor_free(ent));
+  smartlist_free(entries);
+  return n_added;
+}
+
+/** Write a new index for the cache file of <b>cache</b>, listing every
+ * microdescriptor we have in it. */
+static void
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  smartlist_t *entries = smartlist_new();
+  microdesc_t **mdp;
+  char *index;
+  size_t index_len;
+
+  if (!cache->cache_content)
+    return;
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_CACHE || !md->body)
+      continue;
+    smartlist_add(entries, md_index_entry_new(md, (uint64_t) md->off));
+  }
+
+  index = microdesc_cache_index_encode(entries,
+                                       cache->cache_content->size,
+                                       &index_len);
+  if (write_bytes_to_file(cache->index_fname, index, index_len, 1) < 0) {
+    log_info(LD_DIR, "Couldn't write microdescriptor cache index to %s",
+             cache->index_fname);
+  }
+
+  tor_free(index);
+  SMARTLIST_FOREACH(entries, md_index_entry_t *, ent, tor_free(ent));
+  smartlist_free(entries);
+}
+
+/** Parse the fields of <b>md</b>, which we loaded from the index of
+ * <b>cache</b> without looking at its body.  If it turns out to be bad,
+ * remove it from the cache, free it, and return -1.  Otherwise return 0. */
+static int
+microdesc_cache_parse_lazy(microdesc_cache_t *cache, microdesc_t *md)
+{
+  tor_assert(md->needs_parse);
+  md->needs_parse = 0;
+  if (microdesc_parse_body(md) == 0)
+    return 0;
+
+  log_warn(LD_DIR, "Microdescriptor cache index pointed to a bad "
+           "microdescriptor; discarding it, and the index.");
+  HT_REMOVE(microdesc_map, &cache->map, md);
+  md->held_in_map = 0;
+  cache->bytes_dropped += md->bodylen;
+  microdesc_free(md);
+  /* The index and the cache file don't agree after all: don't trust the
+   * index the next time we start. */
+  tor_unlink(cache->index_fname);
+  return -1;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -526,12 +850,20 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    int n_indexed = microdesc_cache_load_index(cache);
+    if (n_indexed >= 0) {
+      total += n_indexed;
+    } else {
+      warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added) {
+        total += smartlist_len(added);
+        smartlist_free(added);
+      }
+      /* Remember where everything is, so we needn't parse it all again
+       * next time. */
+      microdesc_cache_write_index(cache);
     }
   }
 
@@ -697,81 +1029,163 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
-/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
- * and update every microdesc_t in the cache with pointers to its new
- * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
-int
-microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+/** Release all storage held by <b>job</b>. */
+static void
+md_rebuild_job_free_(md_rebuild_job_t *job)
 {
-  open_file_t *open_file;
-  int fd = -1, res;
+  if (!job)
+    return;
+  tor_free(job->cache_fname);
+  tor_free(job->index_fname);
+  tor_free(job->body);
+  tor_free(job->index);
+  if (job->entries) {
+    SMARTLIST_FOREACH(job->entries, md_index_entry_t *, ent, tor_free(ent));
+    smartlist_free(job->entries);
+  }
+  tor_free(job);
+}
+#define md_rebuild_job_free(job) \
+  FREE_AND_NULL(md_rebuild_job_t, md_rebuild_job_free_, (job))
+
+/** Assemble a rebuild job holding the new contents of the cache file for
+ * <b>cache</b>, and an index for them.  Doesn't change anything in
+ * <b>cache</b>. */
+static md_rebuild_job_t *
+md_rebuild_job_new(microdesc_cache_t *cache)
+{
+  md_rebuild_job_t *job = tor_malloc_zero(sizeof(*job));
+  buf_t *buf = buf_new();
   microdesc_t **mdp;
-  smartlist_t *wrote;
-  ssize_t size;
-  off_t off = 0, off_real;
-  int orig_size, new_size;
 
-  if (cache == NULL) {
-    cache = the_microdesc_cache;
-    if (cache == NULL)
-      return 0;
-  }
+  job->cache_fname = tor_strdup(cache->cache_fname);
+  job->index_fname = tor_strdup(cache->index_fname);
+  job->entries = smartlist_new();
+  job->orig_size = cache->cache_content ? cache->cache_content->size : 0;
+  job->orig_size += cache->journal_len;
 
-  /* Remove dead descriptors */
-  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    char annotation[MAX_MICRODESC_ANNOTATION_LEN];
+    size_t annotation_len;
+    if (md->no_save || !md->body)
+      continue;
 
-  if (!force && !should_rebuild_md_cache(cache))
-    return 0;
+    annotation_len = format_microdesc_annotations(md, annotation);
+    buf_add(buf, annotation, annotation_len);
+    warn_if_nul_found(md->body, md->bodylen, (int64_t) buf_datalen(buf),
+                      "dumping a microdescriptor");
+    smartlist_add(job->entries,
+                  md_index_entry_new(md, (uint64_t) buf_datalen(buf)));
+    buf_add(buf, md->body, md->bodylen);
+  }
 
-  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+  job->body = buf_extract(buf, &job->body_len);
+  buf_free(buf);
+  job->index = microdesc_cache_index_encode(job->entries, job->body_len,
+                                            &job->index_len);
+  return job;
+}
 
-  orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
-  orig_size += (int)cache->journal_len;
+/** Replace the cache file and its index with the contents of <b>job</b>,
+ * and set its status.  Doesn't touch any other state, so it's safe to call
+ * from a worker thread. */
+static void
+md_rebuild_job_write(md_rebuild_job_t *job)
+{
+  /* Remove the old index first: if we die before writing the new one, we
+   * would rather parse the whole cache file next time than trust an index
+   * of some other file. */
+  tor_unlink(job->index_fname);
+
+  if (write_bytes_to_file(job->cache_fname, job->body, job->body_len,
+                          1) < 0) {
+    job->status = -1;
+    return;
+  }
+  /* Not fatal: we can do without the index. */
+  if (write_bytes_to_file(job->index_fname, job->index, job->index_len,
+                          1) < 0) {
+    log_info(LD_DIR, "Couldn't write microdescriptor cache index to %s",
+             job->index_fname);
+  }
+  job->status = 0;
+}
+
+/** Replace the journal file of <b>cache</b> with one holding every
+ * microdescriptor that is still in the journal, and nothing else. */
+static void
+microdesc_cache_rewrite_journal(microdesc_cache_t *cache)
+{
+  open_file_t *open_file;
+  microdesc_t **mdp;
+  size_t journal_len = 0;
+  int fd;
 
-  fd = start_writing_to_file(cache->cache_fname,
+  fd = start_writing_to_file(cache->journal_fname,
                              OPEN_FLAGS_REPLACE|O_BINARY,
                              0600, &open_file);
-  if (fd < 0)
-    return -1;
-
-  wrote = smartlist_new();
+  if (fd < 0) {
+    log_warn(LD_DIR, "Couldn't rewrite microdescriptor journal in %s: %s",
+             cache->journal_fname, strerror(errno));
+    return;
+  }
 
   HT_FOREACH(mdp, microdesc_map, &cache->map) {
     microdesc_t *md = *mdp;
     size_t annotation_len;
-    if (md->no_save || !md->body)
+    ssize_t size;
+    if (md->saved_location != SAVED_IN_JOURNAL)
       continue;
-
     size = dump_microdescriptor(fd, md, &annotation_len);
     if (size < 0) {
-      microdesc_wipe_body(md);
-
-      /* rewind, in case it was a partial write. */
-      tor_fd_setpos(fd, off);
-      continue;
-    }
-    tor_assert(((size_t)size) == annotation_len + md->bodylen);
-    md->off = off + annotation_len;
-    off += size;
-    off_real = tor_fd_getpos(fd);
-    if (off_real != off) {
-      log_warn(LD_BUG, "Discontinuity in position in microdescriptor cache."
-               "By my count, I'm at %"PRId64
-               ", but I should be at %"PRId64,
-               (int64_t)(off), (int64_t)(off_real));
-      if (off_real >= 0)
-        off = off_real;
+      /* we already warned in dump_microdescriptor.  The old journal still
+       * holds everything we were trying to write. */
+      abort_writing_to_file(open_file);
+      return;
     }
-    if (md->saved_location != SAVED_IN_CACHE) {
-      tor_free(md->body);
-      md->saved_location = SAVED_IN_CACHE;
+    journal_len += size;
+  }
+
+  if (finish_writing_to_file(open_file) < 0) {
+    log_warn(LD_DIR, "Error rewriting microdescriptor journal: %s",
+             strerror(errno));
+    return;
+  }
+  cache->journal_len = journal_len;
+}
+
+/** Finish rebuilding <b>cache</b> once the files for <b>job</b> have been
+ * written: map the new cache file, point every microdescriptor that we
+ * wrote into it, and start a new journal holding whatever we have added
+ * since we made the job.  Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_install_rebuild(microdesc_cache_t *cache,
+                                const md_rebuild_job_t *job)
+{
+  microdesc_t **mdp;
+  int res, new_size;
+
+  if (job->status < 0) {
+    log_warn(LD_DIR, "Error rebuilding microdescriptor cache in %s",
+             job->cache_fname);
+    if (! cache->cache_content) {
+      /* We unmapped the old cache file before trying to replace it. Let's
+       * prevent from making things worse elsewhere. */
+      HT_FOREACH(mdp, microdesc_map, &cache->map) {
+        if ((*mdp)->saved_location == SAVED_IN_CACHE)
+          microdesc_wipe_body(*mdp);
+      }
     }
-    smartlist_add(wrote, md);
+    return -1;
   }
 
-  /* We must do this unmap _before_ we call finish_writing_to_file(), or
-   * windows will not actually replace the file. */
+  /* Everything that pointed into the old mapping needs to point into the
+   * new one instead; anything we can't find there loses its body. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE)
+      (*mdp)->body = NULL;
+  }
   if (cache->cache_content) {
     res = tor_munmap_file(cache->cache_content);
     if (res != 0) {
@@ -781,63 +1195,149 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     cache->cache_content = NULL;
   }
 
-  if (finish_writing_to_file(open_file) < 0) {
-    log_warn(LD_DIR, "Error rebuilding microdescriptor cache: %s",
-             strerror(errno));
-    /* Okay. Let's prevent from making things worse elsewhere. */
-    cache->cache_content = NULL;
-    HT_FOREACH(mdp, microdesc_map, &cache->map) {
-      microdesc_t *md = *mdp;
-      if (md->saved_location == SAVED_IN_CACHE) {
-        microdesc_wipe_body(md);
-      }
-    }
-    smartlist_free(wrote);
-    return -1;
-  }
-
   cache->cache_content = tor_mmap_file(cache->cache_fname);
 
-  if (!cache->cache_content && smartlist_len(wrote)) {
+  if (!cache->cache_content && smartlist_len(job->entries)) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
             cache->cache_fname);
-    smartlist_free(wrote);
+    HT_FOREACH(mdp, microdesc_map, &cache->map) {
+      if ((*mdp)->saved_location == SAVED_IN_CACHE)
+        microdesc_wipe_body(*mdp);
+    }
     return -1;
   }
-  SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
-    tor_assert(md->saved_location == SAVED_IN_CACHE);
-    md->body = (char*)cache->cache_content->data + md->off;
-    if (PREDICT_UNLIKELY(
-             md->bodylen < 9 || fast_memneq(md->body, "onion-key", 9) != 0)) {
-      /* XXXX once bug 2022 is solved, we can kill this block and turn it
-       * into just the tor_assert(fast_memeq) */
-      off_t avail = cache->cache_content->size - md->off;
-      char *bad_str;
-      tor_assert(avail >= 0);
-      bad_str = tor_strndup(md->body, MIN(128, (size_t)avail));
-      log_err(LD_BUG, "After rebuilding microdesc cache, offsets seem wrong. "
-              " At offset %d, I expected to find a microdescriptor starting "
-              " with \"onion-key\".  Instead I got %s.",
-              (int)md->off, escaped(bad_str));
-      tor_free(bad_str);
-      tor_assert(fast_memeq(md->body, "onion-key", 9));
+
+  SMARTLIST_FOREACH_BEGIN(job->entries, const md_index_entry_t *, ent) {
+    microdesc_t *md = microdesc_cache_find(cache, ent->digest);
+    const char *body;
+    if (!md || md->no_save)
+      continue;
+    body = cache->cache_content->data + ent->off;
+    if (BUG(ent->bodylen != md->bodylen) ||
+        BUG(ent->off + ent->bodylen > cache->cache_content->size) ||
+        BUG(md->bodylen < 9 || fast_memneq(body, "onion-key", 9))) {
+      log_warn(LD_BUG, "After rebuilding microdesc cache, offsets seem "
+               "wrong at offset %d.", (int)ent->off);
+      microdesc_wipe_body(md);
+      continue;
     }
-  } SMARTLIST_FOREACH_END(md);
+    if (md->saved_location != SAVED_IN_CACHE)
+      tor_free(md->body);
+    md->body = (char*)body;
+    md->off = (off_t) ent->off;
+    md->saved_location = SAVED_IN_CACHE;
+  } SMARTLIST_FOREACH_END(ent);
 
-  smartlist_free(wrote);
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE && !(*mdp)->body)
+      microdesc_wipe_body(*mdp);
+  }
 
-  write_str_to_file(cache->journal_fname, "", 1);
-  cache->journal_len = 0;
+  microdesc_cache_rewrite_journal(cache);
   cache->bytes_dropped = 0;
 
   new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
            "Saved %d bytes; %d still used.",
-           orig_size-new_size, new_size);
+           (int)job->orig_size-new_size, new_size);
 
   return 0;
 }
 
+/** Worker function: write out the files for a md_rebuild_job_t. */
+static workqueue_reply_t
+md_rebuild_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  md_rebuild_job_t *job = work_;
+  md_rebuild_job_write(job);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: install the result of a md_rebuild_job_t, unless the
+ * cache has been cleared in the meantime. */
+static void
+md_rebuild_replyfn(void *work_)
+{
+  md_rebuild_job_t *job = work_;
+
+  if (BUG(job != pending_rebuild_job)) {
+    md_rebuild_job_free(job);
+    return;
+  }
+  pending_rebuild_job = NULL;
+
+  if (!job->cancelled && the_microdesc_cache) {
+    microdesc_cache_install_rebuild(the_microdesc_cache, job);
+  }
+  md_rebuild_job_free(job);
+}
+
+/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
+ * and update every microdesc_t in the cache with pointers to its new
+ * location.  If <b>force</b> is true, do this unconditionally.  If
+ * <b>force</b> is false, do it only if we expect to save space on disk.
+ *
+ * Unless <b>force</b> is true, we write the new files from a cpuworker when
+ * we have one, and only update the microdesc_t objects once that's done.
+ * We don't start a rebuild while another one is still being written. */
+int
+microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+{
+  md_rebuild_job_t *job;
+  int r;
+
+  if (cache == NULL) {
+    cache = the_microdesc_cache;
+    if (cache == NULL)
+      return 0;
+  }
+
+  /* Remove dead descriptors */
+  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
+
+  if (pending_rebuild_job)
+    return 0;
+
+  if (!force && !should_rebuild_md_cache(cache))
+    return 0;
+
+  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+
+  job = md_rebuild_job_new(cache);
+
+#ifndef _WIN32
+  /* (On Windows, we can't replace a file while it's mapped, so we always
+   * rebuild in the main thread.) */
+  if (!force && cpuworker_get_n_threads() > 0) {
+    if (cpuworker_queue_work(WQ_PRI_LOW, md_rebuild_threadfn,
+                             md_rebuild_replyfn, job)) {
+      pending_rebuild_job = job;
+      return 0;
+    }
+    log_info(LD_DIR, "Couldn't queue microdescriptor cache rebuild; "
+             "doing it in the main thread.");
+  }
+#endif /* !defined(_WIN32) */
+
+  /* We must do this unmap _before_ we replace the file, or windows will not
+   * actually replace it.  microdesc_cache_install_rebuild() repoints
+   * everything that was in it. */
+  if (cache->cache_content) {
+    int res = tor_munmap_file(cache->cache_content);
+    if (res != 0) {
+      log_warn(LD_FS,
+               "Failed to unmap old microdescriptor cache while rebuilding");
+    }
+    cache->cache_content = NULL;
+  }
+
+  md_rebuild_job_write(job);
+  r = microdesc_cache_install_rebuild(cache, job);
+  md_rebuild_job_free(job);
+  return r;
+}
+
 /** Make sure that the reference count of every microdescriptor in cache is
  * accurate. */
 void
@@ -933,6 +1433,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -947,14 +1448,27 @@ microdesc_free_all(void)
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
-  microdesc_t *md, search;
+  microdesc_t *md;
   if (!cache)
     cache = get_microdesc_cache();
-  memcpy(search.digest, d, DIGEST256_LEN);
-  md = HT_FIND(microdesc_map, &cache->map, &search);
+  md = microdesc_cache_find(cache, d);
+  if (md && PREDICT_UNLIKELY(md->needs_parse) &&
+      microdesc_cache_parse_lazy(cache, md) < 0)
+    return NULL;
   return md;
 }
 
+/** As microdesc_cache_lookup_by_digest256(), but never parses a
+ * microdescriptor that we loaded from the cache index.  Use this when the
+ * caller only cares about cache information. */
+static microdesc_t *
+microdesc_cache_find(microdesc_cache_t *cache, const char *d)
+{
+  microdesc_t search;
+  memcpy(search.digest, d, DIGEST256_LEN);
+  return HT_FIND(microdesc_map, &cache->map, &search);
+}
+
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
  * are listed in <b>ns</b> but not present in <b>cache</b>. Returns pointers
  * to internals of <b>ns</b>; you should not free the members of the resulting
@@ -1045,7 +1559,7 @@ update_microdescs_from_networkstatus(time_t now)
   tor_assert(ns->flavor == FLAV_MICRODESC);
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    md = microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+    md = microdesc_cache_find(cache, rs->descriptor_digest);
     if (md && ns->valid_after > md->last_listed)
       md->last_listed = ns->valid_after;
   } SMARTLIST_FOREACH_END(rs);
@@ -56,5 +56,26 @@ void microdesc_note_outdated_dirserver(const char *relay_digest);
 int microdesc_relay_is_outdated_dirserver(const char *relay_digest);
 void microdesc_reset_outdated_dirservers_list(void);
 
+#ifdef MICRODESC_PRIVATE
+/** One entry in the index of the microdescriptor cache file: where to find
+ * a single microdescriptor there, and when it was last listed. */
+typedef struct md_index_entry_t {
+  /** SHA256 digest of the microdescriptor body. */
+  char digest[DIGEST256_LEN];
+  /** Offset of the body within the cache file. */
+  uint64_t off;
+  /** Length of the body. */
+  uint32_t bodylen;
+  /** As microdesc_t.last_listed. */
+  time_t last_listed;
+} md_index_entry_t;
+
+STATIC char *microdesc_cache_index_encode(const smartlist_t *entries,
+                                          uint64_t cache_len,
+                                          size_t *len_out);
+STATIC smartlist_t *microdesc_cache_index_parse(const char *body, size_t len,
+                                                uint64_t cache_len);
+#endif /* defined(MICRODESC_PRIVATE) */
+
 #endif /* !defined(TOR_MICRODESC_H) */
 
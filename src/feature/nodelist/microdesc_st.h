@@ -43,6 +43,10 @@ struct microdesc_t {
   unsigned int held_in_map : 1;
   /** True iff the exit policy for this router rejects everything. */
   unsigned int policy_is_reject_star : 1;
+  /** If true, this microdesc was loaded from the index of the cache file,
+   * and we have not yet parsed its fields (or checked its digest) from its
+   * body.  Only its cache information and digest are set. */
+  unsigned int needs_parse : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -1706,6 +1706,7 @@ notify_after_networkstatus_changes(void)
   circuit_build_times_new_consensus_params(
                                  get_circuit_build_times_mutable(), c);
   channelpadding_new_consensus_params(c);
+  connection_housekeeping_reschedule_all();
   circpad_new_consensus_params(c);
   router_new_consensus_params(c);
   congestion_control_new_consensus_params(c);
@@ -593,6 +593,30 @@ log_buggy_rs_source(const routerstatus_t *rs)
   }
 }
 
+/** Bits of a node's weight class in compute_weighted_bandwidths(). */
+#define WEIGHT_CLASS_GUARD (1<<0)
+#define WEIGHT_CLASS_EXIT  (1<<1)
+#define WEIGHT_CLASS_DIR   (1<<2)
+/** Number of distinct weight classes. */
+#define N_WEIGHT_CLASSES   (1<<3)
+
+/** Return the bandwidth to assume for a consensus entry with no bandwidth,
+ * warning about it the first time. */
+static int
+weighting_missing_bandwidth(void)
+{
+  static int warned_missing_bw = 0;
+  /* This should never happen, unless all the authorities downgrade
+   * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
+  if (! warned_missing_bw) {
+    log_warn(LD_BUG,
+             "Consensus is missing some bandwidths. Using a naive "
+             "router selection algorithm");
+    warned_missing_bw = 1;
+  }
+  return 30000; /* Chosen arbitrarily */
+}
+
 /** Given a list of routers and a weighting rule as in
  * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
  * values for each node and store them in a freshly allocated
@@ -612,6 +636,8 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   guardfraction_bandwidth_t guardfraction_bw;
   double *bandwidths = NULL;
   double total_bandwidth = 0.0;
+  double weights[N_WEIGHT_CLASSES];
+  double weights_without_guard_flag[N_WEIGHT_CLASSES];
 
   tor_assert(sl);
   tor_assert(bandwidths_out);
@@ -703,59 +729,73 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   Web /= weight_scale;
   Wdb /= weight_scale;
 
+  /* Every node falls into one of eight classes by its guard, exit and dir
+   * status; work out the weights for each class once, so that the loop
+   * below is a table lookup per node. */
+  for (int cls = 0; cls < N_WEIGHT_CLASSES; ++cls) {
+    const int is_guard = (cls & WEIGHT_CLASS_GUARD) != 0;
+    const int is_exit = (cls & WEIGHT_CLASS_EXIT) != 0;
+    const int is_dir = (cls & WEIGHT_CLASS_DIR) != 0;
+    double weight, weight_without_guard_flag = 0;
+    if (is_guard && is_exit) {
+      weight = (is_dir ? Wdb*Wd : Wd);
+      weight_without_guard_flag = (is_dir ? Web*We : We);
+    } else if (is_guard) {
+      weight = (is_dir ? Wgb*Wg : Wg);
+      weight_without_guard_flag = (is_dir ? Wmb*Wm : Wm);
+    } else if (is_exit) {
+      weight = (is_dir ? Web*We : We);
+    } else { // middle
+      weight = (is_dir ? Wmb*Wm : Wm);
+    }
+    /* These should be impossible; but overflows here would be bad, so let's
+     * make sure. */
+    if (weight < 0.0)
+      weight = 0.0;
+    if (weight_without_guard_flag < 0.0)
+      weight_without_guard_flag = 0.0;
+    weights[cls] = weight;
+    weights_without_guard_flag[cls] = weight_without_guard_flag;
+  }
+
   bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
 
   // Cycle through smartlist and total the bandwidth.
-  static int warned_missing_bw = 0;
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
-    int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0;
-    double weight = 1;
-    double weight_without_guard_flag = 0; /* Used for guardfraction */
+    const node_sel_entry_t *sel = nodelist_get_sel_entry(node);
+    int is_dir = 0, this_bw = 0, cls;
     double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
-        /* This should never happen, unless all the authorities downgrade
-         * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
-        if (! warned_missing_bw) {
-          log_warn(LD_BUG,
-                 "Consensus is missing some bandwidths. Using a naive "
-                 "router selection algorithm");
-          warned_missing_bw = 1;
-        }
-        this_bw = 30000; /* Chosen arbitrarily */
-      } else {
+    if (sel) {
+      /* Fast path: everything we need from the consensus is in the
+       * nodelist's selection table. */
+      is_dir = (sel->flags & NODE_SEL_IS_DIR) != 0;
+      if (sel->flags & NODE_SEL_HAS_BW)
+        this_bw = kb_to_bytes(sel->bandwidth_kb);
+      else
+        this_bw = weighting_missing_bandwidth();
+    } else if (node->rs) {
+      is_dir = node_is_dir(node);
+      if (node->rs->has_bandwidth)
         this_bw = kb_to_bytes(node->rs->bandwidth_kb);
-      }
+      else
+        this_bw = weighting_missing_bandwidth();
     } else if (node->ri) {
       /* bridge or other descriptor not in our consensus */
+      is_dir = node_is_dir(node);
       this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
     } else {
       /* We can't use this one. */
       continue;
     }
 
-    if (is_guard && is_exit) {
-      weight = (is_dir ? Wdb*Wd : Wd);
-      weight_without_guard_flag = (is_dir ? Web*We : We);
-    } else if (is_guard) {
-      weight = (is_dir ? Wgb*Wg : Wg);
-      weight_without_guard_flag = (is_dir ? Wmb*Wm : Wm);
-    } else if (is_exit) {
-      weight = (is_dir ? Web*We : We);
-    } else { // middle
-      weight = (is_dir ? Wmb*Wm : Wm);
-    }
+    cls = (node->is_possible_guard ? WEIGHT_CLASS_GUARD : 0) |
+          (node->is_exit && !node->is_bad_exit ? WEIGHT_CLASS_EXIT : 0) |
+          (is_dir ? WEIGHT_CLASS_DIR : 0);
+
     /* These should be impossible; but overflows here would be bad, so let's
      * make sure. */
     if (this_bw < 0)
       this_bw = 0;
-    if (weight < 0.0)
-      weight = 0.0;
-    if (weight_without_guard_flag < 0.0)
-      weight_without_guard_flag = 0.0;
 
     /* If guardfraction information is available in the consensus, we
      * want to calculate this router's bandwidth according to its
@@ -768,27 +808,29 @@ compute_weighted_bandwidths(const smartlist_t *sl,
      *    N for position p proportionally to Wpf*B or Wpn*B, clients should
      *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
      */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
+    if (rule != WEIGHT_FOR_GUARD &&
+        (sel ? (sel->flags & NODE_SEL_HAS_GUARDFRACTION) != 0
+             : (node->rs && node->rs->has_guardfraction))) {
       /* We should only have guardfraction set if the node has the Guard
          flag. */
       if (! node->rs->is_possible_guard) {
         log_buggy_rs_source(node->rs);
       }
 
-      guard_get_guardfraction_bandwidth(&guardfraction_bw,
-                                        this_bw,
+      guard_get_guardfraction_bandwidth(&guardfraction_bw, this_bw,
+                                        sel ? sel->guardfraction_pct :
                                         node->rs->guardfraction_percentage);
 
       /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
       final_weight =
-        guardfraction_bw.guard_bw * weight +
-        guardfraction_bw.non_guard_bw * weight_without_guard_flag;
+        guardfraction_bw.guard_bw * weights[cls] +
+        guardfraction_bw.non_guard_bw * weights_without_guard_flag[cls];
 
       log_debug(LD_GENERAL, "%s: Guardfraction weight %f instead of %f (%s)",
-                node->rs->nickname, final_weight, weight*this_bw,
+                node->rs->nickname, final_weight, weights[cls]*this_bw,
                 bandwidth_weight_rule_to_string(rule));
     } else { /* no guardfraction information. calculate the weight normally. */
-      final_weight = weight*this_bw;
+      final_weight = weights[cls]*this_bw;
     }
 
     bandwidths[node_sl_idx] = final_weight;
@@ -41,20 +41,10 @@ struct node_t {
   /** Position of the node within the list of nodes */
   int nodelist_idx;
 
-  /** The identity digest of this node_t.  No more than one node_t per
-   * identity may exist at a time. */
-  char identity[DIGEST_LEN];
-
-  /** The ed25519 identity of this node_t. This field is nonzero iff we
-   * currently have an ed25519 identity for this node in either md or ri,
-   * _and_ this node has been inserted to the ed25519-to-node map in the
-   * nodelist.
-   */
-  ed25519_public_key_t ed25519_id;
-
-  microdesc_t *md;
-  routerinfo_t *ri;
-  routerstatus_t *rs;
+  /* The fields below, up to the identity digest, are the ones that path
+   * selection reads for every candidate node.  Keep them together near the
+   * start of the structure, with the flags packed next to nodelist_idx, so
+   * that they share a cache line. */
 
   /* local info: copied from routerstatus, then possibly frobbed based
    * on experience.  Authorities set this stuff directly.  Note that
@@ -78,6 +68,21 @@ struct node_t {
   unsigned int strip_hsdir:1; /**< True iff we should strip the HSDir flag. */
   unsigned int strip_v2dir:1; /**< True iff we should strip the V2Dir flag. */
 
+  microdesc_t *md;
+  routerinfo_t *ri;
+  routerstatus_t *rs;
+
+  /** The identity digest of this node_t.  No more than one node_t per
+   * identity may exist at a time. */
+  char identity[DIGEST_LEN];
+
+  /** The ed25519 identity of this node_t. This field is nonzero iff we
+   * currently have an ed25519 identity for this node in either md or ri,
+   * _and_ this node has been inserted to the ed25519-to-node map in the
+   * nodelist.
+   */
+  ed25519_public_key_t ed25519_id;
+
   /* Local info: warning state. */
 
   unsigned int name_lookup_warned:1; /**< Have we warned the user for referring
@@ -107,6 +112,11 @@ struct node_t {
    * in order to know what's the hs directory index for this node at the time
    * the consensus is set. */
   struct hsdir_index_t hsdir_index;
+  /** Generation of the HSDir index parameters that <b>hsdir_index</b> was
+   * built from, or 0 if it was never built. */
+  uint32_t hsdir_index_gen;
+  /** The ed25519 identity that <b>hsdir_index</b> was built from. */
+  ed25519_public_key_t hsdir_index_ed_id;
 };
 
 #endif /* !defined(NODE_ST_H) */
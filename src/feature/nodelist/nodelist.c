@@ -138,10 +138,26 @@ typedef struct nodelist_t {
    * allow network re-entry towards them. */
   digestmap_t *reentry_set;
 
+  /* Number of addresses that node_addrs was sized for. */
+  int node_addrs_capacity;
+  /* True iff node_addrs or reentry_set may hold an address that no node
+   * has anymore. Neither can forget a single entry, so the next consensus
+   * has to rebuild them from scratch. */
+  unsigned int node_addrs_stale : 1;
+  /* Flavor of the last consensus we set, whose routerstatus entries our
+   * nodes point into. */
+  consensus_flavor_t flavor;
+
   /* The valid-after time of the last live consensus that initialized the
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* Selection data for each node, indexed by nodelist_idx, as of the last
+   * consensus we set. See node_sel_entry_t. */
+  node_sel_entry_t *sel_table;
+  /* Number of entries in sel_table. */
+  int sel_table_len;
 } nodelist_t;
 
 static inline unsigned int
@@ -350,90 +366,161 @@ node_add_to_ed25519_map(node_t *node)
   return 1;
 }
 
-/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
- * for the node, both current and next if possible. This can only fails if the
- * node_t ed25519 identity key can't be found which would be a bug. */
-STATIC void
-node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
-{
-  time_t now = approx_time();
-  const ed25519_public_key_t *node_identity_pk;
-  uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
-  uint64_t next_time_period_num, current_time_period_num;
-  uint64_t fetch_tp, store_first_tp, store_second_tp;
-
-  tor_assert(node);
-  tor_assert(ns);
+/** Inputs to the HSDir index computation that are the same for every node
+ * given a consensus and a time: which time periods we build indices for, and
+ * the shared random values that go with them. */
+typedef struct hsdir_index_params_t {
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  /** True iff we are between the start of a time period and the next SRV. */
+  uint8_t between_tp_and_srv;
+} hsdir_index_params_t;
+
+/** The most recently computed HSDir index parameters. */
+static hsdir_index_params_t hsdir_index_params;
+/** Generation number of <b>hsdir_index_params</b>. It only changes when the
+ * content of the parameters changes, so a node whose index was built with
+ * this generation and the same ed25519 identity already has the right
+ * index. Zero means "never computed". */
+static uint32_t hsdir_index_params_gen = 0;
+
+/** Compute the HSDir index parameters for the consensus <b>ns</b> at time
+ * <b>now</b>, and remember them as the current ones. Return the generation
+ * number of the parameters, or 0 if <b>ns</b> is not live enough to build
+ * indices from. */
+static uint32_t
+hsdir_index_params_update(const networkstatus_t *ns, time_t now)
+{
+  hsdir_index_params_t params;
+  uint8_t *fetch_srv, *store_first_srv, *store_second_srv;
+  uint64_t current_time_period_num;
 
   if (!networkstatus_consensus_reasonably_live(ns, now)) {
     static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
     log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
                    "Not setting hsdir index with a non-live consensus.");
-    goto done;
+    return 0;
   }
 
-  node_identity_pk = node_get_ed25519_id(node);
-  if (node_identity_pk == NULL) {
-    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
-                          "trying to build the hsdir indexes for node %s",
-              node_describe(node));
-    goto done;
-  }
+  /* Zero the whole struct so that padding never makes two equal sets of
+   * parameters compare different. */
+  memset(&params, 0, sizeof(params));
 
-  /* Get the current and next time period number. */
+  /* Get the current and next time period number. We always use the current
+   * time period for fetching descs. */
   current_time_period_num = hs_get_time_period_num(0);
-  next_time_period_num = hs_get_next_time_period_num(0);
-
-  /* We always use the current time period for fetching descs */
-  fetch_tp = current_time_period_num;
+  params.fetch_tp = current_time_period_num;
+  params.between_tp_and_srv = !! hs_in_period_between_tp_and_srv(ns, now);
 
   /* Now extract the needed SRVs and time periods for building hsdir indices */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
-    fetch_srv = hs_get_current_srv(fetch_tp, ns);
+  if (params.between_tp_and_srv) {
+    fetch_srv = hs_get_current_srv(params.fetch_tp, ns);
 
-    store_first_tp = hs_get_previous_time_period_num(0);
-    store_second_tp = current_time_period_num;
+    params.store_first_tp = hs_get_previous_time_period_num(0);
+    params.store_second_tp = current_time_period_num;
   } else {
-    fetch_srv = hs_get_previous_srv(fetch_tp, ns);
+    fetch_srv = hs_get_previous_srv(params.fetch_tp, ns);
 
-    store_first_tp = current_time_period_num;
-    store_second_tp = next_time_period_num;
+    params.store_first_tp = current_time_period_num;
+    params.store_second_tp = hs_get_next_time_period_num(0);
   }
 
   /* We always use the old SRV for storing the first descriptor and the latest
    * SRV for storing the second descriptor */
-  store_first_srv = hs_get_previous_srv(store_first_tp, ns);
-  store_second_srv = hs_get_current_srv(store_second_tp, ns);
+  store_first_srv = hs_get_previous_srv(params.store_first_tp, ns);
+  store_second_srv = hs_get_current_srv(params.store_second_tp, ns);
+
+  memcpy(params.fetch_srv, fetch_srv, DIGEST256_LEN);
+  memcpy(params.store_first_srv, store_first_srv, DIGEST256_LEN);
+  memcpy(params.store_second_srv, store_second_srv, DIGEST256_LEN);
+  tor_free(fetch_srv);
+  tor_free(store_first_srv);
+  tor_free(store_second_srv);
+
+  if (hsdir_index_params_gen == 0 ||
+      tor_memneq(&params, &hsdir_index_params, sizeof(params))) {
+    memcpy(&hsdir_index_params, &params, sizeof(params));
+    if (++hsdir_index_params_gen == 0)
+      ++hsdir_index_params_gen;
+  }
+  return hsdir_index_params_gen;
+}
+
+/** Set the hsdir index of <b>node</b> from the current HSDir index
+ * parameters, whose generation number is <b>gen</b>. Do nothing if the index
+ * was already built from those parameters for the same ed25519 identity.
+ * Return 1 if the index was recomputed, else 0. */
+static int
+node_update_hsdir_index(node_t *node, uint32_t gen)
+{
+  const hsdir_index_params_t *params = &hsdir_index_params;
+  const ed25519_public_key_t *node_identity_pk;
+
+  tor_assert(gen == hsdir_index_params_gen);
+
+  node_identity_pk = node_get_ed25519_id(node);
+  if (node_identity_pk == NULL) {
+    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
+                          "trying to build the hsdir indexes for node %s",
+              node_describe(node));
+    return 0;
+  }
+
+  if (node->hsdir_index_gen == gen &&
+      ed25519_pubkey_eq(node_identity_pk, &node->hsdir_index_ed_id)) {
+    return 0;
+  }
 
   /* Build the fetch index. */
-  hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
+  hs_build_hsdir_index(node_identity_pk, params->fetch_srv, params->fetch_tp,
                        node->hsdir_index.fetch);
 
   /* If we are in the time segment between SRV#N and TP#N, the fetch index is
      the same as the first store index */
-  if (!hs_in_period_between_tp_and_srv(ns, now)) {
+  if (!params->between_tp_and_srv) {
     memcpy(node->hsdir_index.store_first, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_first));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_first_srv, store_first_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_first_srv,
+                         params->store_first_tp,
                          node->hsdir_index.store_first);
   }
 
   /* If we are in the time segment between TP#N and SRV#N+1, the fetch index is
      the same as the second store index */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
+  if (params->between_tp_and_srv) {
     memcpy(node->hsdir_index.store_second, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_second));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_second_srv, store_second_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_second_srv,
+                         params->store_second_tp,
                          node->hsdir_index.store_second);
   }
 
- done:
-  tor_free(fetch_srv);
-  tor_free(store_first_srv);
-  tor_free(store_second_srv);
-  return;
+  node->hsdir_index_gen = gen;
+  memcpy(&node->hsdir_index_ed_id, node_identity_pk,
+         sizeof(node->hsdir_index_ed_id));
+  return 1;
+}
+
+/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
+ * for the node, both current and next if possible. This can only fails if the
+ * node_t ed25519 identity key can't be found which would be a bug. */
+STATIC void
+node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+{
+  uint32_t gen;
+
+  tor_assert(node);
+  tor_assert(ns);
+
+  gen = hsdir_index_params_update(ns, approx_time());
+  if (gen)
+    node_update_hsdir_index(node, gen);
 }
 
 /** Called when a node's address changes. */
@@ -442,6 +529,28 @@ node_addrs_changed(node_t *node)
 {
   node->last_reachable = node->last_reachable6 = 0;
   node->country = -1;
+  nodelist_mark_addresses_stale();
+}
+
+/** Tell the nodelist that some address may have gone away from the nodes or
+ * the trusted directories, so that the address set gets rebuilt with the
+ * next consensus. */
+void
+nodelist_mark_addresses_stale(void)
+{
+  if (the_nodelist)
+    the_nodelist->node_addrs_stale = 1;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> list the same ORPort addresses. */
+static int
+routerstatus_have_same_or_addrs(const routerstatus_t *a,
+                                const routerstatus_t *b)
+{
+  return tor_addr_eq(&a->ipv4_addr, &b->ipv4_addr) &&
+         a->ipv4_orport == b->ipv4_orport &&
+         tor_addr_eq(&a->ipv6_addr, &b->ipv6_addr) &&
+         a->ipv6_orport == b->ipv6_orport;
 }
 
 /** Add all address information about <b>node</b> to the current address
@@ -652,8 +761,11 @@ nodelist_add_microdesc(microdesc_t *md)
     return NULL;
 
   node_remove_from_ed25519_map(node);
-  if (node->md)
+  if (node->md) {
     node->md->held_by_nodes--;
+    if (!tor_addr_eq(&node->md->ipv6_addr, &md->ipv6_addr))
+      nodelist_mark_addresses_stale();
+  }
 
   node->md = md;
   md->held_by_nodes++;
@@ -671,6 +783,9 @@ nodelist_add_microdesc(microdesc_t *md)
 
 /* Default value. */
 #define ESTIMATED_ADDRESS_PER_NODE 2
+/* The nodelist address set is sized for 1/NODE_ADDRS_HEADROOM_DIVISOR more
+ * addresses than the consensus that built it has. */
+#define NODE_ADDRS_HEADROOM_DIVISOR 16
 
 /* Return the estimated number of address per node_t. This is used for the
  * size of the bloom filter in the nodelist (node_addrs). */
@@ -706,6 +821,53 @@ nodelist_update_consensus_params(const networkstatus_t *ns)
                                              1, 0, 1); // default, low, high
 }
 
+/** Rebuild the selection table of the nodelist from the routerstatus of
+ * every node.  Must be called once nodelist_idx values are final. */
+static void
+nodelist_rebuild_sel_table(void)
+{
+  const int n = smartlist_len(the_nodelist->nodes);
+
+  tor_free(the_nodelist->sel_table);
+  the_nodelist->sel_table = tor_calloc(n ? n : 1, sizeof(node_sel_entry_t));
+  the_nodelist->sel_table_len = n;
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, const node_t *, node) {
+    node_sel_entry_t *ent = &the_nodelist->sel_table[node_sl_idx];
+    const routerstatus_t *rs = node->rs;
+    if (!rs)
+      continue;
+    ent->rs = rs;
+    if (rs->has_bandwidth) {
+      ent->flags |= NODE_SEL_HAS_BW;
+      ent->bandwidth_kb = rs->bandwidth_kb;
+    }
+    if (rs->is_v2_dir)
+      ent->flags |= NODE_SEL_IS_DIR;
+    if (rs->has_guardfraction) {
+      ent->flags |= NODE_SEL_HAS_GUARDFRACTION;
+      ent->guardfraction_pct = rs->guardfraction_percentage;
+    }
+  } SMARTLIST_FOREACH_END(node);
+}
+
+/** Return the selection table entry for <b>node</b>, or NULL if there is no
+ * up-to-date one: for instance because the node has no routerstatus, or
+ * because its routerstatus or its position in the nodelist changed since the
+ * table was built. */
+const node_sel_entry_t *
+nodelist_get_sel_entry(const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  const node_sel_entry_t *ent;
+
+  if (!the_nodelist || !node->rs ||
+      idx < 0 || idx >= the_nodelist->sel_table_len)
+    return NULL;
+  ent = &the_nodelist->sel_table[idx];
+  return ent->rs == node->rs ? ent : NULL;
+}
+
 /** Tell the nodelist that the current usable consensus is <b>ns</b>.
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
@@ -716,50 +878,83 @@ nodelist_set_consensus(const networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
-
+  uint32_t hsdir_index_gen;
+  int n_hsdir_indices = 0;
+  const routerstatus_t **old_rs;
+  int n_old_nodes;
+  smartlist_t *added_nodes = smartlist_new();
+  int rebuild_addrs;
+  monotime_t start, end;
+
+  monotime_get(&start);
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
+  /* Remember which routerstatus each node had, so that we can tell which
+   * nodes are new or changed. If the flavor changed, the old entries may be
+   * gone, and we treat every node as new. */
+  n_old_nodes = smartlist_len(the_nodelist->nodes);
+  old_rs = tor_calloc(n_old_nodes + 1, sizeof(*old_rs));
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+    if (node->rs && the_nodelist->flavor == ns->flavor)
+      old_rs[node_sl_idx] = node->rs;
+    else if (node->rs)
+      the_nodelist->node_addrs_stale = 1;
+    node->rs = NULL;
+  } SMARTLIST_FOREACH_END(node);
+  the_nodelist->flavor = ns->flavor;
 
   nodelist_update_consensus_params(ns);
 
-  /* Conservatively estimate that every node will have 2 addresses (v4 and
-   * v6). Then we add the number of configured trusted authorities we have. */
-  int estimated_addresses = smartlist_len(ns->routerstatus_list) *
-                            get_estimated_address_per_node();
-  estimated_addresses += (get_n_authorities(V3_DIRINFO | BRIDGE_DIRINFO) *
-                          get_estimated_address_per_node());
-  /* Clear our sets because we will repopulate them with what this new
-   * consensus contains. */
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
-  digestmap_free(the_nodelist->reentry_set, NULL);
-  the_nodelist->reentry_set = digestmap_new();
+  /* The HSDir index parameters are the same for every node, so compute them
+   * once. Nodes whose identity is unchanged since the last consensus keep
+   * their index unless the parameters themselves changed. */
+  hsdir_index_gen = hsdir_index_params_update(ns, approx_time());
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    /* New nodes are appended past the old ones. */
+    const routerstatus_t *prev_rs =
+      node->nodelist_idx < n_old_nodes ? old_rs[node->nodelist_idx] : NULL;
+    int addrs_added = (prev_rs == NULL);
+
+    if (prev_rs) {
+      old_rs[node->nodelist_idx] = NULL;
+      if (!routerstatus_have_same_or_addrs(prev_rs, rs)) {
+        the_nodelist->node_addrs_stale = 1;
+        addrs_added = 1;
+      }
+    }
     node->rs = rs;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
           tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
         node_remove_from_ed25519_map(node);
-        if (node->md)
+        if (node->md) {
           node->md->held_by_nodes--;
+          if (!tor_addr_is_null(&node->md->ipv6_addr))
+            the_nodelist->node_addrs_stale = 1;
+        }
         node->md = microdesc_cache_lookup_by_digest256(NULL,
                                                        rs->descriptor_digest);
         if (node->md)
           node->md->held_by_nodes++;
         node_add_to_ed25519_map(node);
+        addrs_added = 1;
       }
     }
 
-    if (rs->pv.supports_v3_hsdir) {
-      node_set_hsdir_index(node, ns);
+    if (rs->pv.supports_v3_hsdir && hsdir_index_gen) {
+      n_hsdir_indices += node_update_hsdir_index(node, hsdir_index_gen);
     }
-    node_set_country(node);
+    if (addrs_added)
+      smartlist_add(added_nodes, node);
+    /* The country only depends on the IPv4 address, which a geoip reload
+     * refreshes for every node anyway. */
+    if (!prev_rs || node->country == -1 ||
+        !tor_addr_eq(&prev_rs->ipv4_addr, &rs->ipv4_addr))
+      node_set_country(node);
 
     /* Set node's flags based on rs's flags. */
     {
@@ -786,16 +981,57 @@ nodelist_set_consensus(const networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
+  /* A node that left the consensus takes its routerstatus addresses with
+   * it. */
+  for (int i = 0; i < n_old_nodes; ++i) {
+    if (old_rs[i])
+      the_nodelist->node_addrs_stale = 1;
+  }
+  tor_free(old_rs);
+
   nodelist_purge();
 
-  /* Now add all the nodes we have to the address set. */
-  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-    node_add_to_address_set(node);
-  } SMARTLIST_FOREACH_END(node);
+  /* Conservatively estimate that every node will have 2 addresses (v4 and
+   * v6). Then we add the number of configured trusted authorities we have. */
+  int estimated_addresses = smartlist_len(ns->routerstatus_list) *
+                            get_estimated_address_per_node();
+  estimated_addresses += (get_n_authorities(V3_DIRINFO | BRIDGE_DIRINFO) *
+                          get_estimated_address_per_node());
+
+  /* Our sets can only grow. Unless an address may have gone away, or the
+   * bloom filter is too small for this consensus, keep them and only add
+   * the addresses of the nodes that are new or changed. */
+  rebuild_addrs = !the_nodelist->node_addrs ||
+                  the_nodelist->node_addrs_stale ||
+                  estimated_addresses > the_nodelist->node_addrs_capacity;
+  if (rebuild_addrs) {
+    /* Clear our sets because we will repopulate them with what this new
+     * consensus contains. Leave room in the bloom filter for the relays
+     * that join over the next few consensuses. */
+    the_nodelist->node_addrs_capacity = estimated_addresses +
+      estimated_addresses / NODE_ADDRS_HEADROOM_DIVISOR;
+    address_set_free(the_nodelist->node_addrs);
+    the_nodelist->node_addrs =
+      address_set_new(the_nodelist->node_addrs_capacity);
+    digestmap_free(the_nodelist->reentry_set, NULL);
+    the_nodelist->reentry_set = digestmap_new();
+    the_nodelist->node_addrs_stale = 0;
+
+    /* Now add all the nodes we have to the address set. */
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+      node_add_to_address_set(node);
+    } SMARTLIST_FOREACH_END(node);
+  } else {
+    SMARTLIST_FOREACH(added_nodes, const node_t *, node,
+                      node_add_to_address_set(node));
+  }
+  smartlist_free(added_nodes);
   /* Then, add all trusted configured directories. Some might not be in the
    * consensus so make sure we know them. */
   dirlist_add_trusted_dir_addresses();
 
+  nodelist_rebuild_sel_table();
+
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
       /* We have no routerstatus for this router. Clear flags so we can skip
@@ -819,6 +1055,13 @@ nodelist_set_consensus(const networkstatus_t *ns)
   if (networkstatus_is_live(ns, approx_time())) {
     the_nodelist->live_consensus_valid_after = ns->valid_after;
   }
+
+  monotime_get(&end);
+  log_info(LD_DIR, "Updated nodelist from a consensus with %d entries in "
+           "%"PRId64" usec; rebuilt %d HSDir indices; %s the address set.",
+           smartlist_len(ns->routerstatus_list),
+           monotime_diff_usec(&start, &end), n_hsdir_indices,
+           rebuild_addrs ? "rebuilt" : "kept");
 }
 
 /** Return 1 iff <b>node</b> has Exit flag and no BadExit flag.
@@ -846,6 +1089,8 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    if (!tor_addr_is_null(&md->ipv6_addr))
+      nodelist_mark_addresses_stale();
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
@@ -859,6 +1104,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    nodelist_mark_addresses_stale();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -939,11 +1185,13 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      the_nodelist->node_addrs_stale = 1;
     }
 
     if (node_is_usable(node)) {
       iter = HT_NEXT(nodelist_map, &the_nodelist->nodes_by_id, iter);
     } else {
+      the_nodelist->node_addrs_stale = 1;
       iter = HT_NEXT_RMV(nodelist_map, &the_nodelist->nodes_by_id, iter);
       nodelist_drop_node(node, 0);
       node_free(node);
@@ -973,6 +1221,8 @@ nodelist_free_all(void)
   digestmap_free(the_nodelist->reentry_set, NULL);
   the_nodelist->reentry_set = NULL;
 
+  tor_free(the_nodelist->sel_table);
+
   tor_free(the_nodelist);
 }
 
@@ -38,6 +38,7 @@ int nodelist_probably_contains_address(const tor_addr_t *addr);
 bool nodelist_reentry_contains(const tor_addr_t *addr, uint16_t port);
 void nodelist_add_addr_to_address_set(const tor_addr_t *addr,
                                       uint16_t or_port, uint16_t dir_port);
+void nodelist_mark_addresses_stale(void);
 
 void nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md);
 void nodelist_remove_routerinfo(routerinfo_t *ri);
@@ -112,6 +113,31 @@ const struct curve25519_public_key_t *node_get_curve25519_onion_key(
 
 MOCK_DECL(const smartlist_t *, nodelist_get_list, (void));
 
+/** Consensus facts about a node that path selection reads for every
+ * candidate. We keep these in one flat array indexed by nodelist_idx, so
+ * that weighting the whole network doesn't chase a routerstatus pointer per
+ * node. */
+typedef struct node_sel_entry_t {
+  /** The routerstatus this entry was built from.  The entry is only valid
+   * while the node's rs is still this one. */
+  const routerstatus_t *rs;
+  /** Consensus bandwidth, in kilobytes. Only set if NODE_SEL_HAS_BW. */
+  uint32_t bandwidth_kb;
+  /** Guardfraction, in percent. Only set if NODE_SEL_HAS_GUARDFRACTION. */
+  uint8_t guardfraction_pct;
+  /** Bitwise OR of NODE_SEL_* flags. */
+  uint8_t flags;
+} node_sel_entry_t;
+
+/** Flag for node_sel_entry_t: the consensus lists a bandwidth. */
+#define NODE_SEL_HAS_BW (1u<<0)
+/** Flag for node_sel_entry_t: the node is a directory cache. */
+#define NODE_SEL_IS_DIR (1u<<1)
+/** Flag for node_sel_entry_t: the consensus lists a guardfraction. */
+#define NODE_SEL_HAS_GUARDFRACTION (1u<<2)
+
+const node_sel_entry_t *nodelist_get_sel_entry(const node_t *node);
+
 /* Temporary during transition to multiple addresses.  */
 void node_get_addr(const node_t *node, tor_addr_t *addr_out);
 
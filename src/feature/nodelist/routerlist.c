@@ -64,6 +64,7 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
@@ -96,6 +97,7 @@
 #include "feature/stats/rephist.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/workqueue.h"
 
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/dirclient/dir_server_st.h"
@@ -226,55 +228,63 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
-#define RRS_FORCE 1
-#define RRS_DONT_REMOVE_OLD 2
-
-/** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
- * <b>flags</b>, then atomically replace the saved router store with the
- * routers currently in our routerlist, and clear the journal.  Unless
- * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
- * rebuilding the store.  Return 0 on success, -1 on failure.
- */
+/** Sorting helper: return &lt;0, 0, or &gt;0 depending on whether the
+ * signed_descriptor_t* in *<b>a</b> was saved before, at the same offset as,
+ * or after the signed_descriptor_t* in *<b>b</b>. */
 static int
-router_rebuild_store(int flags, desc_store_t *store)
+compare_signed_descriptors_by_saved_offset_(const void **_a, const void **_b)
 {
-  smartlist_t *chunk_list = NULL;
-  char *fname = NULL, *fname_tmp = NULL;
-  int r = -1;
-  off_t offset = 0;
-  smartlist_t *signed_descriptors = NULL;
-  size_t total_expected_len = 0;
-  int had_any;
-  int force = flags & RRS_FORCE;
-
-  if (!force && !router_should_rebuild_store(store)) {
-    r = 0;
-    goto done;
-  }
-  if (!routerlist) {
-    r = 0;
-    goto done;
-  }
-
-  if (store->type == EXTRAINFO_STORE)
-    had_any = !eimap_isempty(routerlist->extra_info_map);
-  else
-    had_any = (smartlist_len(routerlist->routers)+
-               smartlist_len(routerlist->old_routers))>0;
-
-  /* Don't save deadweight. */
-  if (!(flags & RRS_DONT_REMOVE_OLD))
-    routerlist_remove_old_routers();
+  const signed_descriptor_t *r1 = *_a, *r2 = *_b;
+  if (r1->saved_offset < r2->saved_offset)
+    return -1;
+  return r1->saved_offset > r2->saved_offset;
+}
 
-  log_info(LD_DIR, "Rebuilding %s cache", store->description);
+#define RRS_FORCE 1
+#define RRS_DONT_REMOVE_OLD 2
 
-  fname = get_cachedir_fname(store->fname_base);
-  fname_tmp = get_cachedir_fname_suffix(store->fname_base, ".tmp");
+/** One descriptor in a store_rebuild_job_t: where we put it in the new
+ * store file. */
+typedef struct store_rebuild_entry_t {
+  /** The signed_descriptor_digest of the descriptor. */
+  char digest[DIGEST_LEN];
+  /** Offset of the descriptor (with its annotations) in the new file. */
+  off_t offset;
+  /** Length of the descriptor, with its annotations. */
+  size_t len;
+} store_rebuild_entry_t;
+
+/** A snapshot of the contents of a desc_store_t, to be written out as its
+ * new store file, either in the main thread or from a cpuworker. */
+struct store_rebuild_job_t {
+  /** Which store is this for? */
+  store_type_t type;
+  /** Name of the store file, and of the temporary file we write first. */
+  char *fname;
+  char *fname_tmp;
+  /** The new contents of the store file. */
+  char *body;
+  /** Length of <b>body</b>. */
+  size_t body_len;
+  /** A list of store_rebuild_entry_t for every descriptor in <b>body</b>. */
+  smartlist_t *entries;
+  /** True iff the store had any descriptors before we removed old ones. */
+  int had_any;
+  /** Set by store_rebuild_job_write(): 0 if we replaced the store file, -1
+   * if we couldn't. */
+  int status;
+  /** True if we reloaded the store since we made this job, so that we should
+   * ignore its result. */
+  unsigned int cancelled : 1;
+};
 
-  chunk_list = smartlist_new();
+/** Return a new list of every signed_descriptor_t that belongs in
+ * <b>store</b>. */
+static smartlist_t *
+router_store_list_descriptors(const desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
 
-  /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
   if (store->type == EXTRAINFO_STORE) {
     eimap_iter_t *iter;
     for (iter = eimap_iter_init(routerlist->extra_info_map);
@@ -291,96 +301,344 @@ router_rebuild_store(int flags, desc_store_t *store)
     SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
                       smartlist_add(signed_descriptors, &ri->cache_info));
   }
+  return signed_descriptors;
+}
+
+/** Release all storage held by <b>job</b>. */
+STATIC void
+store_rebuild_job_free_(store_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->fname);
+  tor_free(job->fname_tmp);
+  tor_free(job->body);
+  if (job->entries) {
+    SMARTLIST_FOREACH(job->entries, store_rebuild_entry_t *, ent,
+                      tor_free(ent));
+    smartlist_free(job->entries);
+  }
+  tor_free(job);
+}
+
+/** Take a snapshot of every descriptor that we want to keep in
+ * <b>store</b>, and return a job to write it out as the new store file.
+ * Doesn't change anything in the routerlist.  Return NULL if some
+ * descriptor's body is missing. */
+STATIC store_rebuild_job_t *
+store_rebuild_job_new(const desc_store_t *store)
+{
+  store_rebuild_job_t *job = NULL;
+  smartlist_t *signed_descriptors;
+  size_t total_len = 0;
+  off_t offset = 0;
 
+  signed_descriptors = router_store_list_descriptors(store);
+
+  /* We sort the routers by age to enhance locality on disk. */
   smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
 
-  /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
-      sized_chunk_t *c;
-      const char *body = signed_descriptor_get_body_impl(sd, 1);
-      if (!body) {
-        log_warn(LD_BUG, "No descriptor available for router.");
-        goto done;
-      }
-      if (sd->do_not_cache) {
-        continue;
-      }
-      c = tor_malloc(sizeof(sized_chunk_t));
-      c->bytes = body;
-      c->len = sd->signed_descriptor_len + sd->annotations_len;
-      total_expected_len += c->len;
-      smartlist_add(chunk_list, c);
+    const char *body = signed_descriptor_get_body_impl(sd, 1);
+    if (!body) {
+      log_warn(LD_BUG, "No descriptor available for router.");
+      goto done;
+    }
+    if (sd->do_not_cache)
+      continue;
+    total_len += sd->signed_descriptor_len + sd->annotations_len;
+  } SMARTLIST_FOREACH_END(sd);
+
+  job = tor_malloc_zero(sizeof(*job));
+  job->type = store->type;
+  job->fname = get_cachedir_fname(store->fname_base);
+  job->fname_tmp = get_cachedir_fname_suffix(store->fname_base, ".tmp");
+  job->body = tor_malloc(total_len + 1);
+  job->body_len = total_len;
+  job->entries = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    store_rebuild_entry_t *ent;
+    if (sd->do_not_cache)
+      continue;
+    ent = tor_malloc_zero(sizeof(*ent));
+    memcpy(ent->digest, sd->signed_descriptor_digest, DIGEST_LEN);
+    ent->offset = offset;
+    ent->len = sd->signed_descriptor_len + sd->annotations_len;
+    memcpy(job->body + offset, signed_descriptor_get_body_impl(sd, 1),
+           ent->len);
+    offset += ent->len;
+    smartlist_add(job->entries, ent);
   } SMARTLIST_FOREACH_END(sd);
+  job->body[total_len] = '\0';
+
+ done:
+  smartlist_free(signed_descriptors);
+  return job;
+}
+
+/** Write the new store file for <b>job</b>, and set its status.  Doesn't
+ * touch the routerlist, so it's safe to call from a worker thread. */
+STATIC void
+store_rebuild_job_write(store_rebuild_job_t *job)
+{
+  smartlist_t *chunk_list = smartlist_new();
+  sized_chunk_t chunk = { job->body, job->body_len };
 
-  if (write_chunks_to_file(fname_tmp, chunk_list, 1, 1)<0) {
+  job->status = -1;
+  smartlist_add(chunk_list, &chunk);
+  if (write_chunks_to_file(job->fname_tmp, chunk_list, 1, 1)<0) {
     log_warn(LD_FS, "Error writing router store to disk.");
     goto done;
   }
-
-  /* Our mmap is now invalid. */
-  if (store->mmap) {
-    int res = tor_munmap_file(store->mmap);
-    store->mmap = NULL;
-    if (res != 0) {
-      log_warn(LD_FS, "Unable to munmap route store in %s", fname);
-    }
+  if (replace_file(job->fname_tmp, job->fname)<0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    goto done;
   }
+  job->status = 0;
+ done:
+  smartlist_free(chunk_list);
+}
 
-  if (replace_file(fname_tmp, fname)<0) {
-    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+/** Replace the journal of <b>store</b> with one holding only the
+ * descriptors that are still in the journal, in the order we added them. */
+static void
+router_store_rewrite_journal(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = router_store_list_descriptors(store);
+  smartlist_t *journal = smartlist_new();
+  smartlist_t *chunk_list = smartlist_new();
+  char *fname = get_cachedir_fname_suffix(store->fname_base, ".new");
+  off_t offset = 0;
+
+  SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
+    if (sd->saved_location == SAVED_IN_JOURNAL)
+      smartlist_add(journal, sd));
+  smartlist_sort(journal, compare_signed_descriptors_by_saved_offset_);
+
+  SMARTLIST_FOREACH_BEGIN(journal, signed_descriptor_t *, sd) {
+    sized_chunk_t *c = tor_malloc(sizeof(sized_chunk_t));
+    c->bytes = signed_descriptor_get_body_impl(sd, 1);
+    c->len = sd->signed_descriptor_len + sd->annotations_len;
+    smartlist_add(chunk_list, c);
+  } SMARTLIST_FOREACH_END(sd);
+
+  if (write_chunks_to_file(fname, chunk_list, 1, 0)<0) {
+    /* The old journal still holds everything we were trying to write. */
+    log_warn(LD_FS, "Error rewriting router journal.");
     goto done;
   }
+  SMARTLIST_FOREACH_BEGIN(journal, signed_descriptor_t *, sd) {
+    sd->saved_offset = offset;
+    offset += sd->signed_descriptor_len + sd->annotations_len;
+  } SMARTLIST_FOREACH_END(sd);
+  store->journal_len = (size_t) offset;
+
+ done:
+  tor_free(fname);
+  SMARTLIST_FOREACH(chunk_list, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(chunk_list);
+  smartlist_free(journal);
+  smartlist_free(signed_descriptors);
+}
+
+/** Finish rebuilding <b>store</b> once the file for <b>job</b> has been
+ * written: map the new store file, point every descriptor that we wrote
+ * into it, and start a new journal holding whatever we have added since
+ * we made the job.  Return 0 on success, -1 on failure. */
+STATIC int
+router_store_install_rebuild(desc_store_t *store,
+                             const store_rebuild_job_t *job)
+{
+  tor_mmap_t *old_mmap, *new_mmap;
+  digestmap_t *written;
+  smartlist_t *signed_descriptors;
+  size_t bytes_dropped = 0;
+
+  if (job->status < 0) {
+    if (!store->mmap && store->store_len) {
+      /* We unmapped the old store so that we could replace it; put it back
+       * so that we can still find the descriptors in it. */
+      store->mmap = tor_mmap_file(job->fname);
+    }
+    return -1;
+  }
 
   errno = 0;
-  store->mmap = tor_mmap_file(fname);
-  if (! store->mmap) {
+  new_mmap = tor_mmap_file(job->fname);
+  if (! new_mmap) {
     if (errno == ERANGE) {
       /* empty store.*/
-      if (total_expected_len) {
+      if (job->body_len) {
         log_warn(LD_FS, "We wrote some bytes to a new descriptor file at '%s',"
-                 " but when we went to mmap it, it was empty!", fname);
-      } else if (had_any) {
+                 " but when we went to mmap it, it was empty!", job->fname);
+      } else if (job->had_any) {
         log_info(LD_FS, "We just removed every descriptor in '%s'.  This is "
                  "okay if we're just starting up after a long time. "
-                 "Otherwise, it's a bug.", fname);
+                 "Otherwise, it's a bug.", job->fname);
       }
     } else {
-      log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",fname);
+      log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",
+               job->fname);
     }
   }
 
   log_info(LD_DIR, "Reconstructing pointers into cache");
 
-  offset = 0;
+  written = digestmap_new();
+  SMARTLIST_FOREACH(job->entries, store_rebuild_entry_t *, ent,
+                    digestmap_set(written, ent->digest, ent));
+
+  old_mmap = store->mmap;
+  signed_descriptors = router_store_list_descriptors(store);
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
-      if (sd->do_not_cache)
-        continue;
+    store_rebuild_entry_t *ent =
+      digestmap_remove(written, sd->signed_descriptor_digest);
+    if (ent && !sd->do_not_cache) {
       sd->saved_location = SAVED_IN_CACHE;
-      if (store->mmap) {
+      if (new_mmap) {
         tor_free(sd->signed_descriptor_body); // sets it to null
-        sd->saved_offset = offset;
+        sd->saved_offset = ent->offset;
       }
-      offset += sd->signed_descriptor_len + sd->annotations_len;
-      signed_descriptor_get_body(sd); /* reconstruct and assert */
+    } else if (sd->saved_location == SAVED_IN_CACHE && old_mmap &&
+               !sd->signed_descriptor_body) {
+      /* We're about to unmap this one, and it isn't in the new file. */
+      sd->signed_descriptor_body =
+        tor_memdup_nulterm(old_mmap->data + sd->saved_offset,
+                           sd->signed_descriptor_len + sd->annotations_len);
+      sd->saved_location = SAVED_NOWHERE;
+    }
   } SMARTLIST_FOREACH_END(sd);
 
-  tor_free(fname);
-  fname = get_cachedir_fname_suffix(store->fname_base, ".new");
-  write_str_to_file(fname, "", 1);
+  /* Anything left in the new file was removed from the routerlist while we
+   * were writing it. */
+  DIGESTMAP_FOREACH(written, digest, store_rebuild_entry_t *, ent) {
+    (void)digest;
+    bytes_dropped += ent->len;
+  } DIGESTMAP_FOREACH_END;
+  digestmap_free(written, NULL);
 
-  r = 0;
-  store->store_len = (size_t) offset;
-  store->journal_len = 0;
-  store->bytes_dropped = 0;
- done:
+  /* Our old mmap is now invalid. */
+  if (old_mmap) {
+    int res = tor_munmap_file(old_mmap);
+    if (res != 0) {
+      log_warn(LD_FS, "Unable to munmap route store in %s", job->fname);
+    }
+  }
+  store->mmap = new_mmap;
+
+  SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
+    if (sd->saved_location == SAVED_IN_CACHE)
+      signed_descriptor_get_body(sd)); /* reconstruct and assert */
   smartlist_free(signed_descriptors);
-  tor_free(fname);
-  tor_free(fname_tmp);
-  if (chunk_list) {
-    SMARTLIST_FOREACH(chunk_list, sized_chunk_t *, c, tor_free(c));
-    smartlist_free(chunk_list);
+
+  store->store_len = job->body_len;
+  store->bytes_dropped = bytes_dropped;
+  router_store_rewrite_journal(store);
+
+  return 0;
+}
+
+/** Worker function: write out the store file for a store_rebuild_job_t. */
+static workqueue_reply_t
+router_rebuild_store_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  store_rebuild_job_t *job = work_;
+  store_rebuild_job_write(job);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: install the result of a store_rebuild_job_t, unless its
+ * store has been reloaded or freed in the meantime. */
+static void
+router_rebuild_store_replyfn(void *work_)
+{
+  store_rebuild_job_t *job = work_;
+  desc_store_t *store = NULL;
+
+  if (routerlist) {
+    store = (job->type == EXTRAINFO_STORE) ?
+      &routerlist->extrainfo_store : &routerlist->desc_store;
+  }
+  if (store && store->rebuild_job == job) {
+    store->rebuild_job = NULL;
+    if (!job->cancelled)
+      router_store_install_rebuild(store, job);
+  }
+  store_rebuild_job_free(job);
+}
+
+/** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
+ * <b>flags</b>, then atomically replace the saved router store with the
+ * routers currently in our routerlist, and clear the journal.  Unless
+ * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
+ * rebuilding the store.  Return 0 on success, -1 on failure.
+ *
+ * Unless RRS_FORCE is set, we write the new store from a cpuworker when we
+ * have one, and keep appending to the journal until it's done.  We don't
+ * start a rebuild while another one of the same store is being written.
+ */
+static int
+router_rebuild_store(int flags, desc_store_t *store)
+{
+  store_rebuild_job_t *job;
+  int had_any, r;
+  int force = flags & RRS_FORCE;
+
+  if (!force && !router_should_rebuild_store(store))
+    return 0;
+  if (!routerlist)
+    return 0;
+  if (store->rebuild_job)
+    return 0;
+
+  if (store->type == EXTRAINFO_STORE)
+    had_any = !eimap_isempty(routerlist->extra_info_map);
+  else
+    had_any = (smartlist_len(routerlist->routers)+
+               smartlist_len(routerlist->old_routers))>0;
+
+  /* Don't save deadweight. */
+  if (!(flags & RRS_DONT_REMOVE_OLD)) {
+    routerlist_remove_old_routers();
+    /* (That can start a rebuild of its own.) */
+    if (store->rebuild_job)
+      return 0;
+  }
+
+  log_info(LD_DIR, "Rebuilding %s cache", store->description);
+
+  job = store_rebuild_job_new(store);
+  if (!job)
+    return -1;
+  job->had_any = had_any;
+
+#ifndef _WIN32
+  /* (On Windows, we can't replace a file while it's mapped, so we always
+   * rebuild in the main thread.) */
+  if (!force && cpuworker_get_n_threads() > 0) {
+    if (cpuworker_queue_work(WQ_PRI_LOW, router_rebuild_store_threadfn,
+                             router_rebuild_store_replyfn, job)) {
+      store->rebuild_job = job;
+      return 0;
+    }
+    log_info(LD_DIR, "Couldn't queue %s cache rebuild; doing it in the "
+             "main thread.", store->description);
+  }
+#else /* defined(_WIN32) */
+  if (store->mmap) {
+    int res = tor_munmap_file(store->mmap);
+    store->mmap = NULL;
+    if (res != 0) {
+      log_warn(LD_FS, "Unable to munmap route store in %s", job->fname);
+    }
   }
+#endif /* !defined(_WIN32) */
 
+  store_rebuild_job_write(job);
+  r = router_store_install_rebuild(store, job);
+  store_rebuild_job_free(job);
   return r;
 }
 
@@ -397,6 +655,9 @@ router_reload_router_list_impl(desc_store_t *store)
 
   fname = get_cachedir_fname(store->fname_base);
 
+  if (store->rebuild_job)
+    store->rebuild_job->cancelled = 1;
+
   if (store->mmap) {
     /* get rid of it first */
     int res = tor_munmap_file(store->mmap);
@@ -208,6 +208,15 @@ MOCK_DECL(STATIC void, initiate_descriptor_downloads,
           (const routerstatus_t *source, int purpose, smartlist_t *digests,
            int lo, int hi, int pds_flags));
 
+typedef struct store_rebuild_job_t store_rebuild_job_t;
+STATIC store_rebuild_job_t *store_rebuild_job_new(const desc_store_t *store);
+STATIC void store_rebuild_job_write(store_rebuild_job_t *job);
+STATIC int router_store_install_rebuild(desc_store_t *store,
+                                        const store_rebuild_job_t *job);
+STATIC void store_rebuild_job_free_(store_rebuild_job_t *job);
+#define store_rebuild_job_free(job) \
+  FREE_AND_NULL(store_rebuild_job_t, store_rebuild_job_free_, (job))
+
 #endif /* defined(ROUTERLIST_PRIVATE) */
 
 #endif /* !defined(TOR_ROUTERLIST_H) */
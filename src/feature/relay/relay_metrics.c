@@ -16,19 +16,23 @@
 #include "core/or/command.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_vegas.h"
+#include "core/or/congestion_control_bbr.h"
 #include "core/or/congestion_control_flow.h"
+#include "core/or/congestion_control_pacing.h"
 #include "core/or/circuitlist.h"
 #include "core/or/dos.h"
 #include "core/or/relay.h"
 
 #include "app/config/config.h"
 
+#include "lib/compress/compress.h"
 #include "lib/container/smartlist.h"
 #include "lib/log/util_bug.h"
 #include "lib/malloc/malloc.h"
 #include "lib/math/fp.h"
 #include "lib/metrics/metrics_store.h"
 
+#include "feature/dircache/consdiffmgr.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/node_st.h"
@@ -58,6 +62,17 @@ static void fill_streams_values(void);
 static void fill_relay_circ_proto_violation(void);
 static void fill_relay_destroy_cell(void);
 static void fill_relay_drop_cell(void);
+static void fill_relay_circ_queue_sojourn(void);
+static void fill_relay_circ_queue_aqm_blocked(void);
+static void fill_conn_housekeeping(void);
+static void fill_conn_housekeeping_usec(void);
+static void fill_conn_bw_blocked(void);
+static void fill_listener_accepts(void);
+static void fill_consdiff_availability(void);
+static void fill_cc_pacing_delay(void);
+static void fill_cc_pacing_burst(void);
+static void fill_compress_pool(void);
+static void fill_compress_pool_bytes(void);
 static void fill_relay_flags(void);
 static void fill_tcp_exhaustion_values(void);
 static void fill_traffic_values(void);
@@ -242,6 +257,83 @@ static const relay_metrics_entry_t base_metrics[] =
     .help = "Total number of DROP cell we received",
     .fill_fn = fill_relay_drop_cell,
   },
+  {
+    .key = RELAY_METRICS_CIRC_QUEUE_SOJOURN,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_circ_queue_sojourn_msec),
+    .help = "Time cells spent in circuit queues in msec",
+    .fill_fn = fill_relay_circ_queue_sojourn,
+  },
+  {
+    .key = RELAY_METRICS_CIRC_QUEUE_AQM_BLOCKED,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_circ_queue_aqm_blocked_total),
+    .help = "Total number of circuits blocked by the cell queue AQM",
+    .fill_fn = fill_relay_circ_queue_aqm_blocked,
+  },
+  {
+    .key = RELAY_METRICS_CONN_HOUSEKEEPING,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_conn_housekeeping_total),
+    .help = "Total number of per-connection housekeeping runs",
+    .fill_fn = fill_conn_housekeeping,
+  },
+  {
+    .key = RELAY_METRICS_CONN_HOUSEKEEPING_USEC,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_conn_housekeeping_usec_total),
+    .help = "Total time spent in per-connection housekeeping in usec",
+    .fill_fn = fill_conn_housekeeping_usec,
+  },
+  {
+    .key = RELAY_METRICS_CONN_BW_BLOCKED,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_conn_bw_blocked_msec_total),
+    .help = "Total time connections spent waiting for bandwidth in msec",
+    .fill_fn = fill_conn_bw_blocked,
+  },
+  {
+    .key = RELAY_METRICS_LISTENER_ACCEPTS,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_listener_accepts_per_wakeup),
+    .help = "Number of connections accepted per listener wakeup",
+    .fill_fn = fill_listener_accepts,
+  },
+  {
+    .key = RELAY_METRICS_CONSDIFF_AVAILABILITY,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_consdiff_availability_msec),
+    .help = "Time for consensus diffs to become available, in msec",
+    .fill_fn = fill_consdiff_availability,
+  },
+  {
+    .key = RELAY_METRICS_COMPRESS_POOL,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_compress_states_total),
+    .help = "Total number of compression states reused or allocated",
+    .fill_fn = fill_compress_pool,
+  },
+  {
+    .key = RELAY_METRICS_COMPRESS_POOL_BYTES,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_compress_pool_bytes),
+    .help = "Memory held by idle pooled compression states in bytes",
+    .fill_fn = fill_compress_pool_bytes,
+  },
+  {
+    .key = RELAY_METRICS_CC_PACING_DELAY,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_congestion_control_pacing_delay_usec),
+    .help = "Time cell pacing held circuits back, in usec",
+    .fill_fn = fill_cc_pacing_delay,
+  },
+  {
+    .key = RELAY_METRICS_CC_PACING_BURST,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_congestion_control_pacing_burst_cells),
+    .help = "Number of cells circuits sent between two pacing stops",
+    .fill_fn = fill_cc_pacing_burst,
+  },
 };
 static const size_t num_base_metrics = ARRAY_LENGTH(base_metrics);
 
@@ -555,6 +647,22 @@ fill_cc_counters_values(void)
   metrics_store_entry_add_label(sentry,
           metrics_format_label("action", "circs_exited_ss"));
   metrics_store_entry_update(sentry, cc_stats_vegas_circ_exited_ss);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("state", "cc_circuits"));
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("action", "circs_exited_bbr_startup"));
+  metrics_store_entry_update(sentry, cc_stats_bbr_circ_exited_startup);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("state", "cc_limits"));
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("action", "bbr_probe_rtt"));
+  metrics_store_entry_update(sentry, cc_stats_bbr_probe_rtt);
 }
 
 /** Fill function for the RELAY_METRICS_CC_GAUGES metric. */
@@ -1258,6 +1366,221 @@ fill_relay_drop_cell(void)
   metrics_store_entry_update(sentry, rep_hist_get_drop_cell_received_count());
 }
 
+/** Fill the metrics store for the RELAY_METRICS_CIRC_QUEUE_SOJOURN
+ * histogram. */
+static void
+fill_relay_circ_queue_sojourn(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CIRC_QUEUE_SOJOURN];
+  static const char *directions[] = { "inbound", "outbound" };
+
+  for (size_t i = 0; i < ARRAY_LENGTH(directions); i++) {
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help,
+                               RELAY_CIRC_QUEUE_SOJOURN_N_BUCKETS,
+                               relay_circ_queue_sojourn_buckets);
+    metrics_store_entry_add_label(sentry,
+                    metrics_format_label("direction", directions[i]));
+    metrics_store_hist_entry_merge(sentry,
+                    stats_circ_queue_sojourn_counts[i],
+                    ARRAY_LENGTH(stats_circ_queue_sojourn_counts[i]),
+                    (int64_t) stats_circ_queue_sojourn_msec[i]);
+  }
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CIRC_QUEUE_AQM_BLOCKED
+ * counter. */
+static void
+fill_relay_circ_queue_aqm_blocked(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CIRC_QUEUE_AQM_BLOCKED];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry,
+                             (int64_t) stats_n_circ_queue_aqm_blocked);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CONN_HOUSEKEEPING. */
+static void
+fill_conn_housekeeping(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CONN_HOUSEKEEPING];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, (int64_t) get_conn_housekeeping_count());
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CONN_HOUSEKEEPING_USEC. */
+static void
+fill_conn_housekeeping_usec(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CONN_HOUSEKEEPING_USEC];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, (int64_t) get_conn_housekeeping_usec());
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CONN_BW_BLOCKED. */
+static void
+fill_conn_bw_blocked(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CONN_BW_BLOCKED];
+
+  for (conn_bw_class_t cls = 0; cls < CONN_BW_CLASS_MAX_; cls++) {
+    const char *type = conn_bw_class_to_string(cls);
+
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help, 0, NULL);
+    metrics_store_entry_add_label(sentry, metrics_format_label("type", type));
+    metrics_store_entry_add_label(sentry,
+                                  metrics_format_label("direction", "read"));
+    metrics_store_entry_update(sentry,
+                        (int64_t) connection_get_bw_blocked_msec(cls, true));
+
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help, 0, NULL);
+    metrics_store_entry_add_label(sentry, metrics_format_label("type", type));
+    metrics_store_entry_add_label(sentry,
+                                  metrics_format_label("direction", "write"));
+    metrics_store_entry_update(sentry,
+                        (int64_t) connection_get_bw_blocked_msec(cls, false));
+  }
+}
+
+/** Fill the metrics store for the RELAY_METRICS_LISTENER_ACCEPTS
+ * histogram. */
+static void
+fill_listener_accepts(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_LISTENER_ACCEPTS];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help,
+                             LISTENER_ACCEPTS_PER_WAKEUP_N_BUCKETS,
+                             listener_accepts_per_wakeup_buckets);
+  metrics_store_hist_entry_merge(sentry,
+                  stats_listener_accepts_per_wakeup,
+                  ARRAY_LENGTH(stats_listener_accepts_per_wakeup),
+                  (int64_t) stats_n_listener_accepts);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_COMPRESS_POOL counter. */
+static void
+fill_compress_pool(void)
+{
+  metrics_store_entry_t *sentry;
+  compress_pool_stats_t stats;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_COMPRESS_POOL];
+
+  tor_compress_pool_get_stats(&stats);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("action", "reused"));
+  metrics_store_entry_update(sentry, stats.n_reused);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("action", "allocated"));
+  metrics_store_entry_update(sentry, stats.n_allocated);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_COMPRESS_POOL_BYTES gauge. */
+static void
+fill_compress_pool_bytes(void)
+{
+  metrics_store_entry_t *sentry;
+  compress_pool_stats_t stats;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_COMPRESS_POOL_BYTES];
+
+  tor_compress_pool_get_stats(&stats);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, stats.pooled_bytes);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CC_PACING_DELAY
+ * histogram. */
+static void
+fill_cc_pacing_delay(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CC_PACING_DELAY];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, CC_PACING_DELAY_N_BUCKETS,
+                             cc_pacing_delay_buckets);
+  metrics_store_hist_entry_merge(sentry, cc_stats_pacing_delay_counts,
+                                 ARRAY_LENGTH(cc_stats_pacing_delay_counts),
+                                 (int64_t) cc_stats_pacing_delay_usec);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CC_PACING_BURST
+ * histogram. */
+static void
+fill_cc_pacing_burst(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CC_PACING_BURST];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, CC_PACING_BURST_N_BUCKETS,
+                             cc_pacing_burst_buckets);
+  metrics_store_hist_entry_merge(sentry, cc_stats_pacing_burst_counts,
+                                 ARRAY_LENGTH(cc_stats_pacing_burst_counts),
+                                 (int64_t) cc_stats_pacing_burst_cells);
+}
+
+/** Fill the metrics store for the RELAY_METRICS_CONSDIFF_AVAILABILITY
+ * histogram. */
+static void
+fill_consdiff_availability(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CONSDIFF_AVAILABILITY];
+
+  for (int method = NO_METHOD; method < UNKNOWN_METHOD; ++method) {
+    int64_t sum_msec = 0;
+    const uint64_t *counts =
+      consdiffmgr_get_diff_availability_hist(method, &sum_msec);
+    if (!counts)
+      continue;
+    sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                               rentry->help,
+                               CONSDIFF_AVAILABILITY_N_BUCKETS,
+                               consdiff_availability_buckets);
+    metrics_store_entry_add_label(sentry,
+                    metrics_format_label("compression",
+                                     compression_method_get_name(method)));
+    metrics_store_hist_entry_merge(sentry, counts,
+                                   CONSDIFF_AVAILABILITY_N_BUCKETS + 1,
+                                   sum_msec);
+  }
+}
+
 /** Fill the metrics store for the RELAY_METRICS_CIRC_PROTO_VIOLATION. */
 static void
 fill_relay_circ_proto_violation(void)
@@ -63,6 +63,28 @@ typedef enum {
   RELAY_METRICS_CIRC_PROTO_VIOLATION,
   /** Number of drop cell seen. */
   RELAY_METRICS_CIRC_DROP_CELL,
+  /** Sojourn time of cells in circuit queues. */
+  RELAY_METRICS_CIRC_QUEUE_SOJOURN,
+  /** Number of circuits blocked by the cell queue AQM. */
+  RELAY_METRICS_CIRC_QUEUE_AQM_BLOCKED,
+  /** Number of per-connection housekeeping runs. */
+  RELAY_METRICS_CONN_HOUSEKEEPING,
+  /** Time spent in per-connection housekeeping. */
+  RELAY_METRICS_CONN_HOUSEKEEPING_USEC,
+  /** Time connections spent waiting for bandwidth. */
+  RELAY_METRICS_CONN_BW_BLOCKED,
+  /** Number of connections accepted per listener wakeup. */
+  RELAY_METRICS_LISTENER_ACCEPTS,
+  /** Time for consensus diffs to become available. */
+  RELAY_METRICS_CONSDIFF_AVAILABILITY,
+  /** Number of compression states reused from the pool or allocated. */
+  RELAY_METRICS_COMPRESS_POOL,
+  /** Memory held by idle states in the compression state pool. */
+  RELAY_METRICS_COMPRESS_POOL_BYTES,
+  /** How long cell pacing held circuits back. */
+  RELAY_METRICS_CC_PACING_DELAY,
+  /** Number of cells circuits sent between two pacing stops. */
+  RELAY_METRICS_CC_PACING_BURST,
 } relay_metrics_key_t;
 
 /** The metadata of a relay metric. */
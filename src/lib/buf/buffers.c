@@ -66,6 +66,11 @@
  * string, use the buf_pullup function to make them so.  Don't do this more
  * than necessary.
  *
+ * A chunk can also refer to memory that it doesn't own, such as a mapped
+ * file, instead of holding a copy: see buf_add_external().  Such chunks are
+ * never written to; we only drop our reference to their memory when they
+ * are drained.
+ *
  * The major free Unix kernels have handled buffers like this since, like,
  * forever.
  */
@@ -130,6 +135,8 @@ buf_chunk_free_unchecked(chunk_t *chunk)
 {
   if (!chunk)
     return;
+  if (CHUNK_IS_EXTERNAL(chunk))
+    chunk->release_fn(chunk->release_arg);
 #ifdef DEBUG_CHUNK_ALLOC
   tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
 #endif
@@ -145,6 +152,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch = tor_malloc(alloc);
   ch->next = NULL;
   ch->datalen = 0;
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
 #ifdef DEBUG_CHUNK_ALLOC
   ch->DBG_alloc = alloc;
 #endif
@@ -155,6 +164,19 @@ chunk_new_with_alloc_size(size_t alloc)
   return ch;
 }
 
+/** Return a new chunk of <b>alloc</b> bytes holding a copy of the data in
+ * <b>in_chunk</b>, which must fit. */
+static chunk_t *
+chunk_new_with_copy(const chunk_t *in_chunk, size_t alloc)
+{
+  chunk_t *ch = chunk_new_with_alloc_size(alloc);
+  tor_assert(ch->memlen >= in_chunk->datalen);
+  memcpy(ch->mem, in_chunk->data, in_chunk->datalen);
+  ch->datalen = in_chunk->datalen;
+  ch->inserted_time = in_chunk->inserted_time;
+  return ch;
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -164,6 +186,7 @@ chunk_grow(chunk_t *chunk, size_t sz)
   const size_t memlen_orig = chunk->memlen;
   const size_t orig_alloc = CHUNK_ALLOC_SIZE(memlen_orig);
   const size_t new_alloc = CHUNK_ALLOC_SIZE(sz);
+  tor_assert(!CHUNK_IS_EXTERNAL(chunk));
   tor_assert(sz > chunk->memlen);
   offset = chunk->data - chunk->mem;
   chunk = tor_realloc(chunk, new_alloc);
@@ -229,6 +252,19 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (CHUNK_IS_EXTERNAL(buf->head)) {
+    /* We can't append to a chunk that refers to external memory: replace it
+     * with a copy that we own, big enough for the whole result. */
+    chunk_t *victim = buf->head;
+    chunk_t *newhead =
+      chunk_new_with_copy(victim, buf_preferred_chunk_size(capacity));
+    newhead->next = victim->next;
+    if (buf->tail == victim)
+      buf->tail = newhead;
+    buf->head = newhead;
+    buf_chunk_free_unchecked(victim);
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -435,6 +471,12 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (CHUNK_IS_EXTERNAL(in_chunk)) {
+    /* Copy the data rather than taking another reference to it: we have no
+     * way to do that. */
+    return chunk_new_with_copy(in_chunk,
+                        buf_preferred_chunk_size(in_chunk->datalen));
+  }
   chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -555,6 +597,53 @@ buf_add(buf_t *buf, const char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Append <b>data_len</b> bytes at <b>data</b> to the end of <b>buf</b>
+ * without copying them.  The caller passes us a reference to the memory
+ * holding <b>data</b>: it must stay valid and unchanged until we call
+ * <b>release_fn</b>(<b>release_arg</b>), which we do exactly once, as soon
+ * as the buffer no longer needs it (possibly before returning, on error or
+ * when <b>data_len</b> is zero).
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                 buf_release_fn_t release_fn, void *release_arg)
+{
+  chunk_t *chunk;
+  tor_assert(release_fn);
+
+  if (!data_len) {
+    release_fn(release_arg);
+    return (int)buf->datalen;
+  }
+  check();
+
+  if (BUG(buf->datalen > BUF_MAX_LEN) ||
+      BUG(buf->datalen > BUF_MAX_LEN - data_len)) {
+    release_fn(release_arg);
+    return -1;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *) data;
+  chunk->datalen = data_len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += data_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Add a nul-terminated <b>string</b> to <b>buf</b>, not including the
  * terminating NUL. */
 void
@@ -921,8 +1010,15 @@ buf_assert_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
-      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->datalen <= BUF_MAX_LEN);
+      if (CHUNK_IS_EXTERNAL(ch)) {
+        tor_assert(ch->datalen > 0);
+        tor_assert(ch->memlen == 0);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
+      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
       if (ch->data == &ch->mem[0]+ch->memlen) {
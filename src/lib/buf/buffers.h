@@ -18,6 +18,7 @@
 #include "lib/testsupport/testsupport.h"
 
 #include <stdarg.h>
+#include <stddef.h>
 
 typedef struct buf_t buf_t;
 
@@ -40,6 +41,11 @@ uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
+/** A function to release a reference to memory that a buffer refers to
+ * without owning it. */
+typedef void (*buf_release_fn_t)(void *arg);
+int buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                     buf_release_fn_t release_fn, void *release_arg);
 void buf_add_string(buf_t *buf, const char *string);
 void buf_add_printf(buf_t *buf, const char *format, ...)
   CHECK_PRINTF(2, 3);
@@ -80,7 +86,14 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in external memory if <b>release_fn</b> is set. */
+  /** If set, this chunk has no storage of its own: <b>data</b> points into
+   * memory owned by someone else, and we call this function with
+   * <b>release_arg</b> to drop our reference to it when the chunk is
+   * freed. */
+  buf_release_fn_t release_fn;
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
@@ -104,11 +117,21 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
  * just start a new chunk. */
 #define MIN_READ_LEN 8
 
+/** Return true iff <b>chunk</b> refers to external memory that it doesn't
+ * own. Nothing can be written onto such a chunk. */
+static inline int
+CHUNK_IS_EXTERNAL(const chunk_t *chunk)
+{
+  return chunk->release_fn != NULL;
+}
+
 /** Return the number of bytes that can be written onto <b>chunk</b> without
  * running out of space. */
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (CHUNK_IS_EXTERNAL(chunk))
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -319,6 +319,8 @@ tor_compress_supports_method(compress_method_t method)
       return tor_lzma_method_supported();
     case ZSTD_METHOD:
       return tor_zstd_method_supported();
+    case ZSTD_DICT_METHOD:
+      return tor_zstd_dict_method_supported();
     case NO_METHOD:
       return 1;
     case UNKNOWN_METHOD:
@@ -359,6 +361,9 @@ static const struct {
   // lower maximum memory usage on the decoding side.
   { "x-tor-lzma", LZMA_METHOD },
   { "x-zstd" , ZSTD_METHOD },
+  // The name of this method includes the identity of the dictionary, so that
+  // peers with a different dictionary fall back to plain x-zstd.
+  { "x-tor-zstd-dict-" TOR_ZSTD_DICT_ID, ZSTD_DICT_METHOD },
   { "identity", NO_METHOD },
 
   /* Later entries in this table are not canonical; these are recognized but
@@ -389,6 +394,7 @@ static const struct {
   { ZLIB_METHOD, "deflated" },
   { LZMA_METHOD, "LZMA compressed" },
   { ZSTD_METHOD, "Zstandard compressed" },
+  { ZSTD_DICT_METHOD, "Zstandard dictionary compressed" },
   { UNKNOWN_METHOD, "unknown encoding" },
 };
 
@@ -431,6 +437,7 @@ tor_compress_version_str(compress_method_t method)
     case LZMA_METHOD:
       return tor_lzma_get_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -452,6 +459,7 @@ tor_compress_header_version_str(compress_method_t method)
     case LZMA_METHOD:
       return tor_lzma_get_header_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_header_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -475,6 +483,8 @@ tor_compress_get_total_allocation(void)
  * this struct is not exposed. */
 struct tor_compress_state_t {
   compress_method_t method; /**< The compression method. */
+  int compress; /**< True if we are compressing; false if we are inflating */
+  compression_level_t level; /**< The compression level. */
 
   union {
     tor_zlib_compress_state_t *zlib_state;
@@ -483,16 +493,215 @@ struct tor_compress_state_t {
   } u; /**< Compression backend state. */
 };
 
+/** @{ */
+/** Largest number of idle states we keep for each (method, level, direction)
+ * in the compression state pool. */
+#define COMPRESS_POOL_MAX_PER_KEY 8
+/** Largest number of bytes of idle states we keep in the compression state
+ * pool.  States bigger than this, like high-level LZMA encoders, are never
+ * pooled. */
+#define COMPRESS_POOL_MAX_BYTES (32*1024*1024)
+/** @} */
+
+/** Number of values in compression_level_t. */
+#define N_COMPRESSION_LEVELS (LOW_COMPRESSION + 1)
+
+/** A stack of idle compression states that share the same parameters. */
+typedef struct compress_pool_bucket_t {
+  /** Number of states in <b>states</b>. */
+  int n_states;
+  /** The idle states, most recently released last. */
+  tor_compress_state_t *states[COMPRESS_POOL_MAX_PER_KEY];
+} compress_pool_bucket_t;
+
+/** Idle compression states, indexed by method, level and direction.  Setting
+ * up a zstd or LZMA context costs hundreds of kilobytes of allocation and
+ * initialization, so directory caches reset and reuse old ones instead of
+ * freeing them after every response. */
+static compress_pool_bucket_t
+  compress_pool[UNKNOWN_METHOD][N_COMPRESSION_LEVELS][2];
+/** Lock protecting compress_pool and the statistics below: states are
+ * created and freed from worker threads too. */
+static tor_mutex_t compress_pool_lock;
+/** Total number of bytes held by idle states in compress_pool. */
+static size_t compress_pool_bytes = 0;
+/** Total number of idle states in compress_pool. */
+static size_t compress_pool_n_states = 0;
+/** Number of states we handed out from compress_pool. */
+static uint64_t compress_pool_n_reused = 0;
+/** Number of poolable states we had to allocate from scratch. */
+static uint64_t compress_pool_n_allocated = 0;
+
+static void tor_compress_state_free_impl(tor_compress_state_t *state);
+
+/** Return the compress_pool bucket for states using <b>method</b> at
+ * <b>level</b>, compressing if <b>compress</b> is true, or NULL if such
+ * states are never pooled. */
+static compress_pool_bucket_t *
+compress_pool_get_bucket(int compress, compress_method_t method,
+                         compression_level_t level)
+{
+  if (method == NO_METHOD || (unsigned) method >= UNKNOWN_METHOD ||
+      (unsigned) level >= N_COMPRESSION_LEVELS)
+    return NULL;
+
+  /* None of our backends care about the level when they are decompressing,
+   * so all decompression states are interchangeable. */
+  if (!compress)
+    level = BEST_COMPRESSION;
+
+  return &compress_pool[method][level][compress ? 1 : 0];
+}
+
+/** Reset the backend of <b>state</b> for a new stream with the same
+ * parameters.  Return 0 on success, -1 on failure. */
+static int
+tor_compress_state_reset(tor_compress_state_t *state)
+{
+  switch (state->method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+      return tor_zlib_compress_reset(state->u.zlib_state);
+    case LZMA_METHOD:
+      return tor_lzma_compress_reset(state->u.lzma_state, state->level);
+    case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
+      return tor_zstd_compress_reset(state->u.zstd_state, state->method,
+                                     state->level);
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+    default:
+      return -1;
+  }
+}
+
+/** Try to take an idle state using <b>method</b> at <b>level</b> from the
+ * pool, and reset it.  Return NULL if there is none. */
+static tor_compress_state_t *
+compress_pool_take(int compress, compress_method_t method,
+                   compression_level_t level)
+{
+  compress_pool_bucket_t *bucket =
+    compress_pool_get_bucket(compress, method, level);
+  tor_compress_state_t *state = NULL;
+
+  if (!bucket)
+    return NULL;
+
+  tor_mutex_acquire(&compress_pool_lock);
+  if (bucket->n_states > 0) {
+    state = bucket->states[--bucket->n_states];
+    bucket->states[bucket->n_states] = NULL;
+    compress_pool_bytes -= tor_compress_state_size(state);
+    --compress_pool_n_states;
+    ++compress_pool_n_reused;
+  } else {
+    ++compress_pool_n_allocated;
+  }
+  tor_mutex_release(&compress_pool_lock);
+
+  if (state && tor_compress_state_reset(state) < 0) {
+    // LCOV_EXCL_START
+    tor_compress_state_free_impl(state);
+    state = NULL;
+    // LCOV_EXCL_STOP
+  }
+  if (state) {
+    /* Decompression states may come from a bucket with another level. */
+    state->level = level;
+  }
+
+  return state;
+}
+
+/** Try to put <b>state</b> into the pool for later reuse.  Return true if
+ * the pool took ownership of it. */
+static int
+compress_pool_put(tor_compress_state_t *state)
+{
+  compress_pool_bucket_t *bucket =
+    compress_pool_get_bucket(state->compress, state->method, state->level);
+  int pooled = 0;
+
+  if (!bucket)
+    return 0;
+
+  const size_t size = tor_compress_state_size(state);
+
+  tor_mutex_acquire(&compress_pool_lock);
+  if (bucket->n_states < COMPRESS_POOL_MAX_PER_KEY &&
+      size <= COMPRESS_POOL_MAX_BYTES - compress_pool_bytes) {
+    bucket->states[bucket->n_states++] = state;
+    compress_pool_bytes += size;
+    ++compress_pool_n_states;
+    pooled = 1;
+  }
+  tor_mutex_release(&compress_pool_lock);
+
+  return pooled;
+}
+
+/** Free every idle state in the compression state pool.  Return the number
+ * of bytes we released. */
+size_t
+tor_compress_pool_clear(void)
+{
+  size_t freed;
+
+  tor_mutex_acquire(&compress_pool_lock);
+  for (unsigned m = 0; m < UNKNOWN_METHOD; ++m) {
+    for (unsigned l = 0; l < N_COMPRESSION_LEVELS; ++l) {
+      for (unsigned c = 0; c < 2; ++c) {
+        compress_pool_bucket_t *bucket = &compress_pool[m][l][c];
+        while (bucket->n_states > 0) {
+          --bucket->n_states;
+          tor_compress_state_free_impl(bucket->states[bucket->n_states]);
+          bucket->states[bucket->n_states] = NULL;
+        }
+      }
+    }
+  }
+  freed = compress_pool_bytes;
+  compress_pool_bytes = 0;
+  compress_pool_n_states = 0;
+  tor_mutex_release(&compress_pool_lock);
+
+  return freed;
+}
+
+/** Fill <b>stats_out</b> with statistics about the compression state
+ * pool. */
+void
+tor_compress_pool_get_stats(compress_pool_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+
+  tor_mutex_acquire(&compress_pool_lock);
+  stats_out->n_reused = compress_pool_n_reused;
+  stats_out->n_allocated = compress_pool_n_allocated;
+  stats_out->n_pooled = compress_pool_n_states;
+  stats_out->pooled_bytes = compress_pool_bytes;
+  tor_mutex_release(&compress_pool_lock);
+}
+
 /** Construct and return a tor_compress_state_t object using <b>method</b>.  If
- * <b>compress</b>, it's for compression; otherwise it's for decompression. */
+ * <b>compress</b>, it's for compression; otherwise it's for decompression.
+ *
+ * We hand out a reset state from the pool if we have a suitable one. */
 tor_compress_state_t *
 tor_compress_new(int compress, compress_method_t method,
                  compression_level_t compression_level)
 {
   tor_compress_state_t *state;
 
+  state = compress_pool_take(compress, method, compression_level);
+  if (state)
+    return state;
+
   state = tor_malloc_zero(sizeof(tor_compress_state_t));
   state->method = method;
+  state->compress = compress;
+  state->level = compression_level;
 
   switch (method) {
     case GZIP_METHOD:
@@ -516,7 +725,8 @@ tor_compress_new(int compress, compress_method_t method,
       state->u.lzma_state = lzma_state;
       break;
     }
-    case ZSTD_METHOD: {
+    case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD: {
       tor_zstd_compress_state_t *zstd_state =
         tor_zstd_compress_new(compress, method, compression_level);
 
@@ -584,6 +794,7 @@ tor_compress_process(tor_compress_state_t *state,
                                      finish);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       rv = tor_zstd_compress_process(state->u.zstd_state,
                                      out, out_len, in, in_len,
                                      finish);
@@ -613,13 +824,24 @@ tor_compress_process(tor_compress_state_t *state,
   return TOR_COMPRESS_ERROR;
 }
 
-/** Deallocate <b>state</b>. */
+/** Release <b>state</b>, keeping it in the pool for reuse if there's room
+ * for it. */
 void
 tor_compress_free_(tor_compress_state_t *state)
 {
   if (state == NULL)
     return;
 
+  if (compress_pool_put(state))
+    return;
+
+  tor_compress_state_free_impl(state);
+}
+
+/** Deallocate <b>state</b>. */
+static void
+tor_compress_state_free_impl(tor_compress_state_t *state)
+{
   switch (state->method) {
     case GZIP_METHOD:
     case ZLIB_METHOD:
@@ -629,6 +851,7 @@ tor_compress_free_(tor_compress_state_t *state)
       tor_lzma_compress_free(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       tor_zstd_compress_free(state->u.zstd_state);
       break;
     case NO_METHOD:
@@ -659,6 +882,7 @@ tor_compress_state_size(const tor_compress_state_t *state)
       size += tor_lzma_compress_state_size(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       size += tor_zstd_compress_state_size(state->u.zstd_state);
       break;
     case NO_METHOD:
@@ -674,6 +898,7 @@ int
 tor_compress_init(void)
 {
   atomic_counter_init(&total_compress_allocation);
+  tor_mutex_init(&compress_pool_lock);
 
   tor_zlib_init();
   tor_lzma_init();
@@ -694,16 +919,31 @@ tor_compress_log_init_warnings(void)
   tor_zstd_warn_if_version_mismatched();
 }
 
+/** Release all storage held by the compression modules. */
+void
+tor_compress_free_all(void)
+{
+  tor_compress_pool_clear();
+  tor_zstd_free_all();
+}
+
 static int
 subsys_compress_initialize(void)
 {
   return tor_compress_init();
 }
 
+static void
+subsys_compress_shutdown(void)
+{
+  tor_compress_free_all();
+}
+
 const subsys_fns_t sys_compress = {
   .name = "compress",
   SUBSYS_DECLARE_LOCATION(),
   .supported = true,
   .level = -55,
   .initialize = subsys_compress_initialize,
+  .shutdown = subsys_compress_shutdown,
 };
@@ -12,6 +12,7 @@
 #define TOR_COMPRESS_H
 
 #include <stddef.h>
+#include "lib/cc/torint.h"
 #include "lib/testsupport/testsupport.h"
 
 /** Enumeration of what kind of compression to use.  Only ZLIB_METHOD and
@@ -24,7 +25,9 @@ typedef enum compress_method_t {
   ZLIB_METHOD=2,
   LZMA_METHOD=3,
   ZSTD_METHOD=4,
-  UNKNOWN_METHOD=5, // This method must be last. Add new ones in the middle.
+  /** Zstandard, primed with our built-in directory dictionary. */
+  ZSTD_DICT_METHOD=5,
+  UNKNOWN_METHOD=6, // This method must be last. Add new ones in the middle.
 } compress_method_t;
 
 /**
@@ -89,7 +92,24 @@ void tor_compress_free_(tor_compress_state_t *state);
 
 size_t tor_compress_state_size(const tor_compress_state_t *state);
 
+/** Statistics about the pool of reusable compression states. */
+typedef struct compress_pool_stats_t {
+  /** Number of states we handed out from the pool. */
+  uint64_t n_reused;
+  /** Number of poolable states we had to allocate from scratch. */
+  uint64_t n_allocated;
+  /** Number of idle states currently in the pool. */
+  size_t n_pooled;
+  /** Approximate number of bytes held by idle states in the pool.  These
+   * are also counted by tor_compress_get_total_allocation(). */
+  size_t pooled_bytes;
+} compress_pool_stats_t;
+
+size_t tor_compress_pool_clear(void);
+void tor_compress_pool_get_stats(compress_pool_stats_t *stats_out);
+
 int tor_compress_init(void);
+void tor_compress_free_all(void);
 void tor_compress_log_init_warnings(void);
 
 struct buf_t;
@@ -353,6 +353,46 @@ tor_lzma_compress_process(tor_lzma_compress_state_t *state,
 #endif /* defined(HAVE_LZMA) */
 }
 
+/** Reset <b>state</b> so that it can be used for a new stream at
+ * <b>level</b>.  liblzma reuses the memory of an existing coder when it is
+ * re-initialized with the same filters, so this is much cheaper than
+ * allocating a new state.  Return 0 on success, -1 on failure. */
+int
+tor_lzma_compress_reset(tor_lzma_compress_state_t *state,
+                        compression_level_t level)
+{
+  tor_assert(state != NULL);
+
+#ifdef HAVE_LZMA
+  lzma_ret retval;
+
+  if (state->compress) {
+    lzma_options_lzma stream_options;
+    lzma_lzma_preset(&stream_options, memory_level(level));
+    retval = lzma_alone_encoder(&state->stream, &stream_options);
+  } else {
+    retval = lzma_alone_decoder(&state->stream, MEMORY_LIMIT);
+  }
+
+  if (retval != LZMA_OK) {
+    // LCOV_EXCL_START
+    log_warn(LD_GENERAL, "Error from LZMA %s: %s (%u).",
+             state->compress ? "encoder" : "decoder",
+             lzma_error_str(retval), retval);
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+
+  state->input_so_far = 0;
+  state->output_so_far = 0;
+  return 0;
+#else /* !defined(HAVE_LZMA) */
+  (void)level;
+
+  return -1;
+#endif /* defined(HAVE_LZMA) */
+}
+
 /** Deallocate <b>state</b>. */
 void
 tor_lzma_compress_free_(tor_lzma_compress_state_t *state)
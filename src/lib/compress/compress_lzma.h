@@ -31,6 +31,9 @@ tor_lzma_compress_process(tor_lzma_compress_state_t *state,
                           const char **in, size_t *in_len,
                           int finish);
 
+int tor_lzma_compress_reset(tor_lzma_compress_state_t *state,
+                            compression_level_t level);
+
 void tor_lzma_compress_free_(tor_lzma_compress_state_t *state);
 #define tor_lzma_compress_free(st)                      \
   FREE_AND_NULL(tor_lzma_compress_state_t,   \
@@ -264,6 +264,27 @@ tor_zlib_compress_process(tor_zlib_compress_state_t *state,
     }
 }
 
+/** Reset <b>state</b> so that it can be used for a new stream with the same
+ * parameters.  Return 0 on success, -1 on failure. */
+int
+tor_zlib_compress_reset(tor_zlib_compress_state_t *state)
+{
+  int err;
+  tor_assert(state != NULL);
+
+  if (state->compress)
+    err = deflateReset(&state->stream);
+  else
+    err = inflateReset(&state->stream);
+
+  if (err != Z_OK)
+    return -1; // LCOV_EXCL_LINE
+
+  state->input_so_far = 0;
+  state->output_so_far = 0;
+  return 0;
+}
+
 /** Deallocate <b>state</b>. */
 void
 tor_zlib_compress_free_(tor_zlib_compress_state_t *state)
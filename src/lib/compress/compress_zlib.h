@@ -31,6 +31,8 @@ tor_zlib_compress_process(tor_zlib_compress_state_t *state,
                           const char **in, size_t *in_len,
                           int finish);
 
+int tor_zlib_compress_reset(tor_zlib_compress_state_t *state);
+
 void tor_zlib_compress_free_(tor_zlib_compress_state_t *state);
 #define tor_zlib_compress_free(st)                      \
   FREE_AND_NULL(tor_zlib_compress_state_t,   \
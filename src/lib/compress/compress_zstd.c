@@ -37,9 +37,37 @@ ENABLE_GCC_WARNING("-Wunused-const-variable")
 #endif
 #endif /* defined(HAVE_ZSTD) */
 
+#ifdef HAVE_ZSTD
+/** Oldest libzstd release with a stable API for sharing a digested
+ * dictionary between streams. */
+#define ZSTD_DICT_MIN_VERSION 10400
+#if ZSTD_VERSION_NUMBER >= ZSTD_DICT_MIN_VERSION
+#define HAVE_ZSTD_DICT_APIS
+#endif
+#endif /* defined(HAVE_ZSTD) */
+
 /** Total number of bytes allocated for Zstandard state. */
 static atomic_counter_t total_zstd_allocation;
 
+/** Our built-in directory dictionary.  See zstd_dirdict.inc. */
+static const char zstd_dirdict[] =
+#include "lib/compress/zstd_dirdict.inc"
+  ;
+
+#ifdef HAVE_ZSTD_DICT_APIS
+/** Number of distinct zstd levels that memory_level() can return. */
+#define N_DIRDICT_LEVELS 3
+
+/** Lock protecting dirdict_cdicts and dirdict_ddict: streams may be created
+ * from worker threads. */
+static tor_mutex_t dirdict_lock;
+/** Our built-in dictionary, digested for compression at each level.  Built
+ * lazily, since only directory caches need them. */
+static ZSTD_CDict *dirdict_cdicts[N_DIRDICT_LEVELS];
+/** Our built-in dictionary, digested for decompression.  Built lazily. */
+static ZSTD_DDict *dirdict_ddict;
+#endif /* defined(HAVE_ZSTD_DICT_APIS) */
+
 #ifdef HAVE_ZSTD
 /** Given <b>level</b> return the memory level. */
 static int
@@ -55,6 +83,58 @@ memory_level(compression_level_t level)
 }
 #endif /* defined(HAVE_ZSTD) */
 
+#ifdef HAVE_ZSTD_DICT_APIS
+/** Given <b>level</b> return its index in dirdict_cdicts. */
+static int
+dirdict_level_idx(compression_level_t level)
+{
+  switch (level) {
+    default:
+    case BEST_COMPRESSION:
+    case HIGH_COMPRESSION: return 2;
+    case MEDIUM_COMPRESSION: return 1;
+    case LOW_COMPRESSION: return 0;
+  }
+}
+
+/** Return our built-in dictionary digested for compressing at <b>level</b>,
+ * building it if needed.  Return NULL on failure. */
+static const ZSTD_CDict *
+tor_zstd_get_dirdict_cdict(compression_level_t level)
+{
+  const int idx = dirdict_level_idx(level);
+  const ZSTD_CDict *cdict;
+
+  tor_mutex_acquire(&dirdict_lock);
+  if (dirdict_cdicts[idx] == NULL) {
+    dirdict_cdicts[idx] = ZSTD_createCDict(zstd_dirdict,
+                                           sizeof(zstd_dirdict) - 1,
+                                           memory_level(level));
+  }
+  cdict = dirdict_cdicts[idx];
+  tor_mutex_release(&dirdict_lock);
+
+  return cdict;
+}
+
+/** Return our built-in dictionary digested for decompression, building it if
+ * needed.  Return NULL on failure. */
+static const ZSTD_DDict *
+tor_zstd_get_dirdict_ddict(void)
+{
+  const ZSTD_DDict *ddict;
+
+  tor_mutex_acquire(&dirdict_lock);
+  if (dirdict_ddict == NULL) {
+    dirdict_ddict = ZSTD_createDDict(zstd_dirdict, sizeof(zstd_dirdict) - 1);
+  }
+  ddict = dirdict_ddict;
+  tor_mutex_release(&dirdict_lock);
+
+  return ddict;
+}
+#endif /* defined(HAVE_ZSTD_DICT_APIS) */
+
 /** Return 1 if Zstandard compression is supported; otherwise 0. */
 int
 tor_zstd_method_supported(void)
@@ -66,6 +146,28 @@ tor_zstd_method_supported(void)
 #endif
 }
 
+/** Return 1 if Zstandard compression with our built-in directory dictionary
+ * is supported; otherwise 0. */
+int
+tor_zstd_dict_method_supported(void)
+{
+#ifdef HAVE_ZSTD_DICT_APIS
+  return ZSTD_versionNumber() >= ZSTD_DICT_MIN_VERSION;
+#else
+  return 0;
+#endif
+}
+
+/** Return our built-in directory dictionary, and set *<b>len_out</b> to its
+ * length. */
+const char *
+tor_zstd_dict_get(size_t *len_out)
+{
+  tor_assert(len_out);
+  *len_out = sizeof(zstd_dirdict) - 1;
+  return zstd_dirdict;
+}
+
 #ifdef HAVE_ZSTD
 /** Format a zstd version number as a string in <b>buf</b>. */
 static void
@@ -240,6 +342,43 @@ tor_zstd_state_size_precalc(int compress, int preset)
 #endif /* defined(ZSTD_STATIC_LINKING_ONLY) */
   return tor_zstd_state_size_precalc_fake(compress, preset);
 }
+
+/** Prime the stream in <b>state</b> with our built-in directory dictionary,
+ * digested for <b>level</b> if we're compressing.  Return 0 on success, -1
+ * on failure. */
+static int
+tor_zstd_load_dirdict(tor_zstd_compress_state_t *state,
+                      compression_level_t level)
+{
+#ifdef HAVE_ZSTD_DICT_APIS
+  size_t retval;
+
+  if (state->compress) {
+    const ZSTD_CDict *cdict = tor_zstd_get_dirdict_cdict(level);
+    if (cdict == NULL)
+      return -1;
+    retval = ZSTD_CCtx_refCDict(state->u.compress_stream, cdict);
+  } else {
+    const ZSTD_DDict *ddict = tor_zstd_get_dirdict_ddict();
+    if (ddict == NULL)
+      return -1;
+    retval = ZSTD_DCtx_refDDict(state->u.decompress_stream, ddict);
+  }
+
+  if (ZSTD_isError(retval)) {
+    log_warn(LD_GENERAL, "Unable to load Zstandard dictionary: %s",
+             ZSTD_getErrorName(retval));
+    return -1;
+  }
+
+  return 0;
+#else /* !defined(HAVE_ZSTD_DICT_APIS) */
+  (void)state;
+  (void)level;
+
+  return -1;
+#endif /* defined(HAVE_ZSTD_DICT_APIS) */
+}
 #endif /* defined(HAVE_ZSTD) */
 
 /** Construct and return a tor_zstd_compress_state_t object using
@@ -250,7 +389,7 @@ tor_zstd_compress_new(int compress,
                       compress_method_t method,
                       compression_level_t level)
 {
-  tor_assert(method == ZSTD_METHOD);
+  tor_assert(method == ZSTD_METHOD || method == ZSTD_DICT_METHOD);
 
 #ifdef HAVE_ZSTD
   const int preset = memory_level(level);
@@ -303,6 +442,9 @@ tor_zstd_compress_new(int compress,
     }
   }
 
+  if (method == ZSTD_DICT_METHOD && tor_zstd_load_dirdict(result, level) < 0)
+    goto err;
+
   atomic_counter_add(&total_zstd_allocation, result->allocation);
   return result;
 
@@ -466,6 +608,47 @@ tor_zstd_compress_process(tor_zstd_compress_state_t *state,
 #endif /* defined(HAVE_ZSTD) */
 }
 
+/** Reset <b>state</b> so that it can be used for a new stream using
+ * <b>method</b> at <b>level</b>.  Return 0 on success, -1 on failure. */
+int
+tor_zstd_compress_reset(tor_zstd_compress_state_t *state,
+                        compress_method_t method,
+                        compression_level_t level)
+{
+  tor_assert(state != NULL);
+  tor_assert(method == ZSTD_METHOD || method == ZSTD_DICT_METHOD);
+
+#ifdef HAVE_ZSTD
+  size_t retval;
+
+  if (state->compress)
+    retval = ZSTD_initCStream(state->u.compress_stream, memory_level(level));
+  else
+    retval = ZSTD_initDStream(state->u.decompress_stream);
+
+  if (ZSTD_isError(retval)) {
+    // LCOV_EXCL_START
+    log_warn(LD_GENERAL, "Zstandard stream initialization error: %s",
+             ZSTD_getErrorName(retval));
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+
+  if (method == ZSTD_DICT_METHOD && tor_zstd_load_dirdict(state, level) < 0)
+    return -1;
+
+  state->have_called_end = 0;
+  state->input_so_far = 0;
+  state->output_so_far = 0;
+  return 0;
+#else /* !defined(HAVE_ZSTD) */
+  (void)method;
+  (void)level;
+
+  return -1;
+#endif /* defined(HAVE_ZSTD) */
+}
+
 /** Deallocate <b>state</b>. */
 void
 tor_zstd_compress_free_(tor_zstd_compress_state_t *state)
@@ -507,6 +690,25 @@ void
 tor_zstd_init(void)
 {
   atomic_counter_init(&total_zstd_allocation);
+#ifdef HAVE_ZSTD_DICT_APIS
+  tor_mutex_init(&dirdict_lock);
+#endif
+}
+
+/** Release all storage held by the zstd module. */
+void
+tor_zstd_free_all(void)
+{
+#ifdef HAVE_ZSTD_DICT_APIS
+  tor_mutex_acquire(&dirdict_lock);
+  for (int i = 0; i < N_DIRDICT_LEVELS; ++i) {
+    ZSTD_freeCDict(dirdict_cdicts[i]);
+    dirdict_cdicts[i] = NULL;
+  }
+  ZSTD_freeDDict(dirdict_ddict);
+  dirdict_ddict = NULL;
+  tor_mutex_release(&dirdict_lock);
+#endif /* defined(HAVE_ZSTD_DICT_APIS) */
 }
 
 /** Warn if the header and library versions don't match. */
@@ -12,6 +12,15 @@
 #define TOR_COMPRESS_ZSTD_H
 
 int tor_zstd_method_supported(void);
+int tor_zstd_dict_method_supported(void);
+
+/** Identifier of our built-in directory dictionary: the first four bytes of
+ * its SHA256 digest, in hex.  Peers advertise it as part of the name of
+ * ZSTD_DICT_METHOD, so that two Tors only use the dictionary if they agree
+ * on its contents. */
+#define TOR_ZSTD_DICT_ID "4610d0d6"
+
+const char *tor_zstd_dict_get(size_t *len_out);
 
 const char *tor_zstd_get_version_str(void);
 
@@ -33,6 +42,10 @@ tor_zstd_compress_process(tor_zstd_compress_state_t *state,
                           const char **in, size_t *in_len,
                           int finish);
 
+int tor_zstd_compress_reset(tor_zstd_compress_state_t *state,
+                            compress_method_t method,
+                            compression_level_t level);
+
 void tor_zstd_compress_free_(tor_zstd_compress_state_t *state);
 #define tor_zstd_compress_free(st)                      \
   FREE_AND_NULL(tor_zstd_compress_state_t,   \
@@ -43,6 +56,7 @@ size_t tor_zstd_compress_state_size(const tor_zstd_compress_state_t *state);
 size_t tor_zstd_get_total_allocation(void);
 
 void tor_zstd_init(void);
+void tor_zstd_free_all(void);
 void tor_zstd_warn_if_version_mismatched(void);
 
 #ifdef TOR_UNIT_TESTS
@@ -717,6 +717,31 @@ smartlist_heapify(smartlist_t *sl,
   }
 }
 
+/** Helper for pqueue functions: move the item at <b>idx</b> toward the top of
+ * the heap stored in <b>sl</b> until its parent is no larger than it.
+ * Return the new index of the item. */
+static inline int
+smartlist_heap_sift_up(smartlist_t *sl,
+                       int (*compare)(const void *a, const void *b),
+                       ptrdiff_t idx_field_offset,
+                       int idx)
+{
+  while (idx) {
+    int parent = PARENT(idx);
+    if (compare(sl->list[idx], sl->list[parent]) < 0) {
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    } else {
+      break;
+    }
+  }
+  return idx;
+}
+
 /** Insert <b>item</b> into the heap stored in <b>sl</b>, where order is
  * determined by <b>compare</b> and the offset of the item in the heap is
  * stored in an int-typed field at position <b>idx_field_offset</b> within
@@ -728,23 +753,10 @@ smartlist_pqueue_add(smartlist_t *sl,
                      ptrdiff_t idx_field_offset,
                      void *item)
 {
-  int idx;
   smartlist_add(sl,item);
   UPDATE_IDX(sl->num_used-1);
 
-  for (idx = sl->num_used - 1; idx; ) {
-    int parent = PARENT(idx);
-    if (compare(sl->list[idx], sl->list[parent]) < 0) {
-      void *tmp = sl->list[parent];
-      sl->list[parent] = sl->list[idx];
-      sl->list[idx] = tmp;
-      UPDATE_IDX(parent);
-      UPDATE_IDX(idx);
-      idx = parent;
-    } else {
-      return;
-    }
-  }
+  smartlist_heap_sift_up(sl, compare, idx_field_offset, sl->num_used - 1);
 }
 
 /** Remove and return the top-priority item from the heap stored in <b>sl</b>,
@@ -793,7 +805,10 @@ smartlist_pqueue_remove(smartlist_t *sl,
     sl->list[idx] = sl->list[sl->num_used];
     sl->list[sl->num_used] = NULL;
     UPDATE_IDX(idx);
-    smartlist_heapify(sl, compare, idx_field_offset, idx);
+    /* The last item came from another subtree: it can be smaller than the
+     * parent of the removed one, or larger than its children. */
+    if (smartlist_heap_sift_up(sl, compare, idx_field_offset, idx) == idx)
+      smartlist_heapify(sl, compare, idx_field_offset, idx);
   }
 }
 
@@ -137,6 +137,49 @@ metrics_store_hist_entry_update(metrics_store_entry_t *entry,
   }
 }
 
+/** Merge pre-aggregated observations into the histogram <b>entry</b>.
+ *
+ * The <b>counts</b> array has <b>n_counts</b> elements which MUST be the
+ * number of buckets of the entry plus one. Element i is the number of
+ * observations that fell in bucket i and not in any lower bucket, the last
+ * element being the observations above the highest bucket. The <b>sum</b> is
+ * the sum of all those observations.
+ *
+ * This is useful for fast path code that keeps its own plain counters and
+ * only builds the metrics entry when the MetricsPort is queried.
+ *
+ * Note: entry **must** be a histogram. */
+void
+metrics_store_hist_entry_merge(metrics_store_entry_t *entry,
+                               const uint64_t *counts, size_t n_counts,
+                               const int64_t sum)
+{
+  uint64_t cumulative = 0;
+
+  if (BUG(entry->type != METRICS_TYPE_HISTOGRAM)) {
+    return;
+  }
+  if (BUG(n_counts != entry->u.histogram.bucket_count + 1)) {
+    return;
+  }
+
+  /* Same overflow policy as metrics_store_hist_entry_update(). */
+  if (PREDICT_UNLIKELY(
+          (sum > 0 && entry->u.histogram.sum > INT64_MAX - sum) ||
+          (sum < 0 && entry->u.histogram.sum < INT64_MIN - sum))) {
+    metrics_store_entry_reset(entry);
+  }
+
+  for (size_t i = 0; i < entry->u.histogram.bucket_count; ++i) {
+    cumulative += counts[i];
+    entry->u.histogram.buckets[i].value += cumulative;
+  }
+  cumulative += counts[n_counts - 1];
+
+  entry->u.histogram.count += cumulative;
+  entry->u.histogram.sum += sum;
+}
+
 /** Reset a store entry that is set its metric data to 0. */
 void
 metrics_store_entry_reset(metrics_store_entry_t *entry)
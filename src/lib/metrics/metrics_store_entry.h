@@ -78,5 +78,8 @@ void metrics_store_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value);
 void metrics_store_hist_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value, const int64_t obs);
+void metrics_store_hist_entry_merge(metrics_store_entry_t *entry,
+                                    const uint64_t *counts, size_t n_counts,
+                                    const int64_t sum);
 
 #endif /* !defined(TOR_LIB_METRICS_METRICS_STORE_ENTRY_H) */
@@ -27,18 +27,22 @@
 
 #include "ext/polyval/polyval.h"
 #include "core/or/circuitlist.h"
+#include "core/or/conflux.h"
+#include "core/or/reasons.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
 #include "core/crypto/relay_crypto_cgo.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/conflux_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
@@ -46,6 +50,15 @@
 
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerlist_st.h"
+#include "feature/nodelist/routerstatus_st.h"
 
 #if defined(__amd64__) || defined(__amd64) || defined(__x86_64__) \
   || defined(_M_X64) || defined(_M_IX86) || defined(__i486)       \
@@ -833,6 +846,445 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** A relay in the synthetic network used by bench_consdiff. */
+typedef struct bench_cd_relay_t {
+  uint8_t id[DIGEST_LEN];
+  uint8_t desc[DIGEST_LEN];
+  uint32_t addr;
+  uint32_t bw;
+  int published;
+  int flags;
+} bench_cd_relay_t;
+
+/** Helper: sort bench_cd_relay_t by identity. */
+static int
+bench_cd_relay_cmp(const void **a_, const void **b_)
+{
+  const bench_cd_relay_t *a = *a_, *b = *b_;
+  return fast_memcmp(a->id, b->id, DIGEST_LEN);
+}
+
+/** Helper: return a new random relay for bench_consdiff. */
+static bench_cd_relay_t *
+bench_cd_relay_new(tor_weak_rng_t *rng, int published)
+{
+  bench_cd_relay_t *r = tor_malloc_zero(sizeof(*r));
+  for (int i = 0; i < DIGEST_LEN; ++i) {
+    r->id[i] = (uint8_t) tor_weak_random_range(rng, 256);
+    r->desc[i] = (uint8_t) tor_weak_random_range(rng, 256);
+  }
+  r->addr = (uint32_t) tor_weak_random(rng);
+  r->bw = 1 + tor_weak_random_range(rng, 100000);
+  r->published = published;
+  r->flags = tor_weak_random_range(rng, 16);
+  return r;
+}
+
+/** Simulate one hour of churn on the network <b>relays</b>: some relays
+ * leave, some join, and some publish new descriptors or get new flags or
+ * bandwidth weights. */
+static void
+bench_cd_advance_hour(smartlist_t *relays, tor_weak_rng_t *rng, int hour)
+{
+  const int published = hour * 3600;
+  SMARTLIST_FOREACH_BEGIN(relays, bench_cd_relay_t *, r) {
+    int x = tor_weak_random_range(rng, 1000);
+    if (x < 10) {
+      SMARTLIST_DEL_CURRENT(relays, r);
+      tor_free(r);
+      continue;
+    }
+    if (x < 70) {
+      r->published = published + tor_weak_random_range(rng, 3600);
+      for (int i = 0; i < DIGEST_LEN; ++i)
+        r->desc[i] = (uint8_t) tor_weak_random_range(rng, 256);
+    }
+    if (tor_weak_random_range(rng, 100) < 25)
+      r->bw = 1 + tor_weak_random_range(rng, 100000);
+    if (tor_weak_random_range(rng, 100) < 3)
+      r->flags = tor_weak_random_range(rng, 16);
+  } SMARTLIST_FOREACH_END(r);
+  int n_new = smartlist_len(relays) / 100;
+  for (int i = 0; i < n_new; ++i) {
+    smartlist_add(relays, bench_cd_relay_new(rng, published));
+  }
+}
+
+/** Return a newly allocated consensus-like document listing
+ * <b>relays</b>. */
+static char *
+bench_cd_format(smartlist_t *relays, int hour)
+{
+  static const char *flagsets[] = {
+    "Fast Running Valid",
+    "Fast Running Stable Valid",
+    "Fast Guard Running Stable V2Dir Valid",
+    "Exit Fast Running Stable V2Dir Valid",
+  };
+  smartlist_t *chunks = smartlist_new();
+  char va[ISO_TIME_LEN+1];
+  format_iso_time(va, 1700000000 + hour * 3600);
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3\n"
+                         "vote-status consensus\n"
+                         "consensus-method 33\n"
+                         "valid-after %s\n"
+                         "known-flags Exit Fast Guard Running Stable V2Dir "
+                         "Valid\n"
+                         "params CircuitPriorityHalflifeMsec=30000\n", va);
+  smartlist_sort(relays, bench_cd_relay_cmp);
+  SMARTLIST_FOREACH_BEGIN(relays, const bench_cd_relay_t *, r) {
+    char id[BASE64_DIGEST_LEN+1], desc[BASE64_DIGEST_LEN+1];
+    char pub[ISO_TIME_LEN+1];
+    digest_to_base64(id, (const char *)r->id);
+    digest_to_base64(desc, (const char *)r->desc);
+    format_iso_time(pub, 1700000000 + r->published);
+    smartlist_add_asprintf(chunks,
+                           "r relay%02x%02x %s %s %s %u.%u.%u.%u 9001 0\n"
+                           "s %s\n"
+                           "v Tor 0.4.8.%d\n"
+                           "pr Cons=1-2 Desc=1-2 Link=1-5 Relay=1-4\n"
+                           "w Bandwidth=%u\n"
+                           "p reject 1-65535\n",
+                           r->id[0], r->id[1], id, desc, pub,
+                           r->addr >> 24, (r->addr >> 16) & 0xff,
+                           (r->addr >> 8) & 0xff, r->addr & 0xff,
+                           flagsets[r->flags % ARRAY_LENGTH(flagsets)],
+                           r->flags, r->bw);
+  } SMARTLIST_FOREACH_END(r);
+  smartlist_add_strdup(chunks,
+                       "directory-footer\n"
+                       "directory-signature 0 0\n"
+                       "-----BEGIN SIGNATURE-----\n"
+                       "-----END SIGNATURE-----\n");
+  char *result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Run benchmarks for consensus diff generation, with each diff engine, on
+ * synthetic consensuses that are some hours apart. */
+static void
+bench_consdiff(void)
+{
+  const int N_RELAYS = 7000;
+  const int gaps[] = { 1, 6, 24, 72 };
+  const int N = 5;
+  tor_weak_rng_t rng;
+  smartlist_t *relays = smartlist_new();
+  uint64_t start, end;
+  int hour = 0;
+
+  tor_init_weak_random(&rng, 1337);
+  for (int i = 0; i < N_RELAYS; ++i) {
+    smartlist_add(relays, bench_cd_relay_new(&rng, 0));
+  }
+  char *base = bench_cd_format(relays, 0);
+  size_t baselen = strlen(base);
+
+  for (unsigned g = 0; g < ARRAY_LENGTH(gaps); ++g) {
+    for (; hour < gaps[g]; ++hour) {
+      bench_cd_advance_hour(relays, &rng, hour + 1);
+    }
+    char *target = bench_cd_format(relays, hour);
+    size_t targetlen = strlen(target);
+    double msec[2];
+    size_t difflen = 0;
+
+    for (int engine = 0; engine < 2; ++engine) {
+      reset_perftime();
+      start = perftime();
+      for (int i = 0; i < N; ++i) {
+        char *diff = consensus_diff_generate_with_engine(
+                            base, baselen, target, targetlen,
+                            engine ? CONSDIFF_ENGINE_MYERS
+                                   : CONSDIFF_ENGINE_LCS);
+        tor_assert(diff);
+        difflen = strlen(diff);
+        tor_free(diff);
+      }
+      end = perftime();
+      msec[engine] = NANOCOUNT(start, end, N) / 1e6;
+    }
+    printf("%2d hour gap (%zu byte diff): lcs %.2f msec, myers %.2f msec\n",
+           gaps[g], difflen, msec[0], msec[1]);
+    tor_free(target);
+  }
+
+  tor_free(base);
+  SMARTLIST_FOREACH(relays, bench_cd_relay_t *, r, tor_free(r));
+  smartlist_free(relays);
+}
+
+/** Run benchmarks for bandwidth-weighted node selection over a synthetic
+ * consensus the size of the live network. */
+static void
+bench_node_select(void)
+{
+  const int N_RELAYS = 7000;
+  const int N = 2000;
+  const bandwidth_weight_rule_t rules[] = { WEIGHT_FOR_GUARD,
+                                            WEIGHT_FOR_MID,
+                                            WEIGHT_FOR_EXIT };
+  tor_weak_rng_t rng;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  routerlist_t *rl = router_get_routerlist();
+  smartlist_t *padding = smartlist_new();
+  smartlist_t *sl = smartlist_new();
+  uint64_t start, end;
+
+  tor_init_weak_random(&rng, 1337);
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+
+  for (int i = 0; i < N_RELAYS; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    /* Scatter the objects over the heap, as they are in a long-running
+     * client that has been through many consensuses. */
+    smartlist_add(padding,
+                  tor_malloc(64 + tor_weak_random_range(&rng, 1024)));
+
+    crypto_rand(rs->identity_digest, DIGEST_LEN);
+    tor_addr_from_ipv4h(&rs->ipv4_addr, tor_weak_random(&rng));
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 1 + tor_weak_random_range(&rng, 100000);
+    rs->is_flagged_running = rs->is_valid = rs->is_fast = 1;
+    rs->is_possible_guard = tor_weak_random_range(&rng, 3) == 0;
+    rs->is_exit = tor_weak_random_range(&rng, 4) == 0;
+    rs->is_v2_dir = tor_weak_random_range(&rng, 10) != 0;
+    smartlist_add(ns->routerstatus_list, rs);
+
+    /* The nodelist expects every node without a consensus entry to be
+     * backed by a routerinfo in the routerlist. */
+    memcpy(ri->cache_info.identity_digest, rs->identity_digest, DIGEST_LEN);
+    tor_addr_copy(&ri->ipv4_addr, &rs->ipv4_addr);
+    nodelist_set_routerinfo(ri, NULL);
+    smartlist_add(rl->routers, ri);
+  }
+  SMARTLIST_FOREACH(padding, void *, cp, tor_free(cp));
+  smartlist_free(padding);
+
+  reset_perftime();
+  start = perftime();
+  nodelist_set_consensus(ns);
+  end = perftime();
+  printf("Set a %d-relay consensus: %.2f msec\n", N_RELAYS,
+         NANOCOUNT(start, end, 1) / 1e6);
+
+  smartlist_add_all(sl, nodelist_get_list());
+  for (unsigned r = 0; r < ARRAY_LENGTH(rules); ++r) {
+    reset_perftime();
+    start = perftime();
+    for (int i = 0; i < N; ++i) {
+      const node_t *node = node_sl_choose_by_bandwidth(sl, rules[r]);
+      tor_assert(node);
+    }
+    end = perftime();
+    printf("Weighted choice (%s) among %d relays: %.2f usec\n",
+           bandwidth_weight_rule_to_string(rules[r]), N_RELAYS,
+           MICROCOUNT(start, end, N));
+  }
+
+  smartlist_free(sl);
+  nodelist_free_all();
+  SMARTLIST_FOREACH(rl->routers, routerinfo_t *, ri, tor_free(ri));
+  smartlist_clear(rl->routers);
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+                    tor_free(rs));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+}
+
+/** Return a new consensus with a copy of each routerstatus of <b>ns</b>, as
+ * if it had been parsed again. The first <b>n_left</b> relays leave, and
+ * <b>n_joined</b> new ones are added at the end. Update the routerlist to
+ * match, since the nodelist expects every node without a consensus entry to
+ * be backed by a routerinfo. */
+static networkstatus_t *
+bench_nodelist_next_ns(const networkstatus_t *ns, int n_left, int n_joined,
+                       tor_weak_rng_t *rng)
+{
+  networkstatus_t *next = tor_malloc_zero(sizeof(networkstatus_t));
+  routerlist_t *rl = router_get_routerlist();
+  int n = smartlist_len(ns->routerstatus_list);
+
+  next->flavor = ns->flavor;
+  next->routerstatus_list = smartlist_new();
+  for (int i = 0; i < n; ++i) {
+    const routerstatus_t *old = smartlist_get(ns->routerstatus_list, i);
+    if (i < n_left) {
+      SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+        if (fast_memeq(ri->cache_info.identity_digest,
+                       old->identity_digest, DIGEST_LEN)) {
+          nodelist_remove_routerinfo(ri);
+          SMARTLIST_DEL_CURRENT(rl->routers, ri);
+          tor_free(ri);
+        }
+      } SMARTLIST_FOREACH_END(ri);
+    } else {
+      smartlist_add(next->routerstatus_list,
+                    tor_memdup(old, sizeof(*old)));
+    }
+  }
+  for (int i = 0; i < n_joined; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    crypto_rand(rs->identity_digest, DIGEST_LEN);
+    tor_addr_from_ipv4h(&rs->ipv4_addr, tor_weak_random(rng));
+    rs->ipv4_orport = 9001;
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 1 + tor_weak_random_range(rng, 100000);
+    rs->is_flagged_running = rs->is_valid = rs->is_fast = 1;
+    smartlist_add(next->routerstatus_list, rs);
+
+    memcpy(ri->cache_info.identity_digest, rs->identity_digest, DIGEST_LEN);
+    tor_addr_copy(&ri->ipv4_addr, &rs->ipv4_addr);
+    ri->ipv4_orport = rs->ipv4_orport;
+    nodelist_set_routerinfo(ri, NULL);
+    smartlist_add(rl->routers, ri);
+  }
+  return next;
+}
+
+/** Free a consensus made by bench_nodelist_next_ns(). */
+static void
+bench_nodelist_free_ns(networkstatus_t *ns)
+{
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+                    tor_free(rs));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+}
+
+/** Run benchmarks for updating the nodelist from a new consensus the size of
+ * the live network, with and without relays leaving. */
+static void
+bench_nodelist_update(void)
+{
+  const int N_RELAYS = 7000;
+  const struct {
+    const char *what;
+    int n_left, n_joined;
+  } steps[] = {
+    { "first consensus", 0, N_RELAYS },
+    { "unchanged", 0, 0 },
+    { "1% joined", 0, N_RELAYS / 100 },
+    { "1% left, 1% joined", N_RELAYS / 100, N_RELAYS / 100 },
+  };
+  tor_weak_rng_t rng;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  routerlist_t *rl = router_get_routerlist();
+  uint64_t start, end;
+
+  tor_init_weak_random(&rng, 1337);
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+
+  for (unsigned i = 0; i < ARRAY_LENGTH(steps); ++i) {
+    networkstatus_t *next =
+      bench_nodelist_next_ns(ns, steps[i].n_left, steps[i].n_joined, &rng);
+
+    reset_perftime();
+    start = perftime();
+    nodelist_set_consensus(next);
+    end = perftime();
+    printf("Update the nodelist, %s: %.2f msec\n", steps[i].what,
+           NANOCOUNT(start, end, 1) / 1e6);
+
+    bench_nodelist_free_ns(ns);
+    ns = next;
+  }
+
+  nodelist_free_all();
+  SMARTLIST_FOREACH(rl->routers, routerinfo_t *, ri, tor_free(ri));
+  smartlist_clear(rl->routers);
+  bench_nodelist_free_ns(ns);
+}
+
+/** A cell in the two-leg conflux replay of bench_conflux_ooo. */
+typedef struct bench_cfx_arrival_t {
+  uint64_t seq;
+  uint64_t arrival;
+} bench_cfx_arrival_t;
+
+/** Helper: sort bench_cfx_arrival_t by arrival time, then sequence. */
+static int
+bench_cfx_arrival_cmp(const void *a_, const void *b_)
+{
+  const bench_cfx_arrival_t *a = a_, *b = b_;
+  if (a->arrival != b->arrival)
+    return a->arrival < b->arrival ? -1 : 1;
+  return a->seq < b->seq ? -1 : (a->seq > b->seq);
+}
+
+/** Run benchmarks for the conflux out-of-order queue, by replaying traffic
+ * that a sender interleaves over a fast and a slow leg. */
+static void
+bench_conflux_ooo(void)
+{
+  const int N_CELLS = 100000;
+  const int N = 20;
+  /* Cells sent in a row on one leg before switching, and how many cell
+   * times later the slow leg delivers than the fast one. */
+  const int bursts[] = { 32, 256, 1024 };
+  const int delays[] = { 100, 1000, 5000 };
+  bench_cfx_arrival_t *arrivals =
+    tor_calloc(N_CELLS, sizeof(bench_cfx_arrival_t));
+  uint8_t body[RELAY_PAYLOAD_SIZE_MAX];
+  relay_msg_t msg;
+  uint64_t start, end;
+
+  memset(body, 0x5a, sizeof(body));
+  memset(&msg, 0, sizeof(msg));
+  msg.command = RELAY_COMMAND_DATA;
+  msg.length = sizeof(body);
+  msg.body = body;
+
+  for (unsigned b = 0; b < ARRAY_LENGTH(bursts); ++b) {
+    for (unsigned d = 0; d < ARRAY_LENGTH(delays); ++d) {
+      size_t max_queued = 0;
+      for (int i = 0; i < N_CELLS; ++i) {
+        const int slow_leg = (i / bursts[b]) & 1;
+        arrivals[i].seq = i + 1;
+        arrivals[i].arrival = i + (slow_leg ? delays[d] : 0);
+      }
+      qsort(arrivals, N_CELLS, sizeof(*arrivals), bench_cfx_arrival_cmp);
+
+      reset_perftime();
+      start = perftime();
+      for (int iter = 0; iter < N; ++iter) {
+        conflux_t *cfx = tor_malloc_zero(sizeof(conflux_t));
+        cfx->ooo_q = smartlist_new();
+        for (int i = 0; i < N_CELLS; ++i) {
+          const uint64_t seq = arrivals[i].seq;
+          if (seq != cfx->last_seq_delivered + 1) {
+            conflux_enqueue_relay_msg(cfx, seq, &msg);
+            max_queued = MAX(max_queued, cfx->ooo_q_alloc_cost);
+            continue;
+          }
+          cfx->last_seq_delivered++;
+          conflux_msg_t *c_msg;
+          while ((c_msg = conflux_dequeue_relay_msg(cfx))) {
+            conflux_relay_msg_free(c_msg);
+          }
+        }
+        tor_assert(cfx->last_seq_delivered == (uint64_t) N_CELLS);
+        conflux_clear_ooo_queue(cfx);
+        smartlist_free(cfx->ooo_q);
+        tor_free(cfx);
+      }
+      end = perftime();
+      printf("burst %4d, delay %4d (peak %6zu KB queued): %.2f nsec/cell\n",
+             bursts[b], delays[d], max_queued / 1024,
+             NANOCOUNT(start, end, (uint64_t)N * N_CELLS));
+    }
+  }
+
+  tor_free(arrivals);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -864,6 +1316,10 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(consdiff),
+  ENT(node_select),
+  ENT(nodelist_update),
+  ENT(conflux_ooo),
   {NULL,NULL,0}
 };
 
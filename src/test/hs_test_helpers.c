@@ -4,6 +4,7 @@
 #define HS_CLIENT_PRIVATE
 
 #include "core/or/or.h"
+#include "core/or/congestion_control_common.h"
 #include "core/or/versions.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "test/test.h"
@@ -188,6 +189,7 @@ hs_helper_build_hs_desc_impl(unsigned int no_ip,
   desc->encrypted_data.intro_auth_types = smartlist_new();
   desc->encrypted_data.single_onion_service = 1;
   desc->encrypted_data.flow_control_pv = tor_strdup("FlowCtrl=1-2");
+  desc->encrypted_data.sendme_inc = congestion_control_sendme_inc();
   smartlist_add(desc->encrypted_data.intro_auth_types, tor_strdup("ed25519"));
   desc->encrypted_data.intro_points = smartlist_new();
   if (!no_ip) {
@@ -273,12 +273,100 @@ test_exit_no_reentry(void *arg)
   UNMOCK(dirlist_add_trusted_dir_addresses);
 }
 
+/** Test that a new consensus only rebuilds the address sets when an address
+ * may have gone away, and otherwise adds the new ones to them. */
+static void
+test_nodelist_incremental(void *arg)
+{
+  routerstatus_t *rs1 = NULL, *rs2 = NULL, *rs3 = NULL;
+  tor_addr_t addr1, addr2, sentinel;
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+  MOCK(get_estimated_address_per_node,
+       mock_get_estimated_address_per_node);
+  MOCK(dirlist_add_trusted_dir_addresses,
+       mock_dirlist_add_trusted_dir_addresses);
+
+  dummy_ns = tor_malloc_zero(sizeof(*dummy_ns));
+  dummy_ns->flavor = FLAV_MICRODESC;
+  dummy_ns->routerstatus_list = smartlist_new();
+
+  tor_addr_parse(&addr1, "42.42.42.42");
+  tor_addr_parse(&addr2, "43.43.43.43");
+  tor_addr_parse(&sentinel, "44.44.44.44");
+  addr_per_node = 1024;
+
+  rs1 = tor_malloc_zero(sizeof(*rs1));
+  crypto_rand(rs1->identity_digest, sizeof(rs1->identity_digest));
+  tor_addr_copy(&rs1->ipv4_addr, &addr1);
+  rs1->ipv4_orport = 444;
+  rs2 = tor_malloc_zero(sizeof(*rs2));
+  crypto_rand(rs2->identity_digest, sizeof(rs2->identity_digest));
+  tor_addr_copy(&rs2->ipv4_addr, &addr2);
+  rs2->ipv4_orport = 444;
+
+  smartlist_add(dummy_ns->routerstatus_list, rs1);
+  nodelist_set_consensus(dummy_ns);
+  tt_assert(nodelist_reentry_contains(&addr1, 444));
+
+  /* Only a rebuild forgets an entry that no node has, so use one to tell
+   * whether the sets were kept. */
+  nodelist_add_addr_to_address_set(&sentinel, 555, 0);
+
+  /* Same consensus: the sets are kept. */
+  nodelist_set_consensus(dummy_ns);
+  tt_assert(nodelist_reentry_contains(&sentinel, 555));
+  tt_assert(nodelist_reentry_contains(&addr1, 444));
+
+  /* A new relay: its address is added to the kept sets, as long as they
+   * are big enough for the new consensus. */
+  smartlist_add(dummy_ns->routerstatus_list, rs2);
+  addr_per_node = 512;
+  nodelist_set_consensus(dummy_ns);
+  tt_assert(nodelist_reentry_contains(&sentinel, 555));
+  tt_assert(nodelist_reentry_contains(&addr1, 444));
+  tt_assert(nodelist_reentry_contains(&addr2, 444));
+
+  /* A relay moved to another port: the sets are rebuilt. */
+  rs3 = tor_memdup(rs2, sizeof(*rs2));
+  rs3->ipv4_orport = 445;
+  smartlist_set(dummy_ns->routerstatus_list, 1, rs3);
+  nodelist_set_consensus(dummy_ns);
+  tt_assert(!nodelist_reentry_contains(&sentinel, 555));
+  tt_assert(!nodelist_reentry_contains(&addr2, 444));
+  tt_assert(nodelist_reentry_contains(&addr2, 445));
+  tt_assert(nodelist_reentry_contains(&addr1, 444));
+
+  /* A relay left: the sets are rebuilt without it. */
+  nodelist_add_addr_to_address_set(&sentinel, 555, 0);
+  smartlist_del_keeporder(dummy_ns->routerstatus_list, 0);
+  nodelist_set_consensus(dummy_ns);
+  tt_assert(!nodelist_reentry_contains(&sentinel, 555));
+  tt_assert(!nodelist_reentry_contains(&addr1, 444));
+  tt_assert(nodelist_reentry_contains(&addr2, 445));
+
+ done:
+  routerstatus_free(rs1); routerstatus_free(rs2); routerstatus_free(rs3);
+  smartlist_clear(dummy_ns->routerstatus_list);
+  networkstatus_vote_free(dummy_ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+  UNMOCK(get_estimated_address_per_node);
+  UNMOCK(dirlist_add_trusted_dir_addresses);
+}
+
 struct testcase_t address_set_tests[] = {
   { "contains", test_contains, TT_FORK,
     NULL, NULL },
   { "nodelist", test_nodelist, TT_FORK,
     NULL, NULL },
   { "exit_no_reentry", test_exit_no_reentry, TT_FORK, NULL, NULL },
+  { "nodelist_incremental", test_nodelist_incremental, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
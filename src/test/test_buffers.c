@@ -858,12 +858,97 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+static int n_external_released = 0;
+
+static void
+note_external_released(void *arg)
+{
+  tt_ptr_op(arg, OP_NE, NULL);
+  ++*(int *)arg;
+  ++n_external_released;
+ done:
+  ;
+}
+
+static void
+test_buffer_external(void *arg)
+{
+  (void)arg;
+  buf_t *buf = NULL, *buf2 = NULL;
+  char tmp[64];
+  const char *head;
+  size_t len;
+  int refs_a = 0, refs_b = 0, refs_c = 0;
+  static const char body_a[] = "Alpha, ";
+  static const char body_b[] = "bravo, ";
+  static const char body_c[] = "charlie";
+
+  buf = buf_new();
+  n_external_released = 0;
+
+  /* Empty data is released right away. */
+  tt_int_op(buf_add_external(buf, body_a, 0, note_external_released,
+                             &refs_a), OP_EQ, 0);
+  tt_int_op(refs_a, OP_EQ, 1);
+  refs_a = 0;
+
+  tt_int_op(buf_add_external(buf, body_a, 7, note_external_released,
+                             &refs_a), OP_EQ, 7);
+  /* Ordinary data goes after the external chunk, in a chunk of its own. */
+  buf_add(buf, "and ", 4);
+  tt_int_op(buf_add_external(buf, body_b, 7, note_external_released,
+                             &refs_b), OP_EQ, 18);
+  tt_int_op(buf_add_external(buf, body_c, 7, note_external_released,
+                             &refs_c), OP_EQ, 25);
+  buf_assert_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, 25);
+  /* External chunks don't count towards the allocation beyond their
+   * headers. */
+  tt_uint_op(buf_allocation(buf), OP_LE, 3 * 64 + 4096);
+  tt_int_op(buf_slack(buf), OP_EQ, 0);
+
+  /* A copy doesn't share the external memory. */
+  buf2 = buf_copy(buf);
+  buf_assert_ok(buf2);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 25);
+  buf_free(buf2);
+  tt_int_op(n_external_released, OP_EQ, 1);
+
+  /* Draining part of a chunk keeps the reference; draining all of it
+   * releases it. */
+  buf_get_bytes(buf, tmp, 3);
+  tt_mem_op(tmp, OP_EQ, "Alp", 3);
+  tt_int_op(refs_a, OP_EQ, 0);
+  buf_get_bytes(buf, tmp, 8);
+  tt_mem_op(tmp, OP_EQ, "ha, and ", 8);
+  tt_int_op(refs_a, OP_EQ, 1);
+
+  /* Pulling up across an external head copies it. */
+  buf_pullup(buf, 10, &head, &len);
+  tt_int_op(len, OP_GE, 10);
+  tt_mem_op(head, OP_EQ, "bravo, cha", 10);
+  tt_int_op(refs_b, OP_EQ, 1);
+  tt_int_op(refs_c, OP_EQ, 0);
+  buf_assert_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, 14);
+
+  /* Freeing the buffer releases whatever is left. */
+  buf_free(buf);
+  tt_int_op(refs_c, OP_EQ, 1);
+  tt_int_op(n_external_released, OP_EQ, 4);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "move_all", test_buffers_move_all, 0, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
+  { "external", test_buffer_external, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
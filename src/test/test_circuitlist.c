@@ -18,6 +18,7 @@
 #include "core/or/origin_circuit_st.h"
 
 #include "lib/container/bitarray.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 static channel_t *
 new_fake_channel(void)
@@ -484,11 +485,106 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+/** Set the build start of <b>circ</b> to <b>sec</b> and reindex it. */
+static void
+set_began(origin_circuit_t *circ, time_t sec)
+{
+  TO_CIRCUIT(circ)->timestamp_began.tv_sec = sec;
+  TO_CIRCUIT(circ)->timestamp_began.tv_usec = 0;
+  circuit_update_expiry_index(circ);
+}
+
+static void
+test_expiry_index(void *arg)
+{
+  origin_circuit_t *circs[5] = { NULL };
+  origin_circuit_t *many[200] = { NULL };
+  smartlist_t *found = smartlist_new();
+  struct timeval cutoff = { 0, 0 };
+  const time_t base = 1000000;
+  (void) arg;
+
+  for (int i = 0; i < 5; i++) {
+    circs[i] = origin_circuit_new();
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    /* Insert in reverse so the heap has some work to do. */
+    set_began(circs[i], base + 4 - i);
+  }
+
+  /* Building circuits are always candidates. */
+  tt_assert(circuit_is_expiry_candidate(TO_CIRCUIT(circs[0])));
+
+  /* An open general circuit is never expired by circuit_expire_building()
+   * so it leaves the index. */
+  circs[3]->base_.state = CIRCUIT_STATE_OPEN;
+  circuit_update_expiry_index(circs[3]);
+  tt_int_op(circs[3]->expiry_index_idx, OP_EQ, -1);
+  /* An open intro circuit still has a deadline. */
+  circs[2]->base_.state = CIRCUIT_STATE_OPEN;
+  circs[2]->base_.purpose = CIRCUIT_PURPOSE_S_ESTABLISH_INTRO;
+  circuit_update_expiry_index(circs[2]);
+  tt_int_op(circs[2]->expiry_index_idx, OP_GE, 0);
+
+  /* circs[4] began at base, circs[3] at base+1, circs[2] at base+2... */
+  cutoff.tv_sec = base - 1;
+  circuit_get_expiry_candidates(found, &cutoff);
+  tt_int_op(smartlist_len(found), OP_EQ, 0);
+
+  cutoff.tv_sec = base + 2;
+  circuit_get_expiry_candidates(found, &cutoff);
+  tt_int_op(smartlist_len(found), OP_EQ, 2);
+  tt_assert(smartlist_contains(found, TO_CIRCUIT(circs[4])));
+  tt_assert(smartlist_contains(found, TO_CIRCUIT(circs[2])));
+  smartlist_clear(found);
+
+  /* Freeing a circuit removes it from the index. */
+  circuit_free_(TO_CIRCUIT(circs[2]));
+  circs[2] = NULL;
+  cutoff.tv_sec = base + 10;
+  circuit_get_expiry_candidates(found, &cutoff);
+  tt_int_op(smartlist_len(found), OP_EQ, 3);
+  tt_assert(!smartlist_contains(found, TO_CIRCUIT(circs[3])));
+  smartlist_clear(found);
+
+  /* Compare against a full scan over many random build times. */
+  for (int i = 0; i < (int) ARRAY_LENGTH(many); i++) {
+    many[i] = origin_circuit_new();
+    many[i]->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    set_began(many[i], base + crypto_rand_int(1000));
+  }
+  for (int round = 0; round < 10; round++) {
+    int expected = 0;
+    cutoff.tv_sec = base + crypto_rand_int(1000);
+    for (int i = 0; i < (int) ARRAY_LENGTH(many); i++) {
+      if (many[i]->base_.timestamp_began.tv_sec <= cutoff.tv_sec)
+        expected++;
+    }
+    for (int i = 0; i < (int) ARRAY_LENGTH(circs); i++) {
+      if (circs[i] && circs[i]->expiry_index_idx >= 0 &&
+          circs[i]->base_.timestamp_began.tv_sec <= cutoff.tv_sec)
+        expected++;
+    }
+    circuit_get_expiry_candidates(found, &cutoff);
+    tt_int_op(smartlist_len(found), OP_EQ, expected);
+    SMARTLIST_FOREACH(found, const circuit_t *, c,
+      tt_assert(c->timestamp_began.tv_sec <= cutoff.tv_sec));
+    smartlist_clear(found);
+  }
+
+ done:
+  smartlist_free(found);
+  for (int i = 0; i < (int) ARRAY_LENGTH(circs); i++)
+    circuit_free_(TO_CIRCUIT(circs[i]));
+  for (int i = 0; i < (int) ARRAY_LENGTH(many); i++)
+    circuit_free_(TO_CIRCUIT(many[i]));
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
+  { "expiry_index", test_expiry_index, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
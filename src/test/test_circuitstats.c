@@ -5,6 +5,7 @@
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define CHANNEL_FILE_PRIVATE
+#define RELAY_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
@@ -16,7 +17,10 @@
 #include "core/or/circuitstats.h"
 #include "core/or/circuituse.h"
 #include "core/or/channel.h"
+#include "core/or/relay.h"
+#include "feature/client/circpathbias.h"
 
+#include "core/or/cpath_build_state_st.h"
 #include "core/or/crypt_path_st.h"
 #include "core/or/extend_info_st.h"
 #include "core/or/origin_circuit_st.h"
@@ -136,7 +140,10 @@ test_circuitstats_hoplen(void *arg)
   circuit_expire_building();
   tt_int_op(marked_for_close, OP_EQ, 0);
   tt_int_op(fourhop->relaxed_timeout, OP_EQ, 1);
+  /* Move the build start back by hand, so reindex the circuit like
+   * circuit_reset_timestamp_began() would. */
   TO_CIRCUIT(fourhop)->timestamp_began.tv_sec -= 119;
+  circuit_update_expiry_index(fourhop);
   circuit_expire_building();
   tt_int_op(get_circuit_build_times()->total_build_times, OP_EQ, 1);
   tt_int_op(marked_for_close, OP_EQ, 1);
@@ -177,11 +184,93 @@ test_circuitstats_hoplen(void *arg)
   circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
 }
 
+static int
+mock_relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno)
+{
+  (void) stream_id;
+  (void) circ;
+  (void) relay_command;
+  (void) payload;
+  (void) payload_len;
+  (void) cpath_layer;
+  (void) filename;
+  (void) lineno;
+  return 0;
+}
+
+/* Sending a path bias probe restarts the build clock of a circuit after it
+ * joined the expiry index: make sure that the index stays in order, so that
+ * circuit_expire_building() keeps finding the circuits behind it. */
+static void
+test_circuitstats_expiry_after_probe(void *arg)
+{
+  struct timeval now, cutoff;
+  origin_circuit_t *building = NULL, *probed = NULL;
+  channel_t chan;
+  smartlist_t *found = smartlist_new();
+  (void)arg;
+
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  circuit_build_times_init(get_circuit_build_times_mutable());
+  get_options_mutable()->UseEntryGuards = 1;
+  marked_for_close = 0;
+  memset(&chan, 0, sizeof(chan));
+  chan.state = CHANNEL_STATE_OPEN;
+
+  /* A circuit that has been building for far too long. */
+  tor_gettimeofday(&now);
+  cutoff = now;
+  cutoff.tv_sec -= 400;
+  building = build_unopened_fourhop(cutoff);
+  building->cpath->state = CPATH_STATE_OPEN;
+
+  /* An open circuit that began even earlier, that we tried to use and
+   * failed: closing it sends a probe down it instead. */
+  probed = add_opened_threehop();
+  TO_CIRCUIT(probed)->timestamp_began.tv_sec = now.tv_sec - 1000;
+  circuit_update_expiry_index(probed);
+  probed->cpath->next->state = CPATH_STATE_OPEN;
+  probed->cpath->prev->state = CPATH_STATE_OPEN;
+  probed->path_state = PATH_STATE_USE_ATTEMPTED;
+  TO_CIRCUIT(probed)->n_chan = &chan;
+  tt_int_op(probed->expiry_index_idx, OP_EQ, -1);
+  tt_int_op(pathbias_check_close(probed, END_CIRC_REASON_FINISHED),
+            OP_EQ, -1);
+  tt_int_op(TO_CIRCUIT(probed)->purpose, OP_EQ,
+            CIRCUIT_PURPOSE_PATH_BIAS_TESTING);
+  tt_int_op(probed->expiry_index_idx, OP_GE, 0);
+
+  /* Only the old building circuit is due, and the probe doesn't hide it. */
+  cutoff.tv_sec = now.tv_sec - 300;
+  circuit_get_expiry_candidates(found, &cutoff);
+  tt_int_op(smartlist_len(found), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(found, 0), OP_EQ, TO_CIRCUIT(building));
+  circuit_expire_building();
+  tt_int_op(marked_for_close, OP_EQ, 1);
+
+ done:
+  UNMOCK(circuit_mark_for_close_);
+  UNMOCK(relay_send_command_from_edge_);
+  smartlist_free(found);
+  if (probed) {
+    TO_CIRCUIT(probed)->n_chan = NULL;
+    circuit_free_(TO_CIRCUIT(probed));
+  }
+  circuit_free_(TO_CIRCUIT(building));
+  circuit_build_times_free_timeouts(get_circuit_build_times_mutable());
+}
+
 #define TEST_CIRCUITSTATS(name, flags) \
     { #name, test_##name, (flags), &helper_pubsub_setup, NULL }
 
 struct testcase_t circuitstats_tests[] = {
   TEST_CIRCUITSTATS(circuitstats_hoplen, TT_FORK),
+  TEST_CIRCUITSTATS(circuitstats_expiry_after_probe, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -1338,12 +1338,109 @@ test_conflux_switch(void *arg)
   return;
  }
 
+/** Queue <b>seq</b> on <b>cfx</b>, with a body holding the sequence number
+ * so that we can check what comes out. */
+static void
+ooo_enqueue_seq(conflux_t *cfx, uint64_t seq)
+{
+  relay_msg_t msg;
+  uint8_t body[8];
+
+  memset(&msg, 0, sizeof(msg));
+  set_uint64(body, seq);
+  msg.command = RELAY_COMMAND_DATA;
+  msg.length = sizeof(body);
+  msg.body = body;
+  conflux_enqueue_relay_msg(cfx, seq, &msg);
+}
+
+/** Dequeue from <b>cfx</b> and return the sequence number of the message,
+ * or 0 if nothing was ready. */
+static uint64_t
+ooo_dequeue_seq(conflux_t *cfx)
+{
+  conflux_msg_t *c_msg = conflux_dequeue_relay_msg(cfx);
+  uint64_t seq;
+
+  if (!c_msg)
+    return 0;
+  tor_assert(c_msg->msg->length == 8);
+  seq = get_uint64(c_msg->msg->body);
+  tor_assert(seq == c_msg->seq);
+  conflux_relay_msg_free(c_msg);
+  return seq;
+}
+
+static void
+test_conflux_ooo_queue(void *arg)
+{
+  conflux_t *cfx = tor_malloc_zero(sizeof(conflux_t));
+  const uint64_t base_bytes = conflux_get_total_bytes_allocation();
+  (void) arg;
+
+  cfx->ooo_q = smartlist_new();
+  cfx->last_seq_delivered = 100;
+
+  /* Out of order, with one message far ahead of the window. */
+  ooo_enqueue_seq(cfx, 103);
+  ooo_enqueue_seq(cfx, 102);
+  ooo_enqueue_seq(cfx, 105);
+  ooo_enqueue_seq(cfx, 100 + 1000000);
+  tt_int_op(cfx->ooo_ring_len, OP_EQ, 3);
+  tt_int_op(smartlist_len(cfx->ooo_q), OP_EQ, 1);
+  tt_u64_op(conflux_get_total_bytes_allocation(), OP_GT, base_bytes);
+
+  /* 101 is missing. */
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 0);
+
+  /* Pretend 101 was delivered in place, as conflux_process_relay_msg()
+   * does for the next expected message. */
+  cfx->last_seq_delivered++;
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 102);
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 103);
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 0);
+
+  /* A duplicate goes to the overflow queue, and is dropped once it can no
+   * longer be delivered. */
+  ooo_enqueue_seq(cfx, 105);
+  tt_int_op(smartlist_len(cfx->ooo_q), OP_EQ, 2);
+  cfx->last_seq_delivered++;
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 105);
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 0);
+  tt_int_op(smartlist_len(cfx->ooo_q), OP_EQ, 1);
+
+  /* Fill a window wider than the initial ring, then drain it in order. */
+  for (uint64_t seq = 300; seq > 106; --seq) {
+    ooo_enqueue_seq(cfx, seq);
+  }
+  tt_int_op(cfx->ooo_ring_len, OP_EQ, 300 - 106);
+  cfx->last_seq_delivered++;
+  for (uint64_t seq = 107; seq <= 300; ++seq) {
+    tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, seq);
+  }
+  tt_u64_op(ooo_dequeue_seq(cfx), OP_EQ, 0);
+  tt_int_op(cfx->ooo_ring_len, OP_EQ, 0);
+
+  /* Clearing the queue gives back everything we accounted for. */
+  conflux_clear_ooo_queue(cfx);
+  tt_int_op(smartlist_len(cfx->ooo_q), OP_EQ, 0);
+  tt_u64_op(cfx->ooo_q_alloc_cost, OP_EQ, 0);
+  tt_ptr_op(cfx->ooo_ring, OP_EQ, NULL);
+  tt_u64_op(conflux_get_total_bytes_allocation(), OP_EQ, base_bytes);
+
+ done:
+  conflux_clear_ooo_queue(cfx);
+  smartlist_free(cfx->ooo_q);
+  tor_free(cfx);
+}
+
 struct testcase_t conflux_pool_tests[] = {
   { "link", test_conflux_link, TT_FORK, NULL, NULL },
   { "link_retry", test_conflux_link_retry, TT_FORK, NULL, NULL },
   { "link_relink", test_conflux_link_relink, TT_FORK, NULL, NULL },
   { "link_streams", test_conflux_link_streams, TT_FORK, NULL, NULL },
   { "switch", test_conflux_switch, TT_FORK, NULL, NULL },
+  { "ooo_queue", test_conflux_ooo_queue, TT_FORK, NULL, NULL },
   // XXX: These two currently fail, because they are not finished:
   //{ "link_fail", test_conflux_link_fail, TT_FORK, NULL, NULL },
   //{ "close", test_conflux_close, TT_FORK, NULL, NULL },
@@ -13,13 +13,21 @@
 
 #define TOR_CONGESTION_CONTROL_COMMON_PRIVATE
 #define TOR_CONGESTION_CONTROL_PRIVATE
+#define TOR_CONGESTION_CONTROL_PACING_PRIVATE
 #include "core/or/congestion_control_st.h"
 #include "core/or/congestion_control_common.h"
 #include "core/or/congestion_control_vegas.h"
+#include "core/or/congestion_control_pacing.h"
+#include "lib/evloop/timers.h"
+#include "app/config/config.h"
+#include "app/config/or_options_st.h"
 
 void test_congestion_control_rtt(void *arg);
 void test_congestion_control_clock(void *arg);
 void test_congestion_control_vegas_cwnd(void *arg);
+void test_congestion_control_alg_select(void *arg);
+void test_congestion_control_sim(void *arg);
+void test_congestion_control_pacing(void *arg);
 
 static void
 circuitmux_attach_circuit_mock(circuitmux_t *cmux, circuit_t *circ,
@@ -379,6 +387,388 @@ test_congestion_control_vegas_cwnd(void *arg)
   return;
 }
 
+/**
+ * Check that the __CongestionControlAlg option and the cc_alg consensus
+ * parameter pick the algorithm that each new circuit uses.
+ */
+void
+test_congestion_control_alg_select(void *arg)
+{
+  (void)arg;
+  circuit_params_t params;
+  congestion_control_t *cc = NULL;
+  or_options_t *options = get_options_mutable();
+
+  params.cc_enabled = 1;
+  params.sendme_inc_cells = TLS_RECORD_MAX_CELLS;
+
+  tt_int_op(congestion_control_alg_from_name("vegas"), OP_EQ, CC_ALG_VEGAS);
+  tt_int_op(congestion_control_alg_from_name("bbr"), OP_EQ, CC_ALG_BBR);
+  tt_int_op(congestion_control_alg_from_name("nola"), OP_EQ, -1);
+  tt_ptr_op(congestion_control_alg_get_ops(CC_ALG_NOLA), OP_EQ, NULL);
+  tt_ptr_op(congestion_control_alg_get_ops(NUM_CC_ALGS), OP_EQ, NULL);
+
+  /* The consensus decides by default. */
+  cc_alg = CC_ALG_BBR;
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_int_op(cc->cc_alg, OP_EQ, CC_ALG_BBR);
+  tt_assert(cc->bbr);
+  tt_int_op(cc->bbr->bw_filter_rounds, OP_EQ, 10);
+  congestion_control_free(cc);
+
+  /* The torrc option wins over the consensus. */
+  cc_alg = CC_ALG_VEGAS;
+  options->CongestionControlAlg = CC_ALG_BBR;
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_int_op(cc->cc_alg, OP_EQ, CC_ALG_BBR);
+  congestion_control_free(cc);
+
+  cc_alg = CC_ALG_BBR;
+  options->CongestionControlAlg = CC_ALG_VEGAS;
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_int_op(cc->cc_alg, OP_EQ, CC_ALG_VEGAS);
+  tt_ptr_op(cc->bbr, OP_EQ, NULL);
+
+ done:
+  options->CongestionControlAlg = CC_ALG_SENDME;
+  congestion_control_free(cc);
+}
+
+/* ============= Congestion Control Simulation ============== */
+
+/** A synthetic path for the congestion control simulator. */
+typedef struct cc_sim_path_t {
+  const char *name;
+  /** Bottleneck capacity, in cells per second. Must divide 1000000. */
+  uint32_t bottleneck_cps;
+  /** Base round-trip time, without any queueing. */
+  uint32_t rtt_usec;
+  /** Each SENDME is delayed by up to this much extra, uniformly. */
+  uint32_t jitter_usec;
+  /** This percent of SENDMEs is delayed by spike_usec more, as if a cell
+   * was lost and retransmitted by TCP on the way. */
+  uint32_t spike_pct;
+  uint32_t spike_usec;
+  /** How long to run for. */
+  uint32_t duration_usec;
+} cc_sim_path_t;
+
+/** What we measured on one run of the simulator. */
+typedef struct cc_sim_result_t {
+  /** Acknowledged cells per second. */
+  uint64_t throughput_cps;
+  /** Mean and max number of cells waiting at the bottleneck, as seen by
+   * each cell that we sent. */
+  uint64_t avg_queue_cells;
+  uint64_t max_queue_cells;
+} cc_sim_result_t;
+
+/** Maximum number of SENDMEs in flight in the simulator. */
+#define CC_SIM_MAX_ACKS 4096
+
+/**
+ * Run a bulk transfer on a circuit using congestion control algorithm
+ * <b>alg</b> over the synthetic <b>path</b>, and store what we measured in
+ * <b>res</b>.
+ *
+ * The path is a single FIFO bottleneck that serves one cell every
+ * 1/bottleneck_cps seconds, followed by a fixed delay and a jitter. The
+ * sender always has data: it sends whenever the package window allows,
+ * which includes the pacing credit if pacing is enabled. Everything,
+ * including the jitter, is deterministic.
+ */
+static void
+run_cc_sim(cc_alg_t alg, const cc_sim_path_t *path, cc_sim_result_t *res)
+{
+  circuit_params_t params;
+  channel_t dummy_channel = {0};
+  congestion_control_t *cc = NULL;
+  circuit_t *circ = NULL;
+  uint64_t *acks = tor_calloc(CC_SIM_MAX_ACKS, sizeof(uint64_t));
+  size_t ack_head = 0, ack_len = 0;
+  const uint64_t cell_usec = 1000*1000 / path->bottleneck_cps;
+  const uint64_t start = 1000*1000;
+  const uint64_t end = start + path->duration_usec;
+  uint64_t now = start, last_dep = start, last_ack = start;
+  uint64_t acked = 0, n_sent = 0, queue_sum = 0, queue_max = 0;
+  uint32_t rng = 0x5eed;
+
+  memset(res, 0, sizeof(*res));
+
+  dummy_channel.cmux = circuitmux_alloc();
+  circ = TO_CIRCUIT(new_fake_orcirc(&dummy_channel, &dummy_channel));
+  circ->purpose = CIRCUIT_PURPOSE_OR;
+
+  params.cc_enabled = 1;
+  params.sendme_inc_cells = TLS_RECORD_MAX_CELLS;
+  cc_alg = alg;
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  circ->ccontrol = cc;
+
+  while (now < end) {
+    monotime_set_mock_time_nsec(now*1000);
+
+    /* Send as much as the window allows, through the bottleneck. */
+    while (congestion_control_get_package_window(circ, NULL) > 0) {
+      uint64_t queue = last_dep > now ? (last_dep - now) / cell_usec : 0;
+      queue_sum += queue;
+      queue_max = MAX(queue_max, queue);
+      n_sent++;
+
+      last_dep = MAX(last_dep, now) + cell_usec;
+      congestion_control_note_cell_sent(cc, circ, NULL);
+
+      /* The other end sends a SENDME after every sendme_inc cells. */
+      if (cc->inflight % cc->sendme_inc == 0) {
+        uint64_t ack = last_dep + path->rtt_usec;
+        if (path->jitter_usec) {
+          rng = rng * 1103515245 + 12345;
+          ack += (rng >> 8) % path->jitter_usec;
+        }
+        if (path->spike_pct) {
+          rng = rng * 1103515245 + 12345;
+          if ((rng >> 8) % 100 < path->spike_pct)
+            ack += path->spike_usec;
+        }
+        /* SENDMEs cannot overtake each other. */
+        last_ack = MAX(last_ack, ack);
+        tt_int_op(ack_len, OP_LT, CC_SIM_MAX_ACKS);
+        acks[(ack_head + ack_len++) % CC_SIM_MAX_ACKS] = last_ack;
+      }
+    }
+
+    /* Then wait for pacing credit, or for the next SENDME. */
+    if (cc->pacing && cc->inflight < cc->cwnd) {
+      uint64_t wake = now + cc_pacing_get_delay(cc, circ, now);
+      if (!ack_len || wake < acks[ack_head]) {
+        now = wake;
+        continue;
+      }
+    }
+    tt_int_op(ack_len, OP_GT, 0);
+    now = acks[ack_head];
+    ack_head = (ack_head + 1) % CC_SIM_MAX_ACKS;
+    ack_len--;
+
+    monotime_set_mock_time_nsec(now*1000);
+    tt_int_op(congestion_control_dispatch_cc_alg(cc, circ), OP_EQ, 0);
+    acked += cc->sendme_inc;
+  }
+
+  res->throughput_cps = acked * 1000*1000 / path->duration_usec;
+  res->avg_queue_cells = n_sent ? queue_sum / n_sent : 0;
+  res->max_queue_cells = queue_max;
+
+  log_info(LD_CIRC, "Simulated %s over %s path: %"PRIu64" cells/s of %u, "
+           "queue avg %"PRIu64" max %"PRIu64" cells",
+           alg == CC_ALG_BBR ? "bbr" : "vegas", path->name,
+           res->throughput_cps, path->bottleneck_cps,
+           res->avg_queue_cells, res->max_queue_cells);
+
+ done:
+  free_fake_orcirc(TO_OR_CIRCUIT(circ));
+  circuitmux_free(dummy_channel.cmux);
+  tor_free(acks);
+}
+
+/**
+ * Compare the throughput and bottleneck queueing of TOR_VEGAS and TOR_BBR
+ * on synthetic paths, using the simulator above.
+ */
+void
+test_congestion_control_sim(void *arg)
+{
+  (void)arg;
+  const cc_sim_path_t clean = {
+    "clean", 2000, 100*1000, 0, 0, 0, 30*1000*1000
+  };
+  const cc_sim_path_t jittery = {
+    "jittery", 2000, 100*1000, 100*1000, 0, 0, 30*1000*1000
+  };
+  const cc_sim_path_t lossy = {
+    "lossy", 5000, 80*1000, 10*1000, 5, 200*1000, 30*1000*1000
+  };
+  const cc_sim_path_t long_fat = {
+    "long fat", 10000, 300*1000, 0, 0, 0, 30*1000*1000
+  };
+  cc_sim_result_t vegas, bbr;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_circuit_mock);
+  monotime_init();
+  monotime_enable_test_mocking();
+
+  /* On a clean path, both fill the pipe, but BBR queues less. */
+  run_cc_sim(CC_ALG_VEGAS, &clean, &vegas);
+  run_cc_sim(CC_ALG_BBR, &clean, &bbr);
+  tt_u64_op(vegas.throughput_cps, OP_GE, 1900);
+  tt_u64_op(bbr.throughput_cps, OP_GE, 1900);
+  tt_u64_op(bbr.avg_queue_cells, OP_LT, vegas.avg_queue_cells);
+
+  /* Both ride out moderate RTT jitter. */
+  run_cc_sim(CC_ALG_VEGAS, &jittery, &vegas);
+  run_cc_sim(CC_ALG_BBR, &jittery, &bbr);
+  tt_u64_op(vegas.throughput_cps, OP_GE, 1800);
+  tt_u64_op(bbr.throughput_cps, OP_GE, 1800);
+
+  /* Vegas reads the delay spikes of a lossy link as queueing, and backs
+   * off; BBR does not. */
+  run_cc_sim(CC_ALG_VEGAS, &lossy, &vegas);
+  run_cc_sim(CC_ALG_BBR, &lossy, &bbr);
+  tt_u64_op(bbr.throughput_cps, OP_GT, vegas.throughput_cps * 5 / 4);
+
+  /* A large BDP: both get there, and BBR's startup overshoot stays under
+   * two BDPs of queue. */
+  run_cc_sim(CC_ALG_VEGAS, &long_fat, &vegas);
+  run_cc_sim(CC_ALG_BBR, &long_fat, &bbr);
+  tt_u64_op(vegas.throughput_cps, OP_GE, 8500);
+  tt_u64_op(bbr.throughput_cps, OP_GE, 8500);
+  tt_u64_op(bbr.max_queue_cells, OP_LT, 2 * 3000);
+
+ done:
+  is_monotime_clock_broken = false;
+  monotime_disable_test_mocking();
+  UNMOCK(circuitmux_attach_circuit);
+}
+
+/**
+ * Check the pacing credit arithmetic, the channel budget, and that pacing
+ * evens out bursts on the simulated paths without costing throughput.
+ */
+void
+test_congestion_control_pacing(void *arg)
+{
+  (void)arg;
+  circuit_params_t params;
+  channel_t dummy_channel = {0};
+  congestion_control_t *cc = NULL;
+  circuit_t *circ = NULL;
+  const uint64_t now = 1000*1000;
+  timer_cb_fn_t cb = NULL;
+  void *cb_arg = NULL;
+  const cc_sim_path_t jittery = {
+    "jittery", 2000, 100*1000, 100*1000, 0, 0, 30*1000*1000
+  };
+  const cc_sim_path_t long_fat = {
+    "long fat", 10000, 300*1000, 0, 0, 0, 30*1000*1000
+  };
+  cc_sim_result_t bursty, paced;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_circuit_mock);
+  monotime_init();
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(now*1000);
+  timers_initialize();
+
+  dummy_channel.cmux = circuitmux_alloc();
+  circ = TO_CIRCUIT(new_fake_orcirc(&dummy_channel, &dummy_channel));
+  circ->purpose = CIRCUIT_PURPOSE_OR;
+  params.cc_enabled = 1;
+  params.sendme_inc_cells = TLS_RECORD_MAX_CELLS;
+  cc_alg = CC_ALG_VEGAS;
+
+  /* Pacing is off by default. */
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_ptr_op(cc->pacing, OP_EQ, NULL);
+  congestion_control_free(cc);
+
+  cc_pacing_enabled = true;
+  cc_pacing_chan_budget = 0;
+  cc = congestion_control_new(&params, CC_PATH_EXIT);
+  circ->ccontrol = cc;
+  tt_assert(cc->pacing);
+
+  /* Without an RTT estimate, there is nothing to pace by. */
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now), OP_EQ,
+            UINT64_MAX);
+
+  /* 160 cells per 100 msec, at 125%: 2 cells per msec, in bursts of at
+   * most 16 cells. */
+  cc->ewma_rtt_usec = 100*1000;
+  cc->cwnd = 160;
+  cc->in_slow_start = 0;
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now), OP_EQ, 16);
+  tt_int_op(congestion_control_get_package_window(circ, NULL), OP_EQ, 16);
+  for (int i = 0; i < 16; i++)
+    congestion_control_note_cell_sent(cc, circ, NULL);
+  tt_int_op(congestion_control_get_package_window(circ, NULL), OP_EQ, 0);
+  tt_u64_op(cc_pacing_get_delay(cc, circ, now), OP_EQ, 8000);
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now + 4000),
+            OP_EQ, 8);
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now + 1000*1000),
+            OP_EQ, 16);
+
+  /* In slow start, credit comes twice as fast. */
+  cc->in_slow_start = 1;
+  tt_u64_op(cc_pacing_get_delay(cc, circ, now + 1000*1000), OP_EQ, 1);
+  cc->pacing->credit_milli = 0;
+  tt_u64_op(cc_pacing_get_delay(cc, circ, now + 1000*1000), OP_EQ, 5000);
+  cc->in_slow_start = 0;
+
+  /* The channel budget caps all the circuits on the channel. */
+  cc_pacing_chan_budget = 4;
+  cc->pacing->credit_milli = 16000;
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now + 1000*1000),
+            OP_EQ, 4);
+  for (int i = 0; i < 4; i++)
+    congestion_control_pacing_note_cell_sent(cc, circ, now + 1000*1000);
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ, now + 1000*1000),
+            OP_EQ, 0);
+  cc->inflight = cc->cwnd - 12;
+  tt_u64_op(cc_pacing_get_delay(cc, circ, now + 1000*1000 + 400), OP_EQ,
+            600);
+  tt_u64_op(congestion_control_pacing_get_credit(cc, circ,
+                                                 now + 1000*1000 + 1000),
+            OP_EQ, 4);
+  cc_pacing_chan_budget = 0;
+
+  /* When pacing stops the circuit, it records the burst, and a timer
+   * resumes the circuit later and records the delay. */
+  monotime_set_mock_time_nsec((now + 2000*1000)*1000);
+  cc->pacing->credit_milli = 0;
+  cc->pacing->last_refill_usec = now + 2000*1000;
+  congestion_control_pacing_note_blocked(circ, NULL);
+  tt_assert(cc->pacing->timer_scheduled);
+  tt_u64_op(cc_stats_pacing_burst_counts[5], OP_EQ, 1);
+  tt_u64_op(cc_stats_pacing_burst_cells, OP_EQ, 20);
+  timer_get_cb(cc->pacing->timer, &cb, &cb_arg);
+  monotime_set_mock_time_nsec((now + 2000*1000 + 8000)*1000);
+  cb(cc->pacing->timer, cb_arg, NULL);
+  tt_assert(!cc->pacing->timer_scheduled);
+  tt_u64_op(cc_stats_pacing_delay_counts[6], OP_EQ, 1);
+  tt_u64_op(cc_stats_pacing_delay_usec, OP_EQ, 8000);
+
+  /* A full congestion window is not pacing's business. */
+  cc->inflight = cc->cwnd;
+  congestion_control_pacing_note_blocked(circ, NULL);
+  tt_assert(!cc->pacing->timer_scheduled);
+
+  /* On the simulated paths, pacing keeps the throughput, and the cells
+   * that wait at the bottleneck at worst are far fewer. */
+  cc_pacing_chan_budget = 256;
+  cc_pacing_enabled = false;
+  run_cc_sim(CC_ALG_VEGAS, &jittery, &bursty);
+  cc_pacing_enabled = true;
+  run_cc_sim(CC_ALG_VEGAS, &jittery, &paced);
+  tt_u64_op(paced.throughput_cps, OP_GE, bursty.throughput_cps * 9 / 10);
+  tt_u64_op(paced.max_queue_cells, OP_LT, bursty.max_queue_cells);
+
+  cc_pacing_enabled = false;
+  run_cc_sim(CC_ALG_BBR, &long_fat, &bursty);
+  cc_pacing_enabled = true;
+  run_cc_sim(CC_ALG_BBR, &long_fat, &paced);
+  tt_u64_op(paced.throughput_cps, OP_GE, bursty.throughput_cps * 9 / 10);
+  tt_u64_op(paced.max_queue_cells, OP_LT, bursty.max_queue_cells);
+
+ done:
+  cc_pacing_enabled = false;
+  free_fake_orcirc(TO_OR_CIRCUIT(circ));
+  circuitmux_free(dummy_channel.cmux);
+  timers_shutdown();
+  is_monotime_clock_broken = false;
+  monotime_disable_test_mocking();
+  UNMOCK(circuitmux_attach_circuit);
+}
+
 #define TEST_CONGESTION_CONTROL(name, flags) \
     { #name, test_##name, (flags), NULL, NULL }
 
@@ -386,5 +776,8 @@ struct testcase_t congestion_control_tests[] = {
   TEST_CONGESTION_CONTROL(congestion_control_clock, TT_FORK),
   TEST_CONGESTION_CONTROL(congestion_control_rtt, TT_FORK),
   TEST_CONGESTION_CONTROL(congestion_control_vegas_cwnd, TT_FORK),
+  TEST_CONGESTION_CONTROL(congestion_control_alg_select, TT_FORK),
+  TEST_CONGESTION_CONTROL(congestion_control_sim, TT_FORK),
+  TEST_CONGESTION_CONTROL(congestion_control_pacing, TT_FORK),
   END_OF_TESTCASES
 };
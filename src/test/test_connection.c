@@ -33,6 +33,7 @@
 #include "core/or/or_connection_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
+#include "core/or/port_cfg_st.h"
 
 static void * test_conn_get_basic_setup(const struct testcase_t *tc);
 static int test_conn_get_basic_teardown(const struct testcase_t *tc,
@@ -976,6 +977,181 @@ test_conn_describe(void *arg)
   connection_free_minimal(conn);
 }
 
+static smartlist_t *bw_started_reading = NULL;
+
+static void
+mock_connection_start_reading(connection_t *conn)
+{
+  smartlist_add(bw_started_reading, conn);
+}
+
+static void
+mock_connection_stop_reading(connection_t *conn)
+{
+  (void)conn;
+}
+
+static void
+test_conn_bw_queue(void *arg)
+{
+  (void)arg;
+  connection_t *conns[5];
+  const uint32_t now_ts = monotime_coarse_get_stamp();
+  int i;
+
+  memset(conns, 0, sizeof(conns));
+  bw_started_reading = smartlist_new();
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  MOCK(connection_stop_reading, mock_connection_stop_reading);
+  connection_bucket_init();
+
+  for (i = 0; i < 5; ++i) {
+    conns[i] = TO_CONN(dir_connection_new(AF_INET));
+    conns[i]->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+    conns[i]->always_rate_limit_as_remote = 1;
+    connection_read_bw_exhausted(conns[i], true);
+    tt_int_op(conns[i]->read_blocked_on_bw, OP_EQ, 1);
+  }
+  /* Running out twice doesn't queue a connection twice. */
+  connection_read_bw_exhausted(conns[0], true);
+
+  /* Each of these connections expects to read 996 bytes at a time: with
+   * 3000 bytes in the bucket, only the first four get to go, in order. */
+  token_bucket_rw_init(&global_bucket, 1, 3000, now_ts);
+  token_bucket_rw_init(&global_relayed_bucket, 1, 3000, now_ts);
+  connection_bw_queue_release(true, now_ts);
+  tt_int_op(smartlist_len(bw_started_reading), OP_EQ, 4);
+  for (i = 0; i < 4; ++i) {
+    tt_ptr_op(smartlist_get(bw_started_reading, i), OP_EQ, conns[i]);
+    tt_int_op(conns[i]->read_blocked_on_bw, OP_EQ, 0);
+  }
+  tt_int_op(conns[4]->read_blocked_on_bw, OP_EQ, 1);
+
+  /* The first connection runs out again: it waits behind the last one. */
+  connection_read_bw_exhausted(conns[0], true);
+  smartlist_clear(bw_started_reading);
+  token_bucket_rw_init(&global_bucket, 1, 500, now_ts);
+  connection_bw_queue_release(true, now_ts);
+  tt_int_op(smartlist_len(bw_started_reading), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(bw_started_reading, 0), OP_EQ, conns[4]);
+  tt_int_op(conns[0]->read_blocked_on_bw, OP_EQ, 1);
+
+  /* Nothing left in the bucket: nobody goes. */
+  smartlist_clear(bw_started_reading);
+  token_bucket_rw_dec(&global_bucket, 500, 0);
+  connection_bw_queue_release(true, now_ts);
+  tt_int_op(smartlist_len(bw_started_reading), OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_stop_reading);
+  for (i = 0; i < 5; ++i)
+    connection_free_minimal(conns[i]);
+  smartlist_free(bw_started_reading);
+}
+
+static void
+test_conn_listener_sockets_per_port(void *arg)
+{
+  (void)arg;
+  or_options_t *options = get_options_mutable();
+  port_cfg_t *port = port_cfg_new(0);
+
+  port->type = CONN_TYPE_OR_LISTENER;
+  port->port = 9001;
+  tor_addr_parse(&port->addr, "127.0.0.1");
+
+  options->ListenerSocketsPerPort = 1;
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 1);
+
+  options->ListenerSocketsPerPort = 4;
+#ifdef SO_REUSEPORT
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 4);
+#else
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 1);
+#endif
+
+  /* Ports that can't be shared always get a single socket. */
+  port->port = CFG_AUTO_PORT;
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 1);
+  port->port = 9001;
+  port->type = CONN_TYPE_AP_DNS_LISTENER;
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 1);
+  port->type = CONN_TYPE_OR_LISTENER;
+  port->is_unix_addr = 1;
+  tt_int_op(connection_listener_sockets_per_port(port), OP_EQ, 1);
+
+ done:
+  port_cfg_free(port);
+}
+
+static void
+test_conn_listener_accept_batch(void *arg)
+{
+  (void)arg;
+  connection_t *listener = NULL;
+  tor_socket_t clients[3];
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof(sin);
+  int i, n_conns;
+
+  for (i = 0; i < 3; ++i)
+    clients[i] = TOR_INVALID_SOCKET;
+  tor_init_connection_lists();
+  connection_bucket_init();
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  bw_started_reading = smartlist_new();
+  get_options_mutable()->ListenerAcceptBatchSize = 2;
+
+  listener = connection_new(CONN_TYPE_AP_LISTENER, AF_INET);
+  listener->s = tor_open_socket_nonblocking(AF_INET, SOCK_STREAM,
+                                            IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener->s));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  tt_int_op(bind(listener->s, (struct sockaddr *)&sin, sizeof(sin)),
+            OP_EQ, 0);
+  tt_int_op(listen(listener->s, SOMAXCONN), OP_EQ, 0);
+  tt_int_op(getsockname(listener->s, (struct sockaddr *)&sin, &slen),
+            OP_EQ, 0);
+  tt_int_op(connection_add(listener), OP_EQ, 0);
+  n_conns = smartlist_len(get_connection_array());
+
+  for (i = 0; i < 3; ++i) {
+    clients[i] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    tt_assert(SOCKET_OK(clients[i]));
+    tt_int_op(connect(clients[i], (struct sockaddr *)&sin, sizeof(sin)),
+              OP_EQ, 0);
+  }
+
+  /* The first wakeup takes a full batch, the second one the rest, and the
+   * third one finds nothing to accept. */
+  tt_int_op(connection_handle_read(listener), OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, n_conns + 2);
+  tt_int_op(connection_handle_read(listener), OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, n_conns + 3);
+  tt_int_op(connection_handle_read(listener), OP_EQ, 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, n_conns + 3);
+  tt_int_op(listener->marked_for_close, OP_EQ, 0);
+
+  tt_u64_op(stats_n_listener_accepts, OP_EQ, 3);
+  tt_u64_op(stats_listener_accepts_per_wakeup[0], OP_EQ, 1);
+  tt_u64_op(stats_listener_accepts_per_wakeup[1], OP_EQ, 1);
+  tt_u64_op(stats_listener_accepts_per_wakeup[2], OP_EQ, 1);
+
+ done:
+  UNMOCK(connection_start_reading);
+  smartlist_free(bw_started_reading);
+  for (i = 0; i < 3; ++i) {
+    if (SOCKET_OK(clients[i]))
+      tor_close_socket(clients[i]);
+  }
+  SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn, {
+    connection_close_immediate(conn);
+  });
+}
+
 #ifndef COCCI
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
@@ -1010,5 +1186,10 @@ struct testcase_t connection_tests[] = {
   //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
   { "describe", test_conn_describe, TT_FORK, NULL, NULL },
+  { "bw_queue", test_conn_bw_queue, TT_FORK, NULL, NULL },
+  { "listener_sockets_per_port", test_conn_listener_sockets_per_port,
+    TT_FORK, NULL, NULL },
+  { "listener_accept_batch", test_conn_listener_accept_batch, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
@@ -4,6 +4,8 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "feature/dircache/conscache.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/encoding/binascii.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 
@@ -328,6 +330,128 @@ test_conscache_filter(void *arg)
   smartlist_free(lst);
 }
 
+/** Replace every <b>from</b> in the index <b>s</b> with <b>to</b>, and give
+ * it a fresh digest.  Return a newly allocated string. */
+static char *
+reforge_conscache_index(const char *s, const char *from, const char *to)
+{
+  char digest[DIGEST256_LEN];
+  char hex[HEX_DIGEST256_LEN+1];
+  char *body, *result = NULL;
+  const char *digest_line = strstr(s, "@digest ");
+  tor_assert(digest_line);
+
+  body = tor_strndup(s, digest_line - s);
+  char *cp;
+  while ((cp = strstr(body, from)))
+    memcpy(cp, to, strlen(to));
+  crypto_digest256(digest, body, strlen(body), DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, sizeof(digest));
+  tor_asprintf(&result, "%s@digest %s\n", body, hex);
+  tor_free(body);
+  return result;
+}
+
+static void
+test_conscache_index(void *arg)
+{
+  (void)arg;
+  consensus_cache_t *cache = NULL;
+  consensus_cache_entry_t *ent = NULL;
+  config_line_t *labels = NULL;
+  char *index_fname = NULL, *index = NULL, *forged = NULL;
+  char *fname = NULL;
+  const uint8_t *bp = NULL;
+  size_t sz = 0;
+
+  /* Make a temporary datadir for these tests */
+  char *ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  index_fname = get_cachedir_fname("cons.index");
+
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+  config_line_append(&labels, "Hello", "world");
+  ent = consensus_cache_add(cache, labels, (const uint8_t *)"A\0B\0C", 5);
+  config_free_lines(labels);
+  labels = NULL;
+  tt_assert(ent);
+  consensus_cache_entry_decref(ent);
+  config_line_append(&labels, "Hello", "mundo");
+  ent = consensus_cache_add(cache, labels, (const uint8_t *)"xyzzy", 5);
+  config_free_lines(labels);
+  labels = NULL;
+  tt_assert(ent);
+  consensus_cache_entry_decref(ent);
+  ent = NULL;
+  consensus_cache_free(cache);
+
+  /* The index describes both objects. */
+  index = read_file_to_str(index_fname, 0, NULL);
+  tt_assert(index);
+  tt_assert(!strcmpstart(index, "consensus-cache-index 1\n"));
+  tt_assert(strstr(index, "Hello world\n"));
+  tt_assert(strstr(index, "Hello mundo\n"));
+
+  /* Reopening from the index finds the objects and their bodies. */
+  cache = consensus_cache_open("cons", 128);
+  ent = consensus_cache_find_first(cache, "Hello", "mundo");
+  tt_assert(ent);
+  tt_int_op(consensus_cache_entry_get_body(ent, &bp, &sz), OP_EQ, 0);
+  tt_mem_op(bp, OP_EQ, "xyzzy", 5);
+  ent = NULL;
+  consensus_cache_free(cache);
+
+  /* A corrupt index gets ignored and rewritten. */
+  forged = tor_strdup(index);
+  memcpy(strstr(forged, "mundo"), "MUNDO", 5);
+  tt_int_op(write_str_to_file(index_fname, forged, 0), OP_EQ, 0);
+  tor_free(forged);
+  cache = consensus_cache_open("cons", 128);
+  tt_ptr_op(consensus_cache_find_first(cache, "Hello", "MUNDO"), OP_EQ, NULL);
+  tt_assert(consensus_cache_find_first(cache, "Hello", "mundo"));
+  consensus_cache_free(cache);
+  tor_free(index);
+  index = read_file_to_str(index_fname, 0, NULL);
+  tt_assert(strstr(index, "Hello mundo\n"));
+
+  /* An index that is well-formed but wrong gets caught when we first
+   * look at the object. */
+  forged = reforge_conscache_index(index, "mundo", "MUNDO");
+  tt_int_op(write_str_to_file(index_fname, forged, 0), OP_EQ, 0);
+  cache = consensus_cache_open("cons", 128);
+  ent = consensus_cache_find_first(cache, "Hello", "MUNDO");
+  tt_assert(ent);
+  tt_int_op(consensus_cache_entry_get_body(ent, &bp, &sz), OP_EQ, -1);
+  tt_ptr_op(consensus_cache_find_first(cache, "Hello", "MUNDO"), OP_EQ, NULL);
+  ent = consensus_cache_find_first(cache, "Hello", "world");
+  tt_assert(ent);
+  tt_int_op(consensus_cache_entry_get_body(ent, &bp, &sz), OP_EQ, 0);
+  tt_mem_op(bp, OP_EQ, "A\0B\0C", 5);
+  ent = NULL;
+  consensus_cache_free(cache);
+
+  /* An index that doesn't match the directory is stale. */
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(consensus_cache_find_first(cache, "Hello", "world"));
+  consensus_cache_free(cache);
+  fname = get_cachedir_fname("cons/1000");
+  tt_int_op(unlink(fname), OP_EQ, 0);
+  cache = consensus_cache_open("cons", 128);
+  tt_ptr_op(consensus_cache_find_first(cache, "Hello", "world"), OP_EQ, NULL);
+
+ done:
+  config_free_lines(labels);
+  consensus_cache_free(cache);
+  tor_free(ddir_fname);
+  tor_free(index_fname);
+  tor_free(index);
+  tor_free(forged);
+  tor_free(fname);
+}
+
 #define ENT(name)                                               \
   { #name, test_conscache_ ## name, TT_FORK, NULL, NULL }
 
@@ -336,5 +460,6 @@ struct testcase_t conscache_tests[] = {
   ENT(simple_usage),
   ENT(cleanup),
   ENT(filter),
+  ENT(index),
   END_OF_TESTCASES
 };
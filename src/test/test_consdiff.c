@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -343,6 +344,132 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/** Helper: return a newly allocated random document of at most
+ * <b>max_lines</b> lines drawn from a small alphabet, so that it has many
+ * lines in common with other such documents. */
+static char *
+random_small_document(int max_lines)
+{
+  static const char *alphabet[] = { "a", "b", "c", "d", "r x", "r y" };
+  smartlist_t *lines = smartlist_new();
+  int n = crypto_rand_int(max_lines + 1);
+  for (int i = 0; i < n; ++i) {
+    smartlist_add_asprintf(lines, "%s\n",
+                   alphabet[crypto_rand_int(ARRAY_LENGTH(alphabet))]);
+  }
+  char *result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Helper: return the number of bits set among the first <b>n</b> bits of
+ * <b>b</b>. */
+static int
+count_changed(bitarray_t *b, int n)
+{
+  int count = 0;
+  for (int i = 0; i < n; ++i) {
+    if (bitarray_is_set(b, i))
+      ++count;
+  }
+  return count;
+}
+
+static void
+test_consdiff_calc_changes_myers(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_t *applied = NULL, *diff = NULL;
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
+  bitarray_t *lcs1 = NULL, *lcs2 = NULL;
+  char *doc1 = NULL, *doc2 = NULL;
+  memarea_t *area = memarea_new();
+  (void)arg;
+
+  for (int iter = 0; iter < 500; ++iter) {
+    doc1 = random_small_document(40);
+    doc2 = random_small_document(40);
+    consensus_split_lines_(sl1, doc1, area);
+    consensus_split_lines_(sl2, doc2, area);
+    const int len1 = smartlist_len(sl1), len2 = smartlist_len(sl2);
+
+    /* Myers finds an edit script as short as the LCS one... */
+    changed1 = bitarray_init_zero(len1 + 1);
+    changed2 = bitarray_init_zero(len2 + 1);
+    lcs1 = bitarray_init_zero(len1 + 1);
+    lcs2 = bitarray_init_zero(len2 + 1);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes_myers(sls1, sls2, changed1, changed2);
+    tor_free(sls1);
+    tor_free(sls2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, lcs1, lcs2);
+    tt_int_op(count_changed(changed1, len1) + count_changed(changed2, len2),
+              OP_EQ,
+              count_changed(lcs1, len1) + count_changed(lcs2, len2));
+
+    /* ... whose unchanged lines are common to both documents... */
+    int i1 = 0, i2 = 0;
+    while (i1 < len1 || i2 < len2) {
+      if (i1 < len1 && bitarray_is_set(changed1, i1)) {
+        ++i1;
+      } else if (i2 < len2 && bitarray_is_set(changed2, i2)) {
+        ++i2;
+      } else {
+        tt_int_op(i1, OP_LT, len1);
+        tt_int_op(i2, OP_LT, len2);
+        tt_assert(lines_eq(smartlist_get(sl1, i1), smartlist_get(sl2, i2)));
+        ++i1;
+        ++i2;
+      }
+    }
+
+    /* ... and that turns into an ed diff that we can apply. */
+    diff = gen_ed_diff_with_engine(sl1, sl2, area, CONSDIFF_ENGINE_MYERS);
+    tt_assert(diff);
+    applied = apply_ed_diff(sl1, diff, 0);
+    tt_assert(applied);
+    tt_int_op(smartlist_len(applied), OP_EQ, len2);
+    SMARTLIST_FOREACH(applied, const cdline_t *, line,
+           tt_assert(lines_eq(line, smartlist_get(sl2, line_sl_idx))));
+
+    smartlist_free(applied);
+    smartlist_free(diff);
+    applied = diff = NULL;
+    tor_free(sls1);
+    tor_free(sls2);
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    bitarray_free(lcs1);
+    bitarray_free(lcs2);
+    changed1 = changed2 = lcs1 = lcs2 = NULL;
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    tor_free(doc1);
+    tor_free(doc2);
+  }
+
+ done:
+  tor_free(doc1);
+  tor_free(doc2);
+  tor_free(sls1);
+  tor_free(sls2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  bitarray_free(lcs1);
+  bitarray_free(lcs2);
+  smartlist_free(applied);
+  smartlist_free(diff);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -958,7 +1085,8 @@ test_consdiff_gen_diff(void *arg)
   consensus_split_lines_(cons1, cons1_str, area);
   consensus_split_lines_(cons2, cons2_str, area);
 
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area,
+                           CONSDIFF_ENGINE_DEFAULT);
   tt_ptr_op(NULL, OP_EQ, diff);
 
   /* Check that the headers are done properly. */
@@ -973,7 +1101,8 @@ test_consdiff_gen_diff(void *arg)
       consensus_compute_digest_as_signed_(cons1_str, &digests1));
   smartlist_clear(cons1);
   consensus_split_lines_(cons1, cons1_str, area);
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area,
+                           CONSDIFF_ENGINE_DEFAULT);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(11, OP_EQ, smartlist_len(diff));
   tt_assert(line_str_eq(smartlist_get(diff, 0),
@@ -1205,6 +1334,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_myers),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
@@ -118,6 +118,7 @@ typedef struct fake_work_queue_ent_t {
   enum workqueue_reply_t (*fn)(void *, void *);
   void (*reply_fn)(void *);
   void *arg;
+  workqueue_priority_t prio;
 } fake_work_queue_ent_t;
 static struct workqueue_entry_t *
 mock_cpuworker_queue_work(workqueue_priority_t prio,
@@ -125,8 +126,6 @@ mock_cpuworker_queue_work(workqueue_priority_t prio,
                           void (*reply_fn)(void *),
                           void *arg)
 {
-  (void) prio;
-
   if (! fake_cpuworker_queue)
     fake_cpuworker_queue = smartlist_new();
 
@@ -134,6 +133,7 @@ mock_cpuworker_queue_work(workqueue_priority_t prio,
   ent->fn = fn;
   ent->reply_fn = reply_fn;
   ent->arg = arg;
+  ent->prio = prio;
   smartlist_add(fake_cpuworker_queue, ent);
   return (struct workqueue_entry_t *)ent;
 }
@@ -154,12 +154,38 @@ mock_cpuworker_handle_replies(void)
 {
   if (! fake_cpuworker_queue)
     return;
-  SMARTLIST_FOREACH(fake_cpuworker_queue, fake_work_queue_ent_t *, ent, {
+  /* Replies may queue more work, which goes on a fresh queue. */
+  smartlist_t *queue = fake_cpuworker_queue;
+  fake_cpuworker_queue = NULL;
+  SMARTLIST_FOREACH(queue, fake_work_queue_ent_t *, ent, {
       ent->reply_fn(ent->arg);
       tor_free(ent);
   });
-  smartlist_free(fake_cpuworker_queue);
-  fake_cpuworker_queue = NULL;
+  smartlist_free(queue);
+}
+/* Run the first queued job, and handle its reply. */
+static int
+mock_cpuworker_run_one(void)
+{
+  if (! fake_cpuworker_queue || smartlist_len(fake_cpuworker_queue) == 0)
+    return -1;
+  fake_work_queue_ent_t *ent = smartlist_get(fake_cpuworker_queue, 0);
+  smartlist_del_keeporder(fake_cpuworker_queue, 0);
+  enum workqueue_reply_t r = ent->fn(NULL, ent->arg);
+  ent->reply_fn(ent->arg);
+  tor_free(ent);
+  return r == WQ_RPL_REPLY ? 0 : -1;
+}
+/* Run queued jobs and handle their replies until no work is left. */
+static int
+mock_cpuworker_run_all(void)
+{
+  while (fake_cpuworker_queue) {
+    if (mock_cpuworker_run_work() < 0)
+      return -1;
+    mock_cpuworker_handle_replies();
+  }
+  return 0;
 }
 
 // ==============================  Other helpers
@@ -417,9 +443,8 @@ test_consdiffmgr_make_diffs(void *arg)
   tt_int_op(CONSDIFF_IN_PROGRESS, OP_EQ, diff_status);
 
   // Now run that process and get the diff.
-  r = mock_cpuworker_run_work();
+  r = mock_cpuworker_run_all();
   tt_int_op(r, OP_EQ, 0);
-  mock_cpuworker_handle_replies();
 
   // At this point we should be able to get that diff.
   diff_status = consdiffmgr_find_diff_from(&diff, FLAV_MICRODESC,
@@ -480,8 +505,7 @@ test_consdiffmgr_diff_rules(void *arg)
   consdiffmgr_rescan();
   tt_ptr_op(NULL, OP_NE, fake_cpuworker_queue);
   tt_int_op(3, OP_EQ, smartlist_len(fake_cpuworker_queue));
-  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
-  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
   tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
 
   /* For the NS consensuses: add 3, generate, and add one older one and
@@ -492,8 +516,7 @@ test_consdiffmgr_diff_rules(void *arg)
   consdiffmgr_rescan();
   tt_ptr_op(NULL, OP_NE, fake_cpuworker_queue);
   tt_int_op(2, OP_EQ, smartlist_len(fake_cpuworker_queue));
-  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
-  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
 
   /* At this point, we should actually have working diffs! */
   tt_int_op(0, OP_EQ,
@@ -528,8 +551,7 @@ test_consdiffmgr_diff_rules(void *arg)
   consdiffmgr_rescan();
   tt_ptr_op(NULL, OP_NE, fake_cpuworker_queue);
   tt_int_op(1, OP_EQ, smartlist_len(fake_cpuworker_queue));
-  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
-  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
 
   tt_int_op(0, OP_EQ,
             lookup_apply_and_verify_diff(FLAV_NS, ns_body[2], ns_body[5]));
@@ -641,8 +663,7 @@ test_consdiffmgr_diff_pending(void *arg)
   consdiffmgr_rescan();
   tt_int_op(2, OP_EQ, smartlist_len(fake_cpuworker_queue));
 
-  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
-  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
 
   tt_int_op(0, OP_EQ,
        lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[0], md_body[2]));
@@ -658,6 +679,103 @@ test_consdiffmgr_diff_pending(void *arg)
 #undef N
 }
 
+static void
+test_consdiffmgr_diff_compression_jobs(void *arg)
+{
+#define N 3
+  (void)arg;
+  char *md_body[N];
+  networkstatus_t *md_ns[N];
+  time_t start = approx_time() - 120;
+  const uint64_t START_NSEC = ((uint64_t)start) * 1000000000;
+  uint8_t sha3_0[DIGEST256_LEN];
+  consensus_cache_entry_t *ent = NULL;
+  const uint64_t *hist;
+  int64_t sum_msec = 0;
+  int i;
+  for (i = 0; i < N; ++i) {
+    time_t when = start + i * 30;
+    md_body[i] = fake_ns_body_new(FLAV_MICRODESC, when);
+    md_ns[i] = fake_ns_new(FLAV_MICRODESC, when);
+  }
+  router_get_networkstatus_v3_sha3_as_signed(sha3_0, md_body[0],
+                                             strlen(md_body[0]));
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NSEC);
+
+  /* Clients keep asking for a diff from the oldest consensus. */
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[0], md_ns[0]));
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[1], md_ns[1]));
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(CONSDIFF_NOT_FOUND, OP_EQ,
+              lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  }
+  tt_uint_op(3, OP_EQ, cdm_diff_get_n_requests(FLAV_MICRODESC, sha3_0));
+
+  /* A new consensus arrives: one diff job per source, and the popular
+   * source comes first even though it is older. */
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[2], md_ns[2]));
+  consdiffmgr_rescan();
+  tt_int_op(2, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_one());
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  tt_int_op(CONSDIFF_IN_PROGRESS, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[1]));
+
+  /* Its compressed versions are queued separately, and the cheap ones
+   * run ahead of the remaining diff. */
+  tt_int_op(n_diff_compression_methods(), OP_EQ,
+            smartlist_len(fake_cpuworker_queue));
+  {
+    fake_work_queue_ent_t *w = smartlist_get(fake_cpuworker_queue, 0);
+    tt_int_op(WQ_PRI_LOW, OP_EQ, w->prio);
+    w = smartlist_get(fake_cpuworker_queue, 1);
+    tt_int_op(WQ_PRI_MED, OP_EQ, w->prio);
+  }
+  tt_int_op(CONSDIFF_IN_PROGRESS, OP_EQ,
+            consdiffmgr_find_diff_from(&ent, FLAV_MICRODESC,
+                                       DIGEST_SHA3_256,
+                                       sha3_0, DIGEST256_LEN,
+                                       GZIP_METHOD));
+
+  /* Two seconds later, everything is done. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 2000 * (uint64_t)1000000);
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            consdiffmgr_find_diff_from(&ent, FLAV_MICRODESC,
+                                       DIGEST_SHA3_256,
+                                       sha3_0, DIGEST256_LEN,
+                                       GZIP_METHOD));
+  tt_int_op(0, OP_EQ,
+       lookup_apply_and_verify_diff(FLAV_MICRODESC, md_body[1], md_body[2]));
+
+  /* Time to availability: one uncompressed diff right away, the other
+   * after two seconds; both gzipped diffs after two seconds. */
+  hist = consdiffmgr_get_diff_availability_hist(NO_METHOD, &sum_msec);
+  tt_assert(hist);
+  tt_u64_op(hist[0], OP_EQ, 1);
+  tt_u64_op(hist[3], OP_EQ, 1);
+  tt_i64_op(sum_msec, OP_EQ, 2000);
+  hist = consdiffmgr_get_diff_availability_hist(GZIP_METHOD, &sum_msec);
+  tt_assert(hist);
+  tt_u64_op(hist[3], OP_EQ, 2);
+  tt_i64_op(sum_msec, OP_EQ, 4000);
+  tt_ptr_op(NULL, OP_EQ,
+            consdiffmgr_get_diff_availability_hist(ZLIB_METHOD, &sum_msec));
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  monotime_disable_test_mocking();
+  for (i = 0; i < N; ++i) {
+    tor_free(md_body[i]);
+    networkstatus_vote_free(md_ns[i]);
+  }
+#undef N
+}
+
 static void
 test_consdiffmgr_cleanup_old(void *arg)
 {
@@ -772,8 +890,7 @@ test_consdiffmgr_cleanup_old_diffs(void *arg)
   consdiffmgr_rescan();
   tt_ptr_op(NULL, OP_NE, fake_cpuworker_queue);
   tt_int_op(2, OP_EQ, smartlist_len(fake_cpuworker_queue));
-  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
-  mock_cpuworker_handle_replies();
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_all());
   tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
 
   /* Nothing is deletable now */
@@ -909,6 +1026,7 @@ struct testcase_t consdiffmgr_tests[] = {
   TEST(diff_rules),
   TEST(diff_failure),
   TEST(diff_pending),
+  TEST(diff_compression_jobs),
   TEST(cleanup_old),
   TEST(cleanup_bad_valid_after),
   TEST(cleanup_no_valid_after),
@@ -18,6 +18,7 @@
 #include "feature/dircache/dircache.h"
 #include "test/test.h"
 #include "lib/compress/compress.h"
+#include "lib/compress/compress_zstd.h"
 #include "feature/relay/relay_config.h"
 #include "feature/relay/router.h"
 #include "feature/nodelist/authcert.h"
@@ -2684,6 +2685,7 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   const unsigned B_GZIP = 1u << GZIP_METHOD;
   const unsigned B_LZMA = 1u << LZMA_METHOD;
   const unsigned B_ZSTD = 1u << ZSTD_METHOD;
+  const unsigned B_ZSTD_DICT = 1u << ZSTD_DICT_METHOD;
 
   unsigned encodings;
 
@@ -2718,6 +2720,15 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   encodings = parse_accept_encoding_header("x-zstd,deflate,x-tor-lzma,gzip");
   tt_uint_op(B_NONE|B_ZLIB|B_ZSTD|B_LZMA|B_GZIP, OP_EQ, encodings);
 
+  encodings = parse_accept_encoding_header(
+                              "x-tor-zstd-dict-" TOR_ZSTD_DICT_ID ", x-zstd");
+  tt_uint_op(B_NONE|B_ZSTD|B_ZSTD_DICT, OP_EQ, encodings);
+
+  /* A peer with some other dictionary gets plain zstd. */
+  encodings = parse_accept_encoding_header(
+                              "x-tor-zstd-dict-00000000, x-zstd");
+  tt_uint_op(B_NONE|B_ZSTD, OP_EQ, encodings);
+
  done:
   ;
 }
@@ -26,6 +26,7 @@
 #include "lib/pubsub/pubsub_connect.h"
 
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/connection_or.h"
 #include "core/or/crypt_path.h"
@@ -566,6 +567,65 @@ new_test_origin_circuit(bool has_opened,
     TO_CIRCUIT(origin_circ)->timestamp_created = circ_start_time;
     origin_circ->cpath->state = CPATH_STATE_CLOSED;
   }
+  /* We set the state and timestamp_began directly. */
+  circuit_update_expiry_index(origin_circ);
 
   return origin_circ;
 }
+
+smartlist_t *test_cpuworker_jobs = NULL;
+
+static unsigned int
+mock_cpuworker_get_n_threads(void)
+{
+  return 2;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) priority;
+
+  test_cpuworker_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->fn = fn;
+  job->reply_fn = reply_fn;
+  job->arg = arg;
+  smartlist_add(test_cpuworker_jobs, job);
+  /* Any non NULL value will do, the caller only checks for failure. */
+  return (workqueue_entry_t *) job;
+}
+
+/** Pretend that we have cpuworkers. Work queued to them is kept in
+ * test_cpuworker_jobs until helper_run_cpuworker_job() runs it. */
+void
+helper_mock_cpuworkers(void)
+{
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  test_cpuworker_jobs = smartlist_new();
+}
+
+/** Undo helper_mock_cpuworkers(), forgetting any job that wasn't run. */
+void
+helper_unmock_cpuworkers(void)
+{
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  if (test_cpuworker_jobs) {
+    SMARTLIST_FOREACH(test_cpuworker_jobs, test_cpuworker_job_t *, job,
+                      tor_free(job));
+    smartlist_free(test_cpuworker_jobs);
+  }
+}
+
+/** Run the given cpuworker job, as a worker thread then as the main thread
+ * once it replies. */
+void
+helper_run_cpuworker_job(test_cpuworker_job_t *job)
+{
+  job->fn(NULL, job->arg);
+  job->reply_fn(job->arg);
+}
@@ -7,6 +7,7 @@
 #define BUFFERS_PRIVATE
 
 #include "core/or/or.h"
+#include "lib/evloop/workqueue.h"
 #include "tinytest.h"
 
 const char *get_yesterday_date_str(void);
@@ -47,5 +48,19 @@ origin_circuit_t *new_test_origin_circuit(bool has_opened,
                                           int path_len,
                                           extend_info_t **ei_list);
 
+/** Work that the fake cpuworkers were asked to do. */
+typedef struct test_cpuworker_job_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} test_cpuworker_job_t;
+
+/** Jobs queued to the fake cpuworkers, in order. */
+extern smartlist_t *test_cpuworker_jobs;
+
+void helper_mock_cpuworkers(void);
+void helper_unmock_cpuworkers(void);
+void helper_run_cpuworker_job(test_cpuworker_job_t *job);
+
 #endif /* !defined(TOR_TEST_HELPERS_H) */
 
@@ -23,6 +23,7 @@
 #include "core/or/channel.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/binascii.h"
 
 #include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
@@ -58,7 +59,7 @@ test_directory(void *arg)
   int ret;
   size_t oom_size;
   char *desc1_str = NULL;
-  const char *desc_out;
+  char *desc_out = NULL;
   ed25519_keypair_t signing_kp1;
   hs_descriptor_t *desc1 = NULL;
 
@@ -88,6 +89,7 @@ test_directory(void *arg)
     ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, desc1_str);
+    tor_free(desc_out);
     /* Tell our OOM to run and to at least remove a byte which will result in
      * removing the descriptor from our cache. */
     oom_size = hs_cache_handle_oom(1);
@@ -121,6 +123,7 @@ test_directory(void *arg)
     ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, desc1_str);
+    tor_free(desc_out);
     /* We should NOT find our zero lifetime desc in our cache. */
     ret = hs_cache_lookup_as_dir(3,
                                  helper_get_hsdir_query(desc_zero_lifetime),
@@ -157,6 +160,7 @@ test_directory(void *arg)
     tt_int_op(ret, OP_EQ, 0);
     ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
     tt_int_op(ret, OP_EQ, 1);
+    tor_free(desc_out);
     /* Bump revision counter. */
     desc1->plaintext_data.revision_counter++;
     ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &new_desc_str);
@@ -167,12 +171,63 @@ test_directory(void *arg)
     ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
     tt_int_op(ret, OP_EQ, 1);
     tt_str_op(desc_out, OP_EQ, new_desc_str);
+    tor_free(desc_out);
     tor_free(new_desc_str);
   }
 
  done:
   hs_descriptor_free(desc1);
   tor_free(desc1_str);
+  tor_free(desc_out);
+}
+
+/* Make sure the directory cache keeps a single copy of the superencrypted
+ * blob, and serves the descriptor exactly as it was uploaded. */
+static void
+test_dir_blob_elided(void *arg)
+{
+  int ret;
+  char *desc1_str = NULL, *desc_out = NULL;
+  ed25519_keypair_t signing_kp1;
+  hs_descriptor_t *desc1 = NULL;
+  const hs_cache_dir_descriptor_t *entry;
+  size_t b64_len;
+
+  (void) arg;
+
+  init_test();
+  ret = ed25519_keypair_generate(&signing_kp1, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc1 = hs_helper_build_hs_desc_with_ip(&signing_kp1);
+  tt_assert(desc1);
+  ret = hs_desc_encode_descriptor(desc1, &signing_kp1, NULL, &desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_store_as_dir(desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+
+  entry = lookup_v3_desc_as_dir(desc1->plaintext_data.blinded_pubkey.pubkey);
+  tt_assert(entry);
+  tt_assert(entry->blob_elided);
+  /* Only the base64 body of the superencrypted section is gone. */
+  b64_len = base64_encode_size(entry->plaintext_data->superencrypted_blob_size,
+                               BASE64_ENCODE_MULTILINE);
+  tt_u64_op(strlen(entry->encoded_desc) + b64_len, OP_EQ, strlen(desc1_str));
+  tt_mem_op(entry->encoded_desc, OP_EQ, desc1_str, entry->blob_offset);
+  /* Our accounting only counts the blob once. */
+  tt_u64_op(cache_get_dir_entry_size(entry), OP_LT,
+            sizeof(*entry) + strlen(desc1_str));
+  tt_u64_op(hs_cache_get_total_allocation(), OP_EQ,
+            cache_get_dir_entry_size(entry));
+
+  /* We serve the very same descriptor we got. */
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_str_op(desc_out, OP_EQ, desc1_str);
+
+ done:
+  hs_descriptor_free(desc1);
+  tor_free(desc1_str);
+  tor_free(desc_out);
 }
 
 static void
@@ -758,6 +813,8 @@ struct testcase_t hs_cache[] = {
   /* Encoding tests. */
   { "directory", test_directory, TT_FORK,
     NULL, NULL },
+  { "dir_blob_elided", test_dir_blob_elided, TT_FORK,
+    NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
   { "clean_oom_as_dir", test_clean_oom_as_dir, TT_FORK,
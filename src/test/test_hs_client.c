@@ -1447,6 +1447,121 @@ test_purge_ephemeral_client_auth(void *arg)
   UNMOCK(write_str_to_file);
 }
 
+static void
+mock_connection_mark_for_close_internal_(connection_t *conn,
+                                         int line, const char *file)
+{
+  (void) line;
+  (void) file;
+  conn->marked_for_close = 1;
+}
+
+/** Return a new pending descriptor request for the service <b>pk</b>, in the
+ * global connection list. */
+static dir_connection_t *
+helper_add_desc_request(const ed25519_public_key_t *pk)
+{
+  dir_connection_t *dir_conn = dir_connection_new(AF_INET);
+  dir_conn->hs_ident = tor_malloc_zero(sizeof(hs_ident_dir_conn_t));
+  TO_CONN(dir_conn)->purpose = DIR_PURPOSE_FETCH_HSDESC;
+  TO_CONN(dir_conn)->state = DIR_CONN_STATE_CLIENT_READING;
+  ed25519_pubkey_copy(&dir_conn->hs_ident->identity_pk, pk);
+  smartlist_add(get_connection_array(), TO_CONN(dir_conn));
+  return dir_conn;
+}
+
+static void
+test_desc_fetch_racing(void *arg)
+{
+  int ret;
+  char *desc_encoded = NULL;
+  ed25519_keypair_t service_kp;
+  hs_descriptor_t *desc = NULL;
+  hs_client_desc_fetch_t *fetch;
+  dir_connection_t *winner = NULL, *loser = NULL;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+  MOCK(connection_mark_for_close_internal_,
+       mock_connection_mark_for_close_internal_);
+  MOCK(get_options, mock_get_options);
+
+  parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                           &mock_ns.valid_after);
+  parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                           &mock_ns.fresh_until);
+  parse_rfc1123_time("Sat, 26 Oct 1985 16:00:00 UTC",
+                           &mock_ns.valid_until);
+
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(UINT64_C(1000000000) * 1000);
+
+  mocked_options.HSDescFetchParallelism = 2;
+  hs_init();
+
+  ret = ed25519_keypair_generate(&service_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&service_kp);
+  tt_assert(desc);
+  ret = hs_desc_encode_descriptor(desc, &service_kp, NULL, &desc_encoded);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* The first request starts the fetch. */
+  desc_fetch_note_launched(&service_kp.pubkey);
+  fetch = desc_fetch_lookup(&service_kp.pubkey);
+  tt_assert(fetch);
+  tt_u64_op(fetch->started_msec, OP_EQ, 1000 * 1000);
+
+  /* With no request pending, there is nothing to race. */
+  desc_fetch_hedge(fetch);
+  tt_u64_op(hs_client_stats_desc_fetch_hedged, OP_EQ, 0);
+
+  /* Two requests are pending, which is as many as we may have: hedging
+   * again does nothing. */
+  winner = helper_add_desc_request(&service_kp.pubkey);
+  loser = helper_add_desc_request(&service_kp.pubkey);
+  desc_fetch_hedge(fetch);
+  tt_u64_op(hs_client_stats_desc_fetch_hedged, OP_EQ, 0);
+
+  /* The descriptor arrives 700 msec after the first request. The other
+   * request is cancelled without triggering a refetch, and the fetch is
+   * done. */
+  monotime_set_mock_time_nsec(UINT64_C(1000000000) * 1000 +
+                              UINT64_C(700000000));
+  hs_client_dir_fetch_done(winner, "Reason", desc_encoded, 200);
+  tt_int_op(TO_CONN(winner)->purpose, OP_EQ, DIR_PURPOSE_HAS_FETCHED_HSDESC);
+  tt_int_op(TO_CONN(loser)->purpose, OP_EQ, DIR_PURPOSE_HAS_FETCHED_HSDESC);
+  tt_int_op(TO_CONN(loser)->marked_for_close, OP_EQ, 1);
+  tt_int_op(TO_CONN(winner)->marked_for_close, OP_EQ, 0);
+  tt_u64_op(hs_client_stats_desc_fetch_cancelled, OP_EQ, 1);
+  tt_ptr_op(desc_fetch_lookup(&service_kp.pubkey), OP_EQ, NULL);
+
+  /* It landed in the (500, 1000] msec bucket. */
+  tt_u64_op(hs_client_stats_desc_fetch_time_counts[1], OP_EQ, 0);
+  tt_u64_op(hs_client_stats_desc_fetch_time_counts[2], OP_EQ, 1);
+  tt_u64_op(hs_client_stats_desc_fetch_time_msec, OP_EQ, 700);
+
+ done:
+  if (winner) {
+    smartlist_remove(get_connection_array(), TO_CONN(winner));
+    connection_free_minimal(TO_CONN(winner));
+  }
+  if (loser) {
+    smartlist_remove(get_connection_array(), TO_CONN(loser));
+    connection_free_minimal(TO_CONN(loser));
+  }
+  hs_descriptor_free(desc);
+  tor_free(desc_encoded);
+  hs_free_all();
+  monotime_disable_test_mocking();
+
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+  UNMOCK(connection_mark_for_close_internal_);
+  UNMOCK(get_options);
+}
+
 struct testcase_t hs_client_tests[] = {
   { "e2e_rend_circuit_setup", test_e2e_rend_circuit_setup,
     TT_FORK, NULL, NULL },
@@ -1475,6 +1590,7 @@ struct testcase_t hs_client_tests[] = {
   /* Client authorization. */
   { "purge_ephemeral_client_auth", test_purge_ephemeral_client_auth, TT_FORK,
     NULL, NULL },
+  { "desc_fetch_racing", test_desc_fetch_racing, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -7,6 +7,7 @@
  */
 
 #define CONNECTION_EDGE_PRIVATE
+#define DIRCLIENT_PRIVATE
 #define HS_COMMON_PRIVATE
 #define HS_CLIENT_PRIVATE
 #define HS_SERVICE_PRIVATE
@@ -17,7 +18,9 @@
 #include "test/log_test_helpers.h"
 #include "test/hs_test_helpers.h"
 
+#include "core/or/congestion_control_common.h"
 #include "core/or/connection_edge.h"
+#include "core/or/protover.h"
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/hs/hs_common.h"
@@ -423,13 +426,96 @@ test_responsible_hsdirs(void *arg)
   UNMOCK(networkstatus_get_reasonably_live_consensus);
 }
 
+/** Test that a node's HSDir index is only rebuilt when its inputs change. */
+static void
+test_hsdir_index_reuse(void *arg)
+{
+  networkstatus_t *ns = NULL;
+  node_t *node = NULL;
+  char identity[DIGEST_LEN];
+  uint8_t fetch[DIGEST256_LEN];
+  uint32_t gen;
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+
+  ns = networkstatus_get_latest_consensus();
+  helper_add_hsdir_to_networkstatus(ns, 1, "igor", 1);
+  memset(identity, 1, sizeof(identity));
+  node = node_get_mutable_by_id(identity);
+  tt_assert(node);
+  /* The helper drops the routerinfo, so give the node its identity through
+   * the microdescriptor instead. */
+  node->md->ed25519_identity_pkey =
+    tor_malloc_zero(sizeof(ed25519_public_key_t));
+  memset(node->md->ed25519_identity_pkey, 1, ED25519_PUBKEY_LEN);
+
+  gen = node->hsdir_index_gen;
+  tt_uint_op(gen, OP_NE, 0);
+  memcpy(fetch, node->hsdir_index.fetch, sizeof(fetch));
+
+  /* Same consensus, same identity: the index is left alone. */
+  memset(&node->hsdir_index, 0, sizeof(node->hsdir_index));
+  node_set_hsdir_index(node, ns);
+  tt_uint_op(node->hsdir_index_gen, OP_EQ, gen);
+  tt_assert(fast_mem_is_zero((char *) node->hsdir_index.fetch,
+                             sizeof(node->hsdir_index.fetch)));
+
+  /* New shared random values: the index is rebuilt. */
+  ns->sr_info.current_srv = tor_malloc_zero(sizeof(sr_srv_t));
+  memset(ns->sr_info.current_srv->value, 'A', DIGEST256_LEN);
+  ns->sr_info.previous_srv = tor_malloc_zero(sizeof(sr_srv_t));
+  memset(ns->sr_info.previous_srv->value, 'B', DIGEST256_LEN);
+  node_set_hsdir_index(node, ns);
+  tt_uint_op(node->hsdir_index_gen, OP_NE, gen);
+  tt_assert(!fast_mem_is_zero((char *) node->hsdir_index.fetch,
+                              sizeof(node->hsdir_index.fetch)));
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, fetch, sizeof(fetch));
+  memcpy(fetch, node->hsdir_index.fetch, sizeof(fetch));
+  gen = node->hsdir_index_gen;
+
+  /* New identity with the same parameters: the index is rebuilt too. */
+  memset(node->md->ed25519_identity_pkey, 2, ED25519_PUBKEY_LEN);
+  node_set_hsdir_index(node, ns);
+  tt_uint_op(node->hsdir_index_gen, OP_EQ, gen);
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, fetch, sizeof(fetch));
+
+ done:
+  if (node && node->md)
+    tor_free(node->md->ed25519_identity_pkey);
+  SMARTLIST_FOREACH(ns->routerstatus_list,
+                    routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(mock_ns);
+  cleanup_nodelist();
+
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+}
+
+static int mock_directory_initiate_request_calls = 0;
+
+/** Copy of the payload of the last directory request. */
+static char *mock_directory_initiate_request_payload = NULL;
+
 static void
 mock_directory_initiate_request(directory_request_t *req)
 {
-  (void)req;
+  mock_directory_initiate_request_calls++;
+  tor_free(mock_directory_initiate_request_payload);
+  if (req->payload) {
+    mock_directory_initiate_request_payload =
+      tor_memdup_nulterm(req->payload, req->payload_len);
+  }
   return;
 }
 
+static int mock_hs_desc_encode_descriptor_calls = 0;
+
 static int
 mock_hs_desc_encode_descriptor(const hs_descriptor_t *desc,
                                const ed25519_keypair_t *signing_kp,
@@ -440,6 +526,7 @@ mock_hs_desc_encode_descriptor(const hs_descriptor_t *desc,
   (void)signing_kp;
   (void)descriptor_cookie;
 
+  mock_hs_desc_encode_descriptor_calls++;
   tor_asprintf(encoded_out, "lulu");
   return 0;
 }
@@ -532,9 +619,12 @@ test_desc_reupload_logic(void *arg)
   }
 
   /* Now let's upload our desc to all hsdirs */
+  mock_hs_desc_encode_descriptor_calls = 0;
   upload_descriptor_to_all(service, desc);
   /* Check that previous hsdirs were populated */
   tt_int_op(smartlist_len(desc->previous_hsdirs), OP_EQ, 6);
+  /* The descriptor was encoded once for all the HSDirs. */
+  tt_int_op(mock_hs_desc_encode_descriptor_calls, OP_EQ, 1);
 
   /* Poison next upload time so that we can see if it was changed by
    * router_dir_info_changed(). No changes in hash ring so far, so the upload
@@ -606,7 +696,131 @@ test_desc_reupload_logic(void *arg)
   upload_descriptor_to_all(service, desc);
   tt_int_op(smartlist_len(desc->previous_hsdirs), OP_EQ, 6);
 
+  /* With cpuworkers, the descriptor is encoded on a worker thread and only
+   * uploaded once the worker replies. */
+  helper_mock_cpuworkers();
+  mock_directory_initiate_request_calls = 0;
+  mock_hs_desc_encode_descriptor_calls = 0;
+  upload_descriptor_to_all(service, desc);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 1);
+  tt_int_op(mock_hs_desc_encode_descriptor_calls, OP_EQ, 0);
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 0);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 0));
+  tt_int_op(mock_hs_desc_encode_descriptor_calls, OP_EQ, 1);
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 6);
+
+  /* A worker that replies after a newer upload started is ignored. */
+  mock_directory_initiate_request_calls = 0;
+  upload_descriptor_to_all(service, desc);
+  upload_descriptor_to_all(service, desc);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 3);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 1));
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 0);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 2));
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 6);
+
  done:
+  helper_unmock_cpuworkers();
+  SMARTLIST_FOREACH(ns->routerstatus_list,
+                    routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_clear(ns->routerstatus_list);
+  if (service) {
+    remove_service(get_hs_service_map(), service);
+    hs_service_free(service);
+  }
+  networkstatus_vote_free(ns);
+  cleanup_nodelist();
+  hs_free_all();
+}
+
+/** Test that a cpuworker encodes a descriptor that decodes, with the flow
+ * control values that we had when we queued it. */
+static void
+test_desc_encode_offload(void *arg)
+{
+  networkstatus_t *ns = NULL;
+  hs_service_t *service = NULL;
+  hs_service_descriptor_t *desc = NULL;
+  hs_descriptor_t *decoded = NULL;
+  char *flow_control_pv = NULL;
+  uint8_t sendme_inc = congestion_control_sendme_inc();
+
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_reasonably_live_consensus,
+       mock_networkstatus_get_reasonably_live_consensus);
+  MOCK(router_have_minimum_dir_info,
+       mock_router_have_minimum_dir_info);
+  MOCK(get_or_state,
+       get_or_state_replacement);
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(directory_initiate_request,
+       mock_directory_initiate_request);
+  helper_mock_cpuworkers();
+
+  ns = networkstatus_get_latest_consensus();
+  helper_add_hsdir_to_networkstatus(ns, 1, "dingus", 1);
+  helper_add_hsdir_to_networkstatus(ns, 2, "clive", 1);
+
+  service = tor_malloc_zero(sizeof(hs_service_t));
+  ed25519_secret_key_generate(&service->keys.identity_sk, 0);
+  ed25519_public_key_generate(&service->keys.identity_pk,
+                              &service->keys.identity_sk);
+  hs_build_address(&service->keys.identity_pk, HS_VERSION_THREE,
+                   service->onion_address);
+  register_service(get_hs_service_map(), service);
+
+  desc = service_descriptor_new();
+  ed25519_keypair_generate(&desc->signing_kp, 0);
+  hs_descriptor_free(desc->desc);
+  desc->desc = hs_helper_build_hs_desc_with_ip(&desc->signing_kp);
+  tt_assert(desc->desc);
+  service->desc_current = desc;
+
+  /* Whatever the descriptor said, it advertises our flow control settings
+   * as they are when we queue it. */
+  tor_free(desc->desc->encrypted_data.flow_control_pv);
+  desc->desc->encrypted_data.sendme_inc = 0;
+  tt_assert(congestion_control_enabled());
+  tor_asprintf(&flow_control_pv, "FlowCtrl=%s",
+               protover_get_supported(PRT_FLOWCTRL));
+
+  mock_directory_initiate_request_calls = 0;
+  upload_descriptor_to_all(service, desc);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 1);
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 0);
+
+  /* What the worker encodes doesn't change with the consensus, or the
+   * service's descriptor, after the job was queued. */
+  cc_sendme_inc = sendme_inc + 1;
+  tor_free(desc->desc->encrypted_data.flow_control_pv);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 0));
+  tt_int_op(mock_directory_initiate_request_calls, OP_EQ, 2);
+  tt_assert(mock_directory_initiate_request_payload);
+
+  tt_int_op(hs_desc_decode_descriptor(mock_directory_initiate_request_payload,
+                                      &desc->desc->subcredential, NULL,
+                                      &decoded), OP_EQ, HS_DESC_DECODE_OK);
+  tt_str_op(decoded->encrypted_data.flow_control_pv, OP_EQ, flow_control_pv);
+  tt_int_op(decoded->encrypted_data.sendme_inc, OP_EQ, sendme_inc);
+  tt_int_op(smartlist_len(decoded->encrypted_data.intro_points), OP_EQ,
+            smartlist_len(desc->desc->encrypted_data.intro_points));
+
+ done:
+  helper_unmock_cpuworkers();
+  UNMOCK(networkstatus_get_reasonably_live_consensus);
+  UNMOCK(router_have_minimum_dir_info);
+  UNMOCK(get_or_state);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(directory_initiate_request);
+
+  cc_sendme_inc = sendme_inc;
+  hs_descriptor_free(decoded);
+  tor_free(flow_control_pv);
+  tor_free(mock_directory_initiate_request_payload);
   SMARTLIST_FOREACH(ns->routerstatus_list,
                     routerstatus_t *, rs, routerstatus_free(rs));
   smartlist_clear(ns->routerstatus_list);
@@ -1928,8 +2142,12 @@ struct testcase_t hs_common_tests[] = {
     TT_FORK, NULL, NULL },
   { "responsible_hsdirs", test_responsible_hsdirs, TT_FORK,
     NULL, NULL },
+  { "hsdir_index_reuse", test_hsdir_index_reuse, TT_FORK,
+    NULL, NULL },
   { "desc_reupload_logic", test_desc_reupload_logic, TT_FORK,
     NULL, NULL },
+  { "desc_encode_offload", test_desc_encode_offload, TT_FORK,
+    NULL, NULL },
   { "disaster_srv", test_disaster_srv, TT_FORK,
     NULL, NULL },
   { "hid_serv_request_tracker", test_hid_serv_request_tracker, TT_FORK,
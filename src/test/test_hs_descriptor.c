@@ -238,6 +238,48 @@ test_encode_descriptor(void *arg)
   hs_descriptor_free(desc);
 }
 
+static void
+test_dup_descriptor(void *arg)
+{
+  int ret;
+  char *encoded = NULL;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL, *dup = NULL, *decoded = NULL;
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+
+  dup = hs_descriptor_dup(desc);
+  tt_assert(dup);
+  hs_helper_desc_equal(desc, dup);
+  /* Nothing is shared between the two. */
+  tt_ptr_op(dup->plaintext_data.signing_key_cert, OP_NE,
+            desc->plaintext_data.signing_key_cert);
+  tt_ptr_op(dup->encrypted_data.intro_points, OP_NE,
+            desc->encrypted_data.intro_points);
+  tt_ptr_op(smartlist_get(dup->encrypted_data.intro_points, 0), OP_NE,
+            smartlist_get(desc->encrypted_data.intro_points, 0));
+
+  /* The copy outlives the original, and encodes just the same. */
+  hs_descriptor_free(desc);
+  ret = hs_desc_encode_descriptor(dup, &signing_kp, NULL, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_assert(encoded);
+  ret = hs_desc_decode_descriptor(encoded, &dup->subcredential, NULL,
+                                  &decoded);
+  tt_int_op(ret, OP_EQ, HS_DESC_DECODE_OK);
+  hs_helper_desc_equal(dup, decoded);
+
+ done:
+  tor_free(encoded);
+  hs_descriptor_free(desc);
+  hs_descriptor_free(dup);
+  hs_descriptor_free(decoded);
+}
+
 static void
 test_decode_descriptor(void *arg)
 {
@@ -948,6 +990,8 @@ struct testcase_t hs_descriptor[] = {
     NULL, NULL },
   { "descriptor_padding", test_descriptor_padding, TT_FORK,
     NULL, NULL },
+  { "dup_descriptor", test_dup_descriptor, TT_FORK,
+    NULL, NULL },
 
   /* Decoding tests. */
   { "decode_descriptor", test_decode_descriptor, TT_FORK,
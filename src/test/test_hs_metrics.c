@@ -94,9 +94,71 @@ test_metrics(void *arg)
   hs_free_all();
 }
 
+static void
+test_replay_cache_metrics(void *arg)
+{
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  const smartlist_t *entries;
+  const metrics_store_entry_t *entry;
+  size_t n_bytes;
+
+  (void) arg;
+
+  hs_init();
+
+  service = hs_service_new(get_options());
+  tt_assert(service);
+  service->config.version = HS_VERSION_THREE;
+  ed25519_secret_key_generate(&service->keys.identity_sk, 0);
+  ed25519_public_key_generate(&service->keys.identity_pk,
+                              &service->keys.identity_sk);
+  service->desc_current = service_descriptor_new();
+  register_service(get_hs_service_map(), service);
+
+  ip = service_intro_point_new(NULL);
+  tt_assert(ip);
+  service_intro_point_add(service->desc_current->intro_points.map, ip);
+
+  /* Two digests for the intro point, and one for the rendezvous cookies. */
+  replaycache_add_and_test(ip->replay_cache, "foo", 3);
+  replaycache_add_and_test(ip->replay_cache, "bar", 3);
+  replaycache_add_and_test(service->state.replay_cache_rend_cookie,
+                           "foo", 3);
+  n_bytes = replaycache_get_memory_usage(ip->replay_cache) +
+    replaycache_get_memory_usage(service->state.replay_cache_rend_cookie);
+
+  update_replay_cache_metrics(service);
+
+  entries = metrics_store_get_all(service->metrics.store,
+                                  "tor_hs_replay_cache_entries");
+  tt_assert(entries);
+  tt_int_op(smartlist_len(entries), OP_EQ, 1);
+  entry = smartlist_get(entries, 0);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ, 3);
+
+  entries = metrics_store_get_all(service->metrics.store,
+                                  "tor_hs_replay_cache_bytes");
+  tt_assert(entries);
+  tt_int_op(smartlist_len(entries), OP_EQ, 1);
+  entry = smartlist_get(entries, 0);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ, n_bytes);
+
+  /* The gauges follow the caches, they don't add up. */
+  service_intro_point_remove(service, ip);
+  service_intro_point_free(ip);
+  update_replay_cache_metrics(service);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ,
+     replaycache_get_memory_usage(service->state.replay_cache_rend_cookie));
+
+ done:
+  hs_free_all();
+}
+
 struct testcase_t hs_metrics_tests[] = {
 
   { "metrics", test_metrics, TT_FORK, NULL, NULL },
+  { "replay_cache", test_replay_cache_metrics, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -23,9 +23,11 @@
 #include "core/or/relay.h"
 #include "feature/hs/hs_cell.h"
 #include "feature/hs/hs_circuit.h"
+#include "feature/hs/hs_common.h"
 #include "feature/hs/hs_metrics.h"
 #include "feature/hs/hs_pow.h"
 #include "feature/hs/hs_service.h"
+#include "feature/hs_common/replaycache.h"
 #include "feature/nodelist/nodelist.h"
 
 #include "core/or/crypt_path_st.h"
@@ -37,6 +39,7 @@
 
 static int test_rend_launch_count;
 static uint32_t test_rend_launch_expect_effort;
+static uint8_t test_rend_launch_cookie[HS_REND_COOKIE_LEN];
 
 static void
 mock_launch_rendezvous_point_circuit(const hs_service_t *service,
@@ -52,6 +55,8 @@ mock_launch_rendezvous_point_circuit(const hs_service_t *service,
   (void) now;
 
   tt_int_op(test_rend_launch_expect_effort, OP_EQ, rdv_data->pow_effort);
+  memcpy(test_rend_launch_cookie, rdv_data->rendezvous_cookie,
+         sizeof(test_rend_launch_cookie));
   test_rend_launch_count++;
 
 done:
@@ -493,8 +498,184 @@ test_hs_pow_vectors(void *arg)
   hs_pow_remove_seed_from_cache(NULL);
 }
 
+/* Make sure that INTRODUCE2 cells that cpuworkers parse are acted upon in
+ * the order they arrived, whatever order the cpuworkers finish them in. */
+static void
+test_hs_pow_offload(void *arg)
+{
+  (void)arg;
+
+  testing_hs_pow_service_t *tsvc = testing_hs_pow_service_new();
+  hs_service_t *service = &tsvc->service;
+  uint8_t *first_payload = NULL;
+  size_t first_payload_len;
+  int retval;
+
+  hs_init();
+  helper_mock_cpuworkers();
+
+  /* The cpuworkers look the service and the intro point up again once they
+   * are done, so they have to be known. */
+  ed25519_keypair_t identity_kp;
+  ed25519_keypair_generate(&identity_kp, 0);
+  ed25519_pubkey_copy(&service->keys.identity_pk, &identity_kp.pubkey);
+  service->desc_current = service_descriptor_new();
+  digest256map_set(service->desc_current->intro_points.map,
+                   tsvc->service_ip->auth_key_kp.pubkey.pubkey,
+                   tsvc->service_ip);
+  service->state.replay_cache_rend_cookie = replaycache_new(60, 60);
+  tt_int_op(register_service(get_hs_service_map(), service), OP_EQ, 0);
+
+  test_rend_launch_count = 0;
+  test_rend_launch_expect_effort = 0;
+
+  /* Two requests, with different rendezvous cookies. */
+  memset(tsvc->rend_circ->hs_ident->rendezvous_cookie, 'a',
+         HS_REND_COOKIE_LEN);
+  tt_int_op(hs_circ_send_introduce1(tsvc->intro_circ, tsvc->rend_circ,
+                                    tsvc->desc_ip, &tsvc->subcred, NULL),
+            OP_EQ, 0);
+  first_payload = tor_memdup(relay_payload, relay_payload_len);
+  first_payload_len = relay_payload_len;
+  retval = hs_circ_handle_introduce2(service, tsvc->intro_circ,
+                                     tsvc->service_ip, &tsvc->subcred,
+                                     relay_payload, relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+
+  memset(tsvc->rend_circ->hs_ident->rendezvous_cookie, 'b',
+         HS_REND_COOKIE_LEN);
+  tt_int_op(hs_circ_send_introduce1(tsvc->intro_circ, tsvc->rend_circ,
+                                    tsvc->desc_ip, &tsvc->subcred, NULL),
+            OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, tsvc->intro_circ,
+                                     tsvc->service_ip, &tsvc->subcred,
+                                     relay_payload, relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 2);
+
+  /* A replay of the first cell never reaches the cpuworkers. */
+  retval = hs_circ_handle_introduce2(service, tsvc->intro_circ,
+                                     tsvc->service_ip, &tsvc->subcred,
+                                     first_payload, first_payload_len);
+  tt_int_op(retval, OP_EQ, -1);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 2);
+
+  /* The second cell is done first, but waits for the first one. */
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 1));
+  tt_int_op(test_rend_launch_count, OP_EQ, 0);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 0));
+  tt_int_op(test_rend_launch_count, OP_EQ, 2);
+  tt_mem_op(test_rend_launch_cookie, OP_EQ, "bbbbbbbbbbbbbbbbbbbb",
+            HS_REND_COOKIE_LEN);
+  tt_int_op(tsvc->service_ip->introduce2_count, OP_EQ, 2);
+
+  /* A new cell that reuses the first rendezvous cookie is dropped once
+   * parsed. */
+  memset(tsvc->rend_circ->hs_ident->rendezvous_cookie, 'a',
+         HS_REND_COOKIE_LEN);
+  curve25519_keypair_generate(
+                  &tsvc->rend_circ->hs_ident->rendezvous_client_kp, 0);
+  tt_int_op(hs_circ_send_introduce1(tsvc->intro_circ, tsvc->rend_circ,
+                                    tsvc->desc_ip, &tsvc->subcred, NULL),
+            OP_EQ, 0);
+  retval = hs_circ_handle_introduce2(service, tsvc->intro_circ,
+                                     tsvc->service_ip, &tsvc->subcred,
+                                     relay_payload, relay_payload_len);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 3);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 2));
+  tt_int_op(test_rend_launch_count, OP_EQ, 2);
+  tt_int_op(tsvc->service_ip->introduce2_count, OP_EQ, 2);
+
+ done:
+  helper_unmock_cpuworkers();
+  tor_free(first_payload);
+  remove_service(get_hs_service_map(), service);
+  if (service->desc_current) {
+    /* The intro point belongs to the testing service. */
+    digest256map_remove(service->desc_current->intro_points.map,
+                         tsvc->service_ip->auth_key_kp.pubkey.pubkey);
+    service_descriptor_free(service->desc_current);
+  }
+  replaycache_free(service->state.replay_cache_rend_cookie);
+  testing_hs_pow_service_free(tsvc);
+  hs_free_all();
+}
+
+/* Make sure that INTRODUCE2 cells that we parse on the main thread, because
+ * the cpuworkers hold as many cells as they can, are still acted upon after
+ * the cells that arrived before them. */
+static void
+test_hs_pow_offload_full(void *arg)
+{
+  (void)arg;
+
+  testing_hs_pow_service_t *tsvc = testing_hs_pow_service_new();
+  hs_service_t *service = &tsvc->service;
+  const int n_jobs = 2 * MAX_INTRO2_JOBS_PER_THREAD;
+  uint8_t *cookie = tsvc->rend_circ->hs_ident->rendezvous_cookie;
+  uint8_t last_cookie[HS_REND_COOKIE_LEN];
+  int retval, i;
+
+  hs_init();
+  helper_mock_cpuworkers();
+
+  ed25519_keypair_t identity_kp;
+  ed25519_keypair_generate(&identity_kp, 0);
+  ed25519_pubkey_copy(&service->keys.identity_pk, &identity_kp.pubkey);
+  service->desc_current = service_descriptor_new();
+  digest256map_set(service->desc_current->intro_points.map,
+                   tsvc->service_ip->auth_key_kp.pubkey.pubkey,
+                   tsvc->service_ip);
+  service->state.replay_cache_rend_cookie = replaycache_new(60, 60);
+  tt_int_op(register_service(get_hs_service_map(), service), OP_EQ, 0);
+
+  test_rend_launch_count = 0;
+  test_rend_launch_expect_effort = 0;
+
+  /* Fill the cpuworkers (we have two of them), then send one more cell. */
+  for (i = 0; i <= n_jobs; i++) {
+    memset(cookie, 0, HS_REND_COOKIE_LEN);
+    set_uint32(cookie, htonl(i));
+    tt_int_op(hs_circ_send_introduce1(tsvc->intro_circ, tsvc->rend_circ,
+                                      tsvc->desc_ip, &tsvc->subcred, NULL),
+              OP_EQ, 0);
+    retval = hs_circ_handle_introduce2(service, tsvc->intro_circ,
+                                       tsvc->service_ip, &tsvc->subcred,
+                                       relay_payload, relay_payload_len);
+    tt_int_op(retval, OP_EQ, 0);
+  }
+  memcpy(last_cookie, cookie, sizeof(last_cookie));
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, n_jobs);
+  /* The last cell was parsed right away, but waits for the others. */
+  tt_int_op(test_rend_launch_count, OP_EQ, 0);
+
+  for (i = n_jobs - 1; i > 0; i--) {
+    helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, i));
+  }
+  tt_int_op(test_rend_launch_count, OP_EQ, 0);
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 0));
+  tt_int_op(test_rend_launch_count, OP_EQ, n_jobs + 1);
+  tt_mem_op(test_rend_launch_cookie, OP_EQ, last_cookie, HS_REND_COOKIE_LEN);
+
+ done:
+  helper_unmock_cpuworkers();
+  remove_service(get_hs_service_map(), service);
+  if (service->desc_current) {
+    /* The intro point belongs to the testing service. */
+    digest256map_remove(service->desc_current->intro_points.map,
+                         tsvc->service_ip->auth_key_kp.pubkey.pubkey);
+    service_descriptor_free(service->desc_current);
+  }
+  replaycache_free(service->state.replay_cache_rend_cookie);
+  testing_hs_pow_service_free(tsvc);
+  hs_free_all();
+}
+
 struct testcase_t hs_pow_tests[] = {
   { "unsolicited", test_hs_pow_unsolicited, TT_FORK, NULL, NULL },
   { "vectors", test_hs_pow_vectors, TT_FORK, NULL, NULL },
+  { "offload", test_hs_pow_offload, TT_FORK, NULL, NULL },
+  { "offload_full", test_hs_pow_offload_full, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -6,6 +6,7 @@
  * \brief Slower (solve + verify) tests for service proof-of-work defenses.
  */
 
+#define HS_POW_PRIVATE
 #define HS_SERVICE_PRIVATE
 
 #include "lib/cc/compat_compiler.h"
@@ -267,7 +268,69 @@ test_hs_pow_vectors(void *arg)
   hs_pow_remove_seed_from_cache(NULL);
 }
 
+static void
+test_hs_pow_split(void *arg)
+{
+  (void)arg;
+
+  /* One of the vectors above: the solution is 2 nonces after the one we
+   * start from. */
+  const char *seed_hex =
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+  const char *service_blinded_id_hex =
+    "1111111111111111111111111111111111111111111111111111111111111111";
+  const char *start_hex = "34a20000000000000000000000000000";
+  const char *nonce_hex = "36a20000000000000000000000000000";
+  const char *sol_hex = "ca6899b91113aaf7536f28db42526bff";
+
+  uint8_t start[HS_POW_NONCE_LEN];
+  hs_pow_solution_t output;
+  hs_pow_solution_t solution = { 0 };
+  hs_pow_solver_inputs_t input = {
+    .effort = 31337,
+    .CompiledProofOfWorkHash = -1
+  };
+  hs_pow_solve_group_t *group = pow_solve_group_new(2);
+
+  tt_int_op(base16_decode((char*)input.service_blinded_id.pubkey,
+                          HS_POW_ID_LEN, service_blinded_id_hex,
+                          2 * HS_POW_ID_LEN),
+                          OP_EQ, HS_POW_ID_LEN);
+  tt_int_op(base16_decode((char*)input.seed, HS_POW_SEED_LEN,
+                          seed_hex, 2 * HS_POW_SEED_LEN),
+                          OP_EQ, HS_POW_SEED_LEN);
+  tt_int_op(base16_decode((char*)start, sizeof start,
+                          start_hex, 2 * sizeof start),
+                          OP_EQ, HS_POW_NONCE_LEN);
+  tt_int_op(base16_decode((char*)&solution.nonce, sizeof solution.nonce,
+                          nonce_hex, 2 * sizeof solution.nonce),
+                          OP_EQ, HS_POW_NONCE_LEN);
+  tt_int_op(base16_decode((char*)&solution.equix_solution,
+                          sizeof solution.equix_solution,
+                          sol_hex, 2 * sizeof solution.equix_solution),
+                          OP_EQ, HS_POW_EQX_SOL_LEN);
+
+  /* The first of two solvers tries every other nonce from the start, and
+   * finds the same solution as a single solver would. */
+  memset(&output, 0xaa, sizeof output);
+  tt_int_op(0, OP_EQ, hs_pow_solve_nonces(&input, start, 2, group, &output));
+  tt_mem_op(solution.nonce, OP_EQ, output.nonce, sizeof output.nonce);
+  tt_mem_op(&solution.equix_solution, OP_EQ, &output.equix_solution,
+            sizeof output.equix_solution);
+  tt_u64_op(atomic_counter_get(&group->found), OP_EQ, 1);
+  tt_u64_op(atomic_counter_get(&group->n_solutions), OP_GT, 0);
+
+  /* The second one gives up without trying, now that the first one found a
+   * solution. */
+  start[0]++;
+  tt_int_op(-1, OP_EQ, hs_pow_solve_nonces(&input, start, 2, group, &output));
+
+ done:
+  pow_solve_group_free(group);
+}
+
 struct testcase_t slow_hs_pow_tests[] = {
   { "vectors", test_hs_pow_vectors, 0, NULL, NULL },
+  { "split", test_hs_pow_split, 0, NULL, NULL },
   END_OF_TESTCASES
 };
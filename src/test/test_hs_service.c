@@ -1495,6 +1495,17 @@ test_rotate_descriptors(void *arg)
   tt_mem_op(service->desc_current, OP_EQ, desc_next, sizeof(*desc_next));
   tt_assert(service->desc_next == NULL);
 
+  /* The next descriptor gets built after a random delay of up to one voting
+   * interval, so that services don't all build theirs at once. */
+  tt_i64_op(service->state.next_desc_build_time, OP_GE, mock_ns.valid_after);
+  tt_i64_op(service->state.next_desc_build_time, OP_LT,
+            mock_ns.valid_after + (60 * 60));
+  if (service->state.next_desc_build_time > now) {
+    build_all_descriptors(now);
+    tt_assert(service->desc_next == NULL);
+    now = service->state.next_desc_build_time;
+  }
+
   build_all_descriptors(now);
   tt_mem_op(service->desc_current, OP_EQ, desc_next, sizeof(*desc_next));
   tt_u64_op(service->desc_current->time_period_num, OP_EQ,
@@ -1847,6 +1858,83 @@ test_build_descriptors(void *arg)
   hs_free_all();
 }
 
+/** Test that the scheduled events only look at the services that are due,
+ * and that services say when they are due again. */
+static void
+test_service_scheduler(void *arg)
+{
+  time_t now = approx_time();
+  hs_service_t *s1, *s2, *s3;
+  smartlist_t *due = NULL;
+
+  (void) arg;
+
+  hs_init();
+
+  s1 = helper_create_service();
+  s2 = helper_create_service();
+  s3 = helper_create_service();
+  s1->state.next_run_time = now + 5;
+  s3->state.next_run_time = now + 3;
+
+  /* A new service is due right away. */
+  due = pop_due_services(now);
+  tt_int_op(smartlist_len(due), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(due, 0), OP_EQ, s2);
+  tt_int_op(s2->state.sched_idx, OP_EQ, -1);
+  smartlist_free(due);
+
+  /* Something that happens to a service makes it due. */
+  hs_service_schedule_now(&s1->keys.identity_pk);
+  due = pop_due_services(now);
+  tt_int_op(smartlist_len(due), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(due, 0), OP_EQ, s1);
+  smartlist_free(due);
+
+  /* The others wait for their time. */
+  due = pop_due_services(now + 2);
+  tt_int_op(smartlist_len(due), OP_EQ, 0);
+  smartlist_free(due);
+  due = pop_due_services(now + 3);
+  tt_int_op(smartlist_len(due), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(due, 0), OP_EQ, s3);
+  smartlist_free(due);
+
+  /* A service that is missing its next descriptor, or intro points, needs us
+   * every second... */
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 1);
+  s2->desc_next = service_descriptor_new();
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 1);
+  /* ... else we come back when an upload is due... */
+  s2->state.next_rotation_time = now + 100;
+  s2->config.num_intro_points = 0;
+  s2->desc_current->next_upload_time = now + 100;
+  s2->desc_next->next_upload_time = now + 4;
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 4);
+  /* ... or after a while. */
+  s2->desc_next->next_upload_time = now + 100;
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ,
+            now + HS_SERVICE_IDLE_RUN_INTERVAL);
+  /* An upload that we couldn't do yet also needs us every second. */
+  s2->desc_next->next_upload_time = now;
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 1);
+
+  /* After a rotation, we wait out our delay before building the next
+   * descriptor. */
+  service_descriptor_free(s2->desc_next);
+  s2->state.next_desc_build_time = now + 7;
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 7);
+
+  /* We also come back to rotate the descriptors. */
+  s2->desc_next = service_descriptor_new();
+  s2->desc_next->next_upload_time = now + 100;
+  s2->state.next_rotation_time = now + 9;
+  tt_i64_op(service_get_next_run_time(s2, now), OP_EQ, now + 9);
+
+ done:
+  hs_free_all();
+}
+
 static void
 test_upload_descriptors(void *arg)
 {
@@ -2803,6 +2891,8 @@ struct testcase_t hs_service_tests[] = {
     NULL, NULL },
   { "build_descriptors", test_build_descriptors, TT_FORK,
     NULL, NULL },
+  { "service_scheduler", test_service_scheduler, TT_FORK,
+    NULL, NULL },
   { "upload_descriptors", test_upload_descriptors, TT_FORK,
     NULL, NULL },
   { "cannot_upload_descriptors", test_cannot_upload_descriptors, TT_FORK,
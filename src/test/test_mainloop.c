@@ -7,6 +7,7 @@
  */
 
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
 
@@ -30,6 +31,12 @@
 
 #include "app/main/subsysmgr.h"
 
+#include "core/or/connection_st.h"
+#include "core/or/or_connection_st.h"
+#include "feature/dircommon/dir_connection_st.h"
+#include "feature/dircommon/directory.h"
+#include "lib/evloop/timers.h"
+
 static const uint64_t BILLION = 1000000000;
 
 static void
@@ -369,6 +376,62 @@ test_mainloop_dormant_save_state(void *arg)
   tor_free(state);
 }
 
+static void
+test_mainloop_conn_housekeeping(void *arg)
+{
+  (void)arg;
+  const time_t now = 1543956575;
+  or_options_t *options = get_options_mutable();
+  dir_connection_t *dir_conn = dir_connection_new(AF_INET);
+  or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  connection_t *ctrl_conn = connection_new(CONN_TYPE_CONTROL, AF_INET);
+
+  timers_initialize();
+  update_approx_time(now);
+  connection_housekeeping_set_enabled(1);
+
+  /* A directory connection is due once it could have stalled. */
+  options->TestingDirConnectionMaxStall = 300;
+  dir_conn->base_.purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  dir_conn->base_.timestamp_last_read_allowed = now - 10;
+  tt_i64_op(run_connection_housekeeping(TO_CONN(dir_conn), now), OP_EQ,
+            now - 10 + 300 + 1);
+  tt_int_op(dir_conn->base_.marked_for_close, OP_EQ, 0);
+
+  /* Connections that get no housekeeping are never scheduled. */
+  tt_i64_op(run_connection_housekeeping(ctrl_conn, now), OP_EQ, 0);
+  connection_schedule_housekeeping(ctrl_conn, now + 5);
+  tt_ptr_op(ctrl_conn->housekeeping_timer, OP_EQ, NULL);
+  tt_i64_op(ctrl_conn->housekeeping_at, OP_EQ, 0);
+
+  /* Scheduling only ever moves the deadline earlier. */
+  connection_schedule_housekeeping(TO_CONN(dir_conn), now + 60);
+  tt_ptr_op(dir_conn->base_.housekeeping_timer, OP_NE, NULL);
+  tt_i64_op(dir_conn->base_.housekeeping_at, OP_EQ, now + 60);
+  connection_schedule_housekeeping(TO_CONN(dir_conn), now + 120);
+  tt_i64_op(dir_conn->base_.housekeeping_at, OP_EQ, now + 60);
+  connection_schedule_housekeeping(TO_CONN(dir_conn), now + 5);
+  tt_i64_op(dir_conn->base_.housekeeping_at, OP_EQ, now + 5);
+  /* Deadlines in the past run within the next second. */
+  connection_schedule_housekeeping(TO_CONN(dir_conn), now - 5);
+  tt_i64_op(dir_conn->base_.housekeeping_at, OP_EQ, now + 1);
+
+  /* An OR connection remembers when its outbuf stopped being empty. */
+  or_conn->timestamp_lastempty = 0;
+  connection_buf_add("x", 1, TO_CONN(or_conn));
+  tt_i64_op(or_conn->timestamp_lastempty, OP_EQ, now);
+  update_approx_time(now + 5);
+  connection_buf_add("y", 1, TO_CONN(or_conn));
+  tt_i64_op(or_conn->timestamp_lastempty, OP_EQ, now);
+
+ done:
+  connection_free_minimal(TO_CONN(dir_conn));
+  connection_free_minimal(TO_CONN(or_conn));
+  connection_free_minimal(ctrl_conn);
+  connection_housekeeping_set_enabled(0);
+  timers_shutdown();
+}
+
 #define MAINLOOP_TEST(name) \
   { #name, test_mainloop_## name , TT_FORK, NULL, NULL }
 
@@ -379,5 +442,6 @@ struct testcase_t mainloop_tests[] = {
   MAINLOOP_TEST(check_participation),
   MAINLOOP_TEST(dormant_load_state),
   MAINLOOP_TEST(dormant_save_state),
+  MAINLOOP_TEST(conn_housekeeping),
   END_OF_TESTCASES
 };
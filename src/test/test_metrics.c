@@ -361,6 +361,19 @@ test_store(void *arg)
     tt_uint_op(entry->u.histogram.buckets[i].value, OP_EQ, 0);
   }
 
+  /* Merge pre-aggregated observations: 2 at or below 10, 1 in (20, 3000] and
+   * 5 above the highest bucket. */
+  {
+    const uint64_t counts[] = { 2, 0, 1, 5 };
+    metrics_store_hist_entry_merge(entry, counts, ARRAY_LENGTH(counts), 9001);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 10), OP_EQ, 2);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 20), OP_EQ, 2);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 3000), OP_EQ, 3);
+    tt_int_op(metrics_store_hist_entry_get_count(entry), OP_EQ, 8);
+    tt_int_op(metrics_store_hist_entry_get_sum(entry), OP_EQ, 9001);
+    metrics_store_entry_reset(entry);
+  }
+
   /* tt_int_op assigns the third argument to a variable of type long, which
    * overflows on some platforms (e.g. on some 32-bit systems). We disable
    * these checks for those platforms. */
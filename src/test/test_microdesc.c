@@ -5,6 +5,7 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define MICRODESC_PRIVATE
 #include "app/config/config.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
@@ -22,6 +23,7 @@
 
 #include "test/test.h"
 #include "test/log_test_helpers.h"
+#include "test/test_helpers.h"
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -264,6 +266,241 @@ test_md_cache(void *data)
   tor_free(encoded_family);
 }
 
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL, *entries = NULL;
+  microdesc_t *md;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  char *cache_fn = NULL, *index_fn = NULL;
+  char *s = NULL, *idx = NULL, *idx2 = NULL;
+  size_t cache_len, idx_len, idx2_len;
+  off_t md2_off;
+  struct stat st;
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_index"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tor_asprintf(&index_fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->CacheDirectory);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+
+  /* The index describes where everything is in the cache file. */
+  s = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  cache_len = (size_t)st.st_size;
+  idx = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_assert(idx);
+  idx_len = (size_t)st.st_size;
+  entries = microdesc_cache_index_parse(idx, idx_len, cache_len);
+  tt_assert(entries);
+  tt_int_op(smartlist_len(entries), OP_EQ, 3);
+  SMARTLIST_FOREACH_BEGIN(entries, const md_index_entry_t *, ent) {
+    md = microdesc_cache_lookup_by_digest256(mc, ent->digest);
+    tt_assert(md);
+    tt_u64_op(ent->off, OP_EQ, md->off);
+    tt_uint_op(ent->bodylen, OP_EQ, md->bodylen);
+    tt_mem_op(s + ent->off, OP_EQ, md->body, md->bodylen);
+  } SMARTLIST_FOREACH_END(ent);
+  idx2 = microdesc_cache_index_encode(entries, cache_len, &idx2_len);
+  tt_size_op(idx2_len, OP_EQ, idx_len);
+  tt_mem_op(idx2, OP_EQ, idx, idx_len);
+
+  /* It doesn't describe any other file, and we notice damage. */
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_cache_index_parse(idx, idx_len, cache_len + 1));
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_cache_index_parse(idx, idx_len - 1, cache_len));
+  idx[idx_len - 1] ^= 1;
+  tt_ptr_op(NULL, OP_EQ,
+            microdesc_cache_index_parse(idx, idx_len, cache_len));
+
+  /* Reload from the index; microdescriptors get parsed on lookup. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md);
+  tt_int_op(md->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(md->family, OP_NE, NULL);
+  tt_assert(md->onion_curve25519_pkey);
+  md = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md);
+  md2_off = md->off;
+
+  /* Damage md2 without changing its length or its first line.  We trust
+   * the index at startup, so we only notice when we look md2 up. */
+  microdesc_free_all();
+  s[md2_off + 50] ^= 0x20;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(cache_fn, s, cache_len, 1));
+  setup_full_capture_of_logs(LOG_WARN);
+  mc = get_microdesc_cache();
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d2));
+  expect_log_msg_containing("did not match its digest");
+  teardown_capture_of_logs();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+  /* ... after which we stop trusting the index. */
+  tt_int_op(file_status(index_fn), OP_EQ, FN_NOENT);
+
+  /* Without an index, we parse the whole file, and write a new index. */
+  microdesc_free_all();
+  setup_full_capture_of_logs(LOG_WARN);
+  mc = get_microdesc_cache();
+  teardown_capture_of_logs();
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_int_op(file_status(index_fn), OP_EQ, FN_FILE);
+
+ done:
+  teardown_capture_of_logs();
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  if (entries)
+    SMARTLIST_FOREACH(entries, md_index_entry_t *, ent, tor_free(ent));
+  smartlist_free(entries);
+  smartlist_free(added);
+  tor_free(cache_fn);
+  tor_free(index_fn);
+  tor_free(s);
+  tor_free(idx);
+  tor_free(idx2);
+}
+
+/** Number of microdescriptors we need in the journal for a rebuild to be
+ * worth it. */
+#define N_REBUILD_MDS 64
+
+static void
+test_md_cache_rebuild_async(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc;
+  smartlist_t *added = NULL;
+  microdesc_t *mds[N_REBUILD_MDS], *late = NULL;
+  char *bodies[N_REBUILD_MDS];
+  char *cache_fn = NULL, *journal_fn = NULL;
+  char *s = NULL, *journal = NULL;
+  time_t now = time(NULL);
+  int i;
+  (void)data;
+
+  memset(bodies, 0, sizeof(bodies));
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_async"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tor_asprintf(&journal_fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->CacheDirectory);
+
+  helper_mock_cpuworkers();
+  mc = get_microdesc_cache();
+
+  /* Fill the journal with enough microdescriptors that a rebuild is worth
+   * doing even without force. */
+  for (i = 0; i < N_REBUILD_MDS; ++i) {
+    tor_asprintf(&bodies[i], "%sfamily node%d\n", test_md1, i);
+    added = microdescs_add_to_cache(mc, bodies[i], NULL, SAVED_NOWHERE, 0,
+                                    now, NULL);
+    tt_int_op(1, OP_EQ, smartlist_len(added));
+    mds[i] = smartlist_get(added, 0);
+    smartlist_free(added);
+    added = NULL;
+    tt_int_op(mds[i]->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  }
+
+  /* The new files are written on a cpuworker, and nothing changes until it
+   * replies. */
+  tt_int_op(microdesc_cache_rebuild(mc, 0), OP_EQ, 0);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 1);
+  tt_int_op(mds[0]->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  /* We don't start another rebuild while that one is pending. */
+  tt_int_op(microdesc_cache_rebuild(mc, 0), OP_EQ, 0);
+  tt_int_op(smartlist_len(test_cpuworker_jobs), OP_EQ, 1);
+
+  /* A microdescriptor that arrives in the meantime goes to the journal. */
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  late = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(late->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  helper_run_cpuworker_job(smartlist_get(test_cpuworker_jobs, 0));
+
+  /* Everything the job knew about now lives in the new cache file... */
+  s = read_file_to_str(cache_fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  for (i = 0; i < N_REBUILD_MDS; ++i) {
+    tt_int_op(mds[i]->saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_int_op(mds[i]->bodylen, OP_EQ, strlen(bodies[i]));
+    tt_mem_op(mds[i]->body, OP_EQ, bodies[i], mds[i]->bodylen);
+    tt_mem_op(s + mds[i]->off, OP_EQ, bodies[i], mds[i]->bodylen);
+  }
+  tt_ptr_op(strstr(s, test_md2), OP_EQ, NULL);
+
+  /* ... and the late one is all that is left in the journal. */
+  tt_int_op(late->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_mem_op(late->body, OP_EQ, test_md2, strlen(test_md2));
+  journal = read_file_to_str(journal_fn, RFTS_BIN, NULL);
+  tt_assert(journal);
+  tt_assert(!strcmpstart(journal, "@last-listed "));
+  tt_str_op(strchr(journal, '\n') + 1, OP_EQ, test_md2);
+
+ done:
+  helper_unmock_cpuworkers();
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  for (i = 0; i < N_REBUILD_MDS; ++i)
+    tor_free(bodies[i]);
+  tor_free(cache_fn);
+  tor_free(journal_fn);
+  tor_free(s);
+  tor_free(journal);
+}
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -983,6 +1220,9 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
+  { "cache_rebuild_async", test_md_cache_rebuild_async, TT_FORK,
+    NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "parse_id_ed25519", test_md_parse_id_ed25519, 0, NULL, NULL },
@@ -241,6 +241,83 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+/** Test the per-consensus selection table of the nodelist. */
+static void
+test_nodelist_sel_table(void *arg)
+{
+  routerstatus_t *rs[3];
+  routerstatus_t *rs_other = NULL;
+  networkstatus_t *ns;
+  const node_sel_entry_t *ent;
+  node_t *node;
+  int i;
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  for (i = 0; i < 3; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  rs[0]->has_bandwidth = 1;
+  rs[0]->bandwidth_kb = 1234;
+  rs[0]->is_v2_dir = 1;
+  rs[2]->has_bandwidth = 1;
+  rs[2]->bandwidth_kb = 20;
+  rs[2]->is_possible_guard = 1;
+  rs[2]->has_guardfraction = 1;
+  rs[2]->guardfraction_percentage = 30;
+
+  nodelist_set_consensus(ns);
+  tt_int_op(3, OP_EQ, smartlist_len(nodelist_get_list()));
+
+  node = node_get_mutable_by_id(rs[0]->identity_digest);
+  ent = nodelist_get_sel_entry(node);
+  tt_assert(ent);
+  tt_ptr_op(ent->rs, OP_EQ, rs[0]);
+  tt_uint_op(ent->flags, OP_EQ, NODE_SEL_HAS_BW|NODE_SEL_IS_DIR);
+  tt_uint_op(ent->bandwidth_kb, OP_EQ, 1234);
+
+  node = node_get_mutable_by_id(rs[1]->identity_digest);
+  ent = nodelist_get_sel_entry(node);
+  tt_assert(ent);
+  tt_uint_op(ent->flags, OP_EQ, 0);
+
+  node = node_get_mutable_by_id(rs[2]->identity_digest);
+  ent = nodelist_get_sel_entry(node);
+  tt_assert(ent);
+  tt_uint_op(ent->flags, OP_EQ, NODE_SEL_HAS_BW|NODE_SEL_HAS_GUARDFRACTION);
+  tt_uint_op(ent->bandwidth_kb, OP_EQ, 20);
+  tt_uint_op(ent->guardfraction_pct, OP_EQ, 30);
+
+  /* Once the node's routerstatus changes, the entry is stale and must not
+   * be used. */
+  rs_other = tor_memdup(rs[2], sizeof(*rs[2]));
+  node->rs = rs_other;
+  tt_ptr_op(nodelist_get_sel_entry(node), OP_EQ, NULL);
+  node->rs = rs[2];
+  tt_ptr_op(nodelist_get_sel_entry(node), OP_NE, NULL);
+
+  /* Same if the node isn't where the table expects it. */
+  node->nodelist_idx = 0;
+  tt_ptr_op(nodelist_get_sel_entry(node), OP_EQ, NULL);
+  node->nodelist_idx = 2;
+
+ done:
+  tor_free(rs_other);
+  nodelist_free_all();
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, r, tor_free(r));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+}
+
 static void
 test_nodelist_nodefamily(void *arg)
 {
@@ -1426,6 +1503,7 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(sel_table, TT_FORK),
   NODE(nodefamily, TT_FORK),
   NODE(nodefamily_parse_err, TT_FORK),
   NODE(nodefamily_lookup, TT_FORK),
@@ -16,7 +16,9 @@
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
 
 #define RESOLVE_ADDR_PRIVATE
 #include "feature/nodelist/dirlist.h"
@@ -374,11 +376,105 @@ test_find_addr_to_publish(void *arg)
   or_options_free(options);
 }
 
+static void
+test_relay_circ_queue_aqm(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  circuit_t *circ;
+  cell_queue_t queue;
+  networkstatus_t ns;
+  uint64_t n_blocked;
+  const uint64_t START_NSEC = UINT64_C(1000000000);
+#define AT_MSEC(ms) \
+  (monotime_coarse_set_mock_time_nsec(START_NSEC + (ms) * UINT64_C(1000000)),\
+   monotime_coarse_get_stamp())
+
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  memset(&ns, 0, sizeof(ns));
+  memset(&queue, 0, sizeof(queue));
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circ = TO_CIRCUIT(orcirc);
+
+  /* Well above the low watermark so the AQM looks at the sojourn time. */
+  queue.n = 100;
+  n_blocked = stats_n_circ_queue_aqm_blocked;
+
+  /* Disabled by default: nothing happens even with a very long sojourn. */
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(0), 1000);
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(500), 1000);
+  tt_uint_op(circ->n_chan_cells_aqm_above_since, OP_EQ, 0);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 0);
+
+  /* Enable it with a 10 msec target and a 100 msec interval. */
+  ns.net_params = smartlist_new();
+  smartlist_add(ns.net_params, (char *) "circ_queue_aqm_enabled=1");
+  smartlist_add(ns.net_params, (char *) "circ_queue_aqm_target_ms=10");
+  smartlist_add(ns.net_params, (char *) "circ_queue_aqm_interval_ms=100");
+  relay_consensus_has_changed(&ns);
+
+  /* First cell above target starts the interval. */
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(1000), 50);
+  tt_uint_op(circ->n_chan_cells_aqm_above_since, OP_NE, 0);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 0);
+  /* Still above target but not for a full interval. */
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(1050), 50);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 0);
+  /* A full interval above target blocks the circuit. */
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(1150), 50);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 1);
+  tt_uint_op(circ->circuit_aqm_blocked_on_n_chan, OP_EQ, 1);
+  tt_u64_op(stats_n_circ_queue_aqm_blocked, OP_EQ, n_blocked + 1);
+  /* The other direction is untouched. */
+  tt_uint_op(circ->circuit_blocked_on_p_chan, OP_EQ, 0);
+  tt_uint_op(circ->p_chan_cells_aqm_above_since, OP_EQ, 0);
+
+  /* A cell below target resets the state and unblocks. */
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(1200), 2);
+  tt_uint_op(circ->n_chan_cells_aqm_above_since, OP_EQ, 0);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 0);
+  tt_uint_op(circ->circuit_aqm_blocked_on_n_chan, OP_EQ, 0);
+
+  /* A dip below target restarts the interval. */
+  circuit_queue_aqm_note_sojourn(circ, pchan, &queue, AT_MSEC(2000), 50);
+  circuit_queue_aqm_note_sojourn(circ, pchan, &queue, AT_MSEC(2080), 2);
+  circuit_queue_aqm_note_sojourn(circ, pchan, &queue, AT_MSEC(2090), 50);
+  circuit_queue_aqm_note_sojourn(circ, pchan, &queue, AT_MSEC(2150), 50);
+  tt_uint_op(circ->circuit_blocked_on_p_chan, OP_EQ, 0);
+  circuit_queue_aqm_note_sojourn(circ, pchan, &queue, AT_MSEC(2190), 50);
+  tt_uint_op(circ->circuit_blocked_on_p_chan, OP_EQ, 1);
+  tt_uint_op(circ->circuit_aqm_blocked_on_p_chan, OP_EQ, 1);
+
+  /* A block from the high watermark is never lifted by the AQM. */
+  circ->circuit_blocked_on_n_chan = 1;
+  circuit_queue_aqm_note_sojourn(circ, nchan, &queue, AT_MSEC(3000), 2);
+  tt_uint_op(circ->circuit_blocked_on_n_chan, OP_EQ, 1);
+
+ done:
+  /* Back to defaults for the other tests. */
+  smartlist_clear(ns.net_params);
+  relay_consensus_has_changed(&ns);
+  smartlist_free(ns.net_params);
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  monotime_disable_test_mocking();
+#undef AT_MSEC
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "circ_queue_aqm", test_relay_circ_queue_aqm,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
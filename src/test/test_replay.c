@@ -55,11 +55,19 @@ test_replaycache_badalloc(void *arg)
   (void)arg;
   r = replaycache_new(-600, 300);
   tt_ptr_op(r, OP_EQ, NULL);
-  /* Negative interval should get adjusted to zero */
+  /* Negative interval should get adjusted to zero, which picks a default
+   * bucket width */
   r = replaycache_new(600, -300);
   tt_ptr_op(r, OP_NE, NULL);
-  tt_int_op(r->scrub_interval,OP_EQ, 0);
+  tt_int_op(r->bucket_width,OP_EQ, 600 / (REPLAYCACHE_DEFAULT_BUCKETS - 1));
   replaycache_free(r);
+  /* Tag sizes out of range, or not in bytes, should fail */
+  r = replaycache_new_with_tag_bits(600, 300, 24);
+  tt_ptr_op(r, OP_EQ, NULL);
+  r = replaycache_new_with_tag_bits(600, 300, 72);
+  tt_ptr_op(r, OP_EQ, NULL);
+  r = replaycache_new_with_tag_bits(600, 300, 33);
+  tt_ptr_op(r, OP_EQ, NULL);
   /* Negative horizon and negative interval should still fail */
   r = replaycache_new(-600, -300);
   tt_ptr_op(r, OP_EQ, NULL);
@@ -277,7 +285,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_get_n_entries(r),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +379,108 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_generations(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result;
+  char buf[32];
+
+  (void)arg;
+  r = replaycache_new(600, 200);
+  tt_ptr_op(r, OP_NE, NULL);
+  tt_int_op(r->n_buckets, OP_EQ, 4);
+
+  time_t elapsed = 0;
+
+  /* Fill one bucket every 200 seconds or so. */
+  for (int i = 0; i < 3; i++) {
+    tor_snprintf(buf, sizeof(buf), "item %d", i);
+    result = replaycache_add_and_test_internal(1000 + 201 * i, r, buf,
+                                               strlen(buf), NULL);
+    tt_int_op(result, OP_EQ, 0);
+  }
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 3);
+  tt_int_op(r->cur_bucket, OP_EQ, 2);
+
+  /* Still within the horizon. The hit is refreshed into the current
+   * bucket. */
+  result = replaycache_add_and_test_internal(1500, r, "item 0", 6, &elapsed);
+  tt_int_op(result, OP_EQ, 1);
+  tt_int_op(elapsed, OP_EQ, 500);
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 4);
+
+  /* The first bucket ages out whole, and a new one is started. */
+  result = replaycache_add_and_test_internal(1603, r, "item 3", 6, NULL);
+  tt_int_op(result, OP_EQ, 0);
+  tt_int_op(r->cur_bucket, OP_EQ, 3);
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 4);
+
+  /* Then the second one, and we wrap around to recycle the first. */
+  result = replaycache_add_and_test_internal(1805, r, "item 4", 6, NULL);
+  tt_int_op(result, OP_EQ, 0);
+  tt_int_op(r->cur_bucket, OP_EQ, 0);
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 4);
+  result = replaycache_add_and_test_internal(1805, r, "item 1", 6, NULL);
+  tt_int_op(result, OP_EQ, 0);
+  /* "item 0" was refreshed at 1500 so it's still there. */
+  result = replaycache_add_and_test_internal(1805, r, "item 0", 6, NULL);
+  tt_int_op(result, OP_EQ, 1);
+
+  /* Much later, everything ages out at once. */
+  replaycache_scrub_if_needed_internal(5000, r);
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 0);
+  tt_int_op(replaycache_get_memory_usage(r), OP_EQ, sizeof(*r));
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
+static void
+test_replaycache_tag_bits(void *arg)
+{
+  replaycache_t *r64 = NULL, *r32 = NULL;
+  char buf[32];
+  size_t mem64, mem32;
+
+  (void)arg;
+  r64 = replaycache_new(0, 0);
+  r32 = replaycache_new_with_tag_bits(0, 0, 32);
+  tt_ptr_op(r64, OP_NE, NULL);
+  tt_ptr_op(r32, OP_NE, NULL);
+  tt_int_op(replaycache_get_memory_usage(r64), OP_EQ, sizeof(*r64));
+
+  /* Grow the tables well past their first size. */
+  for (int i = 0; i < 1000; i++) {
+    tor_snprintf(buf, sizeof(buf), "item %d", i);
+    tt_int_op(replaycache_add_and_test_internal(1000, r64, buf, strlen(buf),
+                                                NULL), OP_EQ, 0);
+    tt_int_op(replaycache_add_and_test_internal(1000, r32, buf, strlen(buf),
+                                                NULL), OP_EQ, 0);
+  }
+  for (int i = 0; i < 1000; i++) {
+    tor_snprintf(buf, sizeof(buf), "item %d", i);
+    tt_int_op(replaycache_add_and_test_internal(1001, r64, buf, strlen(buf),
+                                                NULL), OP_EQ, 1);
+    tt_int_op(replaycache_add_and_test_internal(1001, r32, buf, strlen(buf),
+                                                NULL), OP_EQ, 1);
+  }
+  tt_int_op(replaycache_get_n_entries(r64), OP_EQ, 1000);
+  tt_int_op(replaycache_get_n_entries(r32), OP_EQ, 1000);
+
+  /* Tables are at most half full, and a 32-bit tag takes half the room. */
+  mem64 = replaycache_get_memory_usage(r64) - sizeof(*r64);
+  mem32 = replaycache_get_memory_usage(r32) - sizeof(*r32);
+  tt_u64_op(mem64, OP_EQ, 2048 * 8);
+  tt_u64_op(mem32, OP_EQ, 2048 * 4);
+
+ done:
+  replaycache_free(r64);
+  replaycache_free(r32);
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +496,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(generations),
+  REPLAYCACHE_LEGACY(tag_bits),
   END_OF_TESTCASES
 };
 
@@ -44,6 +44,9 @@
 #include "feature/nodelist/node_st.h"
 #include "app/config/or_state_st.h"
 #include "feature/nodelist/routerstatus_st.h"
+#include "feature/nodelist/desc_store_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerlist_st.h"
 
 #include "lib/encoding/confline.h"
 #include "lib/buf/buffers.h"
@@ -51,6 +54,15 @@
 #include "test/test.h"
 #include "test/test_dir_common.h"
 #include "test/log_test_helpers.h"
+#include "test/test_helpers.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef _WIN32
+/* For mkdir() */
+#include <direct.h>
+#endif
 
 static authority_cert_t *mock_cert;
 
@@ -769,6 +781,104 @@ test_warn_early_consensus(void *arg)
   tor_free(c);
 }
 
+/* NOP replacement for router_descriptor_is_older_than() */
+static int
+router_descriptor_is_older_than_nop(const routerinfo_t *router, int seconds)
+{
+  (void) router;
+  (void) seconds;
+  return 0;
+}
+
+static void
+test_routerlist_rebuild_store_snapshot(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  store_rebuild_job_t *job = NULL;
+  desc_store_t *store;
+  routerlist_t *rl;
+  const char *last;
+  char *fname = NULL, *contents = NULL;
+  routerinfo_t *late = NULL;
+  smartlist_t *early = NULL;
+  struct stat st;
+  (void) arg;
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("rebuild_store_snapshot"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+
+  MOCK(router_descriptor_is_older_than, router_descriptor_is_older_than_nop);
+  update_approx_time(1603981036);
+
+  /* Journal all but the last test descriptor, and take a snapshot. */
+  last = TEST_DESCRIPTORS;
+  while (strstr(last + 1, "\nrouter "))
+    last = strstr(last + 1, "\nrouter ") + 1;
+  tt_int_op(router_load_routers_from_string(TEST_DESCRIPTORS, last,
+                                            SAVED_IN_JOURNAL, NULL, 0, NULL),
+            OP_EQ, HELPER_NUMBER_OF_DESCRIPTORS - 1);
+  rl = router_get_routerlist();
+  store = &rl->desc_store;
+  early = smartlist_new();
+  smartlist_add_all(early, rl->routers);
+  job = store_rebuild_job_new(store);
+  tt_assert(job);
+
+  /* The last one arrives while the snapshot is being written. */
+  tt_int_op(router_load_routers_from_string(last, NULL, SAVED_IN_JOURNAL,
+                                            NULL, 0, NULL), OP_EQ, 1);
+  SMARTLIST_FOREACH(rl->routers, routerinfo_t *, ri,
+    if (!smartlist_contains(early, ri))
+      late = ri);
+  tt_assert(late);
+  tt_int_op(late->cache_info.saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  store_rebuild_job_write(job);
+  tt_int_op(router_store_install_rebuild(store, job), OP_EQ, 0);
+
+  /* Everything in the snapshot is now in the mapped store... */
+  tt_assert(store->mmap);
+  tt_size_op(store->store_len, OP_EQ, store->mmap->size);
+  SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+    if (ri == late)
+      continue;
+    tt_int_op(ri->cache_info.saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_ptr_op(ri->cache_info.signed_descriptor_body, OP_EQ, NULL);
+    tt_assert(!strcmpstart(signed_descriptor_get_body(&ri->cache_info),
+                           "router "));
+  } SMARTLIST_FOREACH_END(ri);
+
+  /* ... and the journal holds only the late arrival. */
+  tt_int_op(late->cache_info.saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(late->cache_info.saved_offset, OP_EQ, 0);
+  fname = get_cachedir_fname_suffix("cached-descriptors", ".new");
+  contents = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(contents);
+  tt_size_op(store->journal_len, OP_EQ, (size_t)st.st_size);
+  tt_size_op(store->journal_len, OP_EQ,
+             late->cache_info.signed_descriptor_len +
+             late->cache_info.annotations_len);
+  tt_mem_op(contents, OP_EQ,
+            signed_descriptor_get_annotations(&late->cache_info),
+            store->journal_len);
+
+ done:
+  store_rebuild_job_free(job);
+  smartlist_free(early);
+  tor_free(fname);
+  tor_free(contents);
+  routerlist_free_all();
+  nodelist_free_all();
+  update_approx_time(0);
+  UNMOCK(router_descriptor_is_older_than);
+  tor_free(options->CacheDirectory);
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 #define ROUTER(name,flags) \
@@ -795,5 +905,6 @@ struct testcase_t routerlist_tests[] = {
   TIMELY("timely_consensus3", "690"),
   EARLY("early_consensus1", "689"),
   { "warn_early_consensus", test_warn_early_consensus, 0, NULL, NULL },
+  NODE(rebuild_store_snapshot, TT_FORK),
   END_OF_TESTCASES
 };
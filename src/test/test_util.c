@@ -2584,7 +2584,9 @@ test_util_compress_impl(compress_method_t method)
     tt_int_op(detect_compression_method(buf2, len1), OP_EQ, UNKNOWN_METHOD);
   } else {
     tt_int_op(len1, OP_LT, strlen(buf1));
-    tt_int_op(detect_compression_method(buf2, len1), OP_EQ, method);
+    /* Dictionary-compressed output is an ordinary zstd frame. */
+    tt_int_op(detect_compression_method(buf2, len1), OP_EQ,
+              method == ZSTD_DICT_METHOD ? ZSTD_METHOD : method);
   }
 
   tt_assert(!tor_uncompress(&buf3, &len2, buf2, len1, method, 1, LOG_INFO));
@@ -2612,7 +2614,7 @@ test_util_compress_impl(compress_method_t method)
   tor_free(buf3);
 
   size_t b1len = 1<<10;
-  if (method == ZSTD_METHOD) {
+  if (method == ZSTD_METHOD || method == ZSTD_DICT_METHOD) {
     // zstd needs a big input before it starts generating output that it
     // can partially decompress.
     b1len = 1<<18;
@@ -2753,6 +2755,193 @@ test_util_compress(void *arg)
   ;
 }
 
+/** Compress <b>in</b> with <b>state</b> in one go, and check that it
+ * decompresses back to <b>in</b> with <b>method</b>. */
+static void
+check_pooled_state_roundtrip(tor_compress_state_t *state,
+                             compress_method_t method, const char *in)
+{
+  char buf[1024], *out = NULL;
+  char *cp = buf;
+  const char *ccp = in;
+  size_t buf_len = sizeof(buf), in_len = strlen(in), out_len;
+
+  tt_int_op(tor_compress_process(state, &cp, &buf_len, &ccp, &in_len, 1),
+            OP_EQ, TOR_COMPRESS_DONE);
+  tt_int_op(in_len, OP_EQ, 0);
+  tt_int_op(tor_uncompress(&out, &out_len, buf, cp - buf, method, 1,
+                           LOG_WARN), OP_EQ, 0);
+  tt_str_op(out, OP_EQ, in);
+
+ done:
+  tor_free(out);
+}
+
+/** Run unit tests for the pool of reusable compression states. */
+static void
+test_util_compress_pool(void *arg)
+{
+  (void)arg;
+  compress_pool_stats_t stats;
+  tor_compress_state_t *states[10] = { NULL };
+  tor_compress_state_t *state = NULL, *first;
+  uint64_t n_reused, n_allocated;
+
+  tor_compress_pool_clear();
+  tor_compress_pool_get_stats(&stats);
+  tt_u64_op(stats.n_pooled, OP_EQ, 0);
+  tt_u64_op(stats.pooled_bytes, OP_EQ, 0);
+  n_reused = stats.n_reused;
+  n_allocated = stats.n_allocated;
+
+  /* A released state goes into the pool, and comes back reset. */
+  first = state = tor_compress_new(1, GZIP_METHOD, LOW_COMPRESSION);
+  tt_assert(state);
+  tor_compress_free(state);
+  tor_compress_pool_get_stats(&stats);
+  tt_u64_op(stats.n_allocated, OP_EQ, n_allocated + 1);
+  tt_u64_op(stats.n_pooled, OP_EQ, 1);
+  tt_u64_op(stats.pooled_bytes, OP_GT, 0);
+  tt_u64_op(tor_compress_get_total_allocation(), OP_GE, stats.pooled_bytes);
+
+  state = tor_compress_new(1, GZIP_METHOD, LOW_COMPRESSION);
+  tt_ptr_op(state, OP_EQ, first);
+  tor_compress_pool_get_stats(&stats);
+  tt_u64_op(stats.n_reused, OP_EQ, n_reused + 1);
+  tt_u64_op(stats.n_pooled, OP_EQ, 0);
+  tt_u64_op(stats.pooled_bytes, OP_EQ, 0);
+  check_pooled_state_roundtrip(state, GZIP_METHOD, "Hello pool");
+  tor_compress_free(state);
+
+  /* Once used, it gets reset before we hand it out again. */
+  state = tor_compress_new(1, GZIP_METHOD, LOW_COMPRESSION);
+  tt_ptr_op(state, OP_EQ, first);
+  check_pooled_state_roundtrip(state, GZIP_METHOD, "Hello again, pool");
+  tor_compress_free(state);
+
+  /* Other levels and methods don't share states with it. */
+  state = tor_compress_new(1, GZIP_METHOD, HIGH_COMPRESSION);
+  tt_ptr_op(state, OP_NE, first);
+  tor_compress_free(state);
+  state = tor_compress_new(1, ZLIB_METHOD, LOW_COMPRESSION);
+  tt_ptr_op(state, OP_NE, first);
+  tor_compress_free(state);
+
+  /* Decompression states are shared across levels. */
+  first = state = tor_compress_new(0, GZIP_METHOD, LOW_COMPRESSION);
+  tor_compress_free(state);
+  state = tor_compress_new(0, GZIP_METHOD, HIGH_COMPRESSION);
+  tt_ptr_op(state, OP_EQ, first);
+  tor_compress_free(state);
+
+  if (tor_compress_supports_method(LZMA_METHOD)) {
+    first = state = tor_compress_new(1, LZMA_METHOD, LOW_COMPRESSION);
+    check_pooled_state_roundtrip(state, LZMA_METHOD, "Hello lzma pool");
+    tor_compress_free(state);
+    state = tor_compress_new(1, LZMA_METHOD, LOW_COMPRESSION);
+    tt_ptr_op(state, OP_EQ, first);
+    check_pooled_state_roundtrip(state, LZMA_METHOD, "Hello lzma again");
+    tor_compress_free(state);
+  }
+
+  /* The pool is bounded. */
+  tor_compress_pool_clear();
+  for (unsigned i = 0; i < ARRAY_LENGTH(states); ++i) {
+    states[i] = tor_compress_new(1, ZLIB_METHOD, MEDIUM_COMPRESSION);
+    tt_assert(states[i]);
+  }
+  for (unsigned i = 0; i < ARRAY_LENGTH(states); ++i) {
+    tor_compress_free(states[i]);
+  }
+  tor_compress_pool_get_stats(&stats);
+  tt_u64_op(stats.n_pooled, OP_LT, ARRAY_LENGTH(states));
+  tt_u64_op(stats.n_pooled, OP_GT, 0);
+
+  /* Identity "compression" has no state worth pooling. */
+  state = tor_compress_new(1, NO_METHOD, LOW_COMPRESSION);
+  tor_compress_free(state);
+
+  tt_u64_op(tor_compress_pool_clear(), OP_EQ, stats.pooled_bytes);
+  tor_compress_pool_get_stats(&stats);
+  tt_u64_op(stats.n_pooled, OP_EQ, 0);
+  tt_u64_op(stats.pooled_bytes, OP_EQ, 0);
+
+ done:
+  tor_compress_pool_clear();
+}
+
+/** Run unit tests for our built-in zstd directory dictionary. */
+static void
+test_util_compress_zstd_dict(void *arg)
+{
+  (void)arg;
+  const char *dict;
+  size_t dict_len;
+  char digest[DIGEST256_LEN];
+  char hex[HEX_DIGEST256_LEN+1];
+  smartlist_t *chunks = smartlist_new();
+  char *doc = NULL, *plain = NULL, *dicted = NULL, *out = NULL;
+  size_t doc_len, plain_len, dicted_len, out_len;
+
+  /* The advertised identity has to match the dictionary we ship. */
+  dict = tor_zstd_dict_get(&dict_len);
+  tt_int_op(dict_len, OP_GT, 0);
+  crypto_digest256(digest, dict, dict_len, DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, sizeof(digest));
+  tor_strlower(hex);
+  tt_assert(!strcmpstart(hex, TOR_ZSTD_DICT_ID));
+  tt_int_op(compression_method_get_by_name("x-tor-zstd-dict-"
+                                           TOR_ZSTD_DICT_ID),
+            OP_EQ, ZSTD_DICT_METHOD);
+  tt_int_op(compression_method_get_by_name("x-tor-zstd-dict-00000000"),
+            OP_EQ, UNKNOWN_METHOD);
+
+  if (! tor_compress_supports_method(ZSTD_DICT_METHOD)) {
+    tt_skip();
+  }
+
+  /* A small batch of microdescriptors should compress better with the
+   * dictionary than without it. */
+  for (int i = 0; i < 4; ++i) {
+    char key[32], id[32];
+    crypto_rand(key, sizeof(key));
+    crypto_rand(id, sizeof(id));
+    smartlist_add_asprintf(chunks,
+                           "onion-key\n"
+                           "ntor-onion-key %s\n"
+                           "family $%s\n"
+                           "p accept 80,443\n"
+                           "id ed25519 %s\n",
+                           hex_str(key, 16), hex_str(id, 20),
+                           hex_str(id, 16));
+  }
+  doc = smartlist_join_strings(chunks, "", 0, &doc_len);
+
+  tt_int_op(tor_compress(&plain, &plain_len, doc, doc_len, ZSTD_METHOD),
+            OP_EQ, 0);
+  tt_int_op(tor_compress(&dicted, &dicted_len, doc, doc_len,
+                         ZSTD_DICT_METHOD), OP_EQ, 0);
+  tt_int_op(dicted_len, OP_LT, plain_len);
+
+  tt_int_op(tor_uncompress(&out, &out_len, dicted, dicted_len,
+                           ZSTD_DICT_METHOD, 1, LOG_WARN), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, doc, doc_len);
+  tt_int_op(out_len, OP_EQ, doc_len);
+  tor_free(out);
+
+  /* Without the dictionary, the output is garbage. */
+  tt_int_op(tor_uncompress(&out, &out_len, dicted, dicted_len,
+                           ZSTD_METHOD, 1, LOG_INFO), OP_EQ, -1);
+
+ done:
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(doc);
+  tor_free(plain);
+  tor_free(dicted);
+  tor_free(out);
+}
+
 static void
 test_util_decompress_concatenated_impl(compress_method_t method)
 {
@@ -6972,12 +7161,14 @@ struct testcase_t util_tests[] = {
   COMPRESS(lzma, "x-tor-lzma"),
   COMPRESS(zstd, "x-zstd"),
   COMPRESS(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS(zstd_dict, "x-tor-zstd-dict-" TOR_ZSTD_DICT_ID),
   COMPRESS(none, "identity"),
   COMPRESS_CONCAT(zlib, "deflate"),
   COMPRESS_CONCAT(gzip, "gzip"),
   COMPRESS_CONCAT(lzma, "x-tor-lzma"),
   COMPRESS_CONCAT(zstd, "x-zstd"),
   COMPRESS_CONCAT(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS_CONCAT(zstd_dict, "x-tor-zstd-dict-" TOR_ZSTD_DICT_ID),
   COMPRESS_CONCAT(none, "identity"),
   COMPRESS_JUNK(zlib, "deflate"),
   COMPRESS_JUNK(gzip, "gzip"),
@@ -6987,6 +7178,9 @@ struct testcase_t util_tests[] = {
   COMPRESS_DOS(lzma, "x-tor-lzma"),
   COMPRESS_DOS(zstd, "x-zstd"),
   COMPRESS_DOS(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS_DOS(zstd_dict, "x-tor-zstd-dict-" TOR_ZSTD_DICT_ID),
+  UTIL_TEST(compress_zstd_dict, 0),
+  UTIL_TEST(compress_pool, 0),
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),